@@ -0,0 +1,824 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <opencv2/opencv.hpp>
+#include "protocol.h"
+#include "histogram.h"
+
+// ========== Benchmark / 壓力測試 ==========
+// 模擬大量已登入使用者，依設定的比例混合送出各種指令，統計每個指令的吞吐量與延遲分佈，
+// 結果以 JSON 輸出方便與上一次的結果比對。每個使用者一條 TLS 連線；每個 bench 執行緒輪流
+// 替自己負責的使用者送出指令，因此同時在途的指令數等於執行緒數。
+//
+// 加上 -S <server 執行檔> 時會在暫存目錄產生 self-signed 憑證並啟動一個獨立的 server，
+// 不會動到目前目錄的 user_db 與 store/。
+
+#define DEFAULT_USERS 1000
+#define DEFAULT_THREADS 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_FILE_SIZE (1024 * 1024)
+#define DEFAULT_MESSAGE_SIZE 64
+#define MAX_MESSAGE_SIZE (COMMAND_BUFFER_SIZE - USERNAME_BUFFER_SIZE - 8) // SEND 整行需放進一個指令 buffer
+#define DEFAULT_VIDEO_FRAMES 30
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+#define BENCH_PASSWORD "bench"
+#define REPLY_BUFFER_SIZE 16384             // 一個 TLS record，所有文字回覆都不會超過
+#define IO_BUFFER_SIZE (256 * 1024)
+#define SERVER_START_TIMEOUT_MS 10000
+#define RECONNECT_LIMIT 3
+
+enum {
+    CMD_REGISTER,
+    CMD_LOGIN,
+    CMD_SEND,
+    CMD_RETRIEVE,
+    CMD_ONLINE,
+    CMD_LIST_FILES,
+    CMD_SEND_FILE,
+    CMD_RECEIVE_FILE,
+    CMD_STREAM_VIDEO,
+    CMD_COUNT
+};
+
+static const char *command_names[CMD_COUNT] = {
+    "REGISTER", "LOGIN", "SEND", "RETRIEVE", "ONLINE",
+    "LIST_FILES", "SEND_FILE", "RECEIVE_FILE", "STREAM_VIDEO",
+};
+
+// 預設比例：以訊息與查詢為主，檔案傳輸與串流較少
+static int mix_weights[CMD_COUNT] = {2, 3, 35, 20, 10, 10, 5, 10, 5};
+
+// 建立連線階段的統計 (不算在指令吞吐量內)
+enum {
+    SETUP_CONNECT,
+    SETUP_REGISTER,
+    SETUP_LOGIN,
+    SETUP_COUNT
+};
+
+static const char *setup_names[SETUP_COUNT] = {"CONNECT", "REGISTER", "LOGIN"};
+
+typedef struct {
+    SSL *ssl;
+    int fd;
+    int alive;
+    char username[USERNAME_BUFFER_SIZE];
+} BenchUser;
+
+typedef struct {
+    LatencyHistogram hist[CMD_COUNT];
+    uint64_t errors[CMD_COUNT];
+    uint64_t bytes[CMD_COUNT];
+} CommandStats;
+
+typedef struct {
+    int id;
+    pthread_t thread_id;
+    BenchUser *users;               // 這個執行緒負責的使用者
+    int user_count;
+    CommandStats stats;
+    LatencyHistogram setup[SETUP_COUNT];
+    uint64_t setup_errors;
+    uint64_t rng;
+    unsigned registered;            // REGISTER 指令產生新帳號用的序號
+    char *io_buffer;
+    char reply[REPLY_BUFFER_SIZE];
+} BenchThread;
+
+// 設定
+static int user_count = DEFAULT_USERS;
+static int thread_count = DEFAULT_THREADS;
+static int duration = DEFAULT_DURATION;
+static uint64_t file_size = DEFAULT_FILE_SIZE;
+static int message_size = DEFAULT_MESSAGE_SIZE;
+static int video_frames = DEFAULT_VIDEO_FRAMES;
+static const char *server_path = NULL;
+static const char *output_path = NULL;
+static char **server_args = NULL;
+static int server_arg_count = 0;
+static int keep_workdir = 0;
+
+static SSL_CTX *bench_ctx;
+static BenchUser *all_users;
+static char run_tag[32];            // 帳號 / 檔名前綴，多次執行不會互相衝突
+static char seed_filename[USERNAME_BUFFER_SIZE];
+static char message_body[MAX_MESSAGE_SIZE + 1];
+static std::vector<uchar> video_frame;
+static volatile int running = 0;
+static char workdir[PATH_MAX];
+static pid_t server_pid = -1;
+
+static inline uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t next_random(BenchThread *t) {
+    // xorshift64*
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ULL;
+}
+
+// ========== 連線 / 收送 ==========
+
+static SSL *bench_connect(int *out_fd) {
+    struct sockaddr_in servaddr;
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) return NULL;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+        close(sockfd);
+        return NULL;
+    }
+    // 指令與大小欄位是分開的小 record，關掉 Nagle 才量得到 server 本身的延遲
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    SSL *ssl = SSL_new(bench_ctx);
+    SSL_set_fd(ssl, sockfd);
+    if (SSL_connect(ssl) <= 0) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(sockfd);
+        return NULL;
+    }
+    *out_fd = sockfd;
+    return ssl;
+}
+
+static void bench_disconnect(BenchUser *user) {
+    if (!user->ssl) return;
+    SSL_shutdown(user->ssl);
+    SSL_free(user->ssl);
+    close(user->fd);
+    user->ssl = NULL;
+}
+
+static int write_all(SSL *ssl, const void *data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        int n = SSL_write(ssl, (const char *)data + sent, (int)(len - sent));
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static int read_exact(SSL *ssl, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int n = SSL_read(ssl, (char *)buf + got, (int)(len - got));
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// 送出一個文字指令並讀回一個回覆 record；連線錯誤回傳 -1
+static int round_trip(BenchThread *t, BenchUser *user, const char *command) {
+    if (SSL_write(user->ssl, command, strlen(command)) <= 0) return -1;
+    int n = SSL_read(user->ssl, t->reply, sizeof(t->reply) - 1);
+    if (n <= 0) return -1;
+    t->reply[n] = '\0';
+    return n;
+}
+
+static int expect_reply(BenchThread *t, BenchUser *user, const char *command, const char *expected) {
+    if (round_trip(t, user, command) < 0) return -1;
+    return strstr(t->reply, expected) ? 0 : 1;
+}
+
+static int login_user(BenchThread *t, BenchUser *user) {
+    char command[COMMAND_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "LOGIN %s %s", user->username, BENCH_PASSWORD);
+    return expect_reply(t, user, command, "Login successful");
+}
+
+// 連線中斷時重新連線並登入，失敗就讓這個使用者退出測試
+static void reconnect_user(BenchThread *t, BenchUser *user) {
+    bench_disconnect(user);
+    for (int attempt = 0; attempt < RECONNECT_LIMIT; attempt++) {
+        if ((user->ssl = bench_connect(&user->fd)) != NULL && login_user(t, user) == 0) return;
+        bench_disconnect(user);
+    }
+    user->alive = 0;
+}
+
+// ========== 各指令 ==========
+// 回傳 0 成功、1 server 回覆錯誤 (連線仍可用)、-1 連線錯誤；*bytes 為傳送的資料量
+
+static int op_register(BenchThread *t, BenchUser *user, uint64_t *bytes) {
+    char command[COMMAND_BUFFER_SIZE];
+    (void)bytes;
+    snprintf(command, sizeof(command), "REGISTER %s_%d_r%u %s", run_tag, t->id, t->registered++, BENCH_PASSWORD);
+    return expect_reply(t, user, command, "Registration successful");
+}
+
+// 先 LOGOUT (不計時) 再量 LOGIN
+static int op_login(BenchThread *t, BenchUser *user, uint64_t *bytes, uint64_t *start) {
+    (void)bytes;
+    if (round_trip(t, user, "LOGOUT") < 0) return -1;
+    *start = now_us();
+    return login_user(t, user);
+}
+
+static int op_send(BenchThread *t, BenchUser *user, uint64_t *bytes) {
+    char command[COMMAND_BUFFER_SIZE];
+    const BenchUser *target = &all_users[next_random(t) % user_count];
+    snprintf(command, sizeof(command), "SEND %s %s", target->username, message_body);
+    *bytes = message_size;
+    return expect_reply(t, user, command, "Message sent");
+}
+
+static int op_simple(BenchThread *t, BenchUser *user, const char *command, uint64_t *bytes) {
+    int n = round_trip(t, user, command);
+    if (n < 0) return -1;
+    *bytes = n;
+    return 0;
+}
+
+static int op_send_file(BenchThread *t, BenchUser *user, uint64_t *bytes) {
+    char command[COMMAND_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "SEND_FILE %s.bin 0", user->username);
+    uint64_t net_size = hton64(file_size);
+    if (SSL_write(user->ssl, command, strlen(command)) <= 0 ||
+        SSL_write(user->ssl, &net_size, sizeof(net_size)) <= 0) {
+        return -1;
+    }
+    for (uint64_t sent = 0; sent < file_size;) {
+        size_t chunk = file_size - sent < IO_BUFFER_SIZE ? file_size - sent : IO_BUFFER_SIZE;
+        if (write_all(user->ssl, t->io_buffer, chunk) < 0) return -1;
+        sent += chunk;
+    }
+    *bytes = file_size;
+    int n = SSL_read(user->ssl, t->reply, sizeof(t->reply) - 1);
+    if (n <= 0) return -1;
+    t->reply[n] = '\0';
+    return strstr(t->reply, "uploaded successfully") ? 0 : 1;
+}
+
+static int op_receive_file(BenchThread *t, BenchUser *user, uint64_t *bytes) {
+    char command[COMMAND_BUFFER_SIZE];
+    uint64_t net_length;
+    snprintf(command, sizeof(command), "RECEIVE_FILE %s", seed_filename);
+    if (SSL_write(user->ssl, command, strlen(command)) <= 0) return -1;
+    if (read_exact(user->ssl, &net_length, sizeof(net_length)) < 0) return -1;
+    uint64_t length = ntoh64(net_length);
+    for (uint64_t got = 0; got < length;) {
+        size_t chunk = length - got < IO_BUFFER_SIZE ? length - got : IO_BUFFER_SIZE;
+        int n = SSL_read(user->ssl, t->io_buffer, (int)chunk);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    *bytes = length;
+    int n = SSL_read(user->ssl, t->reply, sizeof(t->reply) - 1);
+    if (n <= 0) return -1;
+    t->reply[n] = '\0';
+    return length == file_size && strstr(t->reply, "download complete") ? 0 : 1;
+}
+
+// STREAM_VIDEO 沒有回覆，延遲為送完所有 frame 與結束標記的時間 (受 server 消化速度的 TCP backpressure 影響)
+static int op_stream_video(BenchThread *t, BenchUser *user, uint64_t *bytes) {
+    (void)t;
+    if (SSL_write(user->ssl, "STREAM_VIDEO", strlen("STREAM_VIDEO")) <= 0) return -1;
+    uint32_t net_frame_size = htonl((uint32_t)video_frame.size());
+    for (int i = 0; i < video_frames; i++) {
+        if (SSL_write(user->ssl, &net_frame_size, sizeof(net_frame_size)) <= 0 ||
+            write_all(user->ssl, video_frame.data(), video_frame.size()) < 0) {
+            return -1;
+        }
+        *bytes += video_frame.size();
+    }
+    uint32_t zero = 0;
+    return SSL_write(user->ssl, &zero, sizeof(zero)) > 0 ? 0 : -1;
+}
+
+static int pick_command(BenchThread *t, int weight_total) {
+    int r = (int)(next_random(t) % (uint64_t)weight_total);
+    for (int i = 0; i < CMD_COUNT; i++) {
+        if (r < mix_weights[i]) return i;
+        r -= mix_weights[i];
+    }
+    return CMD_SEND;
+}
+
+static int run_command(BenchThread *t, BenchUser *user, int cmd, uint64_t *bytes, uint64_t *start) {
+    switch (cmd) {
+        case CMD_REGISTER: return op_register(t, user, bytes);
+        case CMD_LOGIN: return op_login(t, user, bytes, start);
+        case CMD_SEND: return op_send(t, user, bytes);
+        case CMD_RETRIEVE: return op_simple(t, user, "RETRIEVE", bytes);
+        case CMD_ONLINE: return op_simple(t, user, "ONLINE", bytes);
+        case CMD_LIST_FILES: return op_simple(t, user, "LIST_FILES", bytes);
+        case CMD_SEND_FILE: return op_send_file(t, user, bytes);
+        case CMD_RECEIVE_FILE: return op_receive_file(t, user, bytes);
+        case CMD_STREAM_VIDEO: return op_stream_video(t, user, bytes);
+    }
+    return 1;
+}
+
+// ========== 執行緒 ==========
+
+// 建立連線、註冊並登入這個執行緒負責的使用者
+static void *setup_thread(void *arg) {
+    BenchThread *t = (BenchThread *)arg;
+    char command[COMMAND_BUFFER_SIZE];
+
+    for (int i = 0; i < t->user_count; i++) {
+        BenchUser *user = &t->users[i];
+        uint64_t start = now_us();
+        user->ssl = bench_connect(&user->fd);
+        if (!user->ssl) {
+            t->setup_errors++;
+            continue;
+        }
+        hist_record(&t->setup[SETUP_CONNECT], now_us() - start);
+
+        snprintf(command, sizeof(command), "REGISTER %s %s", user->username, BENCH_PASSWORD);
+        start = now_us();
+        int ret = expect_reply(t, user, command, "Registration successful");
+        hist_record(&t->setup[SETUP_REGISTER], now_us() - start);
+        if (ret == 0) {
+            start = now_us();
+            ret = login_user(t, user);
+            hist_record(&t->setup[SETUP_LOGIN], now_us() - start);
+        }
+        if (ret != 0) {
+            t->setup_errors++;
+            bench_disconnect(user);
+            continue;
+        }
+        user->alive = 1;
+    }
+    return NULL;
+}
+
+static void *load_thread(void *arg) {
+    BenchThread *t = (BenchThread *)arg;
+    int weight_total = 0;
+    for (int i = 0; i < CMD_COUNT; i++) weight_total += mix_weights[i];
+
+    int next = 0;
+    while (running) {
+        BenchUser *user = NULL;
+        for (int tries = 0; tries < t->user_count && !user; tries++) {
+            BenchUser *candidate = &t->users[next];
+            next = (next + 1) % t->user_count;
+            if (candidate->alive) user = candidate;
+        }
+        if (!user) break;
+
+        int cmd = pick_command(t, weight_total);
+        uint64_t bytes = 0;
+        uint64_t start = now_us();
+        int ret = run_command(t, user, cmd, &bytes, &start);
+        uint64_t elapsed = now_us() - start;
+
+        if (ret == 0) {
+            hist_record(&t->stats.hist[cmd], elapsed);
+            t->stats.bytes[cmd] += bytes;
+        } else {
+            t->stats.errors[cmd]++;
+            if (ret < 0) reconnect_user(t, user);
+        }
+    }
+    return NULL;
+}
+
+// ========== 本機 server ==========
+
+// 產生 RSA 2048 self-signed 憑證，寫成 server 讀取的 server.crt / server.key
+static int generate_certificate(const char *dir) {
+    char path[PATH_MAX + 16];
+    int ok = 0;
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    X509 *cert = X509_new();
+    if (!key || !cert) goto out;
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), (long)time(NULL));
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 7L * 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    if (X509_sign(cert, key, EVP_sha256()) <= 0) goto out;
+
+    {
+        snprintf(path, sizeof(path), "%s/server.key", dir);
+        FILE *file = fopen(path, "w");
+        if (!file) goto out;
+        chmod(path, 0600);
+        ok = PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL);
+        fclose(file);
+
+        snprintf(path, sizeof(path), "%s/server.crt", dir);
+        file = fopen(path, "w");
+        if (!file) {
+            ok = 0;
+            goto out;
+        }
+        ok = ok && PEM_write_X509(file, cert);
+        fclose(file);
+    }
+out:
+    if (!ok) ERR_print_errors_fp(stderr);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok ? 0 : -1;
+}
+
+static int wait_for_server() {
+    for (int waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 50) {
+        struct sockaddr_in servaddr;
+        int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(PORT);
+        inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
+        int ret = connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+        close(sockfd);
+        if (ret == 0) return 0;
+        if (server_pid > 0 && waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+            server_pid = -1;
+            return -1;
+        }
+        usleep(50000);
+    }
+    return -1;
+}
+
+// 在暫存目錄啟動 server，輸出導到 server.log (server 的 debug 輸出不應拖慢測試)
+static int start_server() {
+    char binary[PATH_MAX];
+    char log_path[PATH_MAX + 16];
+
+    if (!realpath(server_path, binary)) {
+        perror("[ERROR] server binary");
+        return -1;
+    }
+    snprintf(workdir, sizeof(workdir), "/tmp/bench-XXXXXX");
+    if (!mkdtemp(workdir)) {
+        perror("[ERROR] mkdtemp");
+        return -1;
+    }
+    if (generate_certificate(workdir) < 0) {
+        fprintf(stderr, "[ERROR] Failed to generate self-signed certificate\n");
+        return -1;
+    }
+    snprintf(log_path, sizeof(log_path), "%s/server.log", workdir);
+
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("[ERROR] fork");
+        return -1;
+    }
+    if (server_pid == 0) {
+        char **argv = (char **)calloc(server_arg_count + 2, sizeof(char *));
+        argv[0] = binary;
+        for (int i = 0; i < server_arg_count; i++) argv[i + 1] = server_args[i];
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (chdir(workdir) < 0 || log_fd < 0) _exit(127);
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        execv(binary, argv);
+        _exit(127);
+    }
+    if (wait_for_server() < 0) {
+        fprintf(stderr, "[ERROR] Server did not start, see %s\n", log_path);
+        return -1;
+    }
+    fprintf(stderr, "[INFO] Started %s (pid %d) in %s\n", binary, (int)server_pid, workdir);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void stop_server() {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+    if (workdir[0]) {
+        if (keep_workdir) fprintf(stderr, "[INFO] Server files kept in %s\n", workdir);
+        else nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+// ========== 前置資料 ==========
+
+// RECEIVE_FILE 下載的檔案，由第一個使用者先上傳
+static int upload_seed_file(BenchThread *t) {
+    BenchUser seeder;
+    memset(&seeder, 0, sizeof(seeder));
+    strncpy(seeder.username, run_tag, USERNAME_BUFFER_SIZE - 1);
+    strncat(seeder.username, "_seed", USERNAME_BUFFER_SIZE - strlen(seeder.username) - 1);
+    snprintf(seed_filename, sizeof(seed_filename), "%s_seed.bin", run_tag);
+    if (!(seeder.ssl = bench_connect(&seeder.fd))) return -1;
+    uint64_t bytes = 0;
+    int ret = op_send_file(t, &seeder, &bytes);
+    SSL_write(seeder.ssl, "exit", strlen("exit"));
+    bench_disconnect(&seeder);
+    return ret == 0 ? 0 : -1;
+}
+
+// 串流用的 frame：合成的漸層畫面壓成 JPEG，server 才能正常解碼
+static void build_video_frame() {
+    cv::Mat frame(VIDEO_HEIGHT, VIDEO_WIDTH, CV_8UC3);
+    for (int y = 0; y < VIDEO_HEIGHT; y++) {
+        uchar *row = frame.ptr(y);
+        for (int x = 0; x < VIDEO_WIDTH; x++) {
+            row[x * 3] = (uchar)x;
+            row[x * 3 + 1] = (uchar)y;
+            row[x * 3 + 2] = (uchar)(x + y);
+        }
+    }
+    cv::imencode(".jpg", frame, video_frame);
+}
+
+// ========== 結果輸出 ==========
+
+static void write_histogram_json(FILE *out, const LatencyHistogram *hist) {
+    fprintf(out, "\"mean_us\": %.1f, \"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu",
+            hist_mean(hist), (unsigned long long)hist_percentile(hist, 50),
+            (unsigned long long)hist_percentile(hist, 99), (unsigned long long)hist_percentile(hist, 99.9),
+            (unsigned long long)hist->max);
+}
+
+static void write_results(FILE *out, const CommandStats *stats, const LatencyHistogram *setup,
+                          uint64_t setup_errors, int users_alive, double seconds) {
+    uint64_t total_ops = 0, total_errors = 0;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        total_ops += stats->hist[i].total;
+        total_errors += stats->errors[i];
+    }
+
+    fprintf(out, "{\n  \"config\": {\"users\": %d, \"threads\": %d, \"duration_s\": %d, \"file_size\": %llu, "
+                 "\"message_size\": %d, \"video_frames\": %d, \"video_frame_bytes\": %zu, \"mix\": {",
+            user_count, thread_count, duration, (unsigned long long)file_size, message_size, video_frames,
+            video_frame.size());
+    for (int i = 0; i < CMD_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %d", i ? ", " : "", command_names[i], mix_weights[i]);
+    }
+    fprintf(out, "}},\n");
+
+    fprintf(out, "  \"setup\": {\"users_online\": %d, \"errors\": %llu", users_alive,
+            (unsigned long long)setup_errors);
+    for (int i = 0; i < SETUP_COUNT; i++) {
+        fprintf(out, ", \"%s\": {\"count\": %llu, ", setup_names[i], (unsigned long long)setup[i].total);
+        write_histogram_json(out, &setup[i]);
+        fprintf(out, "}");
+    }
+    fprintf(out, "},\n");
+
+    fprintf(out, "  \"elapsed_s\": %.3f,\n  \"total\": {\"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f},\n",
+            seconds, (unsigned long long)total_ops, (unsigned long long)total_errors,
+            seconds > 0 ? total_ops / seconds : 0.0);
+
+    fprintf(out, "  \"commands\": {\n");
+    int first = 1;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        if (mix_weights[i] == 0) continue;
+        const LatencyHistogram *hist = &stats->hist[i];
+        fprintf(out, "%s    \"%s\": {\"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, \"bytes\": %llu, "
+                     "\"mb_per_sec\": %.2f, ",
+                first ? "" : ",\n", command_names[i], (unsigned long long)hist->total,
+                (unsigned long long)stats->errors[i], seconds > 0 ? hist->total / seconds : 0.0,
+                (unsigned long long)stats->bytes[i],
+                seconds > 0 ? stats->bytes[i] / seconds / (1024 * 1024) : 0.0);
+        write_histogram_json(out, hist);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+static void print_summary(const CommandStats *stats, double seconds) {
+    fprintf(stderr, "%-14s %10s %8s %10s %10s %10s %10s\n", "command", "ops", "errors", "ops/s", "p50(us)",
+            "p99(us)", "p999(us)");
+    for (int i = 0; i < CMD_COUNT; i++) {
+        if (mix_weights[i] == 0) continue;
+        const LatencyHistogram *hist = &stats->hist[i];
+        fprintf(stderr, "%-14s %10llu %8llu %10.1f %10llu %10llu %10llu\n", command_names[i],
+                (unsigned long long)hist->total, (unsigned long long)stats->errors[i],
+                seconds > 0 ? hist->total / seconds : 0.0, (unsigned long long)hist_percentile(hist, 50),
+                (unsigned long long)hist_percentile(hist, 99), (unsigned long long)hist_percentile(hist, 99.9));
+    }
+}
+
+// ========== 參數 ==========
+
+// -m SEND=40,RETRIEVE=20,...：沒有列出的指令比例為 0
+static int parse_mix(const char *spec) {
+    char copy[COMMAND_BUFFER_SIZE];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(mix_weights, 0, sizeof(mix_weights));
+
+    int total = 0;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int found = 0;
+        for (int i = 0; i < CMD_COUNT; i++) {
+            if (strcmp(item, command_names[i]) == 0) {
+                mix_weights[i] = atoi(eq + 1);
+                if (mix_weights[i] < 0) return -1;
+                total += mix_weights[i];
+                found = 1;
+            }
+        }
+        if (!found) return -1;
+    }
+    return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-u users] [-t threads] [-d seconds] [-m CMD=weight,...] [-f file_bytes]\n"
+            "          [-s message_bytes] [-v video_frames] [-o result.json] [-S server_binary [-k]] [-- server args]\n"
+            "Commands: REGISTER LOGIN SEND RETRIEVE ONLINE LIST_FILES SEND_FILE RECEIVE_FILE STREAM_VIDEO\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:t:d:m:f:s:v:o:S:k")) != -1) {
+        switch (opt) {
+            case 'u':
+                user_count = atoi(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'm':
+                if (parse_mix(optarg) < 0) usage(argv[0]);
+                break;
+            case 'f':
+                file_size = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                message_size = atoi(optarg);
+                break;
+            case 'v':
+                video_frames = atoi(optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'S':
+                server_path = optarg;
+                break;
+            case 'k':
+                keep_workdir = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    server_args = argv + optind;
+    server_arg_count = argc - optind;
+    if (user_count < 1 || thread_count < 1 || duration < 1 || file_size == 0 || video_frames < 1) usage(argv[0]);
+    if (thread_count > user_count) thread_count = user_count;
+    if (message_size < 1) message_size = 1;
+    if (message_size > MAX_MESSAGE_SIZE) message_size = MAX_MESSAGE_SIZE;
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (server_path && start_server() < 0) {
+        stop_server();
+        return EXIT_FAILURE;
+    }
+
+    bench_ctx = SSL_CTX_new(TLS_client_method());
+    if (!bench_ctx) {
+        ERR_print_errors_fp(stderr);
+        stop_server();
+        return EXIT_FAILURE;
+    }
+
+    snprintf(run_tag, sizeof(run_tag), "b%lx", (unsigned long)time(NULL) ^ ((unsigned long)getpid() << 16));
+    memset(message_body, 'x', message_size);
+    message_body[message_size] = '\0';
+    build_video_frame();
+
+    all_users = (BenchUser *)calloc(user_count, sizeof(BenchUser));
+    BenchThread *threads = (BenchThread *)calloc(thread_count, sizeof(BenchThread));
+    for (int i = 0; i < user_count; i++) {
+        snprintf(all_users[i].username, USERNAME_BUFFER_SIZE, "%s_%d", run_tag, i);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        BenchThread *t = &threads[i];
+        t->id = i;
+        t->users = all_users + (size_t)user_count * i / thread_count;
+        t->user_count = (int)((size_t)user_count * (i + 1) / thread_count - (size_t)user_count * i / thread_count);
+        t->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        t->io_buffer = (char *)malloc(IO_BUFFER_SIZE);
+        memset(t->io_buffer, 'B', IO_BUFFER_SIZE);
+    }
+
+    // 1. 建立連線、註冊、登入
+    uint64_t setup_start = now_us();
+    for (int i = 0; i < thread_count; i++) pthread_create(&threads[i].thread_id, NULL, setup_thread, &threads[i]);
+    for (int i = 0; i < thread_count; i++) pthread_join(threads[i].thread_id, NULL);
+    int users_alive = 0;
+    for (int i = 0; i < user_count; i++) users_alive += all_users[i].alive;
+    fprintf(stderr, "[INFO] %d/%d users online after %.2f s\n", users_alive, user_count,
+            (now_us() - setup_start) / 1e6);
+    if (users_alive == 0 || (mix_weights[CMD_RECEIVE_FILE] > 0 && upload_seed_file(&threads[0]) < 0)) {
+        fprintf(stderr, "[ERROR] Setup failed\n");
+        stop_server();
+        return EXIT_FAILURE;
+    }
+
+    // 2. 依比例送出指令，持續 duration 秒
+    running = 1;
+    uint64_t run_start = now_us();
+    for (int i = 0; i < thread_count; i++) pthread_create(&threads[i].thread_id, NULL, load_thread, &threads[i]);
+    sleep(duration);
+    running = 0;
+    for (int i = 0; i < thread_count; i++) pthread_join(threads[i].thread_id, NULL);
+    double seconds = (now_us() - run_start) / 1e6;
+
+    // 3. 合併各執行緒的統計並輸出
+    CommandStats *merged = (CommandStats *)calloc(1, sizeof(CommandStats));
+    LatencyHistogram *setup = (LatencyHistogram *)calloc(SETUP_COUNT, sizeof(LatencyHistogram));
+    uint64_t setup_errors = 0;
+    for (int i = 0; i < thread_count; i++) {
+        for (int c = 0; c < CMD_COUNT; c++) {
+            hist_merge(&merged->hist[c], &threads[i].stats.hist[c]);
+            merged->errors[c] += threads[i].stats.errors[c];
+            merged->bytes[c] += threads[i].stats.bytes[c];
+        }
+        for (int s = 0; s < SETUP_COUNT; s++) hist_merge(&setup[s], &threads[i].setup[s]);
+        setup_errors += threads[i].setup_errors;
+    }
+    print_summary(merged, seconds);
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        perror("[ERROR] Failed to open output file");
+        out = stdout;
+    }
+    write_results(out, merged, setup, setup_errors, users_alive, seconds);
+    if (out != stdout) fclose(out);
+
+    for (int i = 0; i < user_count; i++) {
+        if (all_users[i].ssl) {
+            SSL_write(all_users[i].ssl, "exit", strlen("exit"));
+            bench_disconnect(&all_users[i]);
+        }
+    }
+    stop_server();
+    for (int i = 0; i < thread_count; i++) free(threads[i].io_buffer);
+    free(threads);
+    free(all_users);
+    free(merged);
+    free(setup);
+    SSL_CTX_free(bench_ctx);
+    return 0;
+}
@@ -4,13 +4,45 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h> // SIOCOUTQNSD
 #include <opencv2/opencv.hpp>
-
-#define PORT 8080
-#define COMMAND_BUFFER_SIZE 512
-#define USERNAME_BUFFER_SIZE 128
+#include "protocol.h"
+
+#define BATCH_WINDOW 64             // pipelining 時最多同時在途的 request 數
+#define FRAME_READER_SIZE 65536
+#define TRANSFER_BUFFER_SIZE (256 * 1024)
+#define LIST_PAGE_SIZE 100          // LIST_FILES 每頁筆數
+#define DEFAULT_STRIPES 4           // 分段下載預設連線數
+#define MAX_STRIPES 16
+#define CHUNK_RETRY_LIMIT 3         // checksum 錯誤 / 斷線時每段最多重試次數
+#define VIDEO_DEFAULT_FPS 30.0      // 影片沒有 FPS 資訊時使用
+#define VIDEO_QUALITY_MAX 90
+#define VIDEO_QUALITY_MIN 30
+#define VIDEO_QUALITY_START 80
+#define VIDEO_QUALITY_STEP_DOWN 10
+#define VIDEO_QUALITY_STEP_UP 2
+#define VIDEO_STABLE_FRAMES 30      // 連續這麼多張都順暢才提高畫質
+#define VIDEO_MAX_ENCODERS 8        // 平行 JPEG 編碼的執行緒上限
+#define ZPIPE_MAX_WORKERS 8         // 上傳時平行壓縮區塊的執行緒上限
+#define VIDEO_KEYFRAME_SECONDS 5.0  // delta 模式下定期送 keyframe 的間隔
+#define VIDEO_TILE_THRESHOLD 12     // 像素差超過此值的 tile 才算變動 (忽略來源影片的壓縮雜訊)
+#define VIDEO_KEYFRAME_RATIO 0.6    // 變動的 tile 超過此比例時直接送 keyframe
+
+#define SESSION_CACHE_FILE ".client_sessions.pem" // 保存 TLS session ticket，下次啟動也能免完整 handshake
+#define TICKET_POOL_SIZE 32
+
+static SSL_CTX *client_ctx;         // 分段下載的額外連線共用同一個 context
 
 void initialize_openssl() {
     SSL_load_error_strings();
@@ -32,210 +64,1677 @@ SSL_CTX *create_context() {
     return ctx;
 }
 
+// ========== TLS session 重用 ==========
+// server 每次 handshake 會發多張 ticket，且開啟 0-RTT 時每張只能用一次，
+// 因此保留一個 ticket pool，每條新連線各取一張。
+
+static SSL_SESSION *ticket_pool[TICKET_POOL_SIZE];
+static int ticket_count = 0;
+static pthread_mutex_t ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ticket_push(SSL_SESSION *session) {
+    pthread_mutex_lock(&ticket_lock);
+    if (ticket_count == TICKET_POOL_SIZE) {
+        // 滿了就丟掉最舊的
+        SSL_SESSION_free(ticket_pool[0]);
+        memmove(ticket_pool, ticket_pool + 1, (TICKET_POOL_SIZE - 1) * sizeof(SSL_SESSION *));
+        ticket_count--;
+    }
+    ticket_pool[ticket_count++] = session;
+    pthread_mutex_unlock(&ticket_lock);
+}
+
+static SSL_SESSION *ticket_pop() {
+    SSL_SESSION *session = NULL;
+    pthread_mutex_lock(&ticket_lock);
+    while (ticket_count > 0 && !session) {
+        session = ticket_pool[--ticket_count];
+        if ((time_t)(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session)) <= time(NULL)) {
+            SSL_SESSION_free(session); // 已過期
+            session = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ticket_lock);
+    return session;
+}
+
+// OpenSSL 收到新 ticket 時呼叫；回傳 1 表示 session 的 reference 由我們持有
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+    (void)ssl;
+    ticket_push(session);
+    return 1;
+}
+
+void load_session_cache(SSL_CTX *ctx) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+    FILE *file = fopen(SESSION_CACHE_FILE, "r");
+    if (!file) return;
+    SSL_SESSION *session;
+    while ((session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL)) != NULL) {
+        ticket_push(session);
+    }
+    ERR_clear_error(); // 讀到檔尾時留下的錯誤
+    fclose(file);
+}
+
+void save_session_cache() {
+    FILE *file = fopen(SESSION_CACHE_FILE, "w");
+    if (!file) return;
+    chmod(SESSION_CACHE_FILE, 0600); // ticket 內含 resumption secret
+    SSL_SESSION *session;
+    while ((session = ticket_pop()) != NULL) {
+        PEM_write_SSL_SESSION(file, session);
+        SSL_SESSION_free(session);
+    }
+    fclose(file);
+}
+
+// 建立一條到 server 的 TLS 連線；失敗回傳 NULL。
+// 有可用的 ticket 時以 session 重用省去完整 handshake；first_command 若非 NULL 則隨 handshake
+// 以 0-RTT early data 送出 (只適用 server 允許的唯讀指令)，被拒絕時於 handshake 後再送一次。
+SSL *connect_server(SSL_CTX *ctx, int *out_fd, const char *first_command) {
+    struct sockaddr_in servaddr;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("Socket creation failed");
+        return NULL;
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+        perror("Connection to the server failed");
+        close(sockfd);
+        return NULL;
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, sockfd);
+
+    int early_sent = 0;
+    SSL_SESSION *session = ticket_pop();
+    if (session) {
+        SSL_set_session(ssl, session);
+        size_t written;
+        if (first_command && SSL_SESSION_get_max_early_data(session) >= strlen(first_command) &&
+            SSL_write_early_data(ssl, first_command, strlen(first_command), &written) == 1) {
+            early_sent = 1;
+        }
+        SSL_SESSION_free(session);
+    }
+
+    if (SSL_connect(ssl) <= 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(sockfd);
+        return NULL;
+    }
+    if (early_sent && SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_ACCEPTED) early_sent = 0;
+    if (first_command && !early_sent && SSL_write(ssl, first_command, strlen(first_command)) <= 0) {
+        SSL_free(ssl);
+        close(sockfd);
+        return NULL;
+    }
+    *out_fd = sockfd;
+    return ssl;
+}
+
+void disconnect_server(SSL *ssl, int sockfd) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(sockfd);
+}
+
+// 讀滿 len bytes (大小欄位可能被拆在不同 record)
+int read_exact(SSL *ssl, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int ret = SSL_read(ssl, (char *)buf + got, (int)(len - got));
+        if (ret <= 0) return -1;
+        got += ret;
+    }
+    return 0;
+}
+
+// FILE_STATUS：size 為 server 上完整檔案大小 (-1 表示不存在)，partial / total 為未完成上傳的進度，
+// mtime 為 server 上檔案的修改時間 (ns，舊版 server 不回報時為 0)
+int query_file_status(SSL *ssl, const char *filename, long long *size, unsigned long long *partial,
+                      unsigned long long *total, long long *mtime) {
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[COMMAND_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "FILE_STATUS %s", filename);
+    SSL_write(ssl, command, strlen(command));
+
+    bzero(reply, sizeof(reply));
+    if (SSL_read(ssl, reply, sizeof(reply) - 1) <= 0) return -1;
+    long long remote_mtime = 0;
+    if (sscanf(reply, "size=%lld partial=%llu total=%llu mtime=%lld", size, partial, total, &remote_mtime) < 3) {
+        printf("From Server: %s", reply);
+        return -1;
+    }
+    if (mtime) *mtime = remote_mtime;
+    return 0;
+}
+
 // ========== 上傳檔案 ==========
+// 以 SEND_FILE_DEDUP 上傳：檔案切成 content-defined chunk，先送 hash 讓 server 回答缺哪些，只送缺的內容。
+// 重新上傳修改過的檔案，或上傳中斷後重試時，server 已有的 chunk 都不必再送。
+
+// 一批 chunk 的位置與要送給 server 的協商內容 ([4 bytes 數量][n 筆 hash + 長度])
+typedef struct {
+    uint32_t count;
+    uint64_t offsets[DEDUP_BATCH_CHUNKS];
+    uint32_t lengths[DEDUP_BATCH_CHUNKS];
+    unsigned char header[4 + DEDUP_BATCH_CHUNKS * DEDUP_ENTRY_SIZE];
+} DedupBatch;
+
+static void dedup_batch_fill(DedupBatch *batch, const unsigned char *data, uint64_t size, uint64_t *pos) {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    batch->count = 0;
+    while (batch->count < DEDUP_BATCH_CHUNKS && *pos < size) {
+        size_t len = dedup_next_chunk(data + *pos, size - *pos);
+        dedup_hash(data + *pos, len, hash);
+        dedup_encode_entry(batch->header + 4 + batch->count * DEDUP_ENTRY_SIZE, hash, (uint32_t)len);
+        batch->offsets[batch->count] = *pos;
+        batch->lengths[batch->count] = (uint32_t)len;
+        batch->count++;
+        *pos += len;
+    }
+    uint32_t net_count = htonl(batch->count);
+    memcpy(batch->header, &net_count, 4);
+}
+
+// 平行壓縮：slot 組成環狀佇列，主執行緒依序放入 chunk、依序送出壓縮好的區塊，
+// worker 依放入順序壓縮，TLS 送出與壓縮同時進行
+typedef struct {
+    const unsigned char *raw;
+    size_t raw_len, wire_len;
+    int done;
+    unsigned char wire[ZBLOCK_MAX_WIRE];
+} ZSlot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    ZSlot *slots;
+    int depth, workers;
+    unsigned long head, tail, next_work;   // 下一個要送出 / 要放入 / 要壓縮的序號
+    int stop;
+    int failed;                             // SSL_write 失敗後不再送出，但仍照常收回 slot
+    uint64_t raw_bytes, wire_bytes;
+    pthread_t threads[ZPIPE_MAX_WORKERS];
+} ZPipeline;
+
+static void *zpipe_worker(void *arg) {
+    ZPipeline *zp = (ZPipeline *)arg;
+    pthread_mutex_lock(&zp->lock);
+    while (1) {
+        while (!zp->stop && zp->next_work == zp->tail) pthread_cond_wait(&zp->work, &zp->lock);
+        if (zp->next_work == zp->tail) break;
+        ZSlot *slot = &zp->slots[zp->next_work++ % zp->depth];
+        pthread_mutex_unlock(&zp->lock);
+        slot->wire_len = zblock_encode(slot->raw, slot->raw_len, slot->wire);
+        pthread_mutex_lock(&zp->lock);
+        slot->done = 1;
+        pthread_cond_broadcast(&zp->done);
+    }
+    pthread_mutex_unlock(&zp->lock);
+    return NULL;
+}
+
+static int zpipe_start(ZPipeline *zp) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    memset(zp, 0, sizeof(*zp));
+    zp->workers = cores > 1 ? (int)cores : 1;
+    if (zp->workers > ZPIPE_MAX_WORKERS) zp->workers = ZPIPE_MAX_WORKERS;
+    zp->depth = zp->workers * 2;
+    zp->slots = (ZSlot *)malloc(zp->depth * sizeof(ZSlot));
+    if (!zp->slots) return -1;
+    pthread_mutex_init(&zp->lock, NULL);
+    pthread_cond_init(&zp->work, NULL);
+    pthread_cond_init(&zp->done, NULL);
+    for (int i = 0; i < zp->workers; i++) pthread_create(&zp->threads[i], NULL, zpipe_worker, zp);
+    return 0;
+}
+
+// 送出最舊的一個區塊
+static void zpipe_flush_one(ZPipeline *zp, SSL *ssl) {
+    ZSlot *slot = &zp->slots[zp->head % zp->depth];
+    pthread_mutex_lock(&zp->lock);
+    while (!slot->done) pthread_cond_wait(&zp->done, &zp->lock);
+    pthread_mutex_unlock(&zp->lock);
+    if (!zp->failed && SSL_write(ssl, slot->wire, (int)slot->wire_len) <= 0) zp->failed = 1;
+    if (!zp->failed) {
+        zp->raw_bytes += slot->raw_len;
+        zp->wire_bytes += slot->wire_len;
+    }
+    zp->head++;
+}
+
+// 放入一個 chunk (最多 ZBLOCK_SIZE)；佇列滿時先送出最舊的區塊。raw 在送出前必須保持有效
+static int zpipe_push(ZPipeline *zp, SSL *ssl, const unsigned char *raw, size_t len) {
+    if (zp->tail - zp->head == (unsigned long)zp->depth) zpipe_flush_one(zp, ssl);
+    ZSlot *slot = &zp->slots[zp->tail % zp->depth];
+    slot->raw = raw;
+    slot->raw_len = len;
+    slot->done = 0;
+    pthread_mutex_lock(&zp->lock);
+    zp->tail++;
+    pthread_cond_signal(&zp->work);
+    pthread_mutex_unlock(&zp->lock);
+    return zp->failed ? -1 : 0;
+}
+
+static int zpipe_drain(ZPipeline *zp, SSL *ssl) {
+    while (zp->head < zp->tail) zpipe_flush_one(zp, ssl);
+    return zp->failed ? -1 : 0;
+}
+
+static void zpipe_stop(ZPipeline *zp) {
+    pthread_mutex_lock(&zp->lock);
+    zp->stop = 1;
+    pthread_cond_broadcast(&zp->work);
+    pthread_mutex_unlock(&zp->lock);
+    for (int i = 0; i < zp->workers; i++) pthread_join(zp->threads[i], NULL);
+    pthread_mutex_destroy(&zp->lock);
+    pthread_cond_destroy(&zp->work);
+    pthread_cond_destroy(&zp->done);
+    free(zp->slots);
+}
+
 void send_file(SSL *ssl) {
     char filename[USERNAME_BUFFER_SIZE];
-    FILE *file;
-    int file_size, bytes_read;
+    struct stat st;
 
     printf("Enter filename to send: ");
-    scanf("%s", filename);
+    scanf("%127s", filename);
 
-    file = fopen(filename, "rb");
-    if (!file) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
         perror("[ERROR] Failed to open file");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    uint64_t file_size = st.st_size;
+    if (file_size == 0) {
+        printf("[ERROR] File is empty. Upload aborted\n");
+        close(fd);
         return;
     }
+    unsigned char *data = (unsigned char *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("[ERROR] Failed to map file");
+        return;
+    }
+    madvise(data, file_size, MADV_SEQUENTIAL);
+
+    // 不是已壓縮格式、開頭樣本也壓得小時，缺的 chunk 以壓縮區塊送出 (一個 chunk 一個區塊)
+    ZPipeline zp;
+    unsigned char *scratch = (unsigned char *)malloc(ZBLOCK_HEADER_SIZE + ZCODEC_SAMPLE_SIZE);
+    int compress = scratch && !zcodec_skip_name(filename) && zcodec_worth(data, file_size, scratch) && zpipe_start(&zp) == 0;
+    free(scratch);
 
     // 發送命令
     char command[COMMAND_BUFFER_SIZE];
-    snprintf(command, sizeof(command), "SEND_FILE %s", filename);
+    snprintf(command, sizeof(command), "SEND_FILE_DEDUP %s %llu%s", filename, (unsigned long long)file_size,
+             compress ? " zlib" : "");
     if (SSL_write(ssl, command, strlen(command)) <= 0) {
         perror("[ERROR] Failed to send command to server");
-        fclose(file);
+        if (compress) zpipe_stop(&zp);
+        munmap(data, file_size);
         return;
     }
     printf("[DEBUG] Sent command: %s\n", command);
 
-    // 獲取檔案大小
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    printf("[DEBUG] file_size=%d\n", file_size);
-
-    // 發送檔案大小
-    int net_file_size = htonl(file_size);
-    if (SSL_write(ssl, &net_file_size, sizeof(net_file_size)) <= 0) {
-        perror("[ERROR] Failed to send file size");
-        fclose(file);
-        return;
-    }
-    printf("[DEBUG] Sent file size: %d bytes\n", file_size);
-
-    // 發送檔案內容
-    char file_buffer[1024];
-    int total_sent = 0;
-    while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0) {
-        int sent = SSL_write(ssl, file_buffer, bytes_read);
-        if (sent <= 0) {
-            perror("[ERROR] Failed to send file data");
+    DedupBatch *cur = (DedupBatch *)malloc(sizeof(DedupBatch));
+    DedupBatch *next = (DedupBatch *)malloc(sizeof(DedupBatch));
+    uint64_t pos = 0, sent_bytes = 0;
+    unsigned long total_chunks = 0, sent_chunks = 0;
+    int ok = 1;
+
+    dedup_batch_fill(cur, data, file_size, &pos);
+    if (SSL_write(ssl, cur->header, 4 + cur->count * DEDUP_ENTRY_SIZE) <= 0) ok = 0;
+    while (ok && cur->count > 0) {
+        // 等 server 回覆 bitmap 的同時先切好下一批
+        dedup_batch_fill(next, data, file_size, &pos);
+        unsigned char bitmap[(DEDUP_BATCH_CHUNKS + 7) / 8];
+        if (read_exact(ssl, bitmap, (cur->count + 7) / 8) < 0) {
+            ok = 0;
             break;
         }
-        total_sent += sent;
-        printf("[DEBUG] Sent %d bytes, total_sent=%d\n", sent, total_sent);
+        if (compress) {
+            for (uint32_t i = 0; i < cur->count && ok; i++) {
+                if (!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+                if (zpipe_push(&zp, ssl, data + cur->offsets[i], cur->lengths[i]) < 0) ok = 0;
+                sent_chunks++;
+            }
+            if (zpipe_drain(&zp, ssl) < 0) {
+                perror("[ERROR] Failed to send file data");
+                ok = 0;
+            }
+        }
+        // 需要的 chunk 在檔案中相鄰時合併成一次 SSL_write
+        for (uint32_t i = 0; i < cur->count && ok && !compress;) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+                i++;
+                continue;
+            }
+            uint64_t start = cur->offsets[i];
+            uint64_t len = 0;
+            while (i < cur->count && (bitmap[i / 8] & (1 << (i % 8))) && len < TRANSFER_BUFFER_SIZE * 64) {
+                len += cur->lengths[i++];
+                sent_chunks++;
+            }
+            if (SSL_write(ssl, data + start, (int)len) <= 0) {
+                perror("[ERROR] Failed to send file data");
+                ok = 0;
+            }
+            sent_bytes += len;
+        }
+        total_chunks += cur->count;
+        if (ok && SSL_write(ssl, next->header, 4 + next->count * DEDUP_ENTRY_SIZE) <= 0) ok = 0;
+        DedupBatch *tmp = cur;
+        cur = next;
+        next = tmp;
     }
-    fclose(file);
+    free(cur);
+    free(next);
+    if (compress) {
+        zpipe_drain(&zp, ssl);
+        sent_bytes = zp.wire_bytes;
+        zpipe_stop(&zp);
+    }
+    munmap(data, file_size);
 
-    if (total_sent == file_size) {
-        printf("File '%s' sent successfully. Total bytes sent: %d\n", filename, total_sent);
+    if (ok) {
+        printf("File '%s' sent: %llu bytes, %lu/%lu chunks transferred (%.1f MB%s), the rest already on server\n",
+               filename, (unsigned long long)file_size, sent_chunks, total_chunks, sent_bytes / (1024.0 * 1024.0),
+               compress ? " compressed" : "");
     } else {
-        printf("[ERROR] File transmission incomplete. Sent %d/%d bytes\n", total_sent, file_size);
+        printf("[ERROR] File transmission incomplete. Sent %lu/%lu chunks\n", sent_chunks, total_chunks);
     }
 
     // 接收伺服器回應
     char server_response[COMMAND_BUFFER_SIZE];
     bzero(server_response, sizeof(server_response));
-    SSL_read(ssl, server_response, sizeof(server_response));
+    SSL_read(ssl, server_response, sizeof(server_response) - 1);
     printf("From Server: %s\n", server_response);
 }
 
 // ========== 下載檔案 ==========
+// 下載完成的暫存檔改成正式檔名，已存在同名檔案時加上 _N 防止重名
+void save_received_file(const char *filename, const char *temp_filename, char *new_filename, size_t size) {
+    snprintf(new_filename, size, "%s", filename);
+    int counter = 1;
+    while (access(new_filename, F_OK) == 0) {
+        snprintf(new_filename, size, "%s_%d", filename, counter);
+        counter++;
+    }
+    rename(temp_filename, new_filename);
+}
+
+// .part 對應的 server 檔案 (大小與修改時間) 記在 <filename>.part.state ("<size> <mtime>\n")
+static int read_download_state(const char *state_path, long long *size, long long *mtime) {
+    FILE *file = fopen(state_path, "r");
+    if (!file) return -1;
+    int ok = fscanf(file, "%lld %lld", size, mtime) == 2;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+static int write_download_state(const char *state_path, long long size, long long mtime) {
+    FILE *file = fopen(state_path, "w");
+    if (!file) return -1;
+    fprintf(file, "%lld %lld\n", size, mtime);
+    return fclose(file);
+}
+
+// 下載到 <filename>.part，中斷後再次下載會從 .part 的長度繼續；完成後才改成正式檔名。
+// server 上的檔案與 .part.state 記錄的大小或修改時間不同時 (已被換掉)，從頭重新下載
 void receive_file(SSL *ssl) {
     char filename[USERNAME_BUFFER_SIZE];
-    char new_filename[USERNAME_BUFFER_SIZE];
+    char part_filename[USERNAME_BUFFER_SIZE + 8];
+    char state_filename[USERNAME_BUFFER_SIZE + 16];
+    char new_filename[USERNAME_BUFFER_SIZE + 16];
+    char server_response[COMMAND_BUFFER_SIZE];
     FILE *file;
-    int file_size, bytes_read;
+    uint64_t net_length;
 
     printf("Enter filename to receive: ");
-    scanf("%s", filename);
-
-    // 發送接收檔案命令
-    char command[COMMAND_BUFFER_SIZE];
-    snprintf(command, sizeof(command), "RECEIVE_FILE %s", filename);
-    SSL_write(ssl, command, strlen(command));
+    scanf("%127s", filename);
 
-    // 接收檔案大小
-    if (SSL_read(ssl, &file_size, sizeof(file_size)) <= 0) {
-        perror("[ERROR] Failed to receive file size");
+    long long remote_size, remote_mtime;
+    unsigned long long partial, partial_total;
+    if (query_file_status(ssl, filename, &remote_size, &partial, &partial_total, &remote_mtime) < 0) return;
+    if (remote_size < 0) {
+        printf("From Server: File not found\n");
         return;
     }
-    file_size = ntohl(file_size);
-    printf("[DEBUG] Receiving file: %s, size: %d bytes\n", filename, file_size);
 
-    if (file_size == 0) {
-        printf("[ERROR] Received file size=0. Aborting download.\n");
+    snprintf(part_filename, sizeof(part_filename), "%s.part", filename);
+    snprintf(state_filename, sizeof(state_filename), "%s.part.state", filename);
+    struct stat st;
+    uint64_t offset = 0;
+    long long part_size, part_mtime;
+    if (stat(part_filename, &st) == 0 && st.st_size > 0) {
+        if (remote_mtime != 0 && read_download_state(state_filename, &part_size, &part_mtime) == 0 &&
+            part_size == remote_size && part_mtime == remote_mtime && (uint64_t)st.st_size <= (uint64_t)remote_size) {
+            offset = st.st_size;
+            printf("Resuming download from byte %llu\n", (unsigned long long)offset);
+        } else {
+            printf("'%s' does not match the file on server, restarting download\n", part_filename);
+        }
+    }
+    if (offset == 0 && write_download_state(state_filename, remote_size, remote_mtime) < 0) {
+        perror("[ERROR] Failed to write download state");
         return;
     }
 
-    // 防止重名
-    strcpy(new_filename, filename);
-    int counter = 1;
-    while (access(new_filename, F_OK) == 0) {
-        snprintf(new_filename, sizeof(new_filename), "%s_%d", filename, counter);
-        counter++;
+    // 發送接收檔案命令；不是已壓縮格式就要求壓縮，由 server 決定實際是否壓縮
+    int requested = !zcodec_skip_name(filename);
+    char command[COMMAND_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "RECEIVE_FILE %s %llu%s", filename, (unsigned long long)offset,
+             requested ? " zlib" : "");
+    SSL_write(ssl, command, strlen(command));
+
+    // 接收區段長度 (8 bytes, big-endian)，要求壓縮時再接 1 byte codec
+    unsigned char codec = ZCODEC_NONE;
+    if (read_exact(ssl, &net_length, sizeof(net_length)) < 0 || (requested && read_exact(ssl, &codec, 1) < 0)) {
+        perror("[ERROR] Failed to receive file size");
+        return;
     }
+    uint64_t length = ntoh64(net_length);
+    uint64_t file_size = offset + length;
+    printf("[DEBUG] Receiving file: %s, size: %llu bytes\n", filename, (unsigned long long)file_size);
 
-    file = fopen(new_filename, "wb");
+    file = fopen(part_filename, offset > 0 ? "ab" : "wb");
     if (!file) {
         perror("[ERROR] Failed to open file for writing");
         return;
     }
 
     // 接收檔案內容
-    char file_buffer[1024];
-    int total_received = 0;
-    while (total_received < file_size) {
-        bytes_read = SSL_read(ssl, file_buffer, sizeof(file_buffer));
+    char *file_buffer = (char *)malloc(TRANSFER_BUFFER_SIZE);
+    uint64_t total_received = 0, wire_received = 0;
+    if (codec == ZCODEC_ZLIB) {
+        // 逐區塊解開後寫入，中斷時 .part 只含完整的區塊
+        unsigned char *block = (unsigned char *)malloc(ZBLOCK_SIZE);
+        unsigned char header[ZBLOCK_HEADER_SIZE];
+        while (block && total_received < length) {
+            uint32_t raw_len, payload_len;
+            int stored;
+            if (read_exact(ssl, header, sizeof(header)) < 0 ||
+                zblock_parse_header(header, &raw_len, &payload_len, &stored) < 0 ||
+                read_exact(ssl, file_buffer, payload_len) < 0 ||
+                zblock_decode((unsigned char *)file_buffer, payload_len, stored, block, raw_len) < 0) {
+                break;
+            }
+            fwrite(block, 1, raw_len, file);
+            total_received += raw_len;
+            wire_received += ZBLOCK_HEADER_SIZE + payload_len;
+        }
+        free(block);
+        if (total_received == length) {
+            printf("Compressed transfer: %.1f MB on the wire for %.1f MB\n", wire_received / (1024.0 * 1024.0),
+                   length / (1024.0 * 1024.0));
+        }
+    }
+    while (codec == ZCODEC_NONE && total_received < length) {
+        uint64_t remaining = length - total_received;
+        int bytes_read = SSL_read(ssl, file_buffer, remaining < TRANSFER_BUFFER_SIZE ? (int)remaining : TRANSFER_BUFFER_SIZE);
         if (bytes_read <= 0) break;
         fwrite(file_buffer, 1, bytes_read, file);
         total_received += bytes_read;
-        printf("[DEBUG] Received %d bytes, total_received=%d\n", bytes_read, total_received);
     }
+    free(file_buffer);
     fclose(file);
 
-    if (total_received == file_size) {
+    // 先讀伺服器回應再決定是否完成：長度 0 也可能是 "File not found" / "Invalid range"
+    bzero(server_response, sizeof(server_response));
+    SSL_read(ssl, server_response, sizeof(server_response) - 1);
+    int complete = total_received == length &&
+                   strncmp(server_response, "File download complete", strlen("File download complete")) == 0;
+
+    if (complete) {
+        save_received_file(filename, part_filename, new_filename, sizeof(new_filename));
+        unlink(state_filename);
         printf("File '%s' received successfully. Saved as '%s'.\n", filename, new_filename);
+    } else if (offset + total_received == 0) {
+        unlink(part_filename);
+        unlink(state_filename);
+        printf("[ERROR] File reception failed.\n");
     } else {
-        printf("[ERROR] File reception incomplete. Received %d/%d bytes\n", total_received, file_size);
+        printf("[ERROR] File reception incomplete. Received %llu/%llu bytes, kept in '%s' for resume\n",
+               (unsigned long long)(offset + total_received), (unsigned long long)file_size, part_filename);
     }
-
-    // 接收伺服器回應
-    char server_response[COMMAND_BUFFER_SIZE];
-    bzero(server_response, sizeof(server_response));
-    SSL_read(ssl, server_response, sizeof(server_response));
     printf("From Server: %s\n", server_response);
 }
 
+// ========== 分段平行下載 ==========
+// 檔案切成 N 段，每段開一條獨立連線以 RECEIVE_CHUNKS 抓取，逐 chunk 驗證 CRC32C 後 pwrite 到對應位置。
+// checksum 不符的 chunk 記下來之後單獨重抓；連線中斷則重連並從已收到的位置繼續。
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+} ChunkRange;
+
+typedef struct {
+    const char *filename;
+    int out_fd;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t done;              // 已收到 (含 checksum 錯誤待重抓) 的 bytes
+    ChunkRange *bad;            // checksum 錯誤待重抓的 chunk
+    int bad_count;
+    int bad_cap;
+    int ok;
+} Stripe;
+
+static void stripe_mark_bad(Stripe *stripe, uint64_t offset, uint32_t length) {
+    if (stripe->bad_count == stripe->bad_cap) {
+        stripe->bad_cap = stripe->bad_cap ? stripe->bad_cap * 2 : 8;
+        stripe->bad = (ChunkRange *)realloc(stripe->bad, stripe->bad_cap * sizeof(ChunkRange));
+    }
+    stripe->bad[stripe->bad_count].offset = offset;
+    stripe->bad[stripe->bad_count].length = length;
+    stripe->bad_count++;
+}
+
+// 抓 [offset, offset+length)，*progress 為已收到的 bytes；連線或協定錯誤回傳 -1。
+// 尚未連線時 (*ssl 為 NULL) 新建連線，指令直接以 0-RTT early data 隨 handshake 送出
+static int fetch_chunks(SSL **ssl_ptr, int *sockfd, Stripe *stripe, uint64_t offset, uint64_t length,
+                        unsigned char *buffer, uint64_t *progress) {
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[COMMAND_BUFFER_SIZE];
+    uint64_t net_length;
+
+    *progress = 0;
+    snprintf(command, sizeof(command), "RECEIVE_CHUNKS %s %llu %llu %d", stripe->filename,
+             (unsigned long long)offset, (unsigned long long)length, DEFAULT_STRIPE_CHUNK_SIZE);
+    if (!*ssl_ptr) {
+        if (!(*ssl_ptr = connect_server(client_ctx, sockfd, command))) return -1;
+    } else if (SSL_write(*ssl_ptr, command, strlen(command)) <= 0) {
+        return -1;
+    }
+    SSL *ssl = *ssl_ptr;
+    if (read_exact(ssl, &net_length, sizeof(net_length)) < 0) return -1;
+    if (ntoh64(net_length) != length) {
+        bzero(reply, sizeof(reply));
+        SSL_read(ssl, reply, sizeof(reply) - 1);
+        printf("[ERROR] Stripe at %llu rejected: %s", (unsigned long long)offset, reply);
+        return -1;
+    }
+
+    while (*progress < length) {
+        uint32_t header[2];
+        if (read_exact(ssl, header, CHUNK_HEADER_SIZE) < 0) return -1;
+        uint32_t chunk_length = ntohl(header[0]);
+        uint32_t expected_crc = ntohl(header[1]);
+        if (chunk_length == 0 || chunk_length > DEFAULT_STRIPE_CHUNK_SIZE || chunk_length > length - *progress) {
+            return -1;
+        }
+        if (read_exact(ssl, buffer, chunk_length) < 0) return -1;
+
+        uint64_t chunk_offset = offset + *progress;
+        if (crc32c(buffer, chunk_length) != expected_crc) {
+            printf("[ERROR] Checksum mismatch at %llu+%u, will refetch\n", (unsigned long long)chunk_offset,
+                   chunk_length);
+            stripe_mark_bad(stripe, chunk_offset, chunk_length);
+        } else if (pwrite(stripe->out_fd, buffer, chunk_length, chunk_offset) != (ssize_t)chunk_length) {
+            perror("[ERROR] Failed to write chunk");
+            return -1;
+        }
+        *progress += chunk_length;
+    }
+
+    bzero(reply, sizeof(reply));
+    if (SSL_read(ssl, reply, sizeof(reply) - 1) <= 0) return -1;
+    return strstr(reply, "complete") && !strstr(reply, "incomplete") ? 0 : -1;
+}
+
+static void *stripe_thread(void *arg) {
+    Stripe *stripe = (Stripe *)arg;
+    unsigned char *buffer = (unsigned char *)malloc(DEFAULT_STRIPE_CHUNK_SIZE);
+    SSL *ssl = NULL;
+    int sockfd = -1;
+    int attempts = 0;
+
+    // 主要傳輸：斷線時重連並從 done 繼續
+    while (buffer && stripe->done < stripe->length && attempts <= CHUNK_RETRY_LIMIT) {
+        uint64_t progress;
+        int ret = fetch_chunks(&ssl, &sockfd, stripe, stripe->offset + stripe->done, stripe->length - stripe->done,
+                               buffer, &progress);
+        stripe->done += progress;
+        if (ret < 0) {
+            if (ssl) disconnect_server(ssl, sockfd);
+            ssl = NULL;
+            attempts++;
+        }
+    }
+
+    // 重抓 checksum 錯誤的 chunk
+    for (int round = 0; buffer && stripe->bad_count > 0 && round < CHUNK_RETRY_LIMIT; round++) {
+        ChunkRange *pending = stripe->bad;
+        int pending_count = stripe->bad_count;
+        stripe->bad = NULL;
+        stripe->bad_count = stripe->bad_cap = 0;
+        for (int i = 0; i < pending_count; i++) {
+            uint64_t progress = 0;
+            if (fetch_chunks(&ssl, &sockfd, stripe, pending[i].offset, pending[i].length, buffer, &progress) < 0) {
+                if (progress < pending[i].length) {
+                    stripe_mark_bad(stripe, pending[i].offset + progress, pending[i].length - (uint32_t)progress);
+                }
+                if (ssl) disconnect_server(ssl, sockfd);
+                ssl = NULL;
+            }
+        }
+        free(pending);
+    }
+
+    if (ssl) {
+        SSL_write(ssl, "exit", strlen("exit"));
+        disconnect_server(ssl, sockfd);
+    }
+    stripe->ok = buffer && stripe->done == stripe->length && stripe->bad_count == 0;
+    free(buffer);
+    free(stripe->bad);
+    return NULL;
+}
+
+void striped_receive_file(SSL *ssl) {
+    char filename[USERNAME_BUFFER_SIZE];
+    char temp_filename[USERNAME_BUFFER_SIZE + 8];
+    char new_filename[USERNAME_BUFFER_SIZE + 16];
+    int stripe_count = DEFAULT_STRIPES;
+
+    printf("Enter filename to receive: ");
+    scanf("%127s", filename);
+    printf("Number of connections (1-%d, default %d): ", MAX_STRIPES, DEFAULT_STRIPES);
+    if (scanf("%d", &stripe_count) != 1 || stripe_count < 1 || stripe_count > MAX_STRIPES) {
+        stripe_count = DEFAULT_STRIPES;
+    }
+    while (getchar() != '\n');
+
+    long long remote_size;
+    unsigned long long partial, partial_total;
+    if (query_file_status(ssl, filename, &remote_size, &partial, &partial_total, NULL) < 0) return;
+    if (remote_size < 0) {
+        printf("From Server: File not found\n");
+        return;
+    }
+
+    // 先寫到 .stripe 暫存檔並預先設定大小，各段直接 pwrite 到自己的位置
+    snprintf(temp_filename, sizeof(temp_filename), "%s.stripe", filename);
+    int out_fd = open(temp_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || ftruncate(out_fd, remote_size) < 0) {
+        perror("[ERROR] Failed to open file for writing");
+        if (out_fd >= 0) close(out_fd);
+        return;
+    }
+
+    uint64_t file_size = remote_size;
+    if ((uint64_t)stripe_count > file_size / DEFAULT_STRIPE_CHUNK_SIZE) {
+        stripe_count = file_size / DEFAULT_STRIPE_CHUNK_SIZE > 0 ? (int)(file_size / DEFAULT_STRIPE_CHUNK_SIZE) : 1;
+    }
+    // 每段長度對齊 chunk 大小，最後一段吃掉餘數
+    uint64_t stripe_length = (file_size / stripe_count) / DEFAULT_STRIPE_CHUNK_SIZE * DEFAULT_STRIPE_CHUNK_SIZE;
+
+    Stripe stripes[MAX_STRIPES];
+    pthread_t threads[MAX_STRIPES];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < stripe_count; i++) {
+        memset(&stripes[i], 0, sizeof(Stripe));
+        stripes[i].filename = filename;
+        stripes[i].out_fd = out_fd;
+        stripes[i].offset = i * stripe_length;
+        stripes[i].length = i == stripe_count - 1 ? file_size - stripes[i].offset : stripe_length;
+        pthread_create(&threads[i], NULL, stripe_thread, &stripes[i]);
+    }
+
+    int ok = 1;
+    uint64_t total_received = 0;
+    for (int i = 0; i < stripe_count; i++) {
+        pthread_join(threads[i], NULL);
+        ok &= stripes[i].ok;
+        total_received += stripes[i].done;
+    }
+    close(out_fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (ok) {
+        save_received_file(filename, temp_filename, new_filename, sizeof(new_filename));
+        printf("File '%s' received successfully in %.2f s (%.1f MB/s). Saved as '%s'.\n", filename, seconds,
+               seconds > 0 ? file_size / seconds / (1024 * 1024) : 0.0, new_filename);
+    } else {
+        unlink(temp_filename);
+        printf("[ERROR] Striped download failed. Received %llu/%llu bytes\n", (unsigned long long)total_received,
+               (unsigned long long)file_size);
+    }
+}
+
 // ========== 查詢檔案清單 ==========
+// 讀取一頁 LIST_FILES 回覆：回覆可能跨多個 TLS record，讀到最後一行為 "[more] ..." 或 "[end] ..." 才結束
+static int read_list_page(SSL *ssl, char *page, size_t size) {
+    size_t used = 0;
+    while (used < size - 1) {
+        int ret = SSL_read(ssl, page + used, (int)(size - 1 - used));
+        if (ret <= 0) return -1;
+        used += ret;
+        page[used] = '\0';
+        if (page[used - 1] != '\n') continue;
+        char *last = page + used - 1;
+        while (last > page && last[-1] != '\n') last--;
+        if (strncmp(last, "[more] ", 7) == 0 || strncmp(last, "[end] ", 6) == 0) return 0;
+    }
+    return 0;
+}
+
 void list_files(SSL *ssl) {
-    SSL_write(ssl, "LIST_FILES", strlen("LIST_FILES"));
+    char command[COMMAND_BUFFER_SIZE];
+    char prefix[USERNAME_BUFFER_SIZE];
+    char page[LIST_REPLY_MAX + 1];
+    long offset = 0;
 
-    char file_list[COMMAND_BUFFER_SIZE * 10];
-    bzero(file_list, sizeof(file_list));
-    int ret = SSL_read(ssl, file_list, sizeof(file_list));
+    printf("Filter by name prefix (Enter for all): ");
+    if (!fgets(prefix, sizeof(prefix), stdin)) return;
+    prefix[strcspn(prefix, " \t\r\n")] = '\0';
 
-    if (ret <= 0) {
-        printf("[ERROR] Failed to retrieve file list\n");
-    } else {
-        printf("Available files on server:\n%s", file_list);
+    printf("Available files on server:\n");
+    while (1) {
+        snprintf(command, sizeof(command), "LIST_FILES %ld %d %s", offset, LIST_PAGE_SIZE, prefix);
+        SSL_write(ssl, command, strlen(command));
+        if (read_list_page(ssl, page, sizeof(page)) < 0) {
+            printf("[ERROR] Failed to retrieve file list\n");
+            return;
+        }
+
+        // 每行 "<檔名> <大小> <mtime>"，其餘 (例如沒有檔案的訊息) 原樣印出
+        size_t total = 0;
+        long next = -1;
+        for (char *line = strtok(page, "\n"); line; line = strtok(NULL, "\n")) {
+            char name[USERNAME_BUFFER_SIZE];
+            unsigned long long size;
+            long long mtime;
+            if (sscanf(line, "[more] next=%ld total=%zu", &next, &total) == 2) continue;
+            if (sscanf(line, "[end] total=%zu", &total) == 1) continue;
+            if (sscanf(line, "%127s %llu %lld", name, &size, &mtime) == 3) {
+                char when[32];
+                time_t t = (time_t)mtime;
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+                printf("  %-40s %14llu  %s\n", name, size, when);
+            } else {
+                printf("%s\n", line);
+            }
+        }
+        if (next < 0) return;
+
+        offset = next;
+        printf("-- %ld/%zu, show more? (y/n): ", offset, total);
+        char answer[8];
+        if (!fgets(answer, sizeof(answer), stdin) || (answer[0] != 'y' && answer[0] != 'Y')) return;
     }
 }
 
 // ========== 串流影片 (Send video) ==========
-// 改良版：結束時傳 frame_size=0 通知 Server
+// 依影片本身的 FPS 以 monotonic clock 排定每個 frame 的送出時間 (絕對時間，不累積誤差)。
+// 每送出一張就依「SSL_write 花的時間」、「socket 尚未送出的 bytes」與 server 的 feedback (ring 滿而丟 frame)
+// 調整 JPEG 品質：壅塞時大幅降低、順暢一段時間才慢慢提高，品質到底後再降低解析度。
+// 落後超過一個 frame 時可選擇跳過 frame (只 grab 不解碼)，讓畫面延遲維持在一兩個 frame 內，
+// 而不是在 TLS / TCP 送出緩衝累積越來越多舊畫面。結束時傳 frame_size=0 通知 Server。
+//
+// 讀取、編碼與傳送分成 pipeline：capture 執行緒依 FPS 讀 frame，多個 encode 執行緒平行壓 JPEG，
+// 呼叫端執行緒依序號送出 (唯一碰 SSL 的執行緒)。frame 存放在固定數量的 VideoSlot 中循環使用，
+// cv::Mat 與 JPEG buffer 只在第一次或解析度改變時配置；slot 用完時 capture 等待，整條 pipeline 有上限。
+//
+// delta 模式 (+delta，適合螢幕錄影等大部分畫面不動的內容) 每張只送與前一張相比有變動的 tile。
+// 比對必須依序進行，因此由 capture 執行緒負責 (SIMD，一張 1080p 約 1 ms)：縮放後與 reference 比對、
+// 把變動的 tile 寫回 reference；encode 執行緒再把變動的 tile 拼成 mosaic 壓 JPEG。reference 即 server 端的畫面
+// (不計 JPEG 失真)，定期、解析度改變、server 要求 (key=1) 或編碼失敗時改送 keyframe 重新同步。
+
+static const double video_scales[] = {1.0, 0.75, 0.5, 0.35};
+#define VIDEO_SCALE_LEVELS (int)(sizeof(video_scales) / sizeof(video_scales[0]))
+
+typedef struct {
+    double interval;                // 來源每個 frame 的秒數
+    int quality;
+    int scale_level;                // video_scales 的 index
+    double send_ewma;               // 平均每張 SSL_write 的秒數
+    int stable;                     // 連續順暢的 frame 數
+    size_t frame_bytes;             // 最近 frame 的平均大小 (delta 模式每張大小差很多)
+    unsigned long server_dropped;   // 最近一次 feedback 的 dropped
+    int server_congested;           // feedback 顯示 server 來不及處理
+    int stopped;                    // server 要求停止 (FB stop)
+    int ended;                      // 收到 FB end
+    int codec_ready;                // 收到 FB codec=...
+    int delta;                      // server 接受 +delta
+    int key_requested;              // server 要求 keyframe (key=1)
+} RateControl;
+
+static double monotonic_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double deadline) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+// unsent 為送出後再過一個 frame 時間仍未送上網路的 bytes：超過一張 frame 代表網路消化不了目前的 bitrate
+static void rate_adjust(RateControl *rc, double send_time, int unsent, size_t frame_bytes) {
+    rc->frame_bytes = rc->frame_bytes ? (rc->frame_bytes * 7 + frame_bytes) / 8 : frame_bytes;
+    rc->send_ewma = rc->send_ewma * 0.8 + send_time * 0.2;
+    int congested = rc->server_congested || rc->send_ewma > rc->interval * 0.5 || (size_t)unsent > rc->frame_bytes;
+    rc->server_congested = 0;
+
+    if (congested) {
+        rc->stable = 0;
+        if (rc->quality > VIDEO_QUALITY_MIN) {
+            rc->quality -= VIDEO_QUALITY_STEP_DOWN;
+            if (rc->quality < VIDEO_QUALITY_MIN) rc->quality = VIDEO_QUALITY_MIN;
+        } else if (rc->scale_level < VIDEO_SCALE_LEVELS - 1) {
+            rc->scale_level++;
+        }
+    } else if (++rc->stable >= VIDEO_STABLE_FRAMES) {
+        rc->stable = 0;
+        if (rc->quality < VIDEO_QUALITY_MAX) {
+            rc->quality += VIDEO_QUALITY_STEP_UP;
+        } else if (rc->scale_level > 0) {
+            rc->scale_level--; // 解析度提高後從中間的品質開始
+            rc->quality = (VIDEO_QUALITY_MIN + VIDEO_QUALITY_MAX) / 2;
+        }
+    }
+}
+
+// 讀取 server 的 feedback ("FB received=<n> dropped=<n> depth=<n> [key=1]" / "FB codec=<codec>" / "FB stop" /
+// "FB end")。until 為 NULL 時只讀已經到達的資料，否則一直讀到 *until 不為 0；回傳 -1 代表連線中斷
+static int video_read_feedback(SSL *ssl, RateControl *rc, const int *until) {
+    char buf[COMMAND_BUFFER_SIZE];
+    int fd = SSL_get_fd(ssl);
+
+    while (!rc->ended && !(until && *until)) {
+        int n;
+        if (until) {
+            n = SSL_read(ssl, buf, sizeof(buf) - 1);
+            if (n <= 0) return -1;
+        } else {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (SSL_pending(ssl) == 0 && poll(&pfd, 1, 0) <= 0) return 0;
+            // 暫時切成 non-blocking，避免只到了一半的 record 卡住送出
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            n = SSL_read(ssl, buf, sizeof(buf) - 1);
+            int err = n <= 0 ? SSL_get_error(ssl, n) : SSL_ERROR_NONE;
+            fcntl(fd, F_SETFL, flags);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+            if (n <= 0) return -1;
+        }
+        buf[n] = '\0';
+
+        char *save = NULL;
+        for (char *line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            unsigned long received, dropped;
+            int depth;
+            if (strcmp(line, "FB end") == 0) {
+                rc->ended = 1;
+            } else if (strcmp(line, "FB stop") == 0) {
+                rc->stopped = 1;
+            } else if (strncmp(line, "FB codec=", 9) == 0) {
+                rc->codec_ready = 1;
+                rc->delta = strcmp(line + 9, "delta") == 0;
+            } else if (sscanf(line, "FB received=%lu dropped=%lu depth=%d", &received, &dropped, &depth) == 3) {
+                if (dropped > rc->server_dropped) rc->server_congested = 1;
+                rc->server_dropped = dropped;
+                if (strstr(line, " key=1")) rc->key_requested = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct VideoSlot {
+    struct VideoSlot *next;         // free / encode 串列
+    cv::Mat frame, scaled;
+    std::vector<uchar> jpeg;        // 要送出的 payload (delta 模式含 header)
+    std::vector<int> params;
+    unsigned long seq;              // 送出順序
+    int quality, scale_level;       // capture 當時的設定
+    int encoded;                    // 1 成功、-1 編碼失敗
+    int keyframe;                   // delta 模式：送整張畫面
+    std::vector<uint16_t> tiles;    // delta 模式：變動的 tile 編號
+    cv::Mat mosaic;
+    std::vector<uchar> packet;
+} VideoSlot;
+
+typedef struct {
+    cv::VideoCapture *cap;
+    int fd;                         // 只用來查詢 socket 未送出的 bytes，SSL 由送出端獨佔
+    int skip_frames;
+    double start;
+    pthread_mutex_t lock;           // 保護以下所有欄位與 rc
+    pthread_cond_t slot_free;
+    pthread_cond_t encode_ready;
+    pthread_cond_t encoded;
+    VideoSlot *slots;
+    int slot_count;
+    VideoSlot *free_slots;
+    VideoSlot *encode_head, *encode_tail;
+    VideoSlot **ordered;            // 編碼完成的 slot，以 seq % slot_count 為 index
+    unsigned long captured;         // 已讀取的 frame 數 (即下一個 seq)
+    unsigned long skipped;
+    int capture_done;
+    int abort;                      // 送出失敗或 server 要求停止
+    int force_key;                  // delta 模式：有 frame 編碼失敗，reference 與 server 不一致
+    RateControl rc;
+    int delta;
+    cv::Mat reference;              // 以下只有 capture 執行緒存取
+    unsigned long key_age;          // 距離上一張 keyframe 的 frame 數
+    unsigned long keyframes;
+} VideoPipeline;
+
+// capture 執行緒：決定這張送 keyframe 或 delta，並讓 reference 跟上 server 端的畫面
+static void video_delta_prepare(VideoPipeline *vp, VideoSlot *slot, int force_key) {
+    const cv::Mat *frame = &slot->frame;
+    if (slot->scale_level > 0) {
+        double scale = video_scales[slot->scale_level];
+        cv::resize(slot->frame, slot->scaled, cv::Size(), scale, scale, cv::INTER_AREA);
+        frame = &slot->scaled;
+    }
+    cv::Mat &ref = vp->reference;
+    int tiles = video_tile_count(frame->cols, frame->rows, VIDEO_TILE_SIZE);
+    slot->tiles.clear();
+    slot->keyframe = force_key || ref.empty() || ref.cols != frame->cols || ref.rows != frame->rows ||
+                     tiles > VIDEO_MAX_TILES || vp->key_age * vp->rc.interval >= VIDEO_KEYFRAME_SECONDS;
+    if (!slot->keyframe) {
+        for (int i = 0; i < tiles; i++) {
+            int x, y, w, h;
+            video_tile_rect(frame->cols, frame->rows, VIDEO_TILE_SIZE, i, &x, &y, &w, &h);
+            if (video_tile_differs(frame->ptr(y) + x * 3, frame->step, ref.ptr(y) + x * 3, ref.step, (size_t)w * 3, h,
+                                   VIDEO_TILE_THRESHOLD)) {
+                slot->tiles.push_back((uint16_t)i);
+            }
+        }
+        // 大部分都變了 (換場景)：整張 JPEG 比 mosaic 小
+        if (slot->tiles.size() > tiles * VIDEO_KEYFRAME_RATIO) slot->keyframe = 1;
+    }
+
+    if (slot->keyframe) {
+        frame->copyTo(ref);
+        slot->tiles.clear();
+        vp->key_age = 0;
+        vp->keyframes++;
+        return;
+    }
+    for (size_t i = 0; i < slot->tiles.size(); i++) {
+        int x, y, w, h;
+        video_tile_rect(frame->cols, frame->rows, VIDEO_TILE_SIZE, slot->tiles[i], &x, &y, &w, &h);
+        for (int r = 0; r < h; r++) memcpy(ref.ptr(y + r) + x * 3, frame->ptr(y + r) + x * 3, (size_t)w * 3);
+    }
+    vp->key_age++;
+}
+
+// encode 執行緒：keyframe 為 [K][JPEG]，delta 為 header + tile 編號 + mosaic JPEG (格式見 protocol.h)
+static int video_encode_delta(VideoSlot *slot, const cv::Mat &frame) {
+    size_t count = slot->tiles.size();
+    slot->packet.clear();
+    if (slot->keyframe) {
+        if (!cv::imencode(".jpg", frame, slot->jpeg, slot->params)) return -1;
+        slot->packet.push_back(VIDEO_FRAME_KEY);
+    } else {
+        slot->packet.resize(VIDEO_DELTA_HEADER_SIZE + count * 2);
+        video_delta_encode_header(slot->packet.data(), VIDEO_TILE_SIZE, frame.cols, frame.rows, (int)count);
+        for (size_t i = 0; i < count; i++) {
+            uint16_t net_index = htons(slot->tiles[i]);
+            memcpy(slot->packet.data() + VIDEO_DELTA_HEADER_SIZE + i * 2, &net_index, sizeof(net_index));
+        }
+        if (count == 0) { // 畫面沒變，只送 header
+            slot->jpeg.swap(slot->packet);
+            return 1;
+        }
+        int columns = count < VIDEO_MOSAIC_COLUMNS ? (int)count : VIDEO_MOSAIC_COLUMNS;
+        int rows = (int)((count + columns - 1) / columns);
+        slot->mosaic.create(rows * VIDEO_TILE_SIZE, columns * VIDEO_TILE_SIZE, CV_8UC3);
+        for (size_t i = 0; i < count; i++) {
+            int x, y, w, h;
+            video_tile_rect(frame.cols, frame.rows, VIDEO_TILE_SIZE, slot->tiles[i], &x, &y, &w, &h);
+            int mx = (int)(i % columns) * VIDEO_TILE_SIZE, my = (int)(i / columns) * VIDEO_TILE_SIZE;
+            for (int r = 0; r < h; r++) memcpy(slot->mosaic.ptr(my + r) + mx * 3, frame.ptr(y + r) + x * 3, (size_t)w * 3);
+        }
+        if (!cv::imencode(".jpg", slot->mosaic, slot->jpeg, slot->params)) return -1;
+    }
+    slot->packet.insert(slot->packet.end(), slot->jpeg.begin(), slot->jpeg.end());
+    slot->jpeg.swap(slot->packet);
+    return 1;
+}
+
+static void *video_capture_thread(void *arg) {
+    VideoPipeline *vp = (VideoPipeline *)arg;
+    unsigned long index = 0; // 來源影片中的 frame 位置 (含跳過的)
+    VideoSlot *slot = NULL;
+
+    while (1) {
+        pthread_mutex_lock(&vp->lock);
+        while (!slot && !vp->free_slots && !vp->abort) pthread_cond_wait(&vp->slot_free, &vp->lock);
+        if (vp->abort) {
+            pthread_mutex_unlock(&vp->lock);
+            break;
+        }
+        if (!slot) {
+            slot = vp->free_slots;
+            vp->free_slots = slot->next;
+        }
+        double interval = vp->rc.interval;
+        size_t frame_bytes = vp->rc.frame_bytes;
+        slot->quality = vp->rc.quality;
+        slot->scale_level = vp->rc.scale_level;
+        pthread_mutex_unlock(&vp->lock);
+
+        sleep_until(vp->start + index * interval);
+        if (vp->skip_frames) {
+            int unsent = 0;
+            ioctl(vp->fd, SIOCOUTQNSD, &unsent);
+            int backlog_full = frame_bytes > 0 && (size_t)unsent > frame_bytes * 2;
+            // 已經落後超過一個 frame (編碼或送出跟不上)：丟掉過時的 frame，直接追上應該播放的位置
+            double behind = monotonic_now() - (vp->start + index * interval);
+            unsigned long skipped = 0;
+            while (behind > interval && vp->cap->grab()) {
+                index++;
+                skipped++;
+                behind -= interval;
+            }
+            // socket 還積著兩張以上沒送出：這一張也不送，讓網路先消化 (否則畫面延遲會一直累積)
+            if (backlog_full && vp->cap->grab()) {
+                index++;
+                skipped++;
+            }
+            if (skipped) {
+                pthread_mutex_lock(&vp->lock);
+                vp->skipped += skipped;
+                pthread_mutex_unlock(&vp->lock);
+                if (backlog_full) continue; // slot 留著給下一張
+            }
+        }
+        if (!vp->cap->read(slot->frame) || slot->frame.empty()) break; // 影片結束
+        index++;
+        if (vp->delta) {
+            pthread_mutex_lock(&vp->lock);
+            int force_key = vp->force_key || vp->rc.key_requested;
+            vp->force_key = vp->rc.key_requested = 0;
+            pthread_mutex_unlock(&vp->lock);
+            if (force_key) vp->reference.release(); // 基準作廢，這張改送 keyframe 重建
+            video_delta_prepare(vp, slot, force_key);
+        }
+
+        pthread_mutex_lock(&vp->lock);
+        slot->seq = vp->captured++;
+        slot->next = NULL;
+        if (vp->encode_tail) vp->encode_tail->next = slot;
+        else vp->encode_head = slot;
+        vp->encode_tail = slot;
+        pthread_cond_signal(&vp->encode_ready);
+        pthread_mutex_unlock(&vp->lock);
+        slot = NULL;
+    }
+
+    pthread_mutex_lock(&vp->lock);
+    if (slot) {
+        slot->next = vp->free_slots;
+        vp->free_slots = slot;
+    }
+    vp->capture_done = 1;
+    pthread_cond_broadcast(&vp->encode_ready);
+    pthread_cond_broadcast(&vp->encoded);
+    pthread_mutex_unlock(&vp->lock);
+    return NULL;
+}
+
+static void *video_encode_thread(void *arg) {
+    VideoPipeline *vp = (VideoPipeline *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&vp->lock);
+        while (!vp->encode_head && !vp->capture_done && !vp->abort) pthread_cond_wait(&vp->encode_ready, &vp->lock);
+        VideoSlot *slot = vp->abort ? NULL : vp->encode_head;
+        if (!slot) {
+            pthread_mutex_unlock(&vp->lock);
+            break;
+        }
+        vp->encode_head = slot->next;
+        if (!vp->encode_head) vp->encode_tail = NULL;
+        pthread_mutex_unlock(&vp->lock);
+
+        // 壓縮幀為 JPEG (依 capture 當時的品質 / 解析度)；resize 與 imencode 都重複使用 slot 內的 buffer
+        // (delta 模式已在 capture 執行緒縮放過)
+        const cv::Mat *out = slot->scale_level > 0 ? &slot->scaled : &slot->frame;
+        if (slot->scale_level > 0 && !vp->delta) {
+            double scale = video_scales[slot->scale_level];
+            cv::resize(slot->frame, slot->scaled, cv::Size(), scale, scale, cv::INTER_AREA);
+        }
+        slot->params[1] = slot->quality;
+        if (vp->delta) slot->encoded = video_encode_delta(slot, *out);
+        else slot->encoded = cv::imencode(".jpg", *out, slot->jpeg, slot->params) && !slot->jpeg.empty() ? 1 : -1;
+
+        pthread_mutex_lock(&vp->lock);
+        if (slot->encoded <= 0 && vp->delta) vp->force_key = 1; // 馬上讓下一張 capture 改送 keyframe
+        vp->ordered[slot->seq % vp->slot_count] = slot;
+        pthread_cond_broadcast(&vp->encoded);
+        pthread_mutex_unlock(&vp->lock);
+    }
+    return NULL;
+}
+
+// 送出 [幀大小][幀資料]
+static int video_send_frame(SSL *ssl, const std::vector<uchar> &jpeg) {
+    uint32_t net_frame_size = htonl((uint32_t)jpeg.size());
+    if (SSL_write(ssl, &net_frame_size, sizeof(net_frame_size)) <= 0) {
+        perror("[ERROR] Failed to send frame size");
+        return -1;
+    }
+    size_t total_sent = 0;
+    while (total_sent < jpeg.size()) {
+        int ret = SSL_write(ssl, jpeg.data() + total_sent, (int)(jpeg.size() - total_sent));
+        if (ret <= 0) {
+            perror("[ERROR] Failed to send frame data");
+            return -1;
+        }
+        total_sent += ret;
+    }
+    return 0;
+}
+
 void send_video_stream(SSL *ssl) {
     char video_path[USERNAME_BUFFER_SIZE];
+    char answer[8];
     printf("Enter video file path to stream: ");
-    scanf("%s", video_path);
-
-    // 發送指令給伺服器，表示要開始串流
-    SSL_write(ssl, "STREAM_VIDEO", strlen("STREAM_VIDEO"));
-
+    if (scanf("%127s", video_path) != 1) return;
+    getchar();
+    printf("Skip frames when falling behind? (Y/n): ");
+    int skip_frames = !(fgets(answer, sizeof(answer), stdin) && (answer[0] == 'n' || answer[0] == 'N'));
+    printf("Send only changed tiles (screen recordings / static scenes)? (y/N): ");
+    int delta = fgets(answer, sizeof(answer), stdin) && (answer[0] == 'y' || answer[0] == 'Y');
+
+    // 先確定影片打得開才通知 server，否則 server 會一直等 frame
     cv::VideoCapture cap(video_path);
     if (!cap.isOpened()) {
         printf("[ERROR] Failed to open video file: %s\n", video_path);
         return;
     }
 
-    while (true) {
-        cv::Mat frame;
-        cap >> frame; // 讀取下一幀
-        if (frame.empty()) {
-            // 影片結束, 傳 frame_size=0
-            int zero_size = 0;
-            int net_zero_size = htonl(zero_size);
-            SSL_write(ssl, &net_zero_size, sizeof(net_zero_size));
-            printf("[DEBUG] Video ended. Sent frame_size=0 to server.\n");
-            break;
+    // 發送指令給伺服器，表示要開始串流 (其他使用者可以 WATCH <自己的 username> 觀看)
+    const char *command = delta ? "STREAM_VIDEO +feedback +delta" : "STREAM_VIDEO +feedback";
+    SSL_write(ssl, command, strlen(command));
+
+    VideoPipeline vp;
+    memset(&vp.rc, 0, sizeof(vp.rc));
+    if (delta) { // 等 server 確認編碼方式
+        if (video_read_feedback(ssl, &vp.rc, &vp.rc.codec_ready) < 0) {
+            printf("[ERROR] Video stream aborted.\n");
+            return;
+        }
+        delta = vp.rc.delta;
+    }
+    double fps = cap.get(cv::CAP_PROP_FPS);
+    if (!(fps > 0 && fps <= 240)) fps = VIDEO_DEFAULT_FPS;
+    vp.rc.interval = 1.0 / fps;
+    vp.rc.quality = VIDEO_QUALITY_START;
+    vp.cap = &cap;
+    vp.skip_frames = skip_frames;
+    pthread_mutex_init(&vp.lock, NULL);
+    pthread_cond_init(&vp.slot_free, NULL);
+    pthread_cond_init(&vp.encode_ready, NULL);
+    pthread_cond_init(&vp.encoded, NULL);
+
+    // 留一個核心給 capture / 送出；slot 數讓每個 encoder 手上一張、佇列中再一張
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int encoders = cores > 1 ? (int)cores - 1 : 1;
+    if (encoders > VIDEO_MAX_ENCODERS) encoders = VIDEO_MAX_ENCODERS;
+    vp.slot_count = encoders * 2 + 2;
+    vp.slots = new VideoSlot[vp.slot_count];
+    vp.ordered = (VideoSlot **)calloc(vp.slot_count, sizeof(VideoSlot *));
+    vp.free_slots = NULL;
+    for (int i = vp.slot_count - 1; i >= 0; i--) {
+        vp.slots[i].params = {cv::IMWRITE_JPEG_QUALITY, VIDEO_QUALITY_START};
+        vp.slots[i].next = vp.free_slots;
+        vp.free_slots = &vp.slots[i];
+    }
+    vp.encode_head = vp.encode_tail = NULL;
+    vp.captured = vp.skipped = 0;
+    vp.capture_done = vp.abort = 0;
+    vp.force_key = 0;
+    vp.delta = delta;
+    vp.key_age = vp.keyframes = 0;
+
+    // 每個 frame 立即送出：Nagle 會把 frame 壓到對方 delayed ACK 之後，延遲超過一個 frame
+    int fd = SSL_get_fd(ssl);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    vp.fd = fd;
+
+    vp.start = monotonic_now();
+    pthread_t capture_thread;
+    pthread_t encode_threads[VIDEO_MAX_ENCODERS];
+    pthread_create(&capture_thread, NULL, video_capture_thread, &vp);
+    for (int i = 0; i < encoders; i++) pthread_create(&encode_threads[i], NULL, video_encode_thread, &vp);
+
+    unsigned long sent = 0;
+    double last_send_time = 0;
+    size_t last_bytes = 0;
+    double total_bytes = 0;
+    int failed = 0;
+    int wait_key = 0; // delta 模式：有 frame 沒送出，之後的 delta 都建立在 server 沒有的畫面上
+    for (unsigned long next = 0;; next++) {
+        pthread_mutex_lock(&vp.lock);
+        VideoSlot **entry = &vp.ordered[next % vp.slot_count];
+        while (!*entry && !(vp.capture_done && next >= vp.captured)) pthread_cond_wait(&vp.encoded, &vp.lock);
+        VideoSlot *slot = *entry;
+        *entry = NULL;
+        pthread_mutex_unlock(&vp.lock);
+        if (!slot) break; // 影片結束且全部送完
+
+        // 上一張送出後又過了約一個 frame 的時間，量還留在 kernel 中沒送上網路的 bytes (不含已送出等待 ACK 的)
+        if (sent > 0) {
+            int unsent = 0;
+            ioctl(fd, SIOCOUTQNSD, &unsent);
+            pthread_mutex_lock(&vp.lock);
+            rate_adjust(&vp.rc, last_send_time, unsent, last_bytes);
+            pthread_mutex_unlock(&vp.lock);
+        }
+
+        if (slot->encoded <= 0) wait_key = vp.delta;
+        else if (wait_key && slot->keyframe) wait_key = 0;
+        if (slot->encoded > 0 && !wait_key) {
+            double send_start = monotonic_now();
+            if (video_send_frame(ssl, slot->jpeg) < 0) failed = 1;
+            last_send_time = monotonic_now() - send_start;
+            last_bytes = slot->jpeg.size();
+            total_bytes += last_bytes;
+            sent++;
         }
 
-        // 壓縮幀為 JPEG
-        std::vector<uchar> buffer;
-        cv::imencode(".jpg", frame, buffer);
+        pthread_mutex_lock(&vp.lock);
+        if (wait_key && slot->encoded > 0) vp.skipped++; // 丟掉的 delta，等 keyframe 重建
+        if (!failed && video_read_feedback(ssl, &vp.rc, NULL) < 0) failed = 1;
+        slot->next = vp.free_slots;
+        vp.free_slots = slot;
+        if (failed || vp.rc.stopped) vp.abort = 1;
+        pthread_cond_signal(&vp.slot_free);
+        int abort = vp.abort;
+        pthread_mutex_unlock(&vp.lock);
+        if (abort) break;
+    }
 
-        // 發送幀大小
-        int frame_size = buffer.size();
-        int net_frame_size = htonl(frame_size);
-        if (SSL_write(ssl, &net_frame_size, sizeof(net_frame_size)) <= 0) {
-            perror("[ERROR] Failed to send frame size");
+    pthread_mutex_lock(&vp.lock);
+    vp.abort = 1;
+    pthread_cond_broadcast(&vp.slot_free);
+    pthread_cond_broadcast(&vp.encode_ready);
+    pthread_mutex_unlock(&vp.lock);
+    pthread_join(capture_thread, NULL);
+    for (int i = 0; i < encoders; i++) pthread_join(encode_threads[i], NULL);
+    RateControl rc = vp.rc;
+    unsigned long skipped = vp.skipped;
+    unsigned long keyframes = vp.keyframes;
+    delete[] vp.slots;
+    free(vp.ordered);
+    pthread_mutex_destroy(&vp.lock);
+    pthread_cond_destroy(&vp.slot_free);
+    pthread_cond_destroy(&vp.encode_ready);
+    pthread_cond_destroy(&vp.encoded);
+
+    nodelay = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (failed) {
+        printf("[ERROR] Video stream aborted.\n");
+        return;
+    }
+    // 影片結束 (或 server 要求停止), 傳 frame_size=0，再讀到 FB end 為止
+    uint32_t net_zero_size = htonl(0);
+    SSL_write(ssl, &net_zero_size, sizeof(net_zero_size));
+    video_read_feedback(ssl, &rc, &rc.ended);
+
+    printf("Video stream completed: %lu frames sent, %lu skipped at %.1f fps with %d encoder(s), final quality %d, "
+           "scale %.2f, %.1f KB/frame\n", sent, skipped, fps, encoders, rc.quality, video_scales[rc.scale_level],
+           sent ? total_bytes / sent / 1024 : 0.0);
+    if (delta) {
+        printf("Delta mode: %lu keyframe(s), %lu delta frame(s)\n", keyframes, sent > keyframes ? sent - keyframes : 0);
+    }
+}
+
+// ========== 觀看直播 (WATCH) ==========
+// Server 回覆 "Watching <頻道>" 後持續送 [4 bytes frame 大小][JPEG]，frame_size=0 代表直播結束。
+// 按 ESC 送出 STOP，server 送完手上的 frame 後同樣以 frame_size=0 結束
+void watch_video_stream(SSL *ssl) {
+    char channel[USERNAME_BUFFER_SIZE];
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[COMMAND_BUFFER_SIZE];
+    printf("Enter stream name (publisher's username): ");
+    if (scanf("%127s", channel) != 1) return;
+    getchar();
+
+    snprintf(command, sizeof(command), "WATCH %s", channel);
+    SSL_write(ssl, command, strlen(command));
+    bzero(reply, sizeof(reply));
+    if (SSL_read(ssl, reply, sizeof(reply) - 1) <= 0) {
+        printf("[ERROR] Failed to watch stream\n");
+        return;
+    }
+    if (strncmp(reply, "Watching", 8) != 0) {
+        printf("From Server: %s", reply);
+        return;
+    }
+
+    char window[USERNAME_BUFFER_SIZE + 8];
+    snprintf(window, sizeof(window), "Live %s", channel);
+    std::vector<uchar> buffer;
+    unsigned long frames = 0;
+    int stop_sent = 0;
+    while (1) {
+        uint32_t net_frame_size;
+        if (read_exact(ssl, &net_frame_size, sizeof(net_frame_size)) < 0) {
+            printf("[ERROR] Connection lost while watching\n");
             break;
         }
+        uint32_t frame_size = ntohl(net_frame_size);
+        if (frame_size == 0) break;
+        buffer.resize(frame_size);
+        if (read_exact(ssl, buffer.data(), frame_size) < 0) {
+            printf("[ERROR] Connection lost while watching\n");
+            break;
+        }
+        frames++;
+        cv::Mat frame = cv::imdecode(buffer, cv::IMREAD_COLOR);
+        if (!frame.empty()) cv::imshow(window, frame);
+        if (cv::waitKey(1) == 27 && !stop_sent) {
+            SSL_write(ssl, "STOP", strlen("STOP"));
+            stop_sent = 1;
+        }
+    }
+    cv::destroyWindow(window);
+    printf("Stream ended (%lu frames received).\n", frames);
+}
 
-        // 發送幀資料
-        int total_sent = 0;
-        while (total_sent < frame_size) {
-            int sent = SSL_write(ssl, buffer.data() + total_sent, frame_size - total_sent);
-            if (sent <= 0) {
-                perror("[ERROR] Failed to send frame data");
-                break;
+// ========== 查詢線上使用者 ==========
+// Server 分頁回傳，最後一行 "[more] next=<offset> total=<n>" 表示還有下一頁
+void view_online_users(SSL *ssl) {
+    char command[COMMAND_BUFFER_SIZE];
+    char page[ONLINE_REPLY_MAX + 1];
+    long offset = 0;
+
+    printf("Online users:\n");
+    while (1) {
+        snprintf(command, sizeof(command), "ONLINE %ld", offset);
+        SSL_write(ssl, command, strlen(command));
+
+        int ret = SSL_read(ssl, page, ONLINE_REPLY_MAX);
+        if (ret <= 0) {
+            printf("[ERROR] Failed to retrieve online users\n");
+            return;
+        }
+        page[ret] = '\0';
+
+        char *more = strstr(page, "[more] next=");
+        if (!more) {
+            printf("%s", page);
+            return;
+        }
+        size_t total = 0;
+        sscanf(more, "[more] next=%ld total=%zu", &offset, &total);
+        *more = '\0';
+        printf("%s", page);
+
+        printf("-- %ld/%zu, show more? (y/n): ", offset, total);
+        char answer[8];
+        if (!fgets(answer, sizeof(answer), stdin) || (answer[0] != 'y' && answer[0] != 'Y')) return;
+    }
+}
+
+// ========== Binary frame ==========
+
+typedef struct {
+    unsigned char buf[FRAME_READER_SIZE];
+    size_t len;
+} FrameReader;
+
+int send_frame(SSL *ssl, uint32_t request_id, const char *payload) {
+    unsigned char frame[FRAME_HEADER_SIZE + COMMAND_BUFFER_SIZE];
+    size_t len = strlen(payload);
+    if (len >= COMMAND_BUFFER_SIZE) return -1;
+    frame_encode_header(frame, FRAME_REQUEST, FRAME_FLAG_ZLIB, request_id, (uint32_t)len); // 長回覆可以壓縮
+    memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+    return SSL_write(ssl, frame, FRAME_HEADER_SIZE + len) > 0 ? 0 : -1;
+}
+
+// 壓縮過的 RESPONSE：[4 bytes 原始長度][zlib 資料]，解開後與一般 payload 相同
+static int frame_inflate(const unsigned char *in, uint32_t len, char *payload, size_t payload_size) {
+    uint32_t net_len;
+    if (len < 4) return -1;
+    memcpy(&net_len, in, 4);
+    uLongf raw_len = ntohl(net_len);
+    if (raw_len >= payload_size ||
+        uncompress((Bytef *)payload, &raw_len, in + 4, len - 4) != Z_OK) {
+        return -1;
+    }
+    payload[raw_len] = '\0';
+    return 0;
+}
+
+// 讀出下一個完整 frame，payload 以 '\0' 結尾；失敗回傳 -1
+int read_frame(SSL *ssl, FrameReader *reader, FrameHeader *header, char *payload, size_t payload_size) {
+    while (1) {
+        if (reader->len >= FRAME_HEADER_SIZE) {
+            if (frame_decode_header(reader->buf, header) < 0 ||
+                FRAME_HEADER_SIZE + header->length > sizeof(reader->buf)) {
+                return -1;
+            }
+            size_t total = FRAME_HEADER_SIZE + header->length;
+            if (reader->len >= total) {
+                if (header->flags & FRAME_FLAG_ZLIB) {
+                    if (frame_inflate(reader->buf + FRAME_HEADER_SIZE, header->length, payload, payload_size) < 0) return -1;
+                } else {
+                    size_t copy = header->length < payload_size - 1 ? header->length : payload_size - 1;
+                    memcpy(payload, reader->buf + FRAME_HEADER_SIZE, copy);
+                    payload[copy] = '\0';
+                }
+                memmove(reader->buf, reader->buf + total, reader->len - total);
+                reader->len -= total;
+                return 0;
+            }
+        }
+        int ret = SSL_read(ssl, reader->buf + reader->len, sizeof(reader->buf) - reader->len);
+        if (ret <= 0) return -1;
+        reader->len += ret;
+    }
+}
+
+// ========== 批次傳送訊息 (pipelining) ==========
+// 一次送出多個 SEND frame，不必每則訊息都等一個來回
+void batch_send_messages(SSL *ssl) {
+    char target[USERNAME_BUFFER_SIZE];
+    char message[COMMAND_BUFFER_SIZE];
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[COMMAND_BUFFER_SIZE];
+    int count;
+
+    printf("Enter target username: ");
+    fgets(target, sizeof(target), stdin);
+    target[strcspn(target, "\n")] = 0;
+    printf("Enter your message: ");
+    fgets(message, sizeof(message), stdin);
+    message[strcspn(message, "\n")] = 0;
+    printf("How many times to send: ");
+    if (scanf("%d", &count) != 1 || count <= 0) {
+        while (getchar() != '\n');
+        printf("Invalid count.\n");
+        return;
+    }
+    getchar();
+
+    // 每次送出的指令都相同，先組好；放不進一個指令 buffer 就不送 (server 也只讀一個 buffer)
+    int len = snprintf(command, sizeof(command), "SEND %s %s", target, message);
+    if (len < 0 || (size_t)len >= sizeof(command)) {
+        printf("Message too long.\n");
+        return;
+    }
+
+    FrameReader *reader = (FrameReader *)calloc(1, sizeof(FrameReader));
+    struct timespec start, end;
+    int sent = 0, received = 0, ok = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (received < count) {
+        while (sent < count && sent - received < BATCH_WINDOW) {
+            if (send_frame(ssl, (uint32_t)sent + 1, command) < 0) {
+                printf("[ERROR] Failed to send request\n");
+                free(reader);
+                return;
             }
-            total_sent += sent;
+            sent++;
+        }
+        FrameHeader header;
+        if (read_frame(ssl, reader, &header, reply, sizeof(reply)) < 0) {
+            printf("[ERROR] Failed to read response\n");
+            break;
+        }
+        received++;
+        if (header.type == FRAME_RESPONSE && strstr(reply, "Message sent")) {
+            ok++;
+        } else if (received - ok == 1) {
+            printf("Request %u: %s", header.request_id, reply); // 只印第一個錯誤
         }
-        // 控制幀率 (30ms 約= 33FPS)
-        usleep(30000);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(reader);
 
-    printf("Video stream completed.\n");
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Sent %d/%d messages in %.1f ms (%.0f msg/s)\n", ok, count, ms, ms > 0 ? received * 1000.0 / ms : 0.0);
+}
+
+// ========== 群組 ==========
+// 群組成員可用 "#群組" 當作 Send message 的收件者，一次送給所有在線成員
+void manage_groups(SSL *ssl) {
+    char name[USERNAME_BUFFER_SIZE];
+    char members[COMMAND_BUFFER_SIZE - USERNAME_BUFFER_SIZE - 12]; // 整個指令不超過 COMMAND_BUFFER_SIZE
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[ONLINE_REPLY_MAX + 1];
+    static const char *actions[] = {"CREATE", "JOIN", "LEAVE", "ADD", "MEMBERS"};
+
+    printf("1. Create group\n");
+    printf("2. Join group\n");
+    printf("3. Leave group\n");
+    printf("4. Add members (owner only)\n");
+    printf("5. List members\n");
+    printf("Enter your choice: ");
+    int choice;
+    if (scanf("%d", &choice) != 1 || choice < 1 || choice > 5) {
+        while (getchar() != '\n');
+        printf("Invalid choice.\n");
+        return;
+    }
+    getchar();
+
+    printf("Enter group name: ");
+    fgets(name, sizeof(name), stdin);
+    name[strcspn(name, "\n")] = 0;
+    if (choice == 4) {
+        printf("Enter usernames (comma separated): ");
+        fgets(members, sizeof(members), stdin);
+        members[strcspn(members, "\n")] = 0;
+        snprintf(command, sizeof(command), "GROUP ADD %s %s", name, members);
+    } else {
+        snprintf(command, sizeof(command), "GROUP %s %s", actions[choice - 1], name);
+    }
+    SSL_write(ssl, command, strlen(command));
+
+    int ret = SSL_read(ssl, reply, ONLINE_REPLY_MAX);
+    if (ret <= 0) {
+        printf("[ERROR] Failed to read server reply\n");
+        return;
+    }
+    reply[ret] = '\0';
+    printf("From Server: %s", reply);
+}
+
+// ========== 新訊息推播 ==========
+// 登入後另開一條連線送 SUBSCRIBE，由背景執行緒讀取並印出 server 推送的新訊息。
+// 主連線上的指令是同步一問一答 (還有 raw 檔案/影像串流)，不能與背景讀取共用同一個 SSL。
+
+typedef struct {
+    SSL *ssl;
+    int sockfd;
+    pthread_t thread;
+} PushListener;
+
+static void *push_listener_thread(void *arg) {
+    PushListener *listener = (PushListener *)arg;
+    char buffer[COMMAND_BUFFER_SIZE * 10 + 1];
+    while (1) {
+        int ret = SSL_read(listener->ssl, buffer, sizeof(buffer) - 1);
+        if (ret <= 0) break;
+        buffer[ret] = '\0';
+        // 一次可能帶多則，每行一則
+        char *line = buffer;
+        while (*line) {
+            char *end = strchr(line, '\n');
+            if (end) *end = '\0';
+            if (*line) printf("\n[New message] %s\n", line);
+            if (!end) break;
+            line = end + 1;
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// 失敗時回傳 -1 (仍可用 RETRIEVE 手動取訊息)
+static int push_listener_start(PushListener *listener, const char *username, const char *password) {
+    char command[COMMAND_BUFFER_SIZE];
+    char reply[COMMAND_BUFFER_SIZE];
+    snprintf(command, sizeof(command), "SUBSCRIBE %s %s", username, password);
+    // 帶密碼的指令不走 0-RTT (early data 可被重放)
+    listener->ssl = connect_server(client_ctx, &listener->sockfd, NULL);
+    if (!listener->ssl) return -1;
+
+    int ret = SSL_write(listener->ssl, command, strlen(command));
+    if (ret > 0) ret = SSL_read(listener->ssl, reply, sizeof(reply) - 1);
+    if (ret > 0) reply[ret] = '\0';
+    if (ret <= 0 || strncmp(reply, "Subscribed\n", strlen("Subscribed\n")) != 0) {
+        disconnect_server(listener->ssl, listener->sockfd);
+        listener->ssl = NULL;
+        return -1;
+    }
+    // 訂閱前已在收件匣的訊息可能與回覆一起到達
+    char *pending = reply + strlen("Subscribed\n");
+    if (*pending) printf("\n[New message] %s", pending);
+
+    if (pthread_create(&listener->thread, NULL, push_listener_thread, listener) != 0) {
+        disconnect_server(listener->ssl, listener->sockfd);
+        listener->ssl = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void push_listener_stop(PushListener *listener) {
+    if (!listener->ssl) return;
+    // 讓阻塞中的 SSL_read 返回，再由主執行緒釋放 SSL。只關讀方向：讀取失敗時 OpenSSL 可能送出 alert，
+    // 寫方向已關閉會觸發 SIGPIPE
+    shutdown(listener->sockfd, SHUT_RD);
+    pthread_join(listener->thread, NULL);
+    SSL_free(listener->ssl);
+    close(listener->sockfd);
+    listener->ssl = NULL;
 }
 
 /**
@@ -248,6 +1747,10 @@ void send_video_stream(SSL *ssl) {
  *  6. List file
  *  7. Receive file
  *  8. Send video file
+ *  9. Batch send messages
+ *  10. Striped download
+ *  11. Watch live stream
+ *  12. Groups
  */
 void menu(SSL *ssl, const char *username) {
     int choice;
@@ -266,6 +1769,10 @@ void menu(SSL *ssl, const char *username) {
         printf("6. List file\n");
         printf("7. Receive file\n");
         printf("8. Send video file\n");
+        printf("9. Batch send messages\n");
+        printf("10. Striped download\n");
+        printf("11. Watch live stream\n");
+        printf("12. Groups\n");
         printf("Enter your choice: ");
 
         if (scanf("%d", &choice) != 1) {
@@ -277,10 +1784,7 @@ void menu(SSL *ssl, const char *username) {
 
         switch (choice) {
             case 1:
-                SSL_write(ssl, "ONLINE", strlen("ONLINE"));
-                bzero(buffer, sizeof(buffer));
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("Online users:\n%s", buffer);
+                view_online_users(ssl);
                 break;
 
             case 2:
@@ -295,7 +1799,7 @@ void menu(SSL *ssl, const char *username) {
                 break;
 
             case 3: {
-                printf("Enter target username: ");
+                printf("Enter target username (a,b,c or #group for several): ");
                 fgets(buffer, sizeof(buffer), stdin);
                 buffer[strcspn(buffer, "\n")] = 0;
 
@@ -337,6 +1841,22 @@ void menu(SSL *ssl, const char *username) {
                 send_video_stream(ssl);
                 break;
 
+            case 9:
+                batch_send_messages(ssl);
+                break;
+
+            case 10:
+                striped_receive_file(ssl);
+                break;
+
+            case 11:
+                watch_video_stream(ssl);
+                break;
+
+            case 12:
+                manage_groups(ssl);
+                break;
+
             default:
                 printf("Invalid choice. Try again.\n");
                 break;
@@ -402,7 +1922,12 @@ void main_menu(SSL *ssl) {
                 printf("From Server: %s", buffer);
 
                 if (strstr(buffer, "successful")) {
+                    PushListener listener;
+                    if (push_listener_start(&listener, username, password) < 0) {
+                        printf("[WARN] Message push unavailable, use \"Retrieve messages\" instead.\n");
+                    }
                     menu(ssl, username);
+                    push_listener_stop(&listener);
                 }
                 break;
             }
@@ -421,48 +1946,25 @@ void main_menu(SSL *ssl) {
 
 int main() {
     int sockfd;
-    struct sockaddr_in servaddr;
-    SSL_CTX *ctx;
     SSL *ssl;
 
     initialize_openssl();
-    ctx = create_context();
+    client_ctx = create_context();
+    load_session_cache(client_ctx);
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(PORT);
-    inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-
-    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
-        perror("Connection to the server failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
-
-    ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, sockfd);
-
-    if (SSL_connect(ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
-        close(sockfd);
-        SSL_free(ssl);
-        SSL_CTX_free(ctx);
+    ssl = connect_server(client_ctx, &sockfd, NULL);
+    if (!ssl) {
+        SSL_CTX_free(client_ctx);
         cleanup_openssl();
         exit(EXIT_FAILURE);
     }
 
-    printf("SSL handshake successful\n");
+    printf("SSL handshake successful%s\n", SSL_session_reused(ssl) ? " (session resumed)" : "");
     main_menu(ssl);
 
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(sockfd);
-    SSL_CTX_free(ctx);
+    disconnect_server(ssl, sockfd);
+    save_session_cache();
+    SSL_CTX_free(client_ctx);
     cleanup_openssl();
 
     return 0;
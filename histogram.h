@@ -0,0 +1,79 @@
+// ========== Latency histogram ==========
+// HDR 風格的 log-linear histogram：小於 128 的值各自一格，之後每個 2 的次方區間再切 64 格，
+// 相對誤差 < 1.6%。記錄只是一次陣列遞增，可以放在熱路徑上；多個 histogram 直接相加即可合併。
+// 每個 histogram 只能有一個寫入者 (通常是 per-thread)，其他執行緒可以同時以 hist_merge 讀取：
+// 欄位以 relaxed atomic 讀寫，在 x86 上與一般讀寫相同，不需要鎖。
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_SHIFT 36                   // 以微秒計約可記到 2^43 us，再大就放進最後一格
+#define HIST_BUCKETS (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_HALF_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} LatencyHistogram;
+
+static inline int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (int)((value >> shift) - HIST_HALF_COUNT);
+}
+
+// 該格涵蓋的最大值
+static inline uint64_t hist_bucket_value(int index) {
+    if (index < HIST_SUB_COUNT) return (uint64_t)index;
+    int shift = (index - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t sub = (uint64_t)((index - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+#define HIST_BUMP(field, delta) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (delta), __ATOMIC_RELAXED)
+
+static inline void hist_record(LatencyHistogram *hist, uint64_t value) {
+    HIST_BUMP(hist->counts[hist_index(value)], 1);
+    HIST_BUMP(hist->total, 1);
+    HIST_BUMP(hist->sum, value);
+    if (value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+// dst 由呼叫者獨佔；src 可能正在被它的執行緒寫入
+static inline void hist_merge(LatencyHistogram *dst, const LatencyHistogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+// percentile 以 0-100 表示 (例如 99.9)；空的 histogram 回傳 0
+static inline uint64_t hist_percentile(const LatencyHistogram *hist, double percentile) {
+    if (hist->total == 0) return 0;
+    uint64_t target = (uint64_t)(percentile / 100.0 * (double)hist->total + 0.5);
+    if (target < 1) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t value = hist_bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static inline double hist_mean(const LatencyHistogram *hist) {
+    return hist->total ? (double)hist->sum / (double)hist->total : 0.0;
+}
+
+#endif // HISTOGRAM_H
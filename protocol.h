@@ -0,0 +1,434 @@
+// ========== Client / Server 共用的協定定義 ==========
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+#include <strings.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define PORT 8080
+#define COMMAND_BUFFER_SIZE 512
+#define USERNAME_BUFFER_SIZE 128
+#define ONLINE_REPLY_MAX 8192           // 單次 ONLINE 回覆上限，控制在一個 TLS record 內
+#define LIST_REPLY_MAX 16384            // 單次 LIST_FILES 回覆上限
+
+// 64-bit 大小欄位 (檔案大小 / offset) 一律以 big-endian 傳送
+static inline uint64_t hton64(uint64_t value) {
+    return ((uint64_t)htonl((uint32_t)value) << 32) | htonl((uint32_t)(value >> 32));
+}
+
+static inline uint64_t ntoh64(uint64_t value) {
+    return hton64(value);
+}
+
+// ========== CRC32C (Castagnoli) ==========
+// 分段傳輸的每個 chunk 都附上 CRC32C；x86 有 SSE4.2 時用硬體指令，否則查表。
+
+static inline const uint32_t *crc32c_table() {
+    static uint32_t table[256];
+    static int ready = 0;
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            table[i] = crc;
+        }
+        __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+    }
+    return table;
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len) {
+    const uint32_t *table = crc32c_table();
+    while (len--) crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+static inline uint32_t crc32c(const void *data, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hw(crc, (const unsigned char *)data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, (const unsigned char *)data, len);
+}
+
+// RECEIVE_CHUNKS 每個 chunk 前的 header：4 bytes 長度 + 4 bytes CRC32C，皆為 network byte order
+#define CHUNK_HEADER_SIZE 8
+#define DEFAULT_STRIPE_CHUNK_SIZE (1024 * 1024)
+#define MAX_STRIPE_CHUNK_SIZE (8 * 1024 * 1024)
+
+// ========== Binary frame ==========
+// 與舊的文字指令並存：第一個 byte 為 FRAME_MAGIC (非 ASCII) 即為 frame。
+//
+//   0      1        2      3      4            8            12
+//   +------+--------+------+------+------------+------------+---------
+//   |magic |version | type |flags | request_id |   length   | payload
+//   +------+--------+------+------+------------+------------+---------
+//
+// request_id / length 皆為 network byte order。REQUEST 的 payload 為一行文字指令
+// (例如 "SEND bob hi")，RESPONSE / ERROR 以相同 request_id 回覆，因此 client 可以
+// 一次送出多個 request (pipelining)，再依 request_id 對應回覆，不需假設回覆順序。
+
+#define FRAME_MAGIC 0xB5
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (1024 * 1024)
+
+#define FRAME_FLAG_ZLIB 0x01              // REQUEST：可接受壓縮的回覆；RESPONSE：payload 已壓縮 (見下方區塊壓縮)
+#define FRAME_COMPRESS_MIN 1024             // 短於此長度的回覆不壓縮
+
+enum {
+    FRAME_REQUEST = 1,
+    FRAME_RESPONSE = 2,
+    FRAME_ERROR = 3,
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t request_id;
+    uint32_t length;
+} FrameHeader;
+
+static inline void frame_encode_header(unsigned char *out, uint8_t type, uint8_t flags,
+                                       uint32_t request_id, uint32_t length) {
+    uint32_t net_id = htonl(request_id);
+    uint32_t net_len = htonl(length);
+    out[0] = FRAME_MAGIC;
+    out[1] = FRAME_VERSION;
+    out[2] = type;
+    out[3] = flags;
+    memcpy(out + 4, &net_id, 4);
+    memcpy(out + 8, &net_len, 4);
+}
+
+// 成功回傳 0；magic / version 不符或長度過大回傳 -1
+static inline int frame_decode_header(const unsigned char *in, FrameHeader *header) {
+    uint32_t net_id, net_len;
+    if (in[0] != FRAME_MAGIC || in[1] != FRAME_VERSION) return -1;
+    memcpy(&net_id, in + 4, 4);
+    memcpy(&net_len, in + 8, 4);
+    header->version = in[1];
+    header->type = in[2];
+    header->flags = in[3];
+    header->request_id = ntohl(net_id);
+    header->length = ntohl(net_len);
+    return header->length > FRAME_MAX_PAYLOAD ? -1 : 0;
+}
+
+// ========== STREAM_VIDEO inter-frame 模式 (+delta) ==========
+// STREAM_VIDEO 加上 +delta 時 server 先回一行 "FB codec=delta" (不接受時為 "FB codec=jpeg"，client 改送一般 JPEG)。
+// 之後每個 frame 仍是 [4 bytes 大小][payload]，payload 第一個 byte 為類型：
+//   VIDEO_FRAME_KEY   ：後接整張畫面的 JPEG
+//   VIDEO_FRAME_DELTA ：只送與上一張相比有變動的 tile
+//
+//   0      1      2       4        6       8
+//   +------+------+-------+--------+-------+-----------------------+-------------
+//   | type | tile | width | height | count | count x 2 bytes 編號   | mosaic JPEG
+//   +------+------+-------+--------+-------+-----------------------+-------------
+//
+// 畫面切成 tile x tile 的方塊 (右 / 下邊緣的方塊較小)，以 row-major 編號 (network byte order)。
+// 變動的方塊依出現順序排進每列 VIDEO_MOSAIC_COLUMNS 格的 mosaic，整張壓成一個 JPEG；count=0 代表畫面沒變，
+// 沒有 JPEG。tile 為 16 的倍數，JPEG 的 8x8 / 16x16 區塊不會跨越 tile，各 tile 的失真互不影響。
+
+#define VIDEO_FRAME_KEY 'K'
+#define VIDEO_FRAME_DELTA 'D'
+#define VIDEO_DELTA_HEADER_SIZE 8
+#define VIDEO_TILE_SIZE 32
+#define VIDEO_MOSAIC_COLUMNS 32
+#define VIDEO_MAX_TILES 65535               // 編號只有 2 bytes，超過時只能送 keyframe
+
+typedef struct {
+    uint8_t tile;
+    uint16_t width;
+    uint16_t height;
+    uint16_t count;
+} VideoDeltaHeader;
+
+static inline int video_tile_count(int width, int height, int tile) {
+    return ((width + tile - 1) / tile) * ((height + tile - 1) / tile);
+}
+
+// 第 index 個 tile 在畫面中的位置與大小
+static inline void video_tile_rect(int width, int height, int tile, int index, int *x, int *y, int *w, int *h) {
+    int columns = (width + tile - 1) / tile;
+    *x = index % columns * tile;
+    *y = index / columns * tile;
+    *w = width - *x < tile ? width - *x : tile;
+    *h = height - *y < tile ? height - *y : tile;
+}
+
+static inline void video_delta_encode_header(unsigned char *out, int tile, int width, int height, int count) {
+    uint16_t fields[3] = {htons((uint16_t)width), htons((uint16_t)height), htons((uint16_t)count)};
+    out[0] = VIDEO_FRAME_DELTA;
+    out[1] = (unsigned char)tile;
+    memcpy(out + 2, fields, sizeof(fields));
+}
+
+// 成功回傳 0；長度不足、tile 大小不合法或編號數超過畫面的 tile 數回傳 -1
+static inline int video_delta_decode_header(const unsigned char *in, size_t len, VideoDeltaHeader *header) {
+    uint16_t fields[3];
+    if (len < VIDEO_DELTA_HEADER_SIZE || in[0] != VIDEO_FRAME_DELTA) return -1;
+    memcpy(fields, in + 2, sizeof(fields));
+    header->tile = in[1];
+    header->width = ntohs(fields[0]);
+    header->height = ntohs(fields[1]);
+    header->count = ntohs(fields[2]);
+    if (header->tile == 0 || header->tile % 16 != 0 || header->width == 0 || header->height == 0) return -1;
+    if (header->count > video_tile_count(header->width, header->height, header->tile)) return -1;
+    return len < VIDEO_DELTA_HEADER_SIZE + (size_t)header->count * 2 ? -1 : 0;
+}
+
+// ========== Tile 差異比對 ==========
+// 兩個區塊中任一 byte 相差超過 threshold 即視為變動 (容許來源影片的壓縮雜訊)。
+// x86-64 以 SSE2 (CPU 支援時 AVX2) 一次比對 16 / 32 bytes：|a-b| 由兩個方向的飽和減法 OR 起來，
+// 再減去 threshold 仍不為 0 就是變動；每一列檢查一次，找到變動即提早結束。
+
+static inline int video_tile_differs_sw(const unsigned char *a, size_t stride_a, const unsigned char *b,
+                                        size_t stride_b, size_t row_bytes, int rows, int threshold) {
+    for (int y = 0; y < rows; y++, a += stride_a, b += stride_b) {
+        for (size_t x = 0; x < row_bytes; x++) {
+            int diff = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+            if (diff > threshold) return 1;
+        }
+    }
+    return 0;
+}
+
+#if defined(__x86_64__)
+static inline int video_tile_differs_sse2(const unsigned char *a, size_t stride_a, const unsigned char *b,
+                                          size_t stride_b, size_t row_bytes, int rows, int threshold) {
+    const __m128i limit = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    for (int y = 0; y < rows; y++, a += stride_a, b += stride_b) {
+        __m128i over = zero;
+        size_t x = 0;
+        for (; x + 16 <= row_bytes; x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            over = _mm_or_si128(over, _mm_subs_epu8(diff, limit));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xFFFF) return 1;
+        if (x < row_bytes && video_tile_differs_sw(a + x, stride_a, b + x, stride_b, row_bytes - x, 1, threshold)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static inline int video_tile_differs_avx2(const unsigned char *a, size_t stride_a, const unsigned char *b,
+                                          size_t stride_b, size_t row_bytes, int rows, int threshold) {
+    const __m256i limit = _mm256_set1_epi8((char)threshold);
+    for (int y = 0; y < rows; y++, a += stride_a, b += stride_b) {
+        __m256i over = _mm256_setzero_si256();
+        size_t x = 0;
+        for (; x + 32 <= row_bytes; x += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + x));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + x));
+            __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+            over = _mm256_or_si256(over, _mm256_subs_epu8(diff, limit));
+        }
+        if (!_mm256_testz_si256(over, over)) return 1;
+        if (x < row_bytes && video_tile_differs_sw(a + x, stride_a, b + x, stride_b, row_bytes - x, 1, threshold)) return 1;
+    }
+    return 0;
+}
+#endif
+
+static inline int video_tile_differs(const unsigned char *a, size_t stride_a, const unsigned char *b,
+                                     size_t stride_b, size_t row_bytes, int rows, int threshold) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return video_tile_differs_avx2(a, stride_a, b, stride_b, row_bytes, rows, threshold);
+    return video_tile_differs_sse2(a, stride_a, b, stride_b, row_bytes, rows, threshold);
+#else
+    return video_tile_differs_sw(a, stride_a, b, stride_b, row_bytes, rows, threshold);
+#endif
+}
+
+// ========== Content-defined chunking (SEND_FILE_DEDUP) ==========
+// 去重上傳時 client 與 server 必須切出相同的 chunk，因此切法定義在這裡。
+// 採 FastCDC：gear rolling hash (fp = (fp << 1) + gear[byte])，前 DEDUP_MIN_CHUNK bytes 不切，
+// 到 DEDUP_AVG_CHUNK 之前用較嚴的 mask、之後用較寬的 mask (normalized chunking，讓 chunk 大小集中在平均值附近)，
+// 最長 DEDUP_MAX_CHUNK。左移的 gear hash 高位元才涵蓋較長的視窗，所以 mask 取最高的幾個 bit。
+// 檔案中間插入 / 刪除資料只會影響附近一兩個 chunk，其餘 chunk 的邊界與 hash 不變，可以沿用 server 已有的資料。
+//
+// SEND_FILE_DEDUP <filename> <size> 之後以批次交換：
+//   client -> server：4 bytes chunk 數 n，接著 n 筆 [32 bytes SHA-256][4 bytes 長度]；n = 0 代表結束
+//   server -> client：(n + 7) / 8 bytes bitmap，第 i 個 bit (LSB first) 為 1 代表 server 沒有、需要資料
+//   client -> server：依序送出需要的 chunk 內容
+// 結束後 server 回一行結果訊息。數值皆為 network byte order。
+
+#define DEDUP_MIN_CHUNK (16 * 1024)
+#define DEDUP_AVG_CHUNK (64 * 1024)
+#define DEDUP_MAX_CHUNK (256 * 1024)
+#define DEDUP_MASK_SMALL (~0ULL << (64 - 18))   // 平均值之前：約 1/2^18 機率切
+#define DEDUP_MASK_LARGE (~0ULL << (64 - 14))   // 平均值之後：約 1/2^14 機率切
+#define DEDUP_HASH_SIZE 32
+#define DEDUP_ENTRY_SIZE (DEDUP_HASH_SIZE + 4)
+#define DEDUP_BATCH_CHUNKS 1024                 // 每批最多協商的 chunk 數 (約 64 MiB 資料)
+
+static inline const uint64_t *dedup_gear_table() {
+    static uint64_t table[256];
+    static int ready = 0;
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        // splitmix64 產生的固定亂數表，兩端一致即可
+        uint64_t state = 0x5EED5EED5EED5EEDULL;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            table[i] = z ^ (z >> 31);
+        }
+        __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+    }
+    return table;
+}
+
+// 回傳從 data 開始的下一個 chunk 長度。len 為剩餘資料量，除非已到檔尾，否則至少要給 DEDUP_MAX_CHUNK bytes
+static inline size_t dedup_next_chunk(const unsigned char *data, size_t len) {
+    if (len <= DEDUP_MIN_CHUNK) return len;
+    const uint64_t *gear = dedup_gear_table();
+    size_t normal = len < DEDUP_AVG_CHUNK ? len : DEDUP_AVG_CHUNK;
+    size_t end = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    uint64_t fp = 0;
+    size_t i = DEDUP_MIN_CHUNK;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & DEDUP_MASK_SMALL)) return i + 1;
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & DEDUP_MASK_LARGE)) return i + 1;
+    }
+    return end;
+}
+
+static inline int dedup_hash(const void *data, size_t len, unsigned char *out) {
+    unsigned int out_len = 0;
+    return EVP_Digest(data, len, out, &out_len, EVP_sha256(), NULL) == 1 && out_len == DEDUP_HASH_SIZE ? 0 : -1;
+}
+
+static inline void dedup_hash_hex(const unsigned char *hash, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < DEDUP_HASH_SIZE; i++) {
+        out[i * 2] = digits[hash[i] >> 4];
+        out[i * 2 + 1] = digits[hash[i] & 0xF];
+    }
+    out[DEDUP_HASH_SIZE * 2] = '\0';
+}
+
+static inline void dedup_encode_entry(unsigned char *out, const unsigned char *hash, uint32_t length) {
+    uint32_t net_len = htonl(length);
+    memcpy(out, hash, DEDUP_HASH_SIZE);
+    memcpy(out + DEDUP_HASH_SIZE, &net_len, 4);
+}
+
+// ========== 區塊壓縮 (zlib) ==========
+// 檔案傳輸指令在最後加上 "zlib" 即協商壓縮，例如 RECEIVE_FILE <filename> <offset> zlib、
+// SEND_FILE <filename> [offset] zlib、SEND_FILE_DEDUP <filename> <size> zlib。
+// 資料切成最多 ZBLOCK_SIZE 的區塊，各自獨立壓縮，因此可以平行壓縮、依序送出，也能直接快取壓縮結果：
+//
+//   [4 bytes 原始長度][4 bytes payload 長度 (最高位元為 1 代表未壓縮)][payload]
+//
+// 壓不小的區塊 (例如已壓縮過的影片) 直接以原始內容送出，最壞情況只多 8 bytes header。
+// 檔名看起來是已壓縮格式，或開頭的樣本壓不到 ZCODEC_SAMPLE_RATIO 以下時，整個傳輸不壓縮。
+//
+// frame 指令則以 FRAME_FLAG_ZLIB 協商：RESPONSE 帶此 flag 時 payload 為 [4 bytes 原始長度][zlib 資料]。
+
+#define ZCODEC_NONE 0
+#define ZCODEC_ZLIB 1
+#define ZBLOCK_SIZE (256 * 1024)
+#define ZBLOCK_HEADER_SIZE 8
+#define ZBLOCK_STORED 0x80000000u
+#define ZBLOCK_MAX_WIRE (ZBLOCK_HEADER_SIZE + ZBLOCK_SIZE)
+#define ZBLOCK_LEVEL 1                      // 速度優先：level 1 對文字類資料已有大部分的壓縮率
+#define ZCODEC_SAMPLE_SIZE (64 * 1024)
+#define ZCODEC_SAMPLE_RATIO 0.9             // 樣本壓縮後超過原本的 90% 就不值得壓
+
+// 把 raw 壓成一個區塊寫到 out (至少 ZBLOCK_HEADER_SIZE + len bytes)，回傳區塊總長度
+static inline size_t zblock_encode(const unsigned char *raw, size_t len, unsigned char *out) {
+    uLongf payload_len = len - 1; // 至少要小 1 byte 才採用壓縮結果；空間不足時 compress2 回傳 Z_BUF_ERROR
+    int compressed = len > 1 && compress2(out + ZBLOCK_HEADER_SIZE, &payload_len, raw, len, ZBLOCK_LEVEL) == Z_OK;
+    if (!compressed) {
+        memcpy(out + ZBLOCK_HEADER_SIZE, raw, len);
+        payload_len = len;
+    }
+    uint32_t net_raw = htonl((uint32_t)len);
+    uint32_t net_payload = htonl((uint32_t)payload_len | (compressed ? 0 : ZBLOCK_STORED));
+    memcpy(out, &net_raw, 4);
+    memcpy(out + 4, &net_payload, 4);
+    return ZBLOCK_HEADER_SIZE + payload_len;
+}
+
+// 解析區塊 header；長度不合法回傳 -1
+static inline int zblock_parse_header(const unsigned char *in, uint32_t *raw_len, uint32_t *payload_len, int *stored) {
+    uint32_t net_raw, net_payload;
+    memcpy(&net_raw, in, 4);
+    memcpy(&net_payload, in + 4, 4);
+    *raw_len = ntohl(net_raw);
+    *payload_len = ntohl(net_payload) & ~ZBLOCK_STORED;
+    *stored = (ntohl(net_payload) & ZBLOCK_STORED) != 0;
+    if (*raw_len == 0 || *raw_len > ZBLOCK_SIZE || *payload_len > *raw_len) return -1;
+    return *stored && *payload_len != *raw_len ? -1 : 0;
+}
+
+// 還原區塊內容到 out (raw_len bytes)；資料損毀回傳 -1
+static inline int zblock_decode(const unsigned char *payload, uint32_t payload_len, int stored,
+                                unsigned char *out, uint32_t raw_len) {
+    if (stored) {
+        memcpy(out, payload, raw_len);
+        return 0;
+    }
+    uLongf out_len = raw_len;
+    return uncompress(out, &out_len, payload, payload_len) == Z_OK && out_len == raw_len ? 0 : -1;
+}
+
+// 副檔名屬於已壓縮格式 (影片、圖片、壓縮檔) 就不必嘗試
+static inline int zcodec_skip_name(const char *name) {
+    static const char *const extensions[] = {
+        "mkv", "mp4", "avi", "mov", "webm", "mp3", "aac", "ogg", "flac", "jpg", "jpeg", "png", "gif", "webp",
+        "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar", "pdf", "docx", "xlsx", "pptx",
+    };
+    const char *dot = strrchr(name, '.');
+    if (!dot) return 0;
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcasecmp(dot + 1, extensions[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// 試壓開頭的樣本決定要不要壓縮；scratch 至少 ZBLOCK_HEADER_SIZE + ZCODEC_SAMPLE_SIZE bytes
+static inline int zcodec_worth(const unsigned char *sample, size_t len, unsigned char *scratch) {
+    if (len > ZCODEC_SAMPLE_SIZE) len = ZCODEC_SAMPLE_SIZE;
+    if (len == 0) return 0;
+    return zblock_encode(sample, len, scratch) - ZBLOCK_HEADER_SIZE < (size_t)(len * ZCODEC_SAMPLE_RATIO);
+}
+
+#endif // PROTOCOL_H
@@ -11,542 +11,7262 @@
 #include <dirent.h>       // for directory operations (file list)
 #include <sys/stat.h>     // for mkdir (ensure_store_directory)
 #include <sys/types.h>    // for mkdir (ensure_store_directory)
+#include <sys/epoll.h>    // event loop
+#include <sys/resource.h> // for RLIMIT_NOFILE
+#include <sys/mman.h>     // mmap user_db snapshot
+#include <sys/eventfd.h>  // 喚醒 relay loop
+#include <sys/inotify.h>  // store/ 目錄索引
+#include <stdint.h>
+#include <stddef.h>       // offsetof
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <opencv2/opencv.hpp>
+#include "protocol.h"
+#include "histogram.h"
 
-#define PORT 8080
-#define MAX_CLIENTS 10
-#define MAX_MESSAGES 100
-#define USERNAME_BUFFER_SIZE 128
-#define COMMAND_BUFFER_SIZE 512
+#define SESSION_SHARDS 64
+#define ONLINE_PAGE_DEFAULT 100
+#define ONLINE_PAGE_MAX 1000
+#define ONLINE_FOOTER_RESERVE 64
+#define MAILBOX_SHARDS 64
+#define MAILBOX_FREE_LIST_MAX 256
+#define DEFAULT_MAILBOX_BUDGET_MB 64
+#define DEFAULT_MAILBOX_BUDGET ((size_t)DEFAULT_MAILBOX_BUDGET_MB * 1024 * 1024)
+#define MAX_EVENT_LOOPS 64
+#define EPOLL_MAX_EVENTS 256
+#define CONN_READ_BUFFER_SIZE 16384         // 一個 TLS record 的最大 payload
+#define DOWNLOAD_BUFFER_SIZE (256 * 1024)   // 無 kTLS 時每次 pread + SSL_write 的大小
+#define SENDFILE_CHUNK_SIZE (4 * 1024 * 1024)
+#define UPLOAD_BUFFER_SIZE (1024 * 1024)    // 上傳 pipeline 每個 buffer 大小
+#define UPLOAD_BUFFER_COUNT 64              // 所有上傳共用的 buffer 數 (即最多 64 MiB 在途)
+#define DISK_WRITER_THREADS 2
+#define PART_CHECKPOINT_BYTES (256ULL * 1024 * 1024) // 上傳中每隔多少 bytes 記錄一次續傳點
+#define DEDUP_CHUNK_DIR "./store/.chunks"
+#define DEDUP_MANIFEST_DIR "./store/.manifests"
+#define DEDUP_BROKEN_DIR "./store/.manifests-broken" // 啟動時發現 chunk 不齊的 manifest 移到這裡
+#define ZCACHE_DIR "./store/.zcache"          // 下載時產生的壓縮區塊快取
+#define RECORD_INDEX_DIR "./store/.recordings" // 錄影的 .idx / .segments 索引
+#define ZCACHE_MAGIC "ZCACHE01"
+#define ZCACHE_DEFAULT_MB 1024              // 壓縮快取的總大小上限，超過時刪掉最久沒用到的 (-C)
+#define ZPIPE_DEPTH 8                       // 每個壓縮下載同時在壓縮 / 等待送出的區塊數
+#define DEDUP_TABLE_INITIAL 4096            // chunk hash table 初始 bucket 數
+#define STORE_INDEX_INITIAL 1024
+#define STORE_INDEX_MERGE_MIN 16            // 一批異動超過此數時改以合併方式套用
+#define STORE_INOTIFY_BUFFER (64 * 1024)
+#define STORE_LIST_PAGE_DEFAULT 100
+#define STORE_LIST_PAGE_MAX 1000
+#define LIST_FOOTER_RESERVE 64
+#define PUSH_WBUF_LIMIT (256 * 1024)        // 推播連線尚未送出的資料超過此量就先暫停取訊息
+#define MSGLOG_DIR "./msglog"
+#define MSGLOG_CHECKPOINT_PATH MSGLOG_DIR "/checkpoint"
+#define MSGLOG_CHECKPOINT_MAGIC "MSGCKPT1"
+#define MSGLOG_SEGMENT_SIZE (64ULL * 1024 * 1024)
+#define MSGLOG_CHECKPOINT_BYTES (16ULL * 1024 * 1024) // log 每成長這麼多寫一次 checkpoint
+#define MSGLOG_RELOCATE_SEGMENTS 4          // segment 超過此數時，把最舊一段的未讀訊息重寫到尾端
+#define MSGLOG_FLUSH_INTERVAL_MS 100        // 沒有人等待時最晚多久寫回一次
+#define MSGLOG_BATCH_RECORDS 256            // 群發時每個 shard 一次寫入的 REF record 上限
+#define DEFAULT_JOB_WORKERS 32
+#define SSL_SESSION_CACHE_SIZE 65536        // server 端 session cache 筆數 (也用於 0-RTT 的 ticket 單次使用檢查)
+#define SSL_SESSION_TIMEOUT 7200            // session / ticket 有效秒數
+#define SSL_TICKETS_PER_HANDSHAKE 4         // TLS 1.3 每次 handshake 發給 client 的 ticket 數
+#define EARLY_DATA_MAX 16384                // 0-RTT 可接收的資料量
+#define USER_DB_PATH "user_db"
+#define USER_DB_SNAPSHOT_PATH "user_db.snap"
+#define USER_SNAPSHOT_MAGIC "UDBSNAP1"
+#define GROUP_DB_PATH "group_db"
+#define GROUP_BUCKETS 256
+#define USER_ARENA_BLOCK (64 * 1024)
+#define USER_COMPACT_THRESHOLD (1024 * 1024) // log 超過快照這麼多 bytes 就重新壓縮
+#define STATS_REPLY_MAX 16384               // STATS 回覆上限 (一個 TLS record)
+#define VIDEO_RING_FRAMES 8                 // 每條串流等待解碼的 frame 上限
+#define VIDEO_FRAME_MAX (16 * 1024 * 1024)
+#define GUI_REFRESH_MS 10
+#define VIDEO_FEEDBACK_INTERVAL_US 250000   // +feedback 串流回報接收狀況的間隔
+#define VIDEO_REENCODE_QUALITY 80           // delta 串流重建的畫面給 record sink / 觀眾時的 JPEG 品質
+#define VIDEO_SEGMENT_SECONDS 10            // record sink 每段錄影的長度
+#define VIDEO_SEGMENT_MAX_BYTES (256ULL * 1024 * 1024)
+#define RELAY_QUEUE_FRAMES 4                // 每位觀眾最多排隊的 frame 數，超過就丟掉較舊的
+#define MAX_RELAY_LOOPS 16
+
+// ========== Log ==========
+// 編譯時以 -DLOG_LEVEL=<n> 決定保留哪些等級 (0 ERROR、1 WARN、2 INFO、3 DEBUG，預設 INFO)，
+// 超過 LOG_LEVEL 的呼叫連同參數一起被編譯器移除。DEBUG 是每個指令 / 每個 frame 一行，
+// 只在除錯時打開；執行時可再以 -L 調低等級。
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+static int log_level = LOG_LEVEL;
+
+#define LOG_AT(level, ...)                                                   \
+    do {                                                                     \
+        if ((level) <= LOG_LEVEL && (level) <= log_level) printf(__VA_ARGS__); \
+    } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
 // ========== 確保有 store/ 資料夾可存放檔案 ==========
 void ensure_store_directory() {
     struct stat st = {0};
     if (stat("./store", &st) == -1) {
         mkdir("./store", 0700); // 創建 store 資料夾，設置讀寫權限
-        printf("[INFO] 'store' directory created for file uploads.\n");
+        LOG_INFO("[INFO] 'store' directory created for file uploads.\n");
     }
 }
 
 // ========== 資料結構定義 ==========
-typedef struct {
+struct Connection;
+
+// 一位已登入使用者，同時掛在 username 與 connection id 兩個索引上
+typedef struct Session {
+    struct Session *next_by_name;
+    struct Session *next_by_id;
     char username[USERNAME_BUFFER_SIZE];
-    SSL *ssl;
-} Client;
+    struct Connection *conn;
+    uint64_t conn_id;
+    struct Connection *push_conn;   // SUBSCRIBE 的推播連線，新訊息直接寫到這裡
+} Session;
 
 typedef struct {
-    char sender[USERNAME_BUFFER_SIZE];
-    char receiver[USERNAME_BUFFER_SIZE];
-    char message[COMMAND_BUFFER_SIZE];
+    pthread_mutex_t lock;
+    Session **buckets;
+    size_t bucket_count;
+    size_t count;
+} SessionShard;
+
+// ONLINE 使用的排序名單快照，以 refcount 共用
+typedef struct {
+    unsigned long version;
+    int refcnt;
+    size_t count;
+    char **names;
+    char *blob;
+} OnlineSnapshot;
+
+// 訊息內容。群發時所有收件匣的節點共用同一份，最後一個參照釋放時才回收
+typedef struct MessageBody {
+    int refcnt;
+    uint16_t text_len;
+    uint8_t shared;                 // 群發的內容：寫在 BODY record，收件匣節點對應 REF record
+    uint64_t lsn;                   // BODY record 在 log 中的位置 (一般訊息的內容在 MESSAGE record 裡，不使用)
+    unsigned checkpoint_seen;       // 以下兩個只由 checkpoint 執行緒使用
+    unsigned checkpoint_moved;
+    char *text;                     // 指向 sender 之後
+    char sender[];                  // sender\0text\0
+} MessageBody;
+
+// 收件匣中的一則訊息：只是指向內容的參照
+typedef struct Message {
+    struct Message *next;
+    uint64_t id;                    // 遞增的訊息編號，ACK 以它表示取到哪裡
+    uint64_t lsn;                   // 在離線訊息 log 中的位置 (MESSAGE 或 REF record)
+    MessageBody *body;
 } Message;
 
-// 全域變數
-Client clients[MAX_CLIENTS];
-Message messages[MAX_MESSAGES];
-int message_count = 0;
+// 單一收件者的離線訊息佇列
+typedef struct Mailbox {
+    struct Mailbox *next;           // 同一個 bucket 的下一個
+    char username[USERNAME_BUFFER_SIZE];
+    Message *head, *tail;
+    size_t count;
+} Mailbox;
 
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t messages_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct {
+    pthread_mutex_t lock;
+    Mailbox **buckets;
+    size_t bucket_count;
+    size_t mailbox_count;
+    Message *free_list;             // 回收的訊息節點
+    size_t free_count;
+} MailboxShard;
 
-// ========== 處理影片串流 ==========
-// 修正重點：若收到 frame_size=0，就代表串流結束
-void handle_video_stream(SSL *ssl) {
-    cv::namedWindow("Video Stream", cv::WINDOW_AUTOSIZE);
+// 每條 TLS 連線在 event loop 中的狀態
+typedef enum {
+    CONN_HANDSHAKE,  // 等待 TLS handshake 完成
+    CONN_READY,      // 可接收指令
+    CONN_BUSY,       // 正在執行長時間指令 (檔案傳輸 / 串流)
+    CONN_WATCHING,   // 觀看直播中，由 relay loop 負責收送
+    CONN_CLOSED
+} ConnState;
 
-    while (1) {
-        int net_frame_size;
-        // 先讀4 bytes 影格大小
-        int ret = SSL_read(ssl, &net_frame_size, sizeof(net_frame_size));
-        if (ret <= 0) {
-            perror("[ERROR] Failed to receive frame size");
-            break; 
-        }
+typedef struct Connection {
+    uint64_t id;                    // 遞增的連線編號，作為 session 索引
+    int fd;
+    SSL *ssl;
+    ConnState state;
+    int loop;                       // 所屬的 event loop
+    int handshake_done;
+    int early_done;                 // 已讀完 0-RTT early data (或 client 沒送)
+    int in_early;                   // 正在處理 early data 中的指令，只允許冪等指令
+    char *early_buf;                // handshake 完成前收到的 early data，每筆為 [2 bytes 長度][record]
+    size_t early_len;
+    int want_write;                 // SSL 需要等 socket 可寫才能繼續
+    int logged_in;
+    char username[USERNAME_BUFFER_SIZE];
+    char pending[COMMAND_BUFFER_SIZE]; // 交給執行緒處理的長時間指令
+    char *wbuf;                     // 尚未送出的回覆
+    size_t wlen, wcap;
+    size_t wretry;                  // 上次 SSL_write 未完成時的長度
+    int corked;                     // 處理同一批 frame 時先累積回覆，最後一次送出
+    unsigned char *rbuf;            // 尚未湊滿的 frame
+    size_t rlen, rcap;
+    int framed;                     // 目前指令來自 frame，回覆需包成 frame
+    uint32_t request_id;            // 目前 frame 的 request_id
+    uint8_t request_flags;          // 目前 frame 的 flags (FRAME_FLAG_ZLIB：回覆可以壓縮)
+    uint64_t accepted_us;           // accept 的時間，用來量 handshake 耗時
+    uint64_t commit_lsn;            // 送出回覆前，離線訊息 log 須落地到此位置
+    pthread_mutex_t arm_lock;       // 保護 owned / push_pending / push_replaced，讓其他執行緒可安全地喚醒這條連線
+    int owned;                      // 有執行緒正在處理 (或持有) 這條連線；0 代表正在 epoll 中等待
+    int push_pending;               // 有新訊息要推播，下次處理時取出
+    int push_replaced;              // 同一使用者有了新的推播連線，這條下次處理時關閉
+    char push_user[USERNAME_BUFFER_SIZE]; // SUBSCRIBE 的使用者，非空代表這是推播連線
+    struct Viewer *viewer;          // WATCH 中的觀眾狀態
+    struct Connection *retired_next; // 已關閉、等待所屬 event loop 釋放
+} Connection;
 
-        int frame_size = ntohl(net_frame_size);
-        if (frame_size == 0) {
-            // Client 傳 0 代表串流結束
-            printf("[DEBUG] Received frame_size=0, stopping stream.\n");
-            break;
-        }
+static void conn_reply(Connection *conn, const char *msg);
+static int conn_flush(Connection *conn);
+static void conn_arm(Connection *conn, int op);
+static void conn_close(Connection *conn);
+static void conn_push_notify(Connection *conn);
+static void conn_handle_event(void *arg);
 
-        printf("[DEBUG] Receiving frame of size: %d bytes\n", frame_size);
-        std::vector<uchar> frame_buffer(frame_size);
-        int total_received = 0;
-        while (total_received < frame_size) {
-            int bytes = SSL_read(ssl, frame_buffer.data() + total_received, frame_size - total_received);
-            if (bytes <= 0) {
-                perror("[ERROR] Failed to receive frame data");
-                break;
-            }
-            total_received += bytes;
-        }
+// 全域變數
+SessionShard session_by_name[SESSION_SHARDS];
+SessionShard session_by_id[SESSION_SHARDS];
+size_t online_count = 0;
+size_t push_subscribers = 0;
+unsigned long push_deliveries = 0; // 經推播送出的 (批次) 訊息數
+unsigned long online_version = 0;   // 每次登入 / 登出遞增
+OnlineSnapshot *online_snapshot = NULL;
+pthread_mutex_t online_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+MailboxShard mailbox_shards[MAILBOX_SHARDS];
+size_t mailbox_bytes = 0;           // 目前所有待收訊息佔用的記憶體
+unsigned long multicast_sends = 0;  // 群發次數
+unsigned long multicast_refs = 0;   // 群發投遞的總人數 (共用內容的參照數)
+size_t mailbox_budget = DEFAULT_MAILBOX_BUDGET;
 
-        if (total_received < frame_size) {
-            printf("[ERROR] Received incomplete frame data. total_received=%d\n", total_received);
-            break;
-        }
+// ========== Metrics ==========
+// 每個執行緒第一次記錄時建立自己的 ThreadMetrics 並掛到全域串列，之後只寫自己的那份，
+// 熱路徑上沒有鎖也沒有 atomic RMW。STATS / stats port 讀取時把所有執行緒的值加總。
+// 延遲以微秒為單位；指令的 histogram 在該執行緒第一次執行該指令時才配置。
 
-        // 解碼並顯示
-        cv::Mat frame = cv::imdecode(frame_buffer, cv::IMREAD_COLOR);
-        if (frame.empty()) {
-            printf("[ERROR] Failed to decode frame.\n");
-            continue;
-        }
+enum {
+    METRIC_REGISTER,
+    METRIC_LOGIN,
+    METRIC_LOGOUT,
+    METRIC_SEND,
+    METRIC_RETRIEVE,
+    METRIC_ONLINE,
+    METRIC_LIST_FILES,
+    METRIC_FILE_STATUS,
+    METRIC_STATS,
+    METRIC_SEND_FILE,
+    METRIC_SEND_FILE_DEDUP,
+    METRIC_RECEIVE_FILE,
+    METRIC_RECEIVE_CHUNKS,
+    METRIC_STREAM_VIDEO,
+    METRIC_WATCH,
+    METRIC_SEEK_RECORDING,
+    METRIC_SUBSCRIBE,
+    METRIC_GROUP,
+    METRIC_OTHER,
+    METRIC_COMMAND_COUNT
+};
 
-        cv::imshow("Video Stream", frame);
-        if (cv::waitKey(30) == 27) { // ESC
-            printf("[DEBUG] ESC pressed. Stopping stream.\n");
-            break;
-        }
-    }
+static const char *metric_command_names[METRIC_COMMAND_COUNT] = {
+    "REGISTER", "LOGIN", "LOGOUT", "SEND", "RETRIEVE", "ONLINE", "LIST_FILES",
+    "FILE_STATUS", "STATS", "SEND_FILE", "SEND_FILE_DEDUP", "RECEIVE_FILE", "RECEIVE_CHUNKS", "STREAM_VIDEO", "WATCH",
+    "SEEK_RECORDING", "SUBSCRIBE", "GROUP", "OTHER",
+};
 
-    cv::destroyWindow("Video Stream");
-    printf("Video stream ended.\n");
-}
+enum {
+    METRIC_HANDSHAKE_FULL,
+    METRIC_HANDSHAKE_RESUMED,
+    METRIC_HANDSHAKE_COUNT
+};
 
-// ========== 上傳 / 下載 檔案操作 ==========
+typedef struct ThreadMetrics {
+    struct ThreadMetrics *next;
+    LatencyHistogram *commands[METRIC_COMMAND_COUNT];
+    LatencyHistogram *handshakes[METRIC_HANDSHAKE_COUNT];
+    LatencyHistogram *video_decode;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} ThreadMetrics;
 
-void handle_list_files(SSL *ssl) {
-    struct dirent *entry;
-    DIR *dir = opendir("./store");
-    char file_list[COMMAND_BUFFER_SIZE * 10] = ""; // 預估能放多個檔案名
+static ThreadMetrics *metrics_threads;
+static pthread_mutex_t metrics_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadMetrics *thread_metrics = NULL;
+static long active_connections = 0;
+static unsigned long accepted_connections = 0;
 
-    if (!dir) {
-        perror("[ERROR] Failed to open 'store' directory");
-        SSL_write(ssl, "Failed to retrieve file list\n", strlen("Failed to retrieve file list\n"));
-        return;
-    }
+static inline uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        // 排除 . 和 .. 目錄
-        if (entry->d_name[0] == '.') continue;
+static ThreadMetrics *metrics_self() {
+    if (!thread_metrics) {
+        ThreadMetrics *m = (ThreadMetrics *)calloc(1, sizeof(ThreadMetrics));
+        if (!m) return NULL;
+        pthread_mutex_lock(&metrics_threads_lock);
+        m->next = metrics_threads;
+        __atomic_store_n(&metrics_threads, m, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&metrics_threads_lock);
+        thread_metrics = m;
+    }
+    return thread_metrics;
+}
 
-        // 添加文件名到列表
-        strcat(file_list, entry->d_name);
-        strcat(file_list, "\n");
+static void metrics_record(LatencyHistogram **slot, uint64_t elapsed_us) {
+    LatencyHistogram *hist = *slot;
+    if (!hist) {
+        hist = (LatencyHistogram *)calloc(1, sizeof(LatencyHistogram));
+        if (!hist) return;
+        __atomic_store_n(slot, hist, __ATOMIC_RELEASE); // 讀取端可能同時在掃描
     }
-    closedir(dir);
+    hist_record(hist, elapsed_us);
+}
 
-    if (strlen(file_list) == 0) {
-        strcpy(file_list, "No files available for download\n");
+static int metric_command_index(const char *command) {
+    for (int i = 0; i < METRIC_OTHER; i++) {
+        if (strcmp(command, metric_command_names[i]) == 0) return i;
     }
+    return METRIC_OTHER;
+}
 
-    SSL_write(ssl, file_list, strlen(file_list));
+static void metrics_record_command(int metric, uint64_t elapsed_us) {
+    ThreadMetrics *m = metrics_self();
+    if (m) metrics_record(&m->commands[metric], elapsed_us);
 }
 
-void handle_send_file(SSL *ssl, char *buffer) {
-    char filename[USERNAME_BUFFER_SIZE];
-    char filepath[USERNAME_BUFFER_SIZE + 10];
-    int file_size, bytes_read;
-    FILE *file;
+static void metrics_record_handshake(int resumed, uint64_t elapsed_us) {
+    ThreadMetrics *m = metrics_self();
+    if (m) metrics_record(&m->handshakes[resumed ? METRIC_HANDSHAKE_RESUMED : METRIC_HANDSHAKE_FULL], elapsed_us);
+}
 
-    sscanf(buffer + 10, "%s", filename); // "SEND_FILE filename"
-    snprintf(filepath, sizeof(filepath), "./store/%s", filename);
+static void metrics_record_decode(uint64_t elapsed_us) {
+    ThreadMetrics *m = metrics_self();
+    if (m) metrics_record(&m->video_decode, elapsed_us);
+}
 
-    file = fopen(filepath, "wb");
-    if (!file) {
-        perror("[ERROR] Failed to open file for writing");
-        SSL_write(ssl, "File upload failed\n", strlen("File upload failed\n"));
-        return;
-    }
+static void metrics_add_bytes(uint64_t in, uint64_t out) {
+    ThreadMetrics *m = metrics_self();
+    if (!m) return;
+    if (in) HIST_BUMP(m->bytes_in, in);
+    if (out) HIST_BUMP(m->bytes_out, out);
+}
 
-    // 接收檔案大小
-    if (SSL_read(ssl, &file_size, sizeof(file_size)) <= 0) {
-        perror("[ERROR] Failed to receive file size");
-        fclose(file);
-        return;
+// 把所有執行緒在 ThreadMetrics 中 offset 位置的 histogram 加總到 out (out 先清空)
+static void metrics_merge(LatencyHistogram *out, size_t offset) {
+    memset(out, 0, sizeof(*out));
+    for (ThreadMetrics *m = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE); m; m = m->next) {
+        LatencyHistogram *hist = __atomic_load_n((LatencyHistogram **)((char *)m + offset), __ATOMIC_ACQUIRE);
+        if (hist) hist_merge(out, hist);
     }
-    file_size = ntohl(file_size);
-    printf("[DEBUG] Receiving file: %s, size: %d bytes\n", filename, file_size);
+}
 
-    if (file_size == 0) {
-        printf("[ERROR] Received file size=0. Aborting upload.\n");
-        fclose(file);
-        SSL_write(ssl, "File size is 0. Upload aborted\n", strlen("File size is 0. Upload aborted\n"));
-        return;
-    }
+static size_t metrics_format_histogram(char *out, size_t out_size, const char *label, const LatencyHistogram *hist) {
+    int len = snprintf(out, out_size, "%s count=%llu mean_us=%.1f p50_us=%llu p99_us=%llu p999_us=%llu max_us=%llu\n",
+                       label, (unsigned long long)hist->total, hist_mean(hist),
+                       (unsigned long long)hist_percentile(hist, 50), (unsigned long long)hist_percentile(hist, 99),
+                       (unsigned long long)hist_percentile(hist, 99.9), (unsigned long long)hist->max);
+    return len < 0 ? 0 : ((size_t)len < out_size ? (size_t)len : out_size - 1);
+}
 
-    char file_buffer[1024];
-    int total_received = 0;
-    while (total_received < file_size) {
-        bytes_read = SSL_read(ssl, file_buffer, sizeof(file_buffer));
-        if (bytes_read <= 0) break;
-        fwrite(file_buffer, 1, bytes_read, file);
-        total_received += bytes_read;
-        printf("[DEBUG] Received %d bytes, total_received=%d\n", bytes_read, total_received);
+// 連線 / 流量 / handshake / 各指令延遲；沒有執行過的指令不列出
+static size_t metrics_format(char *out, size_t out_size) {
+    uint64_t bytes_in = 0, bytes_out = 0;
+    for (ThreadMetrics *m = __atomic_load_n(&metrics_threads, __ATOMIC_ACQUIRE); m; m = m->next) {
+        bytes_in += __atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED);
+        bytes_out += __atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED);
     }
-    fclose(file);
+    int len = snprintf(out, out_size, "connections active=%ld accepted=%lu\nbytes in=%llu out=%llu\n",
+                       __atomic_load_n(&active_connections, __ATOMIC_RELAXED),
+                       __atomic_load_n(&accepted_connections, __ATOMIC_RELAXED),
+                       (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    size_t used = len < 0 ? 0 : ((size_t)len < out_size ? (size_t)len : out_size - 1);
 
-    if (total_received == file_size) {
-        printf("[UPLOAD] File '%s' uploaded successfully. Size=%d\n", filename, total_received);
-        SSL_write(ssl, "File uploaded successfully\n", strlen("File uploaded successfully\n"));
-    } else {
-        printf("[UPLOAD] File '%s' upload incomplete. Received %d/%d bytes\n", filename, total_received, file_size);
-        SSL_write(ssl, "File upload incomplete\n", strlen("File upload incomplete\n"));
+    LatencyHistogram *hist = (LatencyHistogram *)malloc(sizeof(LatencyHistogram));
+    if (!hist) return used;
+    static const char *handshake_labels[METRIC_HANDSHAKE_COUNT] = {"handshake full", "handshake resumed"};
+    for (int i = 0; i < METRIC_HANDSHAKE_COUNT; i++) {
+        metrics_merge(hist, offsetof(ThreadMetrics, handshakes) + i * sizeof(LatencyHistogram *));
+        if (hist->total) used += metrics_format_histogram(out + used, out_size - used, handshake_labels[i], hist);
+    }
+    for (int i = 0; i < METRIC_COMMAND_COUNT; i++) {
+        char label[32];
+        metrics_merge(hist, offsetof(ThreadMetrics, commands) + i * sizeof(LatencyHistogram *));
+        if (hist->total == 0) continue;
+        snprintf(label, sizeof(label), "cmd %s", metric_command_names[i]);
+        used += metrics_format_histogram(out + used, out_size - used, label, hist);
     }
+    metrics_merge(hist, offsetof(ThreadMetrics, video_decode));
+    if (hist->total) used += metrics_format_histogram(out + used, out_size - used, "video decode", hist);
+    free(hist);
+    return used;
 }
 
-void handle_receive_file(SSL *ssl, char *buffer) {
-    char filename[USERNAME_BUFFER_SIZE];
-    char filepath[USERNAME_BUFFER_SIZE + 10];
-    int file_size, bytes_read;
-    FILE *file;
-
-    sscanf(buffer + 13, "%s", filename); // "RECEIVE_FILE filename"
-    snprintf(filepath, sizeof(filepath), "./store/%s", filename);
 
-    file = fopen(filepath, "rb");
-    if (!file) {
-        printf("[ERROR] File '%s' not found in 'store' directory.\n", filename);
-        SSL_write(ssl, "File not found\n", strlen("File not found\n"));
-        return;
-    }
+// ========== 上傳 / 下載 檔案操作 ==========
 
-    // 取得檔案大小
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+// store/ 內的檔名不可含路徑或以 '.' 開頭 (避免 ../ 跳出 store，也保留 . 開頭給內部檔案)
+int is_valid_store_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
 
-    int net_file_size = htonl(file_size);
-    SSL_write(ssl, &net_file_size, sizeof(net_file_size));
-    printf("[DEBUG] Sending file: %s, size: %d bytes\n", filename, file_size);
+// ========== store/ 目錄索引 ==========
+// LIST_FILES 不再每次 readdir：啟動時掃描一次 store/ 與 store/.manifests/，之後由 inotify 執行緒依事件增量更新。
+// 索引是依檔名排序的指標陣列：查詢以二分搜尋定位 (同一個前綴的檔名是連續的一段)，一頁只碰到該頁的項目；
+// 新增 / 刪除以 memmove 維持排序 (幾十萬筆也只是搬幾 MB 的指標)。讀取者持 read lock，inotify 執行緒持 write lock。
 
-    char file_buffer[1024];
-    int total_sent = 0;
-    while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0) {
-        int sent = SSL_write(ssl, file_buffer, bytes_read);
-        if (sent <= 0) {
-            perror("[ERROR] Failed to send file data");
-            break;
-        }
-        total_sent += sent;
-        printf("[DEBUG] Sent %d bytes, total_sent=%d\n", sent, total_sent);
-    }
-    fclose(file);
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    int dedup;                      // 去重上傳的檔案 (大小由 manifest 算出)
+    char name[];
+} StoreEntry;
 
-    if (total_sent == file_size) {
-        printf("[DOWNLOAD] File '%s' downloaded successfully. Size=%d\n", filename, total_sent);
-        SSL_write(ssl, "File download complete\n", strlen("File download complete\n"));
-    } else {
-        printf("[DOWNLOAD] File '%s' download incomplete. Sent=%d/%d\n", filename, total_sent, file_size);
-        SSL_write(ssl, "File download incomplete\n", strlen("File download incomplete\n"));
-    }
-}
+static StoreEntry **store_index;
+static size_t store_index_count;
+static size_t store_index_cap;
+static pthread_rwlock_t store_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int store_inotify_fd = -1;
 
-// ========== SSL 初始化及配置 ==========
+static long long dedup_file_size(const char *filename);
+static void zcache_drop(const char *filename);
 
-SSL_CTX *create_context() {
-    const SSL_METHOD *method = TLS_server_method();
-    SSL_CTX *ctx = SSL_CTX_new(method);
-    if (!ctx) {
-        perror("Unable to create SSL context");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-    return ctx;
+static StoreEntry *store_entry_new(const char *name, uint64_t size, int64_t mtime, int dedup) {
+    size_t len = strlen(name) + 1;
+    StoreEntry *e = (StoreEntry *)malloc(sizeof(StoreEntry) + len);
+    e->size = size;
+    e->mtime = mtime;
+    e->dedup = dedup;
+    memcpy(e->name, name, len);
+    return e;
 }
 
-void configure_context(SSL_CTX *ctx) {
-    if (SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM) <= 0 ||
-        SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+static void store_list_push(StoreEntry ***list, size_t *count, size_t *cap, StoreEntry *e) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : STORE_INDEX_INITIAL;
+        *list = (StoreEntry **)realloc(*list, *cap * sizeof(StoreEntry *));
     }
+    (*list)[(*count)++] = e;
 }
 
-// ========== 輔助函式 ==========
+// 啟動時 (還沒有其他執行緒) 先不排序地加入，store_index_init 再一次排序
+static void store_index_append(const char *name, uint64_t size, int64_t mtime, int dedup) {
+    store_list_push(&store_index, &store_index_count, &store_index_cap, store_entry_new(name, size, mtime, dedup));
+}
 
-int is_user_online(const char *username) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].ssl != NULL && strcmp(clients[i].username, username) == 0) {
-            pthread_mutex_unlock(&clients_mutex);
-            return 1;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
-    return 0;
+// 同名時一般檔案排前面 (與 store_open 的優先順序一致)
+static int compare_store_entries(const void *a, const void *b) {
+    const StoreEntry *x = *(const StoreEntry *const *)a, *y = *(const StoreEntry *const *)b;
+    int diff = strcmp(x->name, y->name);
+    return diff ? diff : x->dedup - y->dedup;
 }
 
-int username_exists_in_db(const char *username) {
-    FILE *file = fopen("user_db", "r");
-    if (!file) {
-        perror("Failed to open user_db");
-        return 0;
+static void store_list_sort_unique(StoreEntry **list, size_t *count) {
+    qsort(list, *count, sizeof(StoreEntry *), compare_store_entries);
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (kept > 0 && strcmp(list[kept - 1]->name, list[i]->name) == 0) free(list[i]);
+        else list[kept++] = list[i];
     }
+    *count = kept;
+}
 
-    char stored_username[USERNAME_BUFFER_SIZE];
-    char stored_password[USERNAME_BUFFER_SIZE];
-    while (fscanf(file, "%s %s", stored_username, stored_password) != EOF) {
-        if (strcmp(stored_username, username) == 0) {
-            fclose(file);
-            return 1;
+static void store_scan_plain(StoreEntry ***list, size_t *count, size_t *cap) {
+    char path[sizeof(((struct dirent *)0)->d_name) + 16];
+    struct stat st;
+    DIR *dir = opendir("./store");
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "./store/%s", entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            store_list_push(list, count, cap, store_entry_new(entry->d_name, st.st_size, st.st_mtime, 0));
         }
     }
-    fclose(file);
-    return 0;
-}
-
-void log_user_login(const char *username) {
-    time_t now = time(NULL);
-    char *timestamp = ctime(&now);
-    timestamp[strcspn(timestamp, "\n")] = 0;
-    printf("[LOGIN] User '%s' logged in at %s\n", username, timestamp);
+    if (dir) closedir(dir);
 }
 
-// ========== 客戶端管理 ==========
-
-void add_client(const char *username, SSL *ssl) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].ssl == NULL) {
-            strncpy(clients[i].username, username, USERNAME_BUFFER_SIZE);
-            clients[i].ssl = ssl;
-            break;
+static void store_scan_manifests(StoreEntry ***list, size_t *count, size_t *cap) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + sizeof(((struct dirent *)0)->d_name)];
+    struct stat st;
+    DIR *dir = opendir(DEDUP_MANIFEST_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= USERNAME_BUFFER_SIZE) continue;
+        snprintf(path, sizeof(path), DEDUP_MANIFEST_DIR "/%s", entry->d_name);
+        long long size = dedup_file_size(entry->d_name);
+        if (size >= 0 && stat(path, &st) == 0) {
+            store_list_push(list, count, cap, store_entry_new(entry->d_name, size, st.st_mtime, 1));
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
+    if (dir) closedir(dir);
 }
 
-void remove_client(SSL *ssl) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].ssl == ssl) {
-            clients[i].ssl = NULL;
-            bzero(clients[i].username, USERNAME_BUFFER_SIZE);
-            break;
-        }
+// 第一個檔名 >= name 的位置
+static size_t store_index_lower_bound(const char *name) {
+    size_t lo = 0, hi = store_index_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(store_index[mid]->name, name) < 0) lo = mid + 1;
+        else hi = mid;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    return lo;
 }
 
-SSL *find_client(const char *username) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].ssl != NULL && strcmp(clients[i].username, username) == 0) {
-            pthread_mutex_unlock(&clients_mutex);
-            return clients[i].ssl;
-        }
+// begin 之後第一個不以 prefix 開頭的位置 (begin 起的檔名都 >= prefix，因此可二分搜尋)
+static size_t store_index_prefix_end(size_t begin, const char *prefix, size_t prefix_len) {
+    size_t lo = begin, hi = store_index_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strncmp(store_index[mid]->name, prefix, prefix_len) == 0) lo = mid + 1;
+        else hi = mid;
     }
-    pthread_mutex_unlock(&clients_mutex);
-    return NULL;
+    return lo;
 }
 
-// ========== 訊息管理 ==========
+// 一筆待套用的異動：entry 為該檔名在磁碟上的最新狀態 (一般檔案或去重檔案)，remove 代表兩處都已不存在
+typedef struct {
+    StoreEntry *entry;
+    int remove;
+    size_t seq;
+} StoreUpdate;
+
+static int compare_store_updates(const void *a, const void *b) {
+    const StoreUpdate *x = (const StoreUpdate *)a, *y = (const StoreUpdate *)b;
+    int diff = strcmp(x->entry->name, y->entry->name);
+    if (diff) return diff;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
 
-void store_message(const char *sender, const char *receiver, const char *message) {
-    pthread_mutex_lock(&messages_mutex);
-    if (message_count < MAX_MESSAGES) {
-        strncpy(messages[message_count].sender, sender, USERNAME_BUFFER_SIZE);
-        strncpy(messages[message_count].receiver, receiver, USERNAME_BUFFER_SIZE);
-        strncpy(messages[message_count].message, message, COMMAND_BUFFER_SIZE);
-        message_count++;
+// 依目前磁碟上的狀態產生一筆異動；不是合法檔名回傳 -1。
+// 不論事件來自 store/ 或 store/.manifests/，都重新檢查兩處 (一般檔案優先，與 store_open 一致)：
+// 去重版本取代一般檔案 (或反過來) 時，manifest 的 rename 與舊檔的刪除可能落在同一批事件中，
+// 只看事件本身的話，保留下來的最後一筆可能是舊檔的刪除，而檔案其實還在
+static int store_update_prepare(const char *name, StoreUpdate *update) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + sizeof(((struct dirent *)0)->d_name)];
+    struct stat st;
+    long long size = -1;
+    int dedup = 0;
+    if (!is_valid_store_name(name)) return -1;
+    snprintf(path, sizeof(path), "./store/%s", name);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    } else {
+        snprintf(path, sizeof(path), DEDUP_MANIFEST_DIR "/%s", name);
+        if (stat(path, &st) == 0) size = dedup_file_size(name);
+        dedup = 1;
     }
-    pthread_mutex_unlock(&messages_mutex);
+    update->remove = size < 0;
+    update->entry = store_entry_new(name, size < 0 ? 0 : size, size < 0 ? 0 : st.st_mtime, dedup);
+    return 0;
 }
 
-void get_messages(const char *username, char *output) {
-    pthread_mutex_lock(&messages_mutex);
-    output[0] = '\0';
-    for (int i = 0; i < message_count; i++) {
-        if (strcmp(messages[i].receiver, username) == 0) {
-            char msg_buffer[COMMAND_BUFFER_SIZE + 50];
-            snprintf(msg_buffer, sizeof(msg_buffer), "From %s: %s\n",
-                     messages[i].sender, messages[i].message);
-            strcat(output, msg_buffer);
+// 一次套用一批異動。少量時直接在陣列中 memmove；大量時 (例如整批刪除) 排序後與索引合併成新陣列，
+// 整批只需 O(n + k log k)，不會因為每筆都搬一次陣列而變成 O(n * k)
+static void store_index_apply(StoreUpdate *updates, size_t count) {
+    if (count == 0) return;
+    for (size_t i = 0; i < count; i++) updates[i].seq = i;
+    qsort(updates, count, sizeof(StoreUpdate), compare_store_updates);
+    // 同一個檔名只留最後一筆 (每筆都是當時兩處重新檢查的結果，最後一筆即最新狀態)
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept > 0 && strcmp(updates[kept - 1].entry->name, updates[i].entry->name) == 0) {
+            free(updates[kept - 1].entry);
+            updates[kept - 1] = updates[i];
+        } else {
+            updates[kept++] = updates[i];
+        }
+    }
+    count = kept;
 
-            // 將已讀的消息往前覆蓋
-            for (int j = i; j < message_count - 1; j++) {
-                messages[j] = messages[j + 1];
+    pthread_rwlock_wrlock(&store_index_lock);
+    if (count <= STORE_INDEX_MERGE_MIN) {
+        for (size_t i = 0; i < count; i++) {
+            StoreEntry *e = updates[i].entry;
+            size_t pos = store_index_lower_bound(e->name);
+            int found = pos < store_index_count && strcmp(store_index[pos]->name, e->name) == 0;
+            if (updates[i].remove) {
+                if (found) {
+                    free(store_index[pos]);
+                    memmove(store_index + pos, store_index + pos + 1,
+                            (store_index_count - pos - 1) * sizeof(StoreEntry *));
+                    store_index_count--;
+                }
+                free(e);
+            } else if (found) {
+                free(store_index[pos]);
+                store_index[pos] = e;
+            } else {
+                if (store_index_count == store_index_cap) {
+                    store_index_cap = store_index_cap ? store_index_cap * 2 : STORE_INDEX_INITIAL;
+                    store_index = (StoreEntry **)realloc(store_index, store_index_cap * sizeof(StoreEntry *));
+                }
+                memmove(store_index + pos + 1, store_index + pos, (store_index_count - pos) * sizeof(StoreEntry *));
+                store_index[pos] = e;
+                store_index_count++;
             }
-            message_count--;
-            i--;
         }
+    } else {
+        size_t cap = store_index_count + count;
+        StoreEntry **merged = (StoreEntry **)malloc(cap * sizeof(StoreEntry *));
+        size_t used = 0, i = 0, j = 0;
+        while (i < store_index_count || j < count) {
+            int cmp = i == store_index_count ? 1 : j == count ? -1 : strcmp(store_index[i]->name, updates[j].entry->name);
+            if (cmp < 0) {
+                merged[used++] = store_index[i++];
+                continue;
+            }
+            StoreUpdate *u = &updates[j++];
+            if (cmp == 0) {
+                StoreEntry *current = store_index[i++];
+                if (!u->remove) {
+                    free(current);
+                    merged[used++] = u->entry;
+                    continue;
+                }
+                free(current);
+            } else if (!u->remove) {
+                merged[used++] = u->entry;
+                continue;
+            }
+            free(u->entry);
+        }
+        free(store_index);
+        store_index = merged;
+        store_index_count = used;
+        store_index_cap = cap;
     }
-    pthread_mutex_unlock(&messages_mutex);
+    pthread_rwlock_unlock(&store_index_lock);
 }
 
-// ========== 客戶端連線執行緒 ==========
-
-void *client_handler(void *arg) {
-    SSL *ssl = (SSL *)arg;
-    char buffer[COMMAND_BUFFER_SIZE];
-    char command[COMMAND_BUFFER_SIZE];
-    char username[USERNAME_BUFFER_SIZE];
-    int logged_in = 0;
+// inotify 佇列溢位 (漏掉事件) 時整個重掃
+static void store_index_rescan() {
+    StoreEntry **list = NULL;
+    size_t count = 0, cap = 0;
+    store_scan_plain(&list, &count, &cap);
+    store_scan_manifests(&list, &count, &cap);
+    store_list_sort_unique(list, &count);
 
-    bzero(username, sizeof(username));
+    pthread_rwlock_wrlock(&store_index_lock);
+    StoreEntry **old = store_index;
+    size_t old_count = store_index_count;
+    store_index = list;
+    store_index_count = count;
+    store_index_cap = cap;
+    pthread_rwlock_unlock(&store_index_lock);
+    for (size_t i = 0; i < old_count; i++) free(old[i]);
+    free(old);
+    LOG_WARN("[WARN] Store index rescanned after inotify overflow (%zu files)\n", count);
+}
 
+// 每次 read 拿到的一批事件先各自 stat (不持鎖)，再一次套用
+static void *store_index_thread(void *arg) {
+    (void)arg;
+    static char buffer[STORE_INOTIFY_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    StoreUpdate *updates = (StoreUpdate *)malloc(STORE_INOTIFY_BUFFER / sizeof(struct inotify_event) * sizeof(StoreUpdate));
     while (1) {
-        bzero(buffer, sizeof(buffer));
-        int bytes_received = SSL_read(ssl, buffer, sizeof(buffer));
-        if (bytes_received <= 0) {
-            if (logged_in) {
-                printf("Client %s disconnected.\n", username);
-                remove_client(ssl);
-            } else {
-                printf("Anonymous client disconnected.\n");
-            }
+        ssize_t len = read(store_inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            perror("[ERROR] inotify read");
             break;
         }
+        size_t count = 0;
+        int overflow = 0;
+        for (char *p = buffer; p < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) overflow = 1;
+            else if (event->len > 0 && store_update_prepare(event->name, &updates[count]) == 0) {
+                if (updates[count].remove) zcache_drop(event->name); // 檔案刪除時一併丟掉壓縮快取
+                count++;
+            }
+        }
+        if (overflow) {
+            // 已漏掉事件，重掃的結果涵蓋這批異動
+            for (size_t i = 0; i < count; i++) free(updates[i].entry);
+            store_index_rescan();
+        } else {
+            store_index_apply(updates, count);
+        }
+    }
+    free(updates);
+    return NULL;
+}
 
-        sscanf(buffer, "%s", command);
-        printf("[DEBUG] Received command: %s\n", command);
+// 在 dedup_init 之後呼叫 (它已把所有 manifest 加進索引)；先建立 watch 再掃描，掃描期間的異動也不會漏掉
+void store_index_init() {
+    uint32_t mask = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+    store_inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (store_inotify_fd < 0 || inotify_add_watch(store_inotify_fd, "./store", mask) < 0 ||
+        inotify_add_watch(store_inotify_fd, DEDUP_MANIFEST_DIR, mask) < 0) {
+        perror("[ERROR] inotify");
+        exit(EXIT_FAILURE);
+    }
+    store_scan_plain(&store_index, &store_index_count, &store_index_cap);
+    store_list_sort_unique(store_index, &store_index_count);
 
-        if (strcmp(command, "REGISTER") == 0) {
-            char reg_username[USERNAME_BUFFER_SIZE];
-            char reg_password[USERNAME_BUFFER_SIZE];
-            sscanf(buffer, "REGISTER %s %s", reg_username, reg_password);
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, store_index_thread, NULL);
+    pthread_detach(thread_id);
+    LOG_INFO("[INFO] Store index: %zu file(s)\n", store_index_count);
+}
 
-            if (username_exists_in_db(reg_username)) {
-                SSL_write(ssl, "Username already exists\n", strlen("Username already exists\n"));
-            } else {
-                FILE *file = fopen("user_db", "a");
-                if (!file) {
-                    perror("Failed to open user_db");
-                    SSL_write(ssl, "Registration failed\n", strlen("Registration failed\n"));
-                } else {
-                    fprintf(file, "%s %s\n", reg_username, reg_password);
-                    fclose(file);
-                    printf("[REGISTER] New user: %s\n", reg_username);
-                    SSL_write(ssl, "Registration successful\n", strlen("Registration successful\n"));
-                }
-            }
+static void store_index_format_stats(char *out, size_t out_size) {
+    pthread_rwlock_rdlock(&store_index_lock);
+    snprintf(out, out_size, "store files=%zu\n", store_index_count);
+    pthread_rwlock_unlock(&store_index_lock);
+}
 
-        } else if (strcmp(command, "LOGIN") == 0) {
-            char tmp_user[USERNAME_BUFFER_SIZE];
-            char tmp_pass[USERNAME_BUFFER_SIZE];
-            int ret = sscanf(buffer, "LOGIN %s %s", tmp_user, tmp_pass);
-            if (ret < 2) {
-                SSL_write(ssl, "Login command parse error\n", strlen("Login command parse error\n"));
-                continue;
-            }
-            if (is_user_online(tmp_user)) {
-                SSL_write(ssl, "User already logged in\n", strlen("User already logged in\n"));
-            } else {
-                add_client(tmp_user, ssl);
-                log_user_login(tmp_user);
-                SSL_write(ssl, "Login successful\n", strlen("Login successful\n"));
-                logged_in = 1;
-                strncpy(username, tmp_user, USERNAME_BUFFER_SIZE);
-            }
-
-        } else if (strcmp(command, "RETRIEVE") == 0) {
-            char output[COMMAND_BUFFER_SIZE * 10];
-            get_messages(username, output);
-            if (strlen(output) == 0) {
-                strcpy(output, "No new messages\n");
-            }
-            SSL_write(ssl, output, strlen(output));
-
-        } else if (strcmp(command, "ONLINE") == 0) {
-            char online_users[COMMAND_BUFFER_SIZE];
-            online_users[0] = '\0';
-            pthread_mutex_lock(&clients_mutex);
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (clients[i].ssl != NULL && strcmp(clients[i].username, username) != 0) {
-                    strcat(online_users, clients[i].username);
-                    strcat(online_users, "\n");
-                }
-            }
-            pthread_mutex_unlock(&clients_mutex);
-            if (strlen(online_users) == 0) {
-                strcpy(online_users, "No other users online.\n");
-            }
-            SSL_write(ssl, online_users, strlen(online_users));
+// LIST_FILES [offset] [limit] [prefix]：依檔名排序，每行 "<檔名> <大小> <mtime>"，只列出以 prefix 開頭的檔案。
+// 最後一行為 "[more] next=<offset> total=<n>" 或 "[end] total=<n>"，total 為符合 prefix 的檔案數
+void handle_list_files(Connection *conn, const char *buffer) {
+    long offset = 0, limit = STORE_LIST_PAGE_DEFAULT;
+    char prefix[USERNAME_BUFFER_SIZE] = "";
+    sscanf(buffer, "LIST_FILES %ld %ld %127s", &offset, &limit, prefix);
+    if (offset < 0) offset = 0;
+    if (limit <= 0 || limit > STORE_LIST_PAGE_MAX) limit = STORE_LIST_PAGE_MAX;
 
-        } else if (strcmp(command, "LOGOUT") == 0) {
-            printf("Client %s logged out.\n", username);
-            remove_client(ssl);
-            bzero(username, sizeof(username));
-            logged_in = 0;
-            SSL_write(ssl, "Logged out successfully\n", strlen("Logged out successfully\n"));
+    char *reply = (char *)malloc(LIST_REPLY_MAX);
+    if (!reply) {
+        conn_reply(conn, "Server busy\n");
+        return;
+    }
+    size_t prefix_len = strlen(prefix);
+    size_t used = 0;
+    long listed = 0;
 
-        } else if (strcmp(command, "exit") == 0) {
-            printf("Client %s disconnected.\n", username);
-            remove_client(ssl);
-            break;
+    pthread_rwlock_rdlock(&store_index_lock);
+    size_t begin = store_index_lower_bound(prefix);
+    size_t end = prefix_len ? store_index_prefix_end(begin, prefix, prefix_len) : store_index_count;
+    size_t total = end - begin;
+    size_t i = begin + ((size_t)offset < total ? (size_t)offset : total);
+    for (; i < end && listed < limit; i++) {
+        const StoreEntry *e = store_index[i];
+        int len = snprintf(reply + used, LIST_REPLY_MAX - used, "%s %llu %lld\n", e->name,
+                           (unsigned long long)e->size, (long long)e->mtime);
+        if (used + len + LIST_FOOTER_RESERVE > LIST_REPLY_MAX) break;
+        used += len;
+        listed++;
+    }
+    pthread_rwlock_unlock(&store_index_lock);
 
-        // ========== 關鍵：先檢查 SEND_FILE，再檢查 SEND ==========
-        } else if (strncmp(command, "SEND_FILE", 9) == 0) {
-            handle_send_file(ssl, buffer);
+    if (listed == 0) {
+        used = snprintf(reply, LIST_REPLY_MAX, offset == 0 ? "No files available for download\n" : "No more files.\n");
+    }
+    if (i < end) {
+        snprintf(reply + used, LIST_REPLY_MAX - used, "[more] next=%zu total=%zu\n", i - begin, total);
+    } else {
+        snprintf(reply + used, LIST_REPLY_MAX - used, "[end] total=%zu\n", total);
+    }
+    conn_reply(conn, reply);
+    free(reply);
+}
 
-        } else if (strncmp(command, "SEND", 4) == 0) {
-            // SEND <target_username> <message...>
-            char target_username[USERNAME_BUFFER_SIZE];
-            char msg_content[COMMAND_BUFFER_SIZE];
-            sscanf(buffer, "SEND %s %[^\n]", target_username, msg_content);
+// ========== 去重 chunk store ==========
+// SEND_FILE_DEDUP 上傳的檔案以 content-defined chunk 存放，相同內容只存一份：
+//   store/.chunks/<hash 前 2 碼>/<SHA-256 hex>   chunk 內容
+//   store/.manifests/<filename>                  每行 "<hash hex> <長度>"，依序串起來就是檔案內容
+// chunk 的參照數只放在記憶體，啟動時由所有 manifest 重建；沒有 manifest 參照的 chunk (上傳中 crash 留下的) 在啟動時清掉。
+// 執行中的參照包含 manifest 與進行中的上傳 / 下載 (pin)，manifest 被取代、下載結束或上傳失敗使參照降到 0 時即刪除 chunk 檔，
+// 不會留下沒人參照的 chunk。
 
-            SSL *target_ssl = find_client(target_username);
-            if (target_ssl != NULL) {
-                store_message(username, target_username, msg_content);
-                SSL_write(ssl, "Message sent\n", strlen("Message sent\n"));
-            } else {
-                SSL_write(ssl, "Target user not found\n", strlen("Target user not found\n"));
-            }
+typedef struct DedupChunk {
+    struct DedupChunk *next;
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t length;
+    uint32_t refs;
+} DedupChunk;
+
+typedef struct {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t length;
+} DedupRef;
 
-        } else if (strcmp(command, "LIST_FILES") == 0) {
-            handle_list_files(ssl);
+static DedupChunk **dedup_buckets;
+static size_t dedup_bucket_count;
+static size_t dedup_chunk_count;
+static uint64_t dedup_stored_bytes;
+static unsigned long dedup_chunks_received;     // 上傳時實際收到資料的 chunk 數
+static unsigned long dedup_chunks_reused;       // 上傳時 server 已有、不必傳送的 chunk 數
+static unsigned long dedup_tmp_seq;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        } else if (strncmp(command, "RECEIVE_FILE", 12) == 0) {
-            handle_receive_file(ssl, buffer);
+static void dedup_chunk_path(const unsigned char *hash, char *out, size_t size) {
+    char hex[DEDUP_HASH_SIZE * 2 + 1];
+    dedup_hash_hex(hash, hex);
+    snprintf(out, size, DEDUP_CHUNK_DIR "/%.2s/%s", hex, hex);
+}
 
-        } else if (strncmp(command, "STREAM_VIDEO", 12) == 0) {
-            // 此處處理影片串流
-            handle_video_stream(ssl);
+static int dedup_parse_hex(const char *hex, unsigned char *hash) {
+    for (int i = 0; i < DEDUP_HASH_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        hash[i] = (unsigned char)byte;
+    }
+    return hex[DEDUP_HASH_SIZE * 2] == '\0' ? 0 : -1;
+}
 
-        } else {
-            SSL_write(ssl, "Unknown command\n", strlen("Unknown command\n"));
+// SHA-256 本身已均勻分布，直接取前 8 bytes 當 bucket 索引
+static DedupChunk **dedup_slot(const unsigned char *hash) {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    DedupChunk **slot = &dedup_buckets[key % dedup_bucket_count];
+    while (*slot && memcmp((*slot)->hash, hash, DEDUP_HASH_SIZE) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+static void dedup_table_grow() {
+    size_t old_count = dedup_bucket_count;
+    DedupChunk **old = dedup_buckets;
+    dedup_bucket_count = old_count * 2;
+    dedup_buckets = (DedupChunk **)calloc(dedup_bucket_count, sizeof(DedupChunk *));
+    for (size_t i = 0; i < old_count; i++) {
+        while (old[i]) {
+            DedupChunk *c = old[i];
+            old[i] = c->next;
+            DedupChunk **slot = dedup_slot(c->hash);
+            c->next = NULL;
+            *slot = c;
         }
     }
+    free(old);
+}
 
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    pthread_exit(NULL);
+// 以下 _locked 函式的呼叫者需持有 dedup_lock
+static DedupChunk *dedup_insert_locked(const unsigned char *hash, uint32_t length) {
+    DedupChunk **slot = dedup_slot(hash);
+    if (*slot) return *slot;
+    if (dedup_chunk_count >= dedup_bucket_count) {
+        dedup_table_grow();
+        slot = dedup_slot(hash);
+    }
+    DedupChunk *c = (DedupChunk *)calloc(1, sizeof(DedupChunk));
+    memcpy(c->hash, hash, DEDUP_HASH_SIZE);
+    c->length = length;
+    *slot = c;
+    dedup_chunk_count++;
+    dedup_stored_bytes += length;
+    return c;
 }
 
-// ========== 主程式入口 ==========
+static void dedup_unref_locked(const unsigned char *hash) {
+    DedupChunk **slot = dedup_slot(hash);
+    DedupChunk *c = *slot;
+    if (!c) return;
+    if (c->refs > 0) c->refs--;
+    if (c->refs == 0) {
+        char path[sizeof(DEDUP_CHUNK_DIR) + DEDUP_HASH_SIZE * 2 + 8];
+        dedup_chunk_path(hash, path, sizeof(path));
+        unlink(path);
+        *slot = c->next;
+        dedup_chunk_count--;
+        dedup_stored_bytes -= c->length;
+        free(c);
+    }
+}
 
-int main() {
-    int sockfd, connfd;
-    struct sockaddr_in servaddr, cli;
-    SSL_CTX *ctx;
+static void dedup_unref_all(const DedupRef *refs, size_t count) {
+    pthread_mutex_lock(&dedup_lock);
+    for (size_t i = 0; i < count; i++) dedup_unref_locked(refs[i].hash);
+    pthread_mutex_unlock(&dedup_lock);
+}
 
-    ensure_store_directory(); // 確保有 store/ 目錄
-    ctx = create_context();
-    configure_context(ctx);
+// 全部 pin 住才成功；有 chunk 已不存在 (manifest 剛被另一次上傳取代) 就放掉已 pin 的並回傳 -1
+static int dedup_pin_all(const DedupRef *refs, size_t count) {
+    pthread_mutex_lock(&dedup_lock);
+    for (size_t i = 0; i < count; i++) {
+        DedupChunk *c = *dedup_slot(refs[i].hash);
+        if (!c) {
+            for (size_t j = 0; j < i; j++) dedup_unref_locked(refs[j].hash);
+            pthread_mutex_unlock(&dedup_lock);
+            return -1;
+        }
+        c->refs++;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return 0;
+}
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    bzero(&servaddr, sizeof(servaddr));
+static void dedup_manifest_path(const char *filename, char *out, size_t size) {
+    snprintf(out, size, DEDUP_MANIFEST_DIR "/%s", filename);
+}
 
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT);
+// 讀取 manifest，*refs 由呼叫者 free；不存在或格式錯誤回傳 -1
+static int dedup_read_manifest(const char *path, DedupRef **refs, size_t *count, uint64_t *size) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    DedupRef *list = NULL;
+    size_t used = 0, cap = 0;
+    uint64_t total = 0;
+    char hex[DEDUP_HASH_SIZE * 2 + 2];
+    unsigned int length;
+    int fields, ok = 1;
+    while ((fields = fscanf(file, "%65s %u", hex, &length)) == 2) {
+        if (used == cap) {
+            cap = cap ? cap * 2 : 64;
+            list = (DedupRef *)realloc(list, cap * sizeof(DedupRef));
+        }
+        if (dedup_parse_hex(hex, list[used].hash) < 0 || length == 0 || length > DEDUP_MAX_CHUNK) {
+            ok = 0;
+            break;
+        }
+        list[used++].length = length;
+        total += length;
+    }
+    if (fields != EOF) ok = 0;
+    fclose(file);
+    if (!ok || used == 0) {
+        free(list);
+        return -1;
+    }
+    *refs = list;
+    *count = used;
+    *size = total;
+    return 0;
+}
 
-    bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr));
-    listen(sockfd, 5);
+// 去重檔案的大小；不是去重檔案回傳 -1
+static long long dedup_file_size(const char *filename) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + USERNAME_BUFFER_SIZE];
+    DedupRef *refs;
+    size_t count;
+    uint64_t size;
+    dedup_manifest_path(filename, path, sizeof(path));
+    if (dedup_read_manifest(path, &refs, &count, &size) < 0) return -1;
+    free(refs);
+    return (long long)size;
+}
 
-    printf("Server listening on port %d...\n", PORT);
+// 移除檔名對應的 manifest (該檔名改以一般檔案上傳時)，並釋放它的 chunk
+static void dedup_drop_manifest(const char *filename) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + USERNAME_BUFFER_SIZE];
+    DedupRef *refs;
+    size_t count;
+    uint64_t size;
+    dedup_manifest_path(filename, path, sizeof(path));
+    if (dedup_read_manifest(path, &refs, &count, &size) < 0) return;
+    unlink(path);
+    dedup_unref_all(refs, count);
+    free(refs);
+}
 
-    while (1) {
-        socklen_t len = sizeof(cli);
-        connfd = accept(sockfd, (struct sockaddr *)&cli, &len);
-        SSL *ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, connfd);
+// 啟動時重建參照數：先載入所有 manifest (同時加進 store 索引)，再清掉沒被參照的 chunk 與暫存檔
+void dedup_init() {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + sizeof(((struct dirent *)0)->d_name) + 8];
+    mkdir(DEDUP_CHUNK_DIR, 0700);
+    mkdir(DEDUP_MANIFEST_DIR, 0700);
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), DEDUP_CHUNK_DIR "/%02x", i);
+        mkdir(path, 0700);
+    }
+    dedup_bucket_count = DEDUP_TABLE_INITIAL;
+    dedup_buckets = (DedupChunk **)calloc(dedup_bucket_count, sizeof(DedupChunk *));
 
-        if (SSL_accept(ssl) <= 0) {
-            ERR_print_errors_fp(stderr);
-            close(connfd);
-            SSL_free(ssl);
+    size_t manifests = 0, missing = 0, orphans = 0;
+    DIR *dir = opendir(DEDUP_MANIFEST_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            // 寫到一半的 manifest 暫存檔
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                snprintf(path, sizeof(path), DEDUP_MANIFEST_DIR "/%s", entry->d_name);
+                unlink(path);
+            }
+            continue;
+        }
+        DedupRef *refs;
+        size_t count;
+        uint64_t size;
+        struct stat manifest_st;
+        snprintf(path, sizeof(path), DEDUP_MANIFEST_DIR "/%s", entry->d_name);
+        if (stat(path, &manifest_st) < 0 || dedup_read_manifest(path, &refs, &count, &size) < 0) {
+            LOG_WARN("[WARN] Ignoring damaged manifest '%s'\n", entry->d_name);
+            continue;
+        }
+        // 先確認 chunk 都在，缺 chunk 的 manifest 整個略過：不加參照也不列入索引，
+        // 移出 .manifests 後重新上傳同名檔案時也不會去釋放它從未加上的參照
+        size_t absent = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (*dedup_slot(refs[i].hash)) continue;
+            struct stat st;
+            dedup_chunk_path(refs[i].hash, path, sizeof(path));
+            if (stat(path, &st) < 0 || (uint64_t)st.st_size != refs[i].length) absent++;
+        }
+        if (absent) {
+            char broken[sizeof(DEDUP_BROKEN_DIR) + sizeof(((struct dirent *)0)->d_name) + 8];
+            snprintf(path, sizeof(path), DEDUP_MANIFEST_DIR "/%s", entry->d_name);
+            snprintf(broken, sizeof(broken), DEDUP_BROKEN_DIR "/%s", entry->d_name);
+            mkdir(DEDUP_BROKEN_DIR, 0700);
+            LOG_WARN("[WARN] Manifest '%s' references %zu missing chunk(s), moved to " DEDUP_BROKEN_DIR "\n",
+                     entry->d_name, absent);
+            if (rename(path, broken) < 0) unlink(path);
+            missing++;
+            free(refs);
             continue;
         }
+        store_index_append(entry->d_name, size, manifest_st.st_mtime, 1);
+        for (size_t i = 0; i < count; i++) {
+            DedupChunk *c = dedup_insert_locked(refs[i].hash, refs[i].length);
+            c->refs++;
+        }
+        free(refs);
+        manifests++;
+    }
+    if (dir) closedir(dir);
 
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, client_handler, ssl);
-        pthread_detach(thread_id);
+    for (int i = 0; i < 256; i++) {
+        char sub[sizeof(DEDUP_CHUNK_DIR) + 4];
+        snprintf(sub, sizeof(sub), DEDUP_CHUNK_DIR "/%02x", i);
+        if (!(dir = opendir(sub))) continue;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            unsigned char hash[DEDUP_HASH_SIZE];
+            if (dedup_parse_hex(entry->d_name, hash) == 0 && *dedup_slot(hash)) continue;
+            snprintf(path, sizeof(path), "%s/%s", sub, entry->d_name);
+            unlink(path);
+            orphans++;
+        }
+        closedir(dir);
+    }
+    if (missing) LOG_ERROR("[ERROR] Dedup store: %zu file(s) skipped because of missing chunks\n", missing);
+    LOG_INFO("[INFO] Dedup store: %zu file(s), %zu chunk(s), %.1f MiB; removed %zu unreferenced chunk(s)\n",
+             manifests, dedup_chunk_count, dedup_stored_bytes / (1024.0 * 1024.0), orphans);
+}
+
+static void dedup_format_stats(char *out, size_t out_size) {
+    pthread_mutex_lock(&dedup_lock);
+    snprintf(out, out_size, "dedup chunks=%zu stored_mb=%.1f received=%lu reused=%lu\n", dedup_chunk_count,
+             dedup_stored_bytes / (1024.0 * 1024.0), dedup_chunks_received, dedup_chunks_reused);
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+// ========== store/ 檔案讀取 ==========
+// 下載類指令以 StoreFile 讀取：一般檔案直接用 fd，去重檔案依 manifest 讀各個 chunk 檔。
+// 去重檔案開啟時 pin 住所有 chunk，下載期間即使同名檔案被重新上傳也不會讀到被刪掉的 chunk。
+
+typedef struct {
+    int fd;                         // 一般檔案；去重檔案為 -1
+    uint64_t size;
+    int64_t mtime;                  // ns；去重檔案為 manifest 的修改時間 (用來判斷壓縮快取是否過期)
+    DedupRef *refs;
+    uint64_t *offsets;              // 每個 chunk 在檔案中的起點
+    size_t count;
+} StoreFile;
+
+static int store_open(const char *filename, StoreFile *sf) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + USERNAME_BUFFER_SIZE];
+    struct stat st;
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = -1;
+    if (!is_valid_store_name(filename)) return -1;
+
+    snprintf(path, sizeof(path), "./store/%s", filename);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            sf->fd = fd;
+            sf->size = st.st_size;
+            sf->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            return 0;
+        }
+        close(fd);
+        return -1;
+    }
+
+    dedup_manifest_path(filename, path, sizeof(path));
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (stat(path, &st) < 0 || dedup_read_manifest(path, &sf->refs, &sf->count, &sf->size) < 0) return -1;
+        if (dedup_pin_all(sf->refs, sf->count) == 0) {
+            sf->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            sf->offsets = (uint64_t *)malloc(sf->count * sizeof(uint64_t));
+            uint64_t offset = 0;
+            for (size_t i = 0; i < sf->count; i++) {
+                sf->offsets[i] = offset;
+                offset += sf->refs[i].length;
+            }
+            return 0;
+        }
+        // 讀到的是剛被取代的舊 manifest，重讀一次
+        free(sf->refs);
+        sf->refs = NULL;
+    }
+    return -1;
+}
+
+static void store_close(StoreFile *sf) {
+    if (sf->fd >= 0) close(sf->fd);
+    if (sf->refs) {
+        dedup_unref_all(sf->refs, sf->count);
+        free(sf->refs);
+        free(sf->offsets);
+    }
+    sf->fd = -1;
+    sf->refs = NULL;
+}
+
+// 含 offset 的 chunk 索引
+static size_t store_find_chunk(const StoreFile *sf, uint64_t offset) {
+    size_t lo = 0, hi = sf->count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (sf->offsets[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// 讀滿 [offset, offset+len)，成功回傳 0
+static int store_pread(StoreFile *sf, void *buf, size_t len, uint64_t offset) {
+    char path[sizeof(DEDUP_CHUNK_DIR) + DEDUP_HASH_SIZE * 2 + 8];
+    size_t done = 0;
+    if (sf->fd >= 0) {
+        while (done < len) {
+            ssize_t n = pread(sf->fd, (char *)buf + done, len - done, offset + done);
+            if (n <= 0) return -1;
+            done += n;
+        }
+        return 0;
+    }
+    for (size_t i = store_find_chunk(sf, offset); done < len && i < sf->count; i++) {
+        uint64_t skip = offset + done - sf->offsets[i];
+        size_t want = sf->refs[i].length - skip;
+        if (want > len - done) want = len - done;
+        dedup_chunk_path(sf->refs[i].hash, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        ssize_t n = pread(fd, (char *)buf + done, want, skip);
+        close(fd);
+        if (n != (ssize_t)want) return -1;
+        done += want;
+    }
+    return done == len ? 0 : -1;
+}
+
+// 上傳 pipeline：連線端把 TLS 資料讀進 pool 中的大 buffer，交給 disk writer 執行緒 pwrite，
+// 網路端只會在 buffer 全部用完時等待 (backpressure)，不會直接卡在磁碟 I/O。
+
+typedef struct UploadBuffer {
+    struct UploadBuffer *next;
+    size_t len;
+    char data[UPLOAD_BUFFER_SIZE];
+} UploadBuffer;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;                    // 已送出但尚未寫完的 buffer 數
+    int error;
+} Upload;
+
+typedef struct UploadName {
+    struct UploadName *next;
+    char name[USERNAME_BUFFER_SIZE];
+} UploadName;
+
+typedef struct WriteRequest {
+    struct WriteRequest *next;
+    Upload *upload;
+    UploadBuffer *buf;
+    uint64_t offset;
+    void (*task)(void *);           // 不是 NULL 時改為執行 task(arg)，排在之前送出的寫入之後
+    void *arg;
+} WriteRequest;
+
+static UploadBuffer *upload_free_buffers;
+static pthread_mutex_t upload_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_buffers_available = PTHREAD_COND_INITIALIZER;
+
+static WriteRequest *write_queue_head, *write_queue_tail;
+static pthread_mutex_t write_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_queue_ready = PTHREAD_COND_INITIALIZER;
+
+static UploadBuffer *upload_buffer_acquire() {
+    pthread_mutex_lock(&upload_buffers_lock);
+    while (!upload_free_buffers) {
+        pthread_cond_wait(&upload_buffers_available, &upload_buffers_lock);
+    }
+    UploadBuffer *buf = upload_free_buffers;
+    upload_free_buffers = buf->next;
+    pthread_mutex_unlock(&upload_buffers_lock);
+    buf->len = 0;
+    return buf;
+}
+
+static void upload_buffer_release(UploadBuffer *buf) {
+    pthread_mutex_lock(&upload_buffers_lock);
+    buf->next = upload_free_buffers;
+    upload_free_buffers = buf;
+    pthread_cond_signal(&upload_buffers_available);
+    pthread_mutex_unlock(&upload_buffers_lock);
+}
+
+static void write_queue_push(WriteRequest *req) {
+    pthread_mutex_lock(&write_queue_lock);
+    if (write_queue_tail) write_queue_tail->next = req;
+    else write_queue_head = req;
+    write_queue_tail = req;
+    pthread_cond_signal(&write_queue_ready);
+    pthread_mutex_unlock(&write_queue_lock);
+}
+
+static void upload_submit_write(Upload *upload, UploadBuffer *buf, uint64_t offset) {
+    WriteRequest *req = (WriteRequest *)calloc(1, sizeof(WriteRequest));
+    req->upload = upload;
+    req->buf = buf;
+    req->offset = offset;
+
+    pthread_mutex_lock(&upload->lock);
+    upload->pending++;
+    pthread_mutex_unlock(&upload->lock);
+    write_queue_push(req);
+}
+
+// 佇列是 FIFO，task 被取出時之前送出的寫入都已被取出 (可能仍在另一個 disk writer 執行中，需要時以 upload_wait_idle 等待)
+static void disk_writer_submit_task(void (*task)(void *), void *arg) {
+    WriteRequest *req = (WriteRequest *)calloc(1, sizeof(WriteRequest));
+    req->task = task;
+    req->arg = arg;
+    write_queue_push(req);
+}
+
+static void *disk_writer_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&write_queue_lock);
+        while (!write_queue_head) pthread_cond_wait(&write_queue_ready, &write_queue_lock);
+        WriteRequest *req = write_queue_head;
+        write_queue_head = req->next;
+        if (!write_queue_head) write_queue_tail = NULL;
+        pthread_mutex_unlock(&write_queue_lock);
+        if (req->task) {
+            req->task(req->arg);
+            free(req);
+            continue;
+        }
+
+        Upload *upload = req->upload;
+        size_t written = 0;
+        while (written < req->buf->len) {
+            ssize_t n = pwrite(upload->fd, req->buf->data + written, req->buf->len - written,
+                               req->offset + written);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                perror("[ERROR] Failed to write upload data");
+                break;
+            }
+            written += n;
+        }
+        // buffer 放回後可能立刻被其他上傳取走並清空 len，要先判斷是否寫完
+        int short_write = written < req->buf->len;
+        upload_buffer_release(req->buf);
+
+        pthread_mutex_lock(&upload->lock);
+        if (short_write) upload->error = 1;
+        if (--upload->pending == 0) pthread_cond_broadcast(&upload->done);
+        pthread_mutex_unlock(&upload->lock);
+        free(req);
+    }
+    return NULL;
+}
+
+void disk_writer_init() {
+    for (int i = 0; i < UPLOAD_BUFFER_COUNT; i++) {
+        UploadBuffer *buf = (UploadBuffer *)malloc(sizeof(UploadBuffer));
+        if (!buf) break;
+        buf->next = upload_free_buffers;
+        upload_free_buffers = buf;
+    }
+    for (int i = 0; i < DISK_WRITER_THREADS; i++) {
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, disk_writer_thread, NULL);
+        pthread_detach(thread_id);
+    }
+}
+
+static int ssl_read_full(SSL *ssl, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int n = SSL_read(ssl, (char *)buf + got, (int)(len - got));
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// 壓縮傳輸的統計 (STATS 的 compress 行)；raw / wire 只計入有壓縮的傳輸
+static unsigned long zstat_blocks_in, zstat_blocks_out, zstat_frames;
+static unsigned long zstat_cache_hits, zstat_cache_writes, zstat_cache_evictions, zstat_skipped;
+static uint64_t zstat_raw_bytes, zstat_wire_bytes;
+
+static void zstat_add(unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void zstat_add_bytes(uint64_t raw, uint64_t wire) {
+    __atomic_fetch_add(&zstat_raw_bytes, raw, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstat_wire_bytes, wire, __ATOMIC_RELAXED);
+}
+
+static uint64_t zcache_used_bytes();
+
+static void zstat_format(char *out, size_t out_size) {
+    snprintf(out, out_size, "compress blocks_out=%lu blocks_in=%lu frames=%lu raw_mb=%.1f wire_mb=%.1f cache_hits=%lu "
+             "cache_writes=%lu cache_evictions=%lu cache_mb=%.1f skipped=%lu\n",
+             __atomic_load_n(&zstat_blocks_out, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstat_blocks_in, __ATOMIC_RELAXED), __atomic_load_n(&zstat_frames, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstat_raw_bytes, __ATOMIC_RELAXED) / (1024.0 * 1024.0),
+             __atomic_load_n(&zstat_wire_bytes, __ATOMIC_RELAXED) / (1024.0 * 1024.0),
+             __atomic_load_n(&zstat_cache_hits, __ATOMIC_RELAXED), __atomic_load_n(&zstat_cache_writes, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstat_cache_evictions, __ATOMIC_RELAXED), zcache_used_bytes() / (1024.0 * 1024.0),
+             __atomic_load_n(&zstat_skipped, __ATOMIC_RELAXED));
+}
+
+// 指令最後的 "zlib" 代表 client 要求壓縮 (見 protocol.h)：去掉它讓原本的參數解析不變，回傳協商的 codec。
+// 至少要有指令與檔名兩個欄位，避免把名為 zlib 的檔案當成選項
+static int zcodec_strip_option(char *command) {
+    size_t len = strlen(command);
+    while (len > 0 && (command[len - 1] == '\n' || command[len - 1] == '\r' || command[len - 1] == ' ')) len--;
+    if (len < 5 || strncmp(command + len - 5, " zlib", 5) != 0 || !memchr(command, ' ', len - 5)) return ZCODEC_NONE;
+    command[len - 5] = '\0';
+    return ZCODEC_ZLIB;
+}
+
+// 上傳資料來源：未壓縮時直接讀 TLS，協商了 zlib 時逐區塊解開 (格式見 protocol.h)
+typedef struct {
+    SSL *ssl;
+    int codec;
+    unsigned char *block;           // 目前解開的區塊
+    unsigned char *payload;         // 收到的區塊 payload
+    uint32_t len, pos;              // block 中的資料量與已讀到的位置
+    uint64_t wire_bytes;            // 實際從網路收到的 bytes
+    unsigned long blocks;
+} UploadReader;
+
+static void upload_reader_init(UploadReader *r, SSL *ssl, int codec) {
+    memset(r, 0, sizeof(*r));
+    r->ssl = ssl;
+    r->codec = codec;
+    if (codec == ZCODEC_ZLIB) {
+        r->block = (unsigned char *)malloc(ZBLOCK_SIZE);
+        r->payload = (unsigned char *)malloc(ZBLOCK_SIZE);
+        if (!r->block || !r->payload) r->codec = -1; // 之後每次讀取都失敗
+    }
+}
+
+static void upload_reader_free(UploadReader *r) {
+    free(r->block);
+    free(r->payload);
+}
+
+// 與 SSL_read 相同：回傳讀到的 bytes，斷線或區塊損毀回傳 <= 0
+static int upload_reader_read(UploadReader *r, void *dst, size_t len) {
+    if (r->codec == ZCODEC_NONE) {
+        int n = SSL_read(r->ssl, dst, (int)len);
+        if (n > 0) r->wire_bytes += n;
+        return n;
+    }
+    if (r->codec != ZCODEC_ZLIB) return -1;
+    if (r->pos == r->len) {
+        unsigned char header[ZBLOCK_HEADER_SIZE];
+        uint32_t raw_len, payload_len;
+        int stored;
+        if (ssl_read_full(r->ssl, header, sizeof(header)) < 0 ||
+            zblock_parse_header(header, &raw_len, &payload_len, &stored) < 0 ||
+            ssl_read_full(r->ssl, r->payload, payload_len) < 0 ||
+            zblock_decode(r->payload, payload_len, stored, r->block, raw_len) < 0) {
+            r->codec = -1;
+            return -1;
+        }
+        r->wire_bytes += ZBLOCK_HEADER_SIZE + payload_len;
+        r->blocks++;
+        r->len = raw_len;
+        r->pos = 0;
+    }
+    size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+    memcpy(dst, r->block + r->pos, n);
+    r->pos += n;
+    return (int)n;
+}
+
+static void zstat_add_upload(const UploadReader *r, uint64_t raw) {
+    if (r->codec == ZCODEC_NONE) return;
+    zstat_add(&zstat_blocks_in, r->blocks);
+    zstat_add_bytes(raw, r->wire_bytes);
+}
+
+static int upload_reader_read_full(UploadReader *r, void *dst, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        int n = upload_reader_read(r, (char *)dst + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// 讀掉 client 已送出的資料 (無法寫入時仍需維持協定同步)
+static void discard_upload_data(UploadReader *r, uint64_t remaining) {
+    char discard[16384];
+    while (remaining > 0) {
+        int n = upload_reader_read(r, discard, remaining < sizeof(discard) ? (int)remaining : (int)sizeof(discard));
+        if (n <= 0) break;
+        remaining -= n;
+    }
+}
+
+// ========== 續傳狀態 ==========
+// 未完成的上傳保存在 store/.<name>.part，已確定寫入的長度記在 store/.<name>.part.state
+// ("<total_size> <committed>\n")，client 以 FILE_STATUS 查詢後從 committed 繼續上傳。
+
+static void partial_paths(const char *filename, char *part, char *state, size_t size) {
+    snprintf(part, size, "./store/.%s.part", filename);
+    snprintf(state, size, "./store/.%s.part.state", filename);
+}
+
+static int read_partial_state(const char *state_path, uint64_t *total, uint64_t *committed) {
+    FILE *file = fopen(state_path, "r");
+    if (!file) return -1;
+    unsigned long long t, c;
+    int ok = fscanf(file, "%llu %llu", &t, &c) == 2 && c <= t;
+    fclose(file);
+    if (!ok) return -1;
+    *total = t;
+    *committed = c;
+    return 0;
+}
+
+// 先寫暫存檔再 rename，避免 crash 時留下壞掉的 state
+static int write_partial_state(const char *state_path, uint64_t total, uint64_t committed) {
+    char tmp_path[USERNAME_BUFFER_SIZE + 48];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return -1;
+    fprintf(file, "%llu %llu\n", (unsigned long long)total, (unsigned long long)committed);
+    fflush(file);
+    fdatasync(fileno(file));
+    fclose(file);
+    return rename(tmp_path, state_path);
+}
+
+// 同一個檔名同時只允許一個上傳
+static UploadName *active_uploads;
+static pthread_mutex_t active_uploads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int upload_name_acquire(const char *filename) {
+    pthread_mutex_lock(&active_uploads_lock);
+    for (UploadName *u = active_uploads; u; u = u->next) {
+        if (strcmp(u->name, filename) == 0) {
+            pthread_mutex_unlock(&active_uploads_lock);
+            return -1;
+        }
+    }
+    UploadName *u = (UploadName *)calloc(1, sizeof(UploadName));
+    strncpy(u->name, filename, USERNAME_BUFFER_SIZE - 1);
+    u->next = active_uploads;
+    active_uploads = u;
+    pthread_mutex_unlock(&active_uploads_lock);
+    return 0;
+}
+
+static void upload_name_release(const char *filename) {
+    pthread_mutex_lock(&active_uploads_lock);
+    for (UploadName **slot = &active_uploads; *slot; slot = &(*slot)->next) {
+        if (strcmp((*slot)->name, filename) == 0) {
+            UploadName *u = *slot;
+            *slot = u->next;
+            free(u);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&active_uploads_lock);
+}
+
+static void upload_wait_idle(Upload *upload) {
+    pthread_mutex_lock(&upload->lock);
+    while (upload->pending > 0) pthread_cond_wait(&upload->done, &upload->lock);
+    pthread_mutex_unlock(&upload->lock);
+}
+
+// FILE_STATUS <filename>：回傳 "size=<完整檔案大小或 -1> partial=<已上傳 bytes> total=<預期大小> mtime=<ns>"。
+// mtime 為檔案 (去重檔案為 manifest) 的修改時間，client 續傳下載前用來確認檔案沒有被換掉
+void handle_file_status(Connection *conn, const char *buffer) {
+    char filename[USERNAME_BUFFER_SIZE];
+    char filepath[USERNAME_BUFFER_SIZE + 10];
+    char part_path[USERNAME_BUFFER_SIZE + 32], state_path[USERNAME_BUFFER_SIZE + 32];
+    char reply[COMMAND_BUFFER_SIZE];
+    uint64_t total = 0, committed = 0;
+    long long size = -1;
+    int64_t mtime = 0;
+    struct stat st;
+
+    filename[0] = '\0';
+    sscanf(buffer, "FILE_STATUS %127s", filename);
+    if (!is_valid_store_name(filename)) {
+        conn_reply(conn, "Invalid filename\n");
+        return;
+    }
+    snprintf(filepath, sizeof(filepath), "./store/%s", filename);
+    if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+    } else {
+        char manifest[sizeof(DEDUP_MANIFEST_DIR) + USERNAME_BUFFER_SIZE];
+        dedup_manifest_path(filename, manifest, sizeof(manifest));
+        if (stat(manifest, &st) < 0 || (size = dedup_file_size(filename)) < 0) size = -1;
+    }
+    if (size >= 0) mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    partial_paths(filename, part_path, state_path, sizeof(part_path));
+    if (read_partial_state(state_path, &total, &committed) < 0) total = committed = 0;
+
+    snprintf(reply, sizeof(reply), "size=%lld partial=%llu total=%llu mtime=%lld\n", size,
+             (unsigned long long)committed, (unsigned long long)total, (long long)mtime);
+    conn_reply(conn, reply);
+}
+
+// SEND_FILE <filename> [offset]：client 接著送 8 bytes 檔案總大小 (big-endian)，再送 [offset, 總大小) 的內容。
+// offset > 0 時必須與 FILE_STATUS 回報的 partial 相符 (或更小)。資料先寫到 .part 檔，
+// 完整收到並 fdatasync 後才 rename 成正式檔名；中途斷線則保存已寫入的長度供續傳。
+// 最後加上 "zlib" 時，檔案總大小之後的內容改以壓縮區塊傳送 (offset 與大小仍以原始 bytes 計)。
+void handle_send_file(SSL *ssl, char *buffer) {
+    char filename[USERNAME_BUFFER_SIZE];
+    char filepath[USERNAME_BUFFER_SIZE + 10];
+    char part_path[USERNAME_BUFFER_SIZE + 32], state_path[USERNAME_BUFFER_SIZE + 32];
+    unsigned long long offset = 0;
+    uint64_t net_file_size;
+    UploadReader reader;
+
+    filename[0] = '\0';
+    upload_reader_init(&reader, ssl, zcodec_strip_option(buffer));
+    sscanf(buffer + 10, "%127s %llu", filename, &offset); // "SEND_FILE filename [offset]"
+    snprintf(filepath, sizeof(filepath), "./store/%s", filename);
+    partial_paths(filename, part_path, state_path, sizeof(part_path));
+
+    // 接收檔案大小
+    if (ssl_read_full(ssl, &net_file_size, sizeof(net_file_size)) < 0) {
+        perror("[ERROR] Failed to receive file size");
+        upload_reader_free(&reader);
+        return;
+    }
+    uint64_t file_size = ntoh64(net_file_size);
+    LOG_DEBUG("[DEBUG] Receiving file: %s, size: %llu bytes, offset: %llu\n", filename,
+           (unsigned long long)file_size, offset);
+
+    if (file_size == 0) {
+        LOG_ERROR("[ERROR] Received file size=0. Aborting upload.\n");
+        SSL_write(ssl, "File size is 0. Upload aborted\n", strlen("File size is 0. Upload aborted\n"));
+        upload_reader_free(&reader);
+        return;
+    }
+    if (offset > file_size) offset = file_size;
+    uint64_t expected = file_size - offset;
+
+    if (!is_valid_store_name(filename) || upload_name_acquire(filename) < 0) {
+        LOG_ERROR("[ERROR] Upload of '%s' rejected.\n", filename);
+        discard_upload_data(&reader, expected);
+        upload_reader_free(&reader);
+        SSL_write(ssl, "File upload failed\n", strlen("File upload failed\n"));
+        return;
+    }
+
+    int fd;
+    if (offset > 0) {
+        uint64_t total, committed;
+        if (read_partial_state(state_path, &total, &committed) < 0 || total != file_size || offset > committed) {
+            upload_name_release(filename);
+            discard_upload_data(&reader, expected);
+            upload_reader_free(&reader);
+            SSL_write(ssl, "Resume offset mismatch\n", strlen("Resume offset mismatch\n"));
+            return;
+        }
+        fd = open(part_path, O_WRONLY | O_CLOEXEC);
+    } else {
+        unlink(state_path);
+        fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        // 先配置好空間，減少邊寫邊長大的 metadata 更新與碎片
+        if (fd >= 0 && fallocate(fd, 0, 0, (off_t)file_size) < 0 && errno != EOPNOTSUPP) {
+            perror("[WARN] fallocate");
+        }
+    }
+    if (fd < 0) {
+        perror("[ERROR] Failed to open file for writing");
+        upload_name_release(filename);
+        discard_upload_data(&reader, expected);
+        upload_reader_free(&reader);
+        SSL_write(ssl, "File upload failed\n", strlen("File upload failed\n"));
+        return;
+    }
+
+    Upload upload;
+    upload.fd = fd;
+    upload.pending = 0;
+    upload.error = 0;
+    pthread_mutex_init(&upload.lock, NULL);
+    pthread_cond_init(&upload.done, NULL);
+
+    uint64_t total_received = 0;
+    uint64_t next_checkpoint = PART_CHECKPOINT_BYTES;
+    UploadBuffer *buf = NULL;
+    while (total_received < expected) {
+        if (!buf) buf = upload_buffer_acquire();
+        uint64_t remaining = expected - total_received;
+        size_t space = UPLOAD_BUFFER_SIZE - buf->len;
+        int want = remaining < space ? (int)remaining : (int)space;
+        int bytes_read = upload_reader_read(&reader, buf->data + buf->len, want);
+        if (bytes_read <= 0) break;
+        buf->len += bytes_read;
+        total_received += bytes_read;
+        if (buf->len == UPLOAD_BUFFER_SIZE || total_received == expected) {
+            upload_submit_write(&upload, buf, offset + total_received - buf->len);
+            buf = NULL;
+        }
+        if (total_received >= next_checkpoint && total_received < expected) {
+            // 定期落地續傳點，server 重啟後也能續傳
+            upload_wait_idle(&upload);
+            if (!upload.error && fdatasync(fd) == 0) {
+                write_partial_state(state_path, file_size, offset + total_received - (buf ? buf->len : 0));
+            }
+            next_checkpoint += PART_CHECKPOINT_BYTES;
+        }
+    }
+    // 斷線時已收到的部分也寫進去，續傳時不必重送
+    if (buf && buf->len > 0) upload_submit_write(&upload, buf, offset + total_received - buf->len);
+    else if (buf) upload_buffer_release(buf);
+
+    metrics_add_bytes(sizeof(net_file_size) + reader.wire_bytes, 0);
+    zstat_add_upload(&reader, total_received);
+    upload_reader_free(&reader);
+    upload_wait_idle(&upload);
+    int error = upload.error;
+    pthread_mutex_destroy(&upload.lock);
+    pthread_cond_destroy(&upload.done);
+
+    int synced = !error && fdatasync(fd) == 0;
+    close(fd);
+    if (total_received == expected && synced && rename(part_path, filepath) == 0) {
+        unlink(state_path);
+        dedup_drop_manifest(filename);
+        LOG_INFO("[UPLOAD] File '%s' uploaded successfully. Size=%llu\n", filename, (unsigned long long)file_size);
+        SSL_write(ssl, "File uploaded successfully\n", strlen("File uploaded successfully\n"));
+    } else {
+        if (synced) write_partial_state(state_path, file_size, offset + total_received);
+        LOG_INFO("[UPLOAD] File '%s' upload incomplete. Received %llu/%llu bytes\n", filename,
+               (unsigned long long)(offset + total_received), (unsigned long long)file_size);
+        SSL_write(ssl, "File upload incomplete\n", strlen("File upload incomplete\n"));
+    }
+    upload_name_release(filename);
+}
+
+// ========== 去重上傳 ==========
+
+enum {
+    DEDUP_NEED,                     // server 沒有，等 client 送資料
+    DEDUP_HAVE,                     // server 已有，已 pin 住
+    DEDUP_STORED,                   // 收到資料並存好，已 pin 住
+    DEDUP_DUPLICATE,                // 與同一批前面的 chunk 相同，不另外要資料
+};
+
+typedef struct {
+    const unsigned char *hash;
+    uint32_t index;
+} DedupSortKey;
+
+static int dedup_compare_keys(const void *a, const void *b) {
+    const DedupSortKey *x = (const DedupSortKey *)a, *y = (const DedupSortKey *)b;
+    int diff = memcmp(x->hash, y->hash, DEDUP_HASH_SIZE);
+    if (diff) return diff;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+// 決定一批 chunk 中哪些要向 client 要資料。server 已有的立即 pin 住，之後才不會被刪；
+// 同一批中重複的 chunk (例如整片的 0) 排序後相鄰，只有第一次出現的需要資料
+static void dedup_negotiate(const DedupRef *batch, uint32_t count, uint8_t *state, DedupSortKey *keys) {
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i].hash = batch[i].hash;
+        keys[i].index = i;
+    }
+    qsort(keys, count, sizeof(DedupSortKey), dedup_compare_keys);
+
+    pthread_mutex_lock(&dedup_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = keys[i].index;
+        if (i > 0 && memcmp(keys[i].hash, keys[i - 1].hash, DEDUP_HASH_SIZE) == 0) {
+            state[index] = DEDUP_DUPLICATE;
+            continue;
+        }
+        DedupChunk *c = *dedup_slot(batch[index].hash);
+        if (c) {
+            c->refs++;
+            state[index] = DEDUP_HAVE;
+        } else {
+            state[index] = DEDUP_NEED;
+        }
+    }
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+// 驗證 hash 後存成 chunk 檔並 pin 住；hash 不符或寫入失敗回傳 -1。
+// chunk 檔不逐一 fsync，由 dedup_commit 寫 manifest 前一次 syncfs
+static int dedup_store_chunk(const DedupRef *ref, const unsigned char *data) {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    if (dedup_hash(data, ref->length, hash) < 0 || memcmp(hash, ref->hash, DEDUP_HASH_SIZE) != 0) return -1;
+
+    char path[sizeof(DEDUP_CHUNK_DIR) + DEDUP_HASH_SIZE * 2 + 8];
+    char tmp_path[sizeof(path) + 32];
+    dedup_chunk_path(ref->hash, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, __atomic_add_fetch(&dedup_tmp_seq, 1, __ATOMIC_RELAXED));
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    size_t written = 0;
+    while (written < ref->length) {
+        ssize_t n = write(fd, data + written, ref->length - written);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            perror("[ERROR] Failed to write chunk");
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+
+    // rename 與放進表中在同一把鎖內完成，不會與參照降到 0 時的刪除交錯
+    DedupChunk *c = NULL;
+    pthread_mutex_lock(&dedup_lock);
+    if (written == ref->length) {
+        c = *dedup_slot(ref->hash);
+        if (!c && rename(tmp_path, path) == 0) c = dedup_insert_locked(ref->hash, ref->length);
+        if (c) c->refs++;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    unlink(tmp_path); // 另一個上傳已先存好同樣的 chunk，或寫入失敗
+    return c ? 0 : -1;
+}
+
+// 所有 chunk 落地後寫入 manifest (暫存檔 + rename)，再釋放同名舊版本的 chunk 與同名一般檔案。
+// 呼叫者持有該檔名的 upload_name_acquire，期間不會有其他上傳改動這個 manifest
+static int dedup_commit(const char *filename, const DedupRef *refs, size_t count) {
+    char path[sizeof(DEDUP_MANIFEST_DIR) + USERNAME_BUFFER_SIZE];
+    char tmp_path[sizeof(path) + 8];
+    char hex[DEDUP_HASH_SIZE * 2 + 1];
+
+    int dir_fd = open(DEDUP_CHUNK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int synced = dir_fd >= 0 && syncfs(dir_fd) == 0;
+    if (dir_fd >= 0) close(dir_fd);
+    if (!synced) return -1;
+
+    snprintf(tmp_path, sizeof(tmp_path), DEDUP_MANIFEST_DIR "/.%s.tmp", filename);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return -1;
+    for (size_t i = 0; i < count; i++) {
+        dedup_hash_hex(refs[i].hash, hex);
+        fprintf(file, "%s %u\n", hex, refs[i].length);
+    }
+    int ok = fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+
+    DedupRef *old = NULL;
+    size_t old_count = 0;
+    uint64_t old_size;
+    dedup_manifest_path(filename, path, sizeof(path));
+    if (dedup_read_manifest(path, &old, &old_count, &old_size) < 0) old = NULL;
+    if (!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        free(old);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "./store/%s", filename);
+    unlink(path);
+    if (old) {
+        dedup_unref_all(old, old_count);
+        free(old);
+    }
+    return 0;
+}
+
+// SEND_FILE_DEDUP <filename> <size> [zlib]：以 chunk hash 協商，只接收 server 沒有的 chunk (格式見 protocol.h)。
+// 全部 chunk 都 pin 住且總長度相符才寫入 manifest；失敗時放掉 pin，沒有其他檔案參照的 chunk 隨之刪除。
+// 協商 zlib 時 chunk 內容以壓縮區塊傳送 (chunk 最大與區塊相同，client 一個 chunk 送一個區塊)。
+void handle_send_file_dedup(SSL *ssl, char *buffer) {
+    char filename[USERNAME_BUFFER_SIZE];
+    unsigned long long file_size = 0;
+    UploadReader reader;
+
+    filename[0] = '\0';
+    upload_reader_init(&reader, ssl, zcodec_strip_option(buffer));
+    sscanf(buffer, "SEND_FILE_DEDUP %127s %llu", filename, &file_size);
+
+    // 拒絕時仍照常協商 (全部回答不需要)，client 才能讀到最後的結果訊息
+    int rejected = !is_valid_store_name(filename) || file_size == 0 || upload_name_acquire(filename) < 0;
+    if (rejected) LOG_ERROR("[ERROR] Deduplicated upload of '%s' rejected.\n", filename);
+    int failed = rejected, broken = 0;
+
+    unsigned char *entries = (unsigned char *)malloc(DEDUP_BATCH_CHUNKS * DEDUP_ENTRY_SIZE);
+    unsigned char *data = (unsigned char *)malloc(DEDUP_MAX_CHUNK);
+    DedupRef *batch = (DedupRef *)malloc(DEDUP_BATCH_CHUNKS * sizeof(DedupRef));
+    DedupSortKey *keys = (DedupSortKey *)malloc(DEDUP_BATCH_CHUNKS * sizeof(DedupSortKey));
+    uint8_t state[DEDUP_BATCH_CHUNKS];
+    unsigned char bitmap[(DEDUP_BATCH_CHUNKS + 7) / 8];
+    DedupRef *pins = NULL;          // 已 pin 住的 chunk，依檔案順序；成功時就是 manifest 的內容
+    size_t pin_count = 0, pin_cap = 0;
+    uint64_t total = 0, received = 0, pinned = 0;
+    unsigned long sent_chunks = 0, reused_chunks = 0;
+    if (!entries || !data || !batch || !keys) broken = 1;
+
+    while (!broken) {
+        uint32_t net_count;
+        if (ssl_read_full(ssl, &net_count, sizeof(net_count)) < 0) {
+            broken = 1;
+            break;
+        }
+        uint32_t count = ntohl(net_count);
+        if (count == 0) break;
+        // 數量或長度不合法時無法得知後面還有多少資料，只能中止
+        if (count > DEDUP_BATCH_CHUNKS || ssl_read_full(ssl, entries, count * DEDUP_ENTRY_SIZE) < 0) {
+            broken = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t net_len;
+            memcpy(batch[i].hash, entries + i * DEDUP_ENTRY_SIZE, DEDUP_HASH_SIZE);
+            memcpy(&net_len, entries + i * DEDUP_ENTRY_SIZE + DEDUP_HASH_SIZE, 4);
+            batch[i].length = ntohl(net_len);
+            if (batch[i].length == 0 || batch[i].length > DEDUP_MAX_CHUNK) broken = 1;
+            total += batch[i].length;
+            state[i] = DEDUP_NEED;
+        }
+        if (broken) break;
+
+        size_t bitmap_size = (count + 7) / 8;
+        memset(bitmap, 0, bitmap_size);
+        if (!failed) {
+            dedup_negotiate(batch, count, state, keys);
+            for (uint32_t i = 0; i < count; i++) {
+                if (state[i] == DEDUP_NEED) bitmap[i / 8] |= 1 << (i % 8);
+            }
+        }
+        if (SSL_write(ssl, bitmap, (int)bitmap_size) <= 0) broken = 1;
+
+        for (uint32_t i = 0; i < count && !broken; i++) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+            if (upload_reader_read_full(&reader, data, batch[i].length) < 0) {
+                broken = 1;
+                break;
+            }
+            received += batch[i].length;
+            if (dedup_store_chunk(&batch[i], data) == 0) {
+                state[i] = DEDUP_STORED;
+                sent_chunks++;
+            } else {
+                LOG_ERROR("[ERROR] Chunk %u of '%s' failed verification.\n", i, filename);
+                failed = 1;
+            }
+        }
+
+        // 依檔案順序記下已 pin 的 chunk；重複的 chunk 此時第一次出現的那份已存好，再 pin 一次
+        if (pin_count + count > pin_cap) {
+            pin_cap = (pin_count + count) * 2;
+            pins = (DedupRef *)realloc(pins, pin_cap * sizeof(DedupRef));
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (state[i] == DEDUP_DUPLICATE) {
+                if (!failed && !broken && dedup_pin_all(&batch[i], 1) == 0) state[i] = DEDUP_HAVE;
+                else failed = 1;
+            }
+            if (state[i] == DEDUP_HAVE) reused_chunks++;
+            if (state[i] == DEDUP_HAVE || state[i] == DEDUP_STORED) {
+                pins[pin_count++] = batch[i];
+                pinned += batch[i].length;
+            }
+        }
+    }
+    free(entries);
+    free(data);
+    free(batch);
+    free(keys);
+
+    metrics_add_bytes(reader.wire_bytes + pin_count * DEDUP_ENTRY_SIZE, 0);
+    zstat_add_upload(&reader, received);
+    upload_reader_free(&reader);
+    pthread_mutex_lock(&dedup_lock);
+    dedup_chunks_received += sent_chunks;
+    dedup_chunks_reused += reused_chunks;
+    pthread_mutex_unlock(&dedup_lock);
+
+    int complete = !broken && !failed && total == file_size && dedup_commit(filename, pins, pin_count) == 0;
+    if (!complete) dedup_unref_all(pins, pin_count);
+    free(pins);
+    if (!rejected) upload_name_release(filename);
+
+    const char *reply;
+    if (complete) {
+        LOG_INFO("[UPLOAD] File '%s' uploaded successfully. Size=%llu, chunks sent=%lu reused=%lu\n", filename,
+                 file_size, sent_chunks, reused_chunks);
+        reply = "File uploaded successfully\n";
+    } else if (failed) {
+        reply = "File upload failed\n";
+    } else {
+        LOG_INFO("[UPLOAD] Deduplicated upload of '%s' incomplete. Stored %llu/%llu bytes\n", filename,
+                 (unsigned long long)pinned, file_size);
+        reply = "File upload incomplete\n";
+    }
+    if (!broken) SSL_write(ssl, reply, strlen(reply));
+}
+
+// 把 fd 的 [offset, offset+length) 送出：有 kTLS 時以 SSL_sendfile 直接從 page cache 送，
+// 否則以大區塊 pread + SSL_write (OpenSSL 會切成最大 16 KiB 的 record)。回傳實際送出的 bytes
+uint64_t send_file_range(SSL *ssl, int fd, uint64_t offset, uint64_t length) {
+    uint64_t sent = 0;
+
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        while (sent < length) {
+            size_t chunk = length - sent < SENDFILE_CHUNK_SIZE ? length - sent : SENDFILE_CHUNK_SIZE;
+            ossl_ssize_t n = SSL_sendfile(ssl, fd, offset + sent, chunk, 0);
+            if (n <= 0) {
+                ERR_print_errors_fp(stderr);
+                break;
+            }
+            sent += n;
+        }
+        return sent;
+    }
+#endif
+
+    char *file_buffer = (char *)malloc(DOWNLOAD_BUFFER_SIZE);
+    if (!file_buffer) return 0;
+    while (sent < length) {
+        size_t chunk = length - sent < DOWNLOAD_BUFFER_SIZE ? length - sent : DOWNLOAD_BUFFER_SIZE;
+        ssize_t bytes_read = pread(fd, file_buffer, chunk, offset + sent);
+        if (bytes_read <= 0) break;
+        int written = SSL_write(ssl, file_buffer, (int)bytes_read);
+        if (written <= 0) {
+            perror("[ERROR] Failed to send file data");
+            break;
+        }
+        sent += written;
+    }
+    free(file_buffer);
+    return sent;
+}
+
+// StoreFile 版本的 send_file_range：去重檔案逐一對涉及的 chunk 檔呼叫 send_file_range (kTLS 時仍是 sendfile)
+static uint64_t store_send_range(SSL *ssl, StoreFile *sf, uint64_t offset, uint64_t length) {
+    if (sf->fd >= 0) return send_file_range(ssl, sf->fd, offset, length);
+    char path[sizeof(DEDUP_CHUNK_DIR) + DEDUP_HASH_SIZE * 2 + 8];
+    uint64_t sent = 0;
+    for (size_t i = store_find_chunk(sf, offset); sent < length && i < sf->count; i++) {
+        uint64_t skip = offset + sent - sf->offsets[i];
+        uint64_t want = sf->refs[i].length - skip;
+        if (want > length - sent) want = length - sent;
+        dedup_chunk_path(sf->refs[i].hash, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) break;
+        uint64_t n = send_file_range(ssl, fd, skip, want);
+        close(fd);
+        sent += n;
+        if (n < want) break;
+    }
+    return sent;
+}
+
+// ========== 壓縮下載 ==========
+// 協商 zlib 的下載由 compress_pool 平行讀取並壓縮各區塊，連線端只依序送出已完成的區塊，
+// 壓縮不會卡在 TLS 後面序列化。完整下載時順便把區塊流寫進 store/.zcache/<name>，
+// 之後的下載 (從區塊邊界開始到檔尾，包含續傳) 直接從快取送出，有 kTLS 時仍是 sendfile。
+// 快取檔記下來源的大小與修改時間，檔案被重新上傳後自動失效。
+// 快取隨時可以重建，所以不 fsync；總大小超過 zcache_budget 時依 LRU 刪掉最久沒被下載的快取檔。
+//
+//   [ZCacheHeader][(count + 1) 個 uint64 區塊起點 (相對檔頭)][區塊 ...]
+
+typedef struct {
+    char magic[8];
+    uint64_t size;                  // 來源檔案大小
+    int64_t mtime;                  // 來源檔案修改時間 (ns)
+    uint32_t block_size;
+    uint32_t count;                 // 區塊數
+} ZCacheHeader;
+
+typedef struct {
+    int fd;
+    uint32_t count;
+    uint64_t *offsets;              // count + 1 個
+} ZCache;
+
+typedef struct {
+    int fd;
+    char tmp_path[sizeof(ZCACHE_DIR) + 16];
+    uint64_t *offsets;
+    uint32_t count, written;
+    uint64_t pos;
+} ZCacheWriter;
+
+// 記憶體中的快取檔清單，依最近使用排序 (環狀串列，head.next 為最近使用)，另以檔名 hash table 索引
+typedef struct ZCacheEntry {
+    struct ZCacheEntry *prev, *next;
+    struct ZCacheEntry *next_by_name; // 同一個 bucket 的下一個
+    uint64_t bytes;
+    char name[USERNAME_BUFFER_SIZE];
+} ZCacheEntry;
+
+static ZCacheEntry zcache_lru = {&zcache_lru, &zcache_lru, NULL, 0, ""};
+static ZCacheEntry **zcache_buckets;
+static size_t zcache_bucket_count;
+static size_t zcache_count;
+static uint64_t zcache_bytes;
+static uint64_t zcache_budget = (uint64_t)ZCACHE_DEFAULT_MB * 1024 * 1024;
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER; // 清單與快取檔的 rename / unlink
+
+static void compress_submit(void (*fn)(void *), void *arg);
+static inline size_t hash_string(const char *str);
+
+static void zcache_path(const char *filename, char *out, size_t size) {
+    snprintf(out, size, ZCACHE_DIR "/%s", filename);
+}
+
+static uint64_t zcache_used_bytes() {
+    pthread_mutex_lock(&zcache_lock);
+    uint64_t bytes = zcache_bytes;
+    pthread_mutex_unlock(&zcache_lock);
+    return bytes;
+}
+
+static ZCacheEntry **zcache_slot_locked(const char *filename) {
+    ZCacheEntry **slot = &zcache_buckets[hash_string(filename) % zcache_bucket_count];
+    while (*slot && strcmp((*slot)->name, filename) != 0) slot = &(*slot)->next_by_name;
+    return slot;
+}
+
+static ZCacheEntry *zcache_find_locked(const char *filename) {
+    return zcache_bucket_count ? *zcache_slot_locked(filename) : NULL;
+}
+
+static void zcache_grow_locked() {
+    size_t new_count = zcache_bucket_count ? zcache_bucket_count * 2 : 256;
+    ZCacheEntry **buckets = (ZCacheEntry **)calloc(new_count, sizeof(ZCacheEntry *));
+    if (!buckets) return;
+    for (size_t i = 0; i < zcache_bucket_count; i++) {
+        ZCacheEntry *e = zcache_buckets[i];
+        while (e) {
+            ZCacheEntry *next = e->next_by_name;
+            size_t idx = hash_string(e->name) % new_count;
+            e->next_by_name = buckets[idx];
+            buckets[idx] = e;
+            e = next;
+        }
+    }
+    free(zcache_buckets);
+    zcache_buckets = buckets;
+    zcache_bucket_count = new_count;
+}
+
+static void zcache_unlink_locked(ZCacheEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    zcache_bytes -= e->bytes;
+}
+
+static void zcache_push_front_locked(ZCacheEntry *e) {
+    e->prev = &zcache_lru;
+    e->next = zcache_lru.next;
+    zcache_lru.next->prev = e;
+    zcache_lru.next = e;
+    zcache_bytes += e->bytes;
+}
+
+// 加進索引並放到 LRU 最前面；索引配置失敗回傳 -1 (由呼叫端釋放 e)
+static int zcache_insert_locked(ZCacheEntry *e) {
+    if (zcache_count >= zcache_bucket_count) zcache_grow_locked();
+    if (!zcache_bucket_count) return -1;
+    ZCacheEntry **slot = &zcache_buckets[hash_string(e->name) % zcache_bucket_count];
+    e->next_by_name = *slot;
+    *slot = e;
+    zcache_count++;
+    zcache_push_front_locked(e);
+    return 0;
+}
+
+// 從索引與 LRU 中移除並釋放
+static void zcache_remove_locked(ZCacheEntry *e) {
+    ZCacheEntry **slot = zcache_slot_locked(e->name);
+    *slot = e->next_by_name;
+    zcache_count--;
+    zcache_unlink_locked(e);
+    free(e);
+}
+
+// 超過預算時從最久沒用到的開始刪；正在送出的下載已開啟 fd，不受 unlink 影響
+static void zcache_evict_locked() {
+    char path[sizeof(ZCACHE_DIR) + USERNAME_BUFFER_SIZE];
+    while (zcache_bytes > zcache_budget && zcache_lru.prev != &zcache_lru) {
+        ZCacheEntry *e = zcache_lru.prev;
+        zcache_path(e->name, path, sizeof(path));
+        unlink(path);
+        zstat_add(&zstat_cache_evictions, 1);
+        zcache_remove_locked(e);
+    }
+}
+
+static void zcache_drop(const char *filename) {
+    char path[sizeof(ZCACHE_DIR) + sizeof(((struct dirent *)0)->d_name)];
+    if (!is_valid_store_name(filename)) return;
+    zcache_path(filename, path, sizeof(path));
+    pthread_mutex_lock(&zcache_lock);
+    ZCacheEntry *e = zcache_find_locked(filename);
+    if (e) zcache_remove_locked(e);
+    unlink(path);
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+// 快取命中：移到 LRU 最前面
+static void zcache_touch(const char *filename) {
+    pthread_mutex_lock(&zcache_lock);
+    ZCacheEntry *e = zcache_find_locked(filename);
+    if (e) {
+        zcache_unlink_locked(e);
+        zcache_push_front_locked(e);
+    }
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+static uint32_t zcache_block_count(uint64_t size) {
+    return (uint32_t)((size + ZBLOCK_SIZE - 1) / ZBLOCK_SIZE);
+}
+
+// 開啟與 sf 相符的快取；不存在或已過期回傳 -1
+static int zcache_open(const char *filename, const StoreFile *sf, ZCache *cache) {
+    char path[sizeof(ZCACHE_DIR) + USERNAME_BUFFER_SIZE];
+    ZCacheHeader header;
+    struct stat st;
+    zcache_path(filename, path, sizeof(path));
+    cache->offsets = NULL;
+    cache->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cache->fd < 0) return -1;
+
+    cache->count = zcache_block_count(sf->size);
+    size_t table = ((size_t)cache->count + 1) * sizeof(uint64_t);
+    int valid = pread(cache->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                memcmp(header.magic, ZCACHE_MAGIC, sizeof(header.magic)) == 0 && header.size == sf->size &&
+                header.mtime == sf->mtime && header.block_size == ZBLOCK_SIZE && header.count == cache->count;
+    if (valid) {
+        cache->offsets = (uint64_t *)malloc(table);
+        // 檔案長度要與最後一個區塊的結尾相符，寫到一半的檔案不會被採用
+        valid = cache->offsets && pread(cache->fd, cache->offsets, table, sizeof(header)) == (ssize_t)table &&
+                fstat(cache->fd, &st) == 0 && (uint64_t)st.st_size == cache->offsets[cache->count];
+    }
+    if (!valid) {
+        close(cache->fd);
+        free(cache->offsets);
+        cache->offsets = NULL;
+        cache->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void zcache_close(ZCache *cache) {
+    if (cache->fd >= 0) close(cache->fd);
+    free(cache->offsets);
+    cache->fd = -1;
+    cache->offsets = NULL;
+}
+
+// 從第 offset / ZBLOCK_SIZE 個區塊送到檔尾；回傳完整送出的原始 bytes，*wire 為實際送出的 bytes
+static uint64_t zcache_send(SSL *ssl, const ZCache *cache, uint64_t offset, uint64_t file_size, uint64_t *wire) {
+    uint32_t first = (uint32_t)(offset / ZBLOCK_SIZE);
+    uint64_t start = cache->offsets[first];
+    *wire = send_file_range(ssl, cache->fd, start, cache->offsets[cache->count] - start);
+    uint32_t sent_blocks = first;
+    while (sent_blocks < cache->count && cache->offsets[sent_blocks + 1] - start <= *wire) sent_blocks++;
+    uint64_t end = (uint64_t)sent_blocks * ZBLOCK_SIZE;
+    return (end < file_size ? end : file_size) - offset;
+}
+
+static int zcache_writer_begin(ZCacheWriter *w, uint64_t size) {
+    snprintf(w->tmp_path, sizeof(w->tmp_path), ZCACHE_DIR "/.tmpXXXXXX");
+    w->count = zcache_block_count(size);
+    w->written = 0;
+    w->pos = sizeof(ZCacheHeader) + ((uint64_t)w->count + 1) * sizeof(uint64_t);
+    w->offsets = (uint64_t *)malloc(((size_t)w->count + 1) * sizeof(uint64_t));
+    w->fd = w->offsets ? mkstemp(w->tmp_path) : -1;
+    if (w->fd < 0) {
+        free(w->offsets);
+        return -1;
+    }
+    return 0;
+}
+
+// 寫入失敗時放棄整個快取 (fd 設為 -1)，不影響下載本身
+static void zcache_writer_append(ZCacheWriter *w, const unsigned char *block, size_t len) {
+    if (w->fd < 0) return;
+    w->offsets[w->written++] = w->pos;
+    if (pwrite(w->fd, block, len, w->pos) != (ssize_t)len) {
+        close(w->fd);
+        unlink(w->tmp_path);
+        w->fd = -1;
+        return;
+    }
+    w->pos += len;
+}
+
+// complete 時寫入 header 並 rename 成正式的快取檔，否則丟掉暫存檔；比整個預算還大的快取也丟掉
+static void zcache_writer_finish(ZCacheWriter *w, const char *filename, const StoreFile *sf, int complete) {
+    if (w->fd >= 0) {
+        char path[sizeof(ZCACHE_DIR) + USERNAME_BUFFER_SIZE];
+        ZCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ZCACHE_MAGIC, sizeof(header.magic));
+        header.size = sf->size;
+        header.mtime = sf->mtime;
+        header.block_size = ZBLOCK_SIZE;
+        header.count = w->count;
+        w->offsets[w->count] = w->pos;
+        size_t table = ((size_t)w->count + 1) * sizeof(uint64_t);
+        int ok = complete && w->written == w->count &&
+                 pwrite(w->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 pwrite(w->fd, w->offsets, table, sizeof(header)) == (ssize_t)table && w->pos <= zcache_budget;
+        close(w->fd);
+        zcache_path(filename, path, sizeof(path));
+        ZCacheEntry *e = ok ? (ZCacheEntry *)calloc(1, sizeof(ZCacheEntry)) : NULL;
+        pthread_mutex_lock(&zcache_lock);
+        if (e && rename(w->tmp_path, path) == 0) {
+            ZCacheEntry *old = zcache_find_locked(filename);
+            if (old) zcache_remove_locked(old);
+            snprintf(e->name, sizeof(e->name), "%s", filename);
+            e->bytes = w->pos;
+            if (zcache_insert_locked(e) < 0) { // 沒有索引就無法計入預算，不留這個快取檔
+                unlink(path);
+                free(e);
+            }
+            zcache_evict_locked();
+            zstat_add(&zstat_cache_writes, 1);
+        } else {
+            unlink(w->tmp_path);
+            free(e);
+        }
+        pthread_mutex_unlock(&zcache_lock);
+    }
+    free(w->offsets);
+}
+
+typedef struct {
+    time_t atime;
+    ZCacheEntry *entry;
+} ZCacheLoad;
+
+static int zcache_compare_atime(const void *a, const void *b) {
+    const ZCacheLoad *x = (const ZCacheLoad *)a, *y = (const ZCacheLoad *)b;
+    return x->atime < y->atime ? -1 : (x->atime > y->atime);
+}
+
+// 啟動時清掉上次中斷留下的暫存檔，其餘依存取時間排進 LRU，超過預算的先刪掉
+static void zcache_init() {
+    mkdir(ZCACHE_DIR, 0700);
+    DIR *dir = opendir(ZCACHE_DIR);
+    struct dirent *entry;
+    ZCacheLoad *found = NULL;
+    size_t count = 0, cap = 0;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, ".tmp", 4) == 0) unlinkat(dirfd(dir), entry->d_name, 0);
+        struct stat st;
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= USERNAME_BUFFER_SIZE ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            ZCacheLoad *grown = (ZCacheLoad *)realloc(found, new_cap * sizeof(ZCacheLoad));
+            if (grown) {
+                found = grown;
+                cap = new_cap;
+            }
+        }
+        ZCacheEntry *e = count < cap ? (ZCacheEntry *)calloc(1, sizeof(ZCacheEntry)) : NULL;
+        if (!e) { // 記憶體不足：不在清單中的快取檔無法計入預算，直接刪掉
+            unlinkat(dirfd(dir), entry->d_name, 0);
+            continue;
+        }
+        memcpy(e->name, entry->d_name, strlen(entry->d_name) + 1); // 長度已在上面檢查過
+        e->bytes = st.st_size;
+        found[count].atime = st.st_atime;
+        found[count++].entry = e;
+    }
+    if (dir) closedir(dir);
+
+    // 由舊到新插到最前面，最近用過的排在前
+    qsort(found, count, sizeof(ZCacheLoad), zcache_compare_atime);
+    pthread_mutex_lock(&zcache_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (zcache_insert_locked(found[i].entry) < 0) { // 不在清單中的快取檔無法計入預算，直接刪掉
+            char path[sizeof(ZCACHE_DIR) + USERNAME_BUFFER_SIZE];
+            zcache_path(found[i].entry->name, path, sizeof(path));
+            unlink(path);
+            free(found[i].entry);
+        }
+    }
+    zcache_evict_locked();
+    pthread_mutex_unlock(&zcache_lock);
+    free(found);
+}
+
+// 平行壓縮：ZPIPE_DEPTH 個 slot 組成環狀佇列，每個 slot 是 compress_pool 中的一個 task
+typedef struct ZPipe ZPipe;
+
+typedef struct {
+    ZPipe *pipe;
+    uint64_t offset;
+    size_t raw_len;
+    size_t wire_len;                // 0 代表讀檔失敗
+    int done;
+    unsigned char *raw;
+    unsigned char *wire;
+} ZSlot;
+
+struct ZPipe {
+    StoreFile *sf;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    ZSlot slots[ZPIPE_DEPTH];
+};
+
+static void zpipe_task(void *arg) {
+    ZSlot *slot = (ZSlot *)arg;
+    size_t wire_len = 0;
+    if (store_pread(slot->pipe->sf, slot->raw, slot->raw_len, slot->offset) == 0) {
+        wire_len = zblock_encode(slot->raw, slot->raw_len, slot->wire);
+    }
+    pthread_mutex_lock(&slot->pipe->lock);
+    slot->wire_len = wire_len;
+    slot->done = 1;
+    pthread_cond_broadcast(&slot->pipe->ready);
+    pthread_mutex_unlock(&slot->pipe->lock);
+}
+
+// 依序送出 [offset, offset+length) 的壓縮區塊；回傳完整送出的原始 bytes，*wire 為實際送出的 bytes
+static uint64_t zpipe_send(SSL *ssl, StoreFile *sf, uint64_t offset, uint64_t length, ZCacheWriter *cache,
+                           uint64_t *wire) {
+    ZPipe pipe;
+    uint64_t blocks = (length + ZBLOCK_SIZE - 1) / ZBLOCK_SIZE;
+    uint64_t submitted = 0, next = 0, sent = 0;
+    int depth = 0;
+    *wire = 0;
+
+    pipe.sf = sf;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.ready, NULL);
+    for (; depth < ZPIPE_DEPTH && (uint64_t)depth < blocks; depth++) {
+        ZSlot *slot = &pipe.slots[depth];
+        slot->pipe = &pipe;
+        slot->raw = (unsigned char *)malloc(ZBLOCK_SIZE);
+        slot->wire = (unsigned char *)malloc(ZBLOCK_MAX_WIRE);
+        if (!slot->raw || !slot->wire) {
+            free(slot->raw);
+            free(slot->wire);
+            break;
+        }
+    }
+
+    int failed = depth == 0 && blocks > 0;
+    while (!failed && next < blocks) {
+        for (; submitted < blocks && submitted - next < (uint64_t)depth; submitted++) {
+            ZSlot *slot = &pipe.slots[submitted % depth];
+            slot->offset = offset + submitted * ZBLOCK_SIZE;
+            slot->raw_len = length - submitted * ZBLOCK_SIZE < ZBLOCK_SIZE ? length - submitted * ZBLOCK_SIZE : ZBLOCK_SIZE;
+            slot->done = 0;
+            compress_submit(zpipe_task, slot);
+        }
+        ZSlot *slot = &pipe.slots[next % depth];
+        pthread_mutex_lock(&pipe.lock);
+        while (!slot->done) pthread_cond_wait(&pipe.ready, &pipe.lock);
+        pthread_mutex_unlock(&pipe.lock);
+        if (slot->wire_len == 0 || SSL_write(ssl, slot->wire, (int)slot->wire_len) <= 0) break; // 檔案被截短或對方斷線
+        if (cache) zcache_writer_append(cache, slot->wire, slot->wire_len);
+        *wire += slot->wire_len;
+        sent += slot->raw_len;
+        next++;
+    }
+
+    // 還在 compress_pool 中的 task 會寫入 slot，全部完成後才能釋放
+    uint64_t sent_blocks = next;
+    pthread_mutex_lock(&pipe.lock);
+    for (; next < submitted; next++) {
+        while (!pipe.slots[next % depth].done) pthread_cond_wait(&pipe.ready, &pipe.lock);
+    }
+    pthread_mutex_unlock(&pipe.lock);
+    for (int i = 0; i < depth; i++) {
+        free(pipe.slots[i].raw);
+        free(pipe.slots[i].wire);
+    }
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.ready);
+    zstat_add(&zstat_blocks_out, (unsigned long)sent_blocks);
+    zstat_add_bytes(sent, *wire);
+    return sent;
+}
+
+// 決定這次下載是否真的壓縮：已壓縮格式的副檔名或樣本壓不小就改送原始資料
+static int zcodec_choose(StoreFile *sf, const char *filename, uint64_t offset, uint64_t length) {
+    if (length == 0 || zcodec_skip_name(filename)) return ZCODEC_NONE;
+    size_t sample_len = length < ZCODEC_SAMPLE_SIZE ? length : ZCODEC_SAMPLE_SIZE;
+    unsigned char *sample = (unsigned char *)malloc(sample_len + ZBLOCK_HEADER_SIZE + ZCODEC_SAMPLE_SIZE);
+    int codec = ZCODEC_NONE;
+    if (sample && store_pread(sf, sample, sample_len, offset) == 0 &&
+        zcodec_worth(sample, sample_len, sample + sample_len)) {
+        codec = ZCODEC_ZLIB;
+    }
+    free(sample);
+    return codec;
+}
+
+// RECEIVE_FILE 的開頭：8 bytes 區段長度 (big-endian)；client 要求壓縮時再接 1 byte 實際採用的 codec
+static void send_receive_header(SSL *ssl, uint64_t length, int requested, int codec) {
+    unsigned char header[9];
+    uint64_t net_length = hton64(length);
+    memcpy(header, &net_length, 8);
+    header[8] = (unsigned char)codec;
+    SSL_write(ssl, header, requested ? 9 : 8);
+}
+
+// RECEIVE_FILE <filename> [offset [length]] [zlib]：回傳區段長度 + 該區段內容 + 一行結果訊息。
+// 省略 offset / length 即為整個檔案；length 超過檔尾時截到檔尾。
+// 要求 zlib 且內容值得壓縮時，內容改為壓縮區塊流 (見 protocol.h)，能用快取時直接送快取。
+void handle_receive_file(SSL *ssl, char *buffer) {
+    char filename[USERNAME_BUFFER_SIZE];
+    unsigned long long offset = 0, length = 0;
+    StoreFile sf;
+
+    filename[0] = '\0';
+    int requested = zcodec_strip_option(buffer) == ZCODEC_ZLIB;
+    int fields = sscanf(buffer + 13, "%127s %llu %llu", filename, &offset, &length); // "RECEIVE_FILE filename ..."
+
+    if (store_open(filename, &sf) < 0) {
+        LOG_ERROR("[ERROR] File '%s' not found in 'store' directory.\n", filename);
+        send_receive_header(ssl, 0, requested, ZCODEC_NONE);
+        SSL_write(ssl, "File not found\n", strlen("File not found\n"));
+        return;
+    }
+
+    uint64_t file_size = sf.size;
+    if (offset > file_size) {
+        store_close(&sf);
+        send_receive_header(ssl, 0, requested, ZCODEC_NONE);
+        SSL_write(ssl, "Invalid range\n", strlen("Invalid range\n"));
+        return;
+    }
+    if (fields < 3 || length > file_size - offset) length = file_size - offset;
+
+    // 快取只涵蓋從區塊邊界到檔尾的範圍 (一般下載與續傳)；其他情況即時壓縮
+    ZCache cache;
+    cache.fd = -1;
+    cache.offsets = NULL;
+    int codec = ZCODEC_NONE;
+    if (requested) {
+        if (length > 0 && offset % ZBLOCK_SIZE == 0 && offset + length == file_size &&
+            zcache_open(filename, &sf, &cache) == 0) {
+            codec = ZCODEC_ZLIB;
+        } else {
+            codec = zcodec_choose(&sf, filename, offset, length);
+            if (codec == ZCODEC_NONE) zstat_add(&zstat_skipped, 1);
+        }
+    }
+
+    if (sf.fd >= 0) posix_fadvise(sf.fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    send_receive_header(ssl, length, requested, codec);
+    LOG_DEBUG("[DEBUG] Sending file: %s, range: %llu+%llu of %llu bytes (%s%s)\n", filename, offset, length,
+           (unsigned long long)file_size,
+           BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "kTLS sendfile" : "userspace TLS",
+           cache.fd >= 0 ? ", zlib cache" : codec == ZCODEC_ZLIB ? ", zlib" : "");
+
+    uint64_t total_sent, wire;
+    if (cache.fd >= 0) {
+        total_sent = zcache_send(ssl, &cache, offset, file_size, &wire);
+        zcache_close(&cache);
+        zcache_touch(filename);
+        zstat_add(&zstat_cache_hits, 1);
+        zstat_add_bytes(total_sent, wire);
+    } else if (codec == ZCODEC_ZLIB) {
+        // 完整下載時順便建立快取，之後的下載不必再壓縮
+        ZCacheWriter writer;
+        int caching = offset == 0 && length == file_size && zcache_writer_begin(&writer, file_size) == 0;
+        total_sent = zpipe_send(ssl, &sf, offset, length, caching ? &writer : NULL, &wire);
+        if (caching) zcache_writer_finish(&writer, filename, &sf, total_sent == length);
+    } else {
+        total_sent = wire = store_send_range(ssl, &sf, offset, length);
+    }
+    store_close(&sf);
+    metrics_add_bytes(0, wire);
+
+    if (total_sent == length) {
+        LOG_INFO("[DOWNLOAD] File '%s' downloaded successfully. Size=%llu, sent=%llu\n", filename,
+               (unsigned long long)total_sent, (unsigned long long)wire);
+        SSL_write(ssl, "File download complete\n", strlen("File download complete\n"));
+    } else {
+        LOG_INFO("[DOWNLOAD] File '%s' download incomplete. Sent=%llu/%llu\n", filename,
+               (unsigned long long)total_sent, length);
+        SSL_write(ssl, "File download incomplete\n", strlen("File download incomplete\n"));
+    }
+}
+
+// RECEIVE_CHUNKS <filename> <offset> <length> [chunk_size]：分段平行下載用。
+// 回傳 8 bytes 區段長度，之後每個 chunk 為 [4 bytes 長度][4 bytes CRC32C][資料]，最後一行結果訊息。
+// 要算 checksum 就必須把資料讀進 user space，因此這裡不走 sendfile；header 與資料合成一次 SSL_write。
+void handle_receive_chunks(SSL *ssl, char *buffer) {
+    char filename[USERNAME_BUFFER_SIZE];
+    unsigned long long offset = 0, length = 0, chunk_size = DEFAULT_STRIPE_CHUNK_SIZE;
+    uint64_t net_length = 0;
+    StoreFile sf;
+
+    filename[0] = '\0';
+    int fields = sscanf(buffer + 14, "%127s %llu %llu %llu", filename, &offset, &length, &chunk_size); // "RECEIVE_CHUNKS ..."
+    if (chunk_size == 0 || chunk_size > MAX_STRIPE_CHUNK_SIZE) chunk_size = DEFAULT_STRIPE_CHUNK_SIZE;
+
+    int opened = fields >= 3 && store_open(filename, &sf) == 0;
+    if (!opened || offset > sf.size) {
+        LOG_ERROR("[ERROR] Invalid chunked download request: %s\n", filename);
+        if (opened) store_close(&sf);
+        SSL_write(ssl, &net_length, sizeof(net_length));
+        SSL_write(ssl, "Invalid range\n", strlen("Invalid range\n"));
+        return;
+    }
+    if (length > sf.size - offset) length = sf.size - offset;
+
+    unsigned char *chunk_buffer = (unsigned char *)malloc(CHUNK_HEADER_SIZE + chunk_size);
+    if (!chunk_buffer) {
+        store_close(&sf);
+        SSL_write(ssl, &net_length, sizeof(net_length));
+        SSL_write(ssl, "Server busy\n", strlen("Server busy\n"));
+        return;
+    }
+
+    if (sf.fd >= 0) posix_fadvise(sf.fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    net_length = hton64(length);
+    SSL_write(ssl, &net_length, sizeof(net_length));
+    LOG_DEBUG("[DEBUG] Sending chunks: %s, range: %llu+%llu, chunk=%llu\n", filename, offset, length, chunk_size);
+
+    uint64_t sent = 0;
+    while (sent < length) {
+        size_t want = length - sent < chunk_size ? length - sent : chunk_size;
+        if (store_pread(&sf, chunk_buffer + CHUNK_HEADER_SIZE, want, offset + sent) < 0) break; // 檔案在傳輸中被截短
+        uint32_t net_len = htonl((uint32_t)want);
+        uint32_t net_crc = htonl(crc32c(chunk_buffer + CHUNK_HEADER_SIZE, want));
+        memcpy(chunk_buffer, &net_len, 4);
+        memcpy(chunk_buffer + 4, &net_crc, 4);
+        if (SSL_write(ssl, chunk_buffer, (int)(CHUNK_HEADER_SIZE + want)) <= 0) {
+            perror("[ERROR] Failed to send chunk");
+            break;
+        }
+        sent += want;
+    }
+    free(chunk_buffer);
+    store_close(&sf);
+    metrics_add_bytes(0, sent + (sent + chunk_size - 1) / chunk_size * CHUNK_HEADER_SIZE);
+
+    if (sent == length) {
+        SSL_write(ssl, "File download complete\n", strlen("File download complete\n"));
+    } else {
+        LOG_INFO("[DOWNLOAD] Chunked download of '%s' incomplete. Sent=%llu/%llu\n", filename,
+               (unsigned long long)sent, length);
+        SSL_write(ssl, "File download incomplete\n", strlen("File download incomplete\n"));
+    }
+}
+
+// ========== SSL 初始化及配置 ==========
+
+SSL_CTX *create_context() {
+    const SSL_METHOD *method = TLS_server_method();
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (!ctx) {
+        perror("Unable to create SSL context");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    return ctx;
+}
+
+static int ktls_enabled = 1;
+static int early_data_enabled = 1;
+static const unsigned char session_id_context[] = "SocketProgrammingProject";
+
+void configure_context(SSL_CTX *ctx) {
+    if (SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    // non-blocking 寫入允許部分完成、緩衝區可搬移；閒置連線釋放 TLS 緩衝以節省記憶體
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    // session 重用：TLS 1.2 以 session id 查 server 端 cache，TLS 1.3 以 ticket 恢復。
+    // cache 由 OpenSSL 內部加鎖，所有 worker 執行緒共用同一個 SSL_CTX 即共用 cache。
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SSL_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(ctx, SSL_TICKETS_PER_HANDSHAKE);
+    SSL_CTX_set1_groups_list(ctx, "X25519:P-256");
+    // 0-RTT：開啟 anti-replay (預設) 時 OpenSSL 會把 ticket 記在 cache 中限制只能用一次
+    if (early_data_enabled) {
+        SSL_CTX_set_max_early_data(ctx, EARLY_DATA_MAX);
+        SSL_CTX_set_recv_max_early_data(ctx, EARLY_DATA_MAX);
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    // kernel 支援時由 kernel 加密 (kTLS)，下載可用 SSL_sendfile 零複製；不支援時 OpenSSL 自動退回 userspace
+    if (ktls_enabled) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+// ========== 輔助函式 ==========
+
+// FNV-1a，供各個 hash table 使用
+static inline size_t hash_string(const char *str) {
+    size_t h = 14695981039346656037ULL;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 64-bit 整數的 mix (splitmix64 的最後一步)
+static inline size_t hash_u64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void log_user_login(const char *username) {
+    time_t now = time(NULL);
+    char timestamp[32];
+    ctime_r(&now, timestamp); // 多個 worker 同時登入，不能用共用緩衝的 ctime()
+    timestamp[strcspn(timestamp, "\n")] = 0;
+    LOG_INFO("[LOGIN] User '%s' logged in at %s\n", username, timestamp);
+}
+
+// ========== 客戶端管理 ==========
+// 線上使用者以兩個索引管理：username -> Session 與 connection id -> Session，
+// 各自分片加鎖，沒有人數上限。ONLINE 使用依版本號快取的排序快照。
+
+static SessionShard *session_name_shard(const char *username) {
+    return &session_by_name[hash_string(username) % SESSION_SHARDS];
+}
+
+static SessionShard *session_id_shard(uint64_t conn_id) {
+    return &session_by_id[conn_id % SESSION_SHARDS];
+}
+
+static Session **session_name_slot(SessionShard *shard, const char *username) {
+    Session **slot = &shard->buckets[hash_string(username) / SESSION_SHARDS % shard->bucket_count];
+    while (*slot && strcmp((*slot)->username, username) != 0) slot = &(*slot)->next_by_name;
+    return slot;
+}
+
+static Session **session_id_slot(SessionShard *shard, uint64_t conn_id) {
+    Session **slot = &shard->buckets[conn_id / SESSION_SHARDS % shard->bucket_count];
+    while (*slot && (*slot)->conn_id != conn_id) slot = &(*slot)->next_by_id;
+    return slot;
+}
+
+static void session_shard_grow(SessionShard *shard, int by_name) {
+    size_t new_count = shard->bucket_count ? shard->bucket_count * 2 : 16;
+    Session **buckets = (Session **)calloc(new_count, sizeof(Session *));
+    if (!buckets) return;
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        Session *sess = shard->buckets[i];
+        while (sess) {
+            Session *next;
+            size_t idx;
+            if (by_name) {
+                next = sess->next_by_name;
+                idx = hash_string(sess->username) / SESSION_SHARDS % new_count;
+                sess->next_by_name = buckets[idx];
+            } else {
+                next = sess->next_by_id;
+                idx = sess->conn_id / SESSION_SHARDS % new_count;
+                sess->next_by_id = buckets[idx];
+            }
+            buckets[idx] = sess;
+            sess = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = new_count;
+}
+
+void session_registry_init() {
+    for (int i = 0; i < SESSION_SHARDS; i++) {
+        pthread_mutex_init(&session_by_name[i].lock, NULL);
+        pthread_mutex_init(&session_by_id[i].lock, NULL);
+        session_shard_grow(&session_by_name[i], 1);
+        session_shard_grow(&session_by_id[i], 0);
+    }
+}
+
+int is_user_online(const char *username) {
+    SessionShard *shard = session_name_shard(username);
+    pthread_mutex_lock(&shard->lock);
+    int online = *session_name_slot(shard, username) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return online;
+}
+
+// 檢查與加入在同一把鎖內完成；已登入回傳 -1
+int add_client(const char *username, Connection *conn) {
+    SessionShard *name_shard = session_name_shard(username);
+
+    pthread_mutex_lock(&name_shard->lock);
+    Session **slot = session_name_slot(name_shard, username);
+    if (*slot) {
+        pthread_mutex_unlock(&name_shard->lock);
+        return -1;
+    }
+    Session *sess = (Session *)calloc(1, sizeof(Session));
+    if (!sess) {
+        pthread_mutex_unlock(&name_shard->lock);
+        return -1;
+    }
+    strncpy(sess->username, username, USERNAME_BUFFER_SIZE - 1);
+    sess->conn = conn;
+    sess->conn_id = conn->id;
+    *slot = sess;
+    if (++name_shard->count > name_shard->bucket_count) session_shard_grow(name_shard, 1);
+
+    SessionShard *id_shard = session_id_shard(conn->id);
+    pthread_mutex_lock(&id_shard->lock);
+    Session **id_slot = session_id_slot(id_shard, conn->id);
+    sess->next_by_id = *id_slot;
+    *id_slot = sess;
+    if (++id_shard->count > id_shard->bucket_count) session_shard_grow(id_shard, 0);
+    pthread_mutex_unlock(&id_shard->lock);
+    pthread_mutex_unlock(&name_shard->lock);
+
+    __atomic_fetch_add(&online_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&online_version, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void remove_client(Connection *conn) {
+    SessionShard *id_shard = session_id_shard(conn->id);
+    char username[USERNAME_BUFFER_SIZE];
+
+    pthread_mutex_lock(&id_shard->lock);
+    Session **id_slot = session_id_slot(id_shard, conn->id);
+    if (!*id_slot) {
+        pthread_mutex_unlock(&id_shard->lock);
+        return;
+    }
+    strcpy(username, (*id_slot)->username);
+    pthread_mutex_unlock(&id_shard->lock);
+
+    // 鎖順序與 add_client 相同：先 name 再 id
+    SessionShard *name_shard = session_name_shard(username);
+    pthread_mutex_lock(&name_shard->lock);
+    Session **slot = session_name_slot(name_shard, username);
+    Session *sess = *slot;
+    if (!sess || sess->conn_id != conn->id) {
+        pthread_mutex_unlock(&name_shard->lock);
+        return;
+    }
+    *slot = sess->next_by_name;
+    name_shard->count--;
+
+    pthread_mutex_lock(&id_shard->lock);
+    id_slot = session_id_slot(id_shard, conn->id);
+    *id_slot = sess->next_by_id;
+    id_shard->count--;
+    pthread_mutex_unlock(&id_shard->lock);
+    pthread_mutex_unlock(&name_shard->lock);
+
+    // 推播連線留給 client 自行關閉，之後不再收到新訊息
+    if (sess->push_conn) __atomic_fetch_sub(&push_subscribers, 1, __ATOMIC_RELAXED);
+    free(sess);
+    __atomic_fetch_sub(&online_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&online_version, 1, __ATOMIC_RELEASE);
+}
+
+// 回傳對方連線的 id，不在線上回傳 0
+uint64_t find_client(const char *username) {
+    SessionShard *shard = session_name_shard(username);
+    pthread_mutex_lock(&shard->lock);
+    Session *sess = *session_name_slot(shard, username);
+    uint64_t conn_id = sess ? sess->conn_id : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return conn_id;
+}
+
+// SUBSCRIBE：conn 成為 username 目前 session 的推播連線；該使用者不在線上回傳 -1。
+// 舊的推播連線 (client 已改用新的) 標記為被取代並喚醒，由它自己的 worker 停止取訊息並關閉
+int session_attach_push(const char *username, Connection *conn) {
+    SessionShard *shard = session_name_shard(username);
+    pthread_mutex_lock(&shard->lock);
+    Session *sess = *session_name_slot(shard, username);
+    if (!sess) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    Connection *old = sess->push_conn;
+    if (old) {
+        pthread_mutex_lock(&old->arm_lock);
+        old->push_replaced = 1;
+        pthread_mutex_unlock(&old->arm_lock);
+        conn_push_notify(old);
+    } else {
+        __atomic_fetch_add(&push_subscribers, 1, __ATOMIC_RELAXED);
+    }
+    sess->push_conn = conn;
+    strncpy(conn->push_user, username, USERNAME_BUFFER_SIZE - 1);
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// 推播連線關閉前呼叫；持有 shard 鎖期間其他執行緒才能安全地使用 sess->push_conn
+void session_detach_push(Connection *conn) {
+    SessionShard *shard = session_name_shard(conn->push_user);
+    pthread_mutex_lock(&shard->lock);
+    Session *sess = *session_name_slot(shard, conn->push_user);
+    if (sess && sess->push_conn == conn) {
+        sess->push_conn = NULL;
+        __atomic_fetch_sub(&push_subscribers, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// 訊息存入 username 的收件匣後呼叫：有推播連線就喚醒它，由該連線自己的 worker 取出訊息寫入，
+// 因此推播與它的其他回覆依序送出，不會插進某個回覆中間
+void session_push(const char *username) {
+    SessionShard *shard = session_name_shard(username);
+    pthread_mutex_lock(&shard->lock);
+    Session *sess = *session_name_slot(shard, username);
+    if (sess && sess->push_conn) conn_push_notify(sess->push_conn);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+void online_snapshot_release(OnlineSnapshot *snap) {
+    if (snap && __atomic_sub_fetch(&snap->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(snap->names);
+        free(snap->blob);
+        free(snap);
+    }
+}
+
+// 取得目前的線上名單快照 (呼叫者需 online_snapshot_release)；只有在成員異動後才重建
+OnlineSnapshot *online_snapshot_get() {
+    pthread_mutex_lock(&online_snapshot_mutex);
+    unsigned long version = __atomic_load_n(&online_version, __ATOMIC_ACQUIRE);
+    if (!online_snapshot || online_snapshot->version != version) {
+        size_t cap = __atomic_load_n(&online_count, __ATOMIC_RELAXED) + 16;
+        OnlineSnapshot *snap = (OnlineSnapshot *)calloc(1, sizeof(OnlineSnapshot));
+        snap->blob = (char *)malloc(cap * USERNAME_BUFFER_SIZE);
+        snap->names = (char **)malloc(cap * sizeof(char *));
+        snap->version = version;
+        snap->refcnt = 1;
+
+        size_t used = 0;
+        for (int i = 0; i < SESSION_SHARDS; i++) {
+            SessionShard *shard = &session_by_name[i];
+            pthread_mutex_lock(&shard->lock);
+            for (size_t b = 0; b < shard->bucket_count; b++) {
+                for (Session *sess = shard->buckets[b]; sess; sess = sess->next_by_name) {
+                    if (snap->count == cap) break; // 重建期間又有人登入，下次再補上
+                    size_t len = strlen(sess->username) + 1;
+                    memcpy(snap->blob + used, sess->username, len);
+                    snap->names[snap->count++] = (char *)(uintptr_t)used;
+                    used += len;
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+        for (size_t i = 0; i < snap->count; i++) {
+            snap->names[i] = snap->blob + (uintptr_t)snap->names[i];
+        }
+        qsort(snap->names, snap->count, sizeof(char *), compare_names);
+
+        online_snapshot_release(online_snapshot);
+        online_snapshot = snap;
+    }
+    OnlineSnapshot *snap = online_snapshot;
+    __atomic_fetch_add(&snap->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&online_snapshot_mutex);
+    return snap;
+}
+
+// ONLINE [offset] [limit]：回傳一頁 (不含自己)，還有下一頁時最後一行為 "[more] next=<offset> total=<n>"
+void handle_online(Connection *conn, const char *buffer) {
+    long offset = 0, limit = ONLINE_PAGE_DEFAULT;
+    sscanf(buffer, "ONLINE %ld %ld", &offset, &limit);
+    if (offset < 0) offset = 0;
+    if (limit <= 0 || limit > ONLINE_PAGE_MAX) limit = ONLINE_PAGE_MAX;
+
+    OnlineSnapshot *snap = online_snapshot_get();
+    char *reply = (char *)malloc(ONLINE_REPLY_MAX);
+    size_t used = 0;
+    size_t i = offset;
+    long listed = 0;
+
+    reply[0] = '\0';
+    for (; i < snap->count && listed < limit; i++) {
+        if (strcmp(snap->names[i], conn->username) == 0) continue;
+        size_t len = strlen(snap->names[i]);
+        if (used + len + 1 + ONLINE_FOOTER_RESERVE > ONLINE_REPLY_MAX) break;
+        memcpy(reply + used, snap->names[i], len);
+        reply[used + len] = '\n';
+        used += len + 1;
+        listed++;
+    }
+    if (i < snap->count) {
+        used += snprintf(reply + used, ONLINE_REPLY_MAX - used, "[more] next=%zu total=%zu\n", i, snap->count);
+    } else {
+        reply[used] = '\0';
+    }
+    if (used == 0) {
+        strcpy(reply, offset == 0 ? "No other users online.\n" : "No more users.\n");
+    }
+    online_snapshot_release(snap);
+
+    conn_reply(conn, reply);
+    free(reply);
+}
+
+// ========== 離線訊息 log ==========
+// 離線訊息的 write-ahead log：./msglog/ 下固定 64 MiB 的 segment，以 LSN (整份 log 的 byte 位置) 命名並 mmap。
+// SEND 只把 record 複製進 mapping，回覆送出前才等 flusher 的 msync；同一段時間內所有連線的 record
+// 共用一次 msync (group commit)。RETRIEVE 只追加 ACK record，不回頭改舊資料。
+// checkpoint 定期記下所有未讀訊息的 LSN，啟動時依它直接讀回未讀訊息，再重播 checkpoint 之後的部分，
+// 不必掃描整份歷史；checkpoint 之前且沒有未讀訊息的 segment 就可以刪除。
+
+// record：[u32 payload 長度][u32 CRC32C][payload]，整筆對齊 8 bytes；長度為 0 代表這個 segment 之後沒有資料
+// MESSAGE：[u8 type][u64 id][u8 收件者長度][u8 寄件者長度][u16 內容長度][收件者][寄件者][內容]
+// ACK：    [u8 type][u64 id][u8 收件者長度][收件者]，表示該收件者 id 以前 (含) 的訊息都已取走
+// BODY：   [u8 type][u8 寄件者長度][u16 內容長度][寄件者][內容]，群發的內容只寫一次
+// REF：    [u8 type][u64 id][u8 收件者長度][u64 BODY 的 LSN][收件者]，群發給每位收件者的一則訊息
+enum { MSGLOG_MESSAGE = 1, MSGLOG_ACK = 2, MSGLOG_BODY = 3, MSGLOG_REF = 4 };
+
+#define MSGLOG_HEADER_SIZE 8
+#define MSGLOG_RECORD_MAX (13 + USERNAME_BUFFER_SIZE * 2 + COMMAND_BUFFER_SIZE)
+#define MSGLOG_ALIGN(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+typedef struct {
+    uint64_t base;                  // 第一個 byte 的 LSN，為 MSGLOG_SEGMENT_SIZE 的倍數
+    int fd;
+    unsigned char *map;             // NULL 代表這段 segment 不存在
+} MsgLogSegment;
+
+typedef struct {
+    uint8_t type;
+    uint64_t id;
+    uint64_t body_lsn;              // REF 指向的 BODY
+    const char *receiver, *sender, *text;
+    size_t receiver_len, sender_len, text_len;
+    uint64_t size;                  // 含 header 與對齊的整筆長度
+} MsgLogRecord;
+
+typedef struct {
+    char magic[8];
+    uint64_t replay_lsn;            // 重播起點
+    uint64_t next_id;
+    uint64_t count;                 // 之後接 count 個 u64 LSN，最後是整個檔案的 u32 CRC32C
+} MsgLogCheckpointHeader;
+
+static pthread_mutex_t msglog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t msglog_wake = PTHREAD_COND_INITIALIZER;            // 叫醒 flusher
+static pthread_cond_t msglog_flushed = PTHREAD_COND_INITIALIZER;         // flusher 完成一次 msync 或備好 segment
+static pthread_cond_t msglog_checkpoint_wake = PTHREAD_COND_INITIALIZER;
+static MsgLogSegment *msglog_segments;  // 依 base 連續排列，最後一個是寫入中的 segment
+static size_t msglog_segment_count, msglog_segment_cap;
+static MsgLogSegment msglog_spare = {0, -1, NULL}; // flusher 預先建立好的下一個 segment
+static int msglog_spare_failed;         // 無法建立新 segment (通常是磁碟已滿)
+static uint64_t msglog_append_lsn;      // 下一筆 record 的位置
+static uint64_t msglog_durable_lsn;     // 此位置以前都已寫入磁碟
+static uint64_t msglog_checkpoint_lsn;  // 最近一次 checkpoint 的重播起點
+static uint64_t msglog_next_id = 1;
+static int msglog_waiters;
+static int msglog_failed;               // msync 失敗過：之後不再接受新 record，也不再宣稱任何位置已落地
+static uint64_t msglog_records, msglog_syncs, msglog_checkpoints, msglog_relocated;
+
+// 不佔住執行緒的等待者：落地後由 flusher 呼叫 done(arg, 1)，log 無法落地時呼叫 done(arg, 0)
+typedef struct MsgLogDeferred {
+    struct MsgLogDeferred *next;
+    uint64_t lsn;
+    void (*done)(void *, int);
+    void *arg;
+} MsgLogDeferred;
+static MsgLogDeferred *msglog_deferred;
+
+static void msglog_segment_path(uint64_t base, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.log", MSGLOG_DIR, (unsigned long long)base);
+}
+
+// create 時預先配置整個檔案：之後經由 mmap 寫入，磁碟滿了只會收到 SIGBUS，必須在這裡就失敗
+static int msglog_segment_open(MsgLogSegment *seg, uint64_t base, int create) {
+    char path[64];
+    msglog_segment_path(base, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    int ok = create ? posix_fallocate(fd, 0, MSGLOG_SEGMENT_SIZE) == 0
+                    : fstat(fd, &st) == 0 && (uint64_t)st.st_size == MSGLOG_SEGMENT_SIZE;
+    void *map = ok ? mmap(NULL, MSGLOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(fd);
+        if (create) unlink(path);
+        return -1;
+    }
+    if (create) {
+        // 目錄項目也要落地，否則當機後整個 segment 可能不見
+        int dir_fd = open(MSGLOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    seg->base = base;
+    seg->fd = fd;
+    seg->map = (unsigned char *)map;
+    return 0;
+}
+
+static void msglog_segment_close(MsgLogSegment *seg, int remove) {
+    if (seg->map) {
+        munmap(seg->map, MSGLOG_SEGMENT_SIZE);
+        close(seg->fd);
+    }
+    if (remove) {
+        char path[64];
+        msglog_segment_path(seg->base, path, sizeof(path));
+        unlink(path);
+    }
+    seg->map = NULL;
+    seg->fd = -1;
+}
+
+static int msglog_push_segment(const MsgLogSegment *seg) {
+    if (msglog_segment_count == msglog_segment_cap) {
+        size_t cap = msglog_segment_cap ? msglog_segment_cap * 2 : 16;
+        MsgLogSegment *p = (MsgLogSegment *)realloc(msglog_segments, cap * sizeof(MsgLogSegment));
+        if (!p) return -1;
+        msglog_segments = p;
+        msglog_segment_cap = cap;
+    }
+    msglog_segments[msglog_segment_count++] = *seg;
+    return 0;
+}
+
+// 呼叫時持有 msglog_lock (或仍在單執行緒的啟動階段)
+static MsgLogSegment *msglog_segment_for(uint64_t lsn) {
+    if (msglog_segment_count == 0 || lsn < msglog_segments[0].base) return NULL;
+    size_t i = (lsn - msglog_segments[0].base) / MSGLOG_SEGMENT_SIZE;
+    if (i >= msglog_segment_count || !msglog_segments[i].map) return NULL;
+    return &msglog_segments[i];
+}
+
+static size_t msglog_encode_message(unsigned char *out, uint64_t id, const char *receiver,
+                                    const char *sender, const char *text) {
+    size_t receiver_len = strlen(receiver), sender_len = strlen(sender);
+    uint16_t text_len = (uint16_t)strlen(text);
+    out[0] = MSGLOG_MESSAGE;
+    memcpy(out + 1, &id, 8);
+    out[9] = (unsigned char)receiver_len;
+    out[10] = (unsigned char)sender_len;
+    memcpy(out + 11, &text_len, 2);
+    memcpy(out + 13, receiver, receiver_len);
+    memcpy(out + 13 + receiver_len, sender, sender_len);
+    memcpy(out + 13 + receiver_len + sender_len, text, text_len);
+    return 13 + receiver_len + sender_len + text_len;
+}
+
+static size_t msglog_encode_body(unsigned char *out, const char *sender, const char *text) {
+    size_t sender_len = strlen(sender);
+    uint16_t text_len = (uint16_t)strlen(text);
+    out[0] = MSGLOG_BODY;
+    out[1] = (unsigned char)sender_len;
+    memcpy(out + 2, &text_len, 2);
+    memcpy(out + 4, sender, sender_len);
+    memcpy(out + 4 + sender_len, text, text_len);
+    return 4 + sender_len + text_len;
+}
+
+static size_t msglog_encode_ref(unsigned char *out, uint64_t id, const char *receiver, uint64_t body_lsn) {
+    size_t receiver_len = strlen(receiver);
+    out[0] = MSGLOG_REF;
+    memcpy(out + 1, &id, 8);
+    out[9] = (unsigned char)receiver_len;
+    memcpy(out + 10, &body_lsn, 8);
+    memcpy(out + 18, receiver, receiver_len);
+    return 18 + receiver_len;
+}
+
+static size_t msglog_encode_ack(unsigned char *out, uint64_t id, const char *receiver) {
+    size_t receiver_len = strlen(receiver);
+    out[0] = MSGLOG_ACK;
+    memcpy(out + 1, &id, 8);
+    out[9] = (unsigned char)receiver_len;
+    memcpy(out + 10, receiver, receiver_len);
+    return 10 + receiver_len;
+}
+
+// 解析 lsn 處的 record；沒有資料、寫到一半或 CRC 不符都回傳 -1
+static int msglog_parse(uint64_t lsn, MsgLogRecord *rec) {
+    MsgLogSegment *seg = msglog_segment_for(lsn);
+    if (!seg) return -1;
+    uint64_t offset = lsn - seg->base;
+    if (offset + MSGLOG_HEADER_SIZE > MSGLOG_SEGMENT_SIZE) return -1;
+
+    uint32_t len, crc;
+    memcpy(&len, seg->map + offset, 4);
+    memcpy(&crc, seg->map + offset + 4, 4);
+    if (len < 4 || len > MSGLOG_RECORD_MAX || offset + MSGLOG_HEADER_SIZE + len > MSGLOG_SEGMENT_SIZE) return -1;
+    const unsigned char *p = seg->map + offset + MSGLOG_HEADER_SIZE;
+    if (crc32c(p, len) != crc) return -1;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->type = p[0];
+    rec->size = MSGLOG_ALIGN(MSGLOG_HEADER_SIZE + len);
+    if (rec->type == MSGLOG_BODY) {
+        uint16_t text_len;
+        memcpy(&text_len, p + 2, 2);
+        rec->sender_len = p[1];
+        rec->text_len = text_len;
+        rec->sender = (const char *)p + 4;
+        rec->text = rec->sender + rec->sender_len;
+        if (4 + rec->sender_len + rec->text_len != len) return -1;
+        return rec->sender_len >= USERNAME_BUFFER_SIZE || rec->text_len >= COMMAND_BUFFER_SIZE ? -1 : 0;
+    }
+    if (len < 10) return -1;
+    memcpy(&rec->id, p + 1, 8);
+    rec->receiver_len = p[9];
+    if (rec->type == MSGLOG_MESSAGE && len >= 13) {
+        uint16_t text_len;
+        memcpy(&text_len, p + 11, 2);
+        rec->receiver = (const char *)p + 13;
+        rec->sender_len = p[10];
+        rec->text_len = text_len;
+        rec->sender = rec->receiver + rec->receiver_len;
+        rec->text = rec->sender + rec->sender_len;
+        if (13 + rec->receiver_len + rec->sender_len + rec->text_len != len) return -1;
+        if (rec->sender_len >= USERNAME_BUFFER_SIZE || rec->text_len >= COMMAND_BUFFER_SIZE) return -1;
+    } else if (rec->type == MSGLOG_REF && len >= 18) {
+        memcpy(&rec->body_lsn, p + 10, 8);
+        rec->receiver = (const char *)p + 18;
+        if (18 + rec->receiver_len != len) return -1;
+    } else if (rec->type == MSGLOG_ACK) {
+        rec->receiver = (const char *)p + 10;
+        if (10 + rec->receiver_len != len) return -1;
+    } else {
+        return -1;
+    }
+    if (rec->receiver_len == 0 || rec->receiver_len >= USERNAME_BUFFER_SIZE) return -1;
+    return 0;
+}
+
+// 在收件者的 shard 鎖內呼叫，同一位收件者的 record 順序就是佇列順序。
+// payload 為 count 筆 record 依序相接，整批放進同一個 segment、一次取得 msglog_lock (全部寫入或全部不寫)。
+// 回傳最後一筆結束的 LSN (等到它 durable 即代表整批已落地)，lsns[i] 為各筆的起點；無法寫入時回傳 0
+static uint64_t msglog_append_batch(const unsigned char *payload, const size_t *lens, size_t count, uint64_t *lsns) {
+    uint32_t crcs[MSGLOG_BATCH_RECORDS];
+    uint64_t size = 0;
+    const unsigned char *p = payload;
+    for (size_t i = 0; i < count; i++) {
+        crcs[i] = crc32c(p, lens[i]);
+        size += MSGLOG_ALIGN(MSGLOG_HEADER_SIZE + lens[i]);
+        p += lens[i];
+    }
+
+    pthread_mutex_lock(&msglog_lock);
+    if (msglog_failed) {
+        pthread_mutex_unlock(&msglog_lock);
+        return 0;
+    }
+    for (;;) {
+        MsgLogSegment *active = &msglog_segments[msglog_segment_count - 1];
+        if (msglog_append_lsn + size <= active->base + MSGLOG_SEGMENT_SIZE) break;
+        // 放不下就換到 flusher 備好的下一個 segment，剩下的空間維持 0 (即結尾標記)
+        if (!msglog_spare.map) {
+            if (msglog_spare_failed) {
+                pthread_mutex_unlock(&msglog_lock);
+                return 0;
+            }
+            pthread_cond_signal(&msglog_wake);
+            pthread_cond_wait(&msglog_flushed, &msglog_lock);
+            continue;
+        }
+        if (msglog_push_segment(&msglog_spare) < 0) {
+            pthread_mutex_unlock(&msglog_lock);
+            return 0;
+        }
+        msglog_append_lsn = msglog_spare.base;
+        msglog_spare.map = NULL;
+        msglog_spare.fd = -1;
+        pthread_cond_signal(&msglog_wake);
+    }
+
+    MsgLogSegment *active = &msglog_segments[msglog_segment_count - 1];
+    p = payload;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char *dst = active->map + (msglog_append_lsn - active->base);
+        uint32_t len32 = (uint32_t)lens[i];
+        memcpy(dst + MSGLOG_HEADER_SIZE, p, lens[i]);
+        memcpy(dst + 4, &crcs[i], 4);
+        memcpy(dst, &len32, 4);
+        lsns[i] = msglog_append_lsn;
+        msglog_append_lsn += MSGLOG_ALIGN(MSGLOG_HEADER_SIZE + lens[i]);
+        p += lens[i];
+    }
+    msglog_records += count;
+    uint64_t end = msglog_append_lsn;
+    pthread_mutex_unlock(&msglog_lock);
+    return end;
+}
+
+static uint64_t msglog_append(const unsigned char *payload, size_t len, uint64_t *lsn) {
+    return msglog_append_batch(payload, &len, 1, lsn);
+}
+
+// 等到 lsn 以前都寫入磁碟；同時等待的執行緒共用 flusher 的同一次 msync。log 無法落地回傳 -1
+static int msglog_wait(uint64_t lsn) {
+    pthread_mutex_lock(&msglog_lock);
+    if (msglog_durable_lsn < lsn) {
+        msglog_waiters++;
+        pthread_cond_signal(&msglog_wake);
+        while (msglog_durable_lsn < lsn && !msglog_failed) pthread_cond_wait(&msglog_flushed, &msglog_lock);
+        msglog_waiters--;
+    }
+    int ok = msglog_durable_lsn >= lsn;
+    pthread_mutex_unlock(&msglog_lock);
+    return ok ? 0 : -1;
+}
+
+// lsn 已落地回傳 0、無法落地回傳 -1；否則登記 done(arg, ok)，由 flusher 之後呼叫並回傳 1
+static int msglog_defer(uint64_t lsn, void (*done)(void *, int), void *arg) {
+    MsgLogDeferred *node = (MsgLogDeferred *)malloc(sizeof(MsgLogDeferred));
+    pthread_mutex_lock(&msglog_lock);
+    if (msglog_durable_lsn >= lsn || msglog_failed || !node) {
+        pthread_mutex_unlock(&msglog_lock);
+        free(node);
+        return msglog_wait(lsn);
+    }
+    node->lsn = lsn;
+    node->done = done;
+    node->arg = arg;
+    node->next = msglog_deferred;
+    msglog_deferred = node;
+    pthread_cond_signal(&msglog_wake);
+    pthread_mutex_unlock(&msglog_lock);
+    return 1;
+}
+
+// 只由 flusher 呼叫：把 [durable, target) 寫回磁碟。checkpoint 只刪除 durable 之前的 segment，
+// 所以這裡取出的 mapping 不會在 msync 期間被 munmap。
+// msync 失敗後 page cache 的狀態已無法確認，不重試：durable 停在原處，所有等待者以失敗結束
+static void msglog_sync(uint64_t target) {
+    uint64_t page_mask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+    uint64_t from = msglog_durable_lsn;
+    int failed = 0;
+    while (from < target && !failed) {
+        MsgLogSegment seg = {0, -1, NULL};
+        pthread_mutex_lock(&msglog_lock);
+        MsgLogSegment *found = msglog_segment_for(from);
+        if (found) seg = *found;
+        pthread_mutex_unlock(&msglog_lock);
+
+        uint64_t segment_end = (from / MSGLOG_SEGMENT_SIZE + 1) * MSGLOG_SEGMENT_SIZE;
+        uint64_t end = target < segment_end ? target : segment_end;
+        if (seg.map) {
+            uint64_t start = (from - seg.base) & ~page_mask;
+            if (msync(seg.map + start, end - seg.base - start, MS_SYNC) < 0) {
+                perror("[ERROR] msync message log");
+                failed = 1;
+            }
+        }
+        from = end;
+    }
+    MsgLogDeferred *ready = NULL;
+    pthread_mutex_lock(&msglog_lock);
+    if (failed) {
+        msglog_failed = 1;
+    } else {
+        msglog_durable_lsn = target;
+        msglog_syncs++;
+    }
+    pthread_cond_broadcast(&msglog_flushed);
+    for (MsgLogDeferred **p = &msglog_deferred; *p;) {
+        MsgLogDeferred *node = *p;
+        if (node->lsn <= target || failed) {
+            *p = node->next;
+            node->next = ready;
+            ready = node;
+        } else {
+            p = &node->next;
+        }
+    }
+    pthread_mutex_unlock(&msglog_lock);
+    while (ready) {
+        MsgLogDeferred *node = ready;
+        ready = node->next;
+        node->done(node->arg, !failed);
+        free(node);
+    }
+}
+
+// 在背景先建立下一個 segment，寫入端換 segment 時不必等 fallocate
+static void msglog_prepare_spare() {
+    pthread_mutex_lock(&msglog_lock);
+    uint64_t base = msglog_segments[msglog_segment_count - 1].base + MSGLOG_SEGMENT_SIZE;
+    pthread_mutex_unlock(&msglog_lock);
+
+    MsgLogSegment seg;
+    int ok = msglog_segment_open(&seg, base, 1) == 0;
+    if (!ok) perror("[ERROR] Failed to create message log segment");
+    pthread_mutex_lock(&msglog_lock);
+    if (ok) msglog_spare = seg;
+    msglog_spare_failed = !ok;
+    pthread_cond_broadcast(&msglog_flushed);
+    pthread_mutex_unlock(&msglog_lock);
+}
+
+// 有人在等就立刻 msync；沒人等 (例如只有 ACK) 時最多 MSGLOG_FLUSH_INTERVAL_MS 寫回一次
+static void *msglog_flush_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&msglog_lock);
+    for (;;) {
+        int idle = msglog_spare.map || msglog_spare_failed;
+        int waiting = msglog_waiters > 0 || msglog_deferred;
+        if (idle && !(waiting && msglog_append_lsn > msglog_durable_lsn)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += MSGLOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&msglog_wake, &msglog_lock, &deadline);
+        }
+        uint64_t target = msglog_append_lsn;
+        int need_spare = !msglog_spare.map;
+        if (target - msglog_checkpoint_lsn >= MSGLOG_CHECKPOINT_BYTES) {
+            pthread_cond_signal(&msglog_checkpoint_wake);
+        }
+        pthread_mutex_unlock(&msglog_lock);
+
+        if (target > msglog_durable_lsn && !msglog_failed) msglog_sync(target);
+        if (need_spare) msglog_prepare_spare();
+        pthread_mutex_lock(&msglog_lock);
+    }
+    return NULL;
+}
+
+static void msglog_format_stats(char *out, size_t out_size) {
+    pthread_mutex_lock(&msglog_lock);
+    snprintf(out, out_size, "msglog segments=%zu records=%llu syncs=%llu checkpoints=%llu relocated=%llu "
+             "unsynced_bytes=%llu\n", msglog_segment_count, (unsigned long long)msglog_records,
+             (unsigned long long)msglog_syncs, (unsigned long long)msglog_checkpoints,
+             (unsigned long long)msglog_relocated, (unsigned long long)(msglog_append_lsn - msglog_durable_lsn));
+    pthread_mutex_unlock(&msglog_lock);
+}
+
+// ========== 訊息管理 ==========
+
+// 依收件者分片：每個 shard 一把鎖、一張 chained hash table，
+// 每位使用者一條 FIFO 佇列，SEND / RETRIEVE 只動到自己的佇列。
+// 佇列節點只是指向 MessageBody 的參照；群發時所有收件者共用同一份內容。
+
+static inline size_t mailbox_node_size() {
+    return sizeof(Message);
+}
+
+static MailboxShard *mailbox_shard_for(const char *username) {
+    return &mailbox_shards[hash_string(username) % MAILBOX_SHARDS];
+}
+
+static Mailbox **mailbox_slot(MailboxShard *shard, const char *username) {
+    Mailbox **slot = &shard->buckets[hash_string(username) / MAILBOX_SHARDS % shard->bucket_count];
+    while (*slot && strcmp((*slot)->username, username) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void mailbox_shard_grow(MailboxShard *shard) {
+    size_t new_count = shard->bucket_count ? shard->bucket_count * 2 : 16;
+    Mailbox **buckets = (Mailbox **)calloc(new_count, sizeof(Mailbox *));
+    if (!buckets) return;
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        Mailbox *box = shard->buckets[i];
+        while (box) {
+            Mailbox *next = box->next;
+            size_t idx = hash_string(box->username) / MAILBOX_SHARDS % new_count;
+            box->next = buckets[idx];
+            buckets[idx] = box;
+            box = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = new_count;
+}
+
+// 從 shard 的 free list 取節點，受整體記憶體預算限制
+static Message *message_alloc(MailboxShard *shard) {
+    size_t size = mailbox_node_size();
+    if (__atomic_add_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED) > mailbox_budget) {
+        __atomic_sub_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Message *msg = shard->free_list;
+    if (msg) {
+        shard->free_list = msg->next;
+        shard->free_count--;
+    } else {
+        msg = (Message *)malloc(size);
+        if (!msg) {
+            __atomic_sub_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    msg->next = NULL;
+    return msg;
+}
+
+// 內容與節點分開計入記憶體預算；回傳的 body 由呼叫者持有一個參照
+static MessageBody *message_body_new(const char *sender, size_t sender_len, const char *text, size_t text_len) {
+    size_t size = sizeof(MessageBody) + sender_len + text_len + 2;
+    if (__atomic_add_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED) > mailbox_budget) {
+        __atomic_sub_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    MessageBody *body = (MessageBody *)malloc(size);
+    if (!body) {
+        __atomic_sub_fetch(&mailbox_bytes, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    body->refcnt = 1;
+    body->text_len = (uint16_t)text_len;
+    body->shared = 0;
+    body->lsn = 0;
+    body->checkpoint_seen = body->checkpoint_moved = 0;
+    memcpy(body->sender, sender, sender_len);
+    body->sender[sender_len] = '\0';
+    body->text = body->sender + sender_len + 1;
+    memcpy(body->text, text, text_len);
+    body->text[text_len] = '\0';
+    return body;
+}
+
+// 參照可能在不同 shard 的鎖下釋放，refcount 以 atomic 操作
+static void message_body_release(MessageBody *body) {
+    if (__atomic_sub_fetch(&body->refcnt, 1, __ATOMIC_ACQ_REL) > 0) return;
+    __atomic_sub_fetch(&mailbox_bytes, sizeof(MessageBody) + strlen(body->sender) + body->text_len + 2,
+                       __ATOMIC_RELAXED);
+    free(body);
+}
+
+static void message_release_node(MailboxShard *shard, Message *msg) {
+    __atomic_sub_fetch(&mailbox_bytes, mailbox_node_size(), __ATOMIC_RELAXED);
+    if (shard->free_count < MAILBOX_FREE_LIST_MAX) {
+        msg->next = shard->free_list;
+        shard->free_list = msg;
+        shard->free_count++;
+    } else {
+        free(msg);
+    }
+}
+
+static void message_release(MailboxShard *shard, Message *msg) {
+    message_body_release(msg->body);
+    message_release_node(shard, msg);
+}
+
+void mailbox_init(size_t budget_bytes) {
+    mailbox_budget = budget_bytes;
+    for (int i = 0; i < MAILBOX_SHARDS; i++) {
+        pthread_mutex_init(&mailbox_shards[i].lock, NULL);
+        mailbox_shard_grow(&mailbox_shards[i]);
+    }
+}
+
+static void mailbox_drop(MailboxShard *shard, Mailbox **slot) {
+    Mailbox *box = *slot;
+    *slot = box->next;
+    shard->mailbox_count--;
+    free(box);
+}
+
+// 找到或建立收件匣；之後 slot 可能因 shard 擴充而失效，需要時重新以 mailbox_slot 取得
+static Mailbox *mailbox_get(MailboxShard *shard, const char *receiver) {
+    Mailbox **slot = mailbox_slot(shard, receiver);
+    Mailbox *box = *slot;
+    if (!box) {
+        box = (Mailbox *)calloc(1, sizeof(Mailbox));
+        if (!box) return NULL;
+        strncpy(box->username, receiver, USERNAME_BUFFER_SIZE - 1);
+        *slot = box;
+        if (++shard->mailbox_count > shard->bucket_count) mailbox_shard_grow(shard);
+    }
+    return box;
+}
+
+static void mailbox_link(Mailbox *box, Message *msg) {
+    if (box->tail) box->tail->next = msg;
+    else box->head = msg;
+    box->tail = msg;
+    box->count++;
+}
+
+// 成功回傳 0，*commit_lsn 為回覆前須等待落地的 log 位置；超過記憶體預算或 log 無法寫入回傳 -1
+int store_message(const char *sender, const char *receiver, const char *message, uint64_t *commit_lsn) {
+    MailboxShard *shard = mailbox_shard_for(receiver);
+    size_t sender_len = strnlen(sender, USERNAME_BUFFER_SIZE - 1);
+    size_t text_len = strnlen(message, COMMAND_BUFFER_SIZE - 1);
+    MessageBody *body = message_body_new(sender, sender_len, message, text_len);
+    if (!body) return -1;
+    int ret = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    Message *msg = message_alloc(shard);
+    Mailbox *box = msg ? mailbox_get(shard, receiver) : NULL;
+    if (box) {
+        unsigned char record[MSGLOG_RECORD_MAX];
+        msg->id = __atomic_fetch_add(&msglog_next_id, 1, __ATOMIC_RELAXED);
+        msg->body = body;
+        size_t len = msglog_encode_message(record, msg->id, box->username, body->sender, body->text);
+        *commit_lsn = msglog_append(record, len, &msg->lsn);
+        if (*commit_lsn == 0) {
+            message_release(shard, msg);
+            if (box->count == 0) mailbox_drop(shard, mailbox_slot(shard, receiver));
+        } else {
+            mailbox_link(box, msg);
+            ret = 0;
+        }
+    } else {
+        if (msg) message_release_node(shard, msg);
+        message_body_release(body);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+// 群發：內容以一筆 BODY record、一份 MessageBody 儲存，每位收件者只多一個節點與一筆小的 REF record。
+// 收件者依 shard 分組，每個 shard 只加一次鎖，該 shard 的 REF 以 msglog_append_batch 一次寫入。
+// receivers 不可重複。回傳成功投遞的人數 (超過記憶體預算的收件者略過)，*commit_lsn 為回覆前須等待落地的位置
+size_t store_multicast(const char *sender, char (*receivers)[USERNAME_BUFFER_SIZE], size_t count,
+                       const char *message, uint64_t *commit_lsn) {
+    size_t sender_len = strnlen(sender, USERNAME_BUFFER_SIZE - 1);
+    size_t text_len = strnlen(message, COMMAND_BUFFER_SIZE - 1);
+    MessageBody *body = message_body_new(sender, sender_len, message, text_len);
+    if (!body) return 0;
+
+    unsigned char record[MSGLOG_RECORD_MAX];
+    uint64_t body_lsn;
+    *commit_lsn = msglog_append(record, msglog_encode_body(record, body->sender, body->text), &body_lsn);
+    body->lsn = body_lsn;
+    body->shared = 1;
+
+    // 依 shard 做 counting sort
+    size_t *order = (size_t *)malloc(count * sizeof(size_t));
+    unsigned char *shard_of = (unsigned char *)malloc(count);
+    unsigned char *batch = (unsigned char *)malloc(MSGLOG_BATCH_RECORDS * (18 + USERNAME_BUFFER_SIZE));
+    size_t start[MAILBOX_SHARDS + 1] = {0};
+    size_t delivered = 0;
+    if (*commit_lsn == 0 || !order || !shard_of || !batch) {
+        free(order);
+        free(shard_of);
+        free(batch);
+        message_body_release(body);
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        shard_of[i] = (unsigned char)(mailbox_shard_for(receivers[i]) - mailbox_shards);
+        start[shard_of[i] + 1]++;
+    }
+    for (int i = 0; i < MAILBOX_SHARDS; i++) start[i + 1] += start[i];
+    size_t fill[MAILBOX_SHARDS];
+    memcpy(fill, start, sizeof(fill));
+    for (size_t i = 0; i < count; i++) order[fill[shard_of[i]]++] = i;
+
+    Message *nodes[MSGLOG_BATCH_RECORDS];
+    Mailbox *boxes[MSGLOG_BATCH_RECORDS];
+    size_t lens[MSGLOG_BATCH_RECORDS];
+    uint64_t lsns[MSGLOG_BATCH_RECORDS];
+    for (int shard_index = 0; shard_index < MAILBOX_SHARDS; shard_index++) {
+        size_t i = start[shard_index], last = start[shard_index + 1];
+        if (i == last) continue;
+        MailboxShard *shard = &mailbox_shards[shard_index];
+        pthread_mutex_lock(&shard->lock);
+        while (i < last) {
+            // 一批最多 MSGLOG_BATCH_RECORDS 位收件者；id 在鎖內配發，每個收件匣的 log 順序與 id 順序一致
+            size_t n = 0, used = 0;
+            for (; i < last && n < MSGLOG_BATCH_RECORDS; i++) {
+                const char *receiver = receivers[order[i]];
+                Message *msg = message_alloc(shard);
+                if (!msg) break;
+                Mailbox *box = mailbox_get(shard, receiver);
+                if (!box) {
+                    message_release_node(shard, msg);
+                    break;
+                }
+                __atomic_fetch_add(&body->refcnt, 1, __ATOMIC_RELAXED);
+                msg->body = body;
+                msg->id = __atomic_fetch_add(&msglog_next_id, 1, __ATOMIC_RELAXED);
+                lens[n] = msglog_encode_ref(batch + used, msg->id, box->username, body_lsn);
+                used += lens[n];
+                nodes[n] = msg;
+                boxes[n++] = box;
+            }
+            uint64_t end = n ? msglog_append_batch(batch, lens, n, lsns) : 0;
+            for (size_t k = 0; k < n; k++) {
+                if (end) {
+                    nodes[k]->lsn = lsns[k];
+                    mailbox_link(boxes[k], nodes[k]);
+                } else {
+                    message_release(shard, nodes[k]);
+                    if (boxes[k]->count == 0) mailbox_drop(shard, mailbox_slot(shard, boxes[k]->username));
+                }
+            }
+            if (!end) break;
+            *commit_lsn = end;
+            delivered += n;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    free(order);
+    free(shard_of);
+    free(batch);
+    message_body_release(body);
+    __atomic_fetch_add(&multicast_sends, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&multicast_refs, delivered, __ATOMIC_RELAXED);
+    return delivered;
+}
+
+// 依序取出訊息直到 output 放不下為止，剩下的留到下次 RETRIEVE，回傳取出的則數。
+// 取走的部分以一筆 ACK 記進 log (不等落地：當機時最多重複投遞，不會遺失)
+size_t get_messages(const char *username, char *output, size_t output_size) {
+    MailboxShard *shard = mailbox_shard_for(username);
+    size_t used = 0, taken = 0;
+    uint64_t acked = 0;
+
+    output[0] = '\0';
+    pthread_mutex_lock(&shard->lock);
+    Mailbox **slot = mailbox_slot(shard, username);
+    Mailbox *box = *slot;
+    while (box && box->head) {
+        Message *msg = box->head;
+        int len = snprintf(output + used, output_size - used, "From %s: %s\n",
+                           msg->body->sender, msg->body->text);
+        if (len < 0 || used + len >= output_size) {
+            output[used] = '\0';
+            break;
+        }
+        used += len;
+        taken++;
+        acked = msg->id;
+        box->head = msg->next;
+        if (!box->head) box->tail = NULL;
+        box->count--;
+        message_release(shard, msg);
+    }
+    if (acked) {
+        unsigned char record[MSGLOG_RECORD_MAX];
+        uint64_t lsn;
+        msglog_append(record, msglog_encode_ack(record, acked, box->username), &lsn);
+    }
+    if (box && box->count == 0) {
+        // 收件匣清空就回收，避免大量使用者累積空的 Mailbox
+        mailbox_drop(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return taken;
+}
+
+// 啟動時 REF 指向的 BODY：以 LSN 為 key 的 open-addressing table，同一份內容只載入一次，
+// 重建後的收件匣仍共用內容。table 各持有一個參照，重建完成後由 mailbox_recover_done 釋放
+static MessageBody **recover_bodies;
+static size_t recover_body_cap, recover_body_count;
+
+static MessageBody *mailbox_recover_body(uint64_t lsn) {
+    if ((recover_body_count + 1) * 2 > recover_body_cap) {
+        size_t cap = recover_body_cap ? recover_body_cap * 2 : 1024;
+        MessageBody **table = (MessageBody **)calloc(cap, sizeof(MessageBody *));
+        if (!table) return NULL;
+        for (size_t i = 0; i < recover_body_cap; i++) {
+            if (!recover_bodies[i]) continue;
+            size_t j = hash_u64(recover_bodies[i]->lsn) & (cap - 1);
+            while (table[j]) j = (j + 1) & (cap - 1);
+            table[j] = recover_bodies[i];
+        }
+        free(recover_bodies);
+        recover_bodies = table;
+        recover_body_cap = cap;
+    }
+    size_t i = hash_u64(lsn) & (recover_body_cap - 1);
+    while (recover_bodies[i]) {
+        if (recover_bodies[i]->lsn == lsn) return recover_bodies[i];
+        i = (i + 1) & (recover_body_cap - 1);
+    }
+    MsgLogRecord rec;
+    if (msglog_parse(lsn, &rec) < 0 || rec.type != MSGLOG_BODY) return NULL;
+    MessageBody *body = message_body_new(rec.sender, rec.sender_len, rec.text, rec.text_len);
+    if (!body) return NULL;
+    body->lsn = lsn;
+    body->shared = 1;
+    recover_bodies[i] = body;
+    recover_body_count++;
+    return body;
+}
+
+static void mailbox_recover_done() {
+    for (size_t i = 0; i < recover_body_cap; i++) {
+        if (recover_bodies[i]) message_body_release(recover_bodies[i]);
+    }
+    free(recover_bodies);
+    recover_bodies = NULL;
+    recover_body_cap = recover_body_count = 0;
+}
+
+// 啟動時依 id 把 MESSAGE / REF 放回佇列。checkpoint 與重播可能讀到同一則訊息 (或搬移後的副本)，
+// 已在佇列中的就只更新位置
+static int mailbox_recover_message(const MsgLogRecord *rec, uint64_t lsn) {
+    char receiver[USERNAME_BUFFER_SIZE];
+    memcpy(receiver, rec->receiver, rec->receiver_len);
+    receiver[rec->receiver_len] = '\0';
+    MailboxShard *shard = mailbox_shard_for(receiver);
+    Mailbox *box = mailbox_get(shard, receiver);
+    if (!box) return -1;
+
+    // 幾乎都是依序出現，先看佇列尾端
+    Message **pos = box->tail && box->tail->id < rec->id ? &box->tail->next : &box->head;
+    while (*pos && (*pos)->id < rec->id) pos = &(*pos)->next;
+    if (*pos && (*pos)->id == rec->id) {
+        if (lsn > (*pos)->lsn) (*pos)->lsn = lsn;
+        return 0;
+    }
+
+    MessageBody *body;
+    if (rec->type == MSGLOG_REF) {
+        body = mailbox_recover_body(rec->body_lsn);
+        if (!body) {
+            LOG_WARN("[WARN] Message log record at %llu refers to a missing body\n", (unsigned long long)lsn);
+            if (box->count == 0) mailbox_drop(shard, mailbox_slot(shard, receiver));
+            return -1;
+        }
+        __atomic_fetch_add(&body->refcnt, 1, __ATOMIC_RELAXED);
+    } else {
+        body = message_body_new(rec->sender, rec->sender_len, rec->text, rec->text_len);
+        if (!body) return -1;
+    }
+    Message *msg = message_alloc(shard);
+    if (!msg) {
+        message_body_release(body);
+        return -1;
+    }
+    msg->id = rec->id;
+    msg->lsn = lsn;
+    msg->body = body;
+    msg->next = *pos;
+    *pos = msg;
+    if (!msg->next) box->tail = msg;
+    box->count++;
+    return 1;
+}
+
+static size_t mailbox_recover_ack(const MsgLogRecord *rec) {
+    char receiver[USERNAME_BUFFER_SIZE];
+    memcpy(receiver, rec->receiver, rec->receiver_len);
+    receiver[rec->receiver_len] = '\0';
+    MailboxShard *shard = mailbox_shard_for(receiver);
+    Mailbox **slot = mailbox_slot(shard, receiver);
+    Mailbox *box = *slot;
+    size_t removed = 0;
+    if (!box) return 0;
+    while (box->head && box->head->id <= rec->id) {
+        Message *msg = box->head;
+        box->head = msg->next;
+        box->count--;
+        message_release(shard, msg);
+        removed++;
+    }
+    if (!box->head) {
+        box->tail = NULL;
+        mailbox_drop(shard, slot);
+    }
+    return removed;
+}
+
+// 上次 checkpoint 判定為稀疏、這次要搬走未讀訊息的 segment 範圍 (只由 checkpoint 執行緒使用)
+static uint64_t msglog_relocate_below;
+static unsigned msglog_checkpoint_epoch; // 每次 checkpoint 遞增，標記群發內容在這一輪是否已處理 / 已搬移
+
+// 把一則未讀訊息計入所在 segment 的未讀 bytes
+static void msglog_count_live(uint64_t *live, uint64_t first_base, size_t segment_count, uint64_t lsn, size_t len) {
+    size_t segment = (lsn - first_base) / MSGLOG_SEGMENT_SIZE;
+    if (segment < segment_count) live[segment] += MSGLOG_ALIGN(MSGLOG_HEADER_SIZE + len);
+}
+
+// 記下目前所有未讀訊息的 LSN。重播起點取在掃描之前，掃描期間的 SEND / ACK 重播時會再套用一次 (以 id 去重)。
+// segment 超過 MSGLOG_RELOCATE_SEGMENTS 個時，把最舊、且未讀訊息不到 1/4 的幾段裡的訊息重寫到尾端，
+// 長期沒人收的訊息就不會把整份歷史留在磁碟上；大部分仍未讀的 segment 不搬，避免一直重寫同一批資料。
+// 群發的 BODY 在第一次遇到它的參照時處理：它也必須保留，被搬移時所有 REF 都要改寫成指向新位置
+static int msglog_checkpoint() {
+    pthread_mutex_lock(&msglog_lock);
+    uint64_t replay_lsn = msglog_append_lsn;
+    uint64_t first_base = msglog_segments[0].base;
+    size_t segment_count = msglog_segment_count;
+    pthread_mutex_unlock(&msglog_lock);
+    uint64_t next_id = __atomic_load_n(&msglog_next_id, __ATOMIC_RELAXED);
+    uint64_t relocate_below = msglog_relocate_below;
+    unsigned epoch = ++msglog_checkpoint_epoch;
+
+    // 前面保留 header 的空間，最後整塊算 CRC 一次寫出
+    size_t header_words = sizeof(MsgLogCheckpointHeader) / 8;
+    size_t count = 0, cap = 1024, relocated = 0;
+    uint64_t keep = replay_lsn;
+    uint64_t *words = (uint64_t *)malloc((header_words + cap + 1) * 8);
+    uint64_t *live = (uint64_t *)calloc(segment_count, sizeof(uint64_t)); // 每個 segment 的未讀 bytes
+    if (!words || !live) {
+        free(words);
+        free(live);
+        return -1;
+    }
+    for (int i = 0; i < MAILBOX_SHARDS; i++) {
+        MailboxShard *shard = &mailbox_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t b = 0; b < shard->bucket_count; b++) {
+            for (Mailbox *box = shard->buckets[b]; box; box = box->next) {
+                for (Message *msg = box->head; msg; msg = msg->next) {
+                    MessageBody *body = msg->body;
+                    unsigned char record[MSGLOG_RECORD_MAX];
+                    uint64_t lsn;
+                    size_t len;
+                    if (body->shared && body->checkpoint_seen != epoch) {
+                        body->checkpoint_seen = epoch;
+                        len = msglog_encode_body(record, body->sender, body->text);
+                        if (body->lsn < relocate_below && msglog_append(record, len, &lsn)) {
+                            body->lsn = lsn;
+                            body->checkpoint_moved = epoch;
+                            relocated++;
+                        }
+                        if (body->lsn < keep) keep = body->lsn;
+                        msglog_count_live(live, first_base, segment_count, body->lsn, len);
+                    }
+                    if (body->shared) {
+                        len = msglog_encode_ref(record, msg->id, box->username, body->lsn);
+                    } else {
+                        len = msglog_encode_message(record, msg->id, box->username, body->sender, body->text);
+                    }
+                    if ((msg->lsn < relocate_below || (body->shared && body->checkpoint_moved == epoch)) &&
+                        msglog_append(record, len, &lsn)) {
+                        msg->lsn = lsn;
+                        relocated++;
+                    }
+                    if (count == cap) {
+                        uint64_t *p = (uint64_t *)realloc(words, (header_words + cap * 2 + 1) * 8);
+                        if (!p) {
+                            pthread_mutex_unlock(&shard->lock);
+                            free(words);
+                            free(live);
+                            return -1;
+                        }
+                        words = p;
+                        cap *= 2;
+                    }
+                    words[header_words + count++] = msg->lsn;
+                    if (msg->lsn < keep) keep = msg->lsn;
+                    msglog_count_live(live, first_base, segment_count, msg->lsn, len);
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // checkpoint 指到的 record (包含剛搬移的副本) 必須先落地
+    pthread_mutex_lock(&msglog_lock);
+    uint64_t walk_end = msglog_append_lsn;
+    pthread_mutex_unlock(&msglog_lock);
+    if (msglog_wait(walk_end) < 0) {
+        free(words);
+        free(live);
+        return -1;
+    }
+
+    msglog_relocate_below = 0;
+    if (segment_count > MSGLOG_RELOCATE_SEGMENTS) {
+        for (size_t i = 0; i + 1 < segment_count && live[i] * 4 <= MSGLOG_SEGMENT_SIZE; i++) {
+            msglog_relocate_below = first_base + (i + 1) * MSGLOG_SEGMENT_SIZE;
+        }
+    }
+    free(live);
+
+    MsgLogCheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MSGLOG_CHECKPOINT_MAGIC, 8);
+    header.replay_lsn = replay_lsn;
+    header.next_id = next_id;
+    header.count = count;
+    memcpy(words, &header, sizeof(header));
+    size_t body = (header_words + count) * 8;
+    uint32_t crc = crc32c(words, body);
+    memcpy((char *)words + body, &crc, 4);
+
+    char tmp_path[] = MSGLOG_CHECKPOINT_PATH ".tmp";
+    FILE *file = fopen(tmp_path, "wb");
+    int ok = file && fwrite(words, 1, body + 4, file) == body + 4 && fflush(file) == 0 &&
+             fdatasync(fileno(file)) == 0;
+    if (file) fclose(file);
+    free(words);
+    if (!ok || rename(tmp_path, MSGLOG_CHECKPOINT_PATH) < 0) {
+        perror("[ERROR] Failed to write message log checkpoint");
+        unlink(tmp_path);
+        return -1;
+    }
+    int dir_fd = open(MSGLOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    // 重播起點與所有未讀訊息之前的 segment 都用不到了；它們都在 durable 之前，flusher 不會再碰
+    size_t removed = 0;
+    pthread_mutex_lock(&msglog_lock);
+    msglog_checkpoint_lsn = replay_lsn;
+    msglog_checkpoints++;
+    msglog_relocated += relocated;
+    while (msglog_segment_count > 1 && msglog_segments[0].base + MSGLOG_SEGMENT_SIZE <= keep) {
+        MsgLogSegment seg = msglog_segments[0];
+        memmove(msglog_segments, msglog_segments + 1, (msglog_segment_count - 1) * sizeof(MsgLogSegment));
+        msglog_segment_count--;
+        pthread_mutex_unlock(&msglog_lock);
+        msglog_segment_close(&seg, 1);
+        removed++;
+        pthread_mutex_lock(&msglog_lock);
+    }
+    pthread_mutex_unlock(&msglog_lock);
+    LOG_DEBUG("[DEBUG] Message log checkpoint: %zu pending, %zu relocated, %zu segment(s) removed\n", count,
+              relocated, removed);
+    return 0;
+}
+
+static void *msglog_checkpoint_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&msglog_lock);
+    for (;;) {
+        while (msglog_append_lsn - msglog_checkpoint_lsn < MSGLOG_CHECKPOINT_BYTES) {
+            pthread_cond_wait(&msglog_checkpoint_wake, &msglog_lock);
+        }
+        pthread_mutex_unlock(&msglog_lock);
+        if (msglog_checkpoint() < 0) sleep(1);
+        pthread_mutex_lock(&msglog_lock);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 載入 checkpoint 列出的未讀訊息；回傳重播起點，沒有或損毀時回傳 0 (改為重播全部 segment)
+static uint64_t msglog_load_checkpoint(size_t *loaded) {
+    int fd = open(MSGLOG_CHECKPOINT_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MsgLogCheckpointHeader) + 4) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    MsgLogCheckpointHeader header;
+    uint32_t crc;
+    memcpy(&header, map, sizeof(header));
+    memcpy(&crc, map + st.st_size - 4, 4);
+    if (memcmp(header.magic, MSGLOG_CHECKPOINT_MAGIC, 8) != 0 ||
+        sizeof(header) + header.count * 8 + 4 != (size_t)st.st_size || crc32c(map, st.st_size - 4) != crc) {
+        LOG_WARN("[WARN] Message log checkpoint is corrupt, replaying all segments.\n");
+        munmap(map, st.st_size);
+        return 0;
+    }
+    for (uint64_t i = 0; i < header.count; i++) {
+        uint64_t lsn;
+        MsgLogRecord rec;
+        memcpy(&lsn, map + sizeof(header) + i * 8, 8);
+        if (msglog_parse(lsn, &rec) < 0 || (rec.type != MSGLOG_MESSAGE && rec.type != MSGLOG_REF)) {
+            LOG_WARN("[WARN] Message log checkpoint points to a missing record at %llu\n", (unsigned long long)lsn);
+            continue;
+        }
+        if (mailbox_recover_message(&rec, lsn) > 0) (*loaded)++;
+    }
+    if (header.next_id > msglog_next_id) msglog_next_id = header.next_id;
+    munmap(map, st.st_size);
+    return header.replay_lsn;
+}
+
+// 開啟所有 segment，由 checkpoint 重建收件匣後重播其後的 record；在 mailbox_init 之後、開始服務之前呼叫
+void msglog_init() {
+    if (mkdir(MSGLOG_DIR, 0700) < 0 && errno != EEXIST) {
+        perror("[ERROR] Failed to create " MSGLOG_DIR);
+        exit(EXIT_FAILURE);
+    }
+    unlink(MSGLOG_CHECKPOINT_PATH ".tmp");
+
+    uint64_t *bases = NULL;
+    size_t base_count = 0, base_cap = 0;
+    DIR *dir = opendir(MSGLOG_DIR);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long long base = strtoull(entry->d_name, &end, 16);
+        if (end != entry->d_name + 16 || strcmp(end, ".log") != 0 || base % MSGLOG_SEGMENT_SIZE != 0) continue;
+        if (base_count == base_cap) {
+            base_cap = base_cap ? base_cap * 2 : 16;
+            bases = (uint64_t *)realloc(bases, base_cap * sizeof(uint64_t));
+            if (!bases) {
+                perror("[ERROR] Failed to load message log");
+                exit(EXIT_FAILURE);
+            }
+        }
+        bases[base_count++] = base;
+    }
+    if (dir) closedir(dir);
+    qsort(bases, base_count, sizeof(uint64_t), compare_u64);
+
+    // 中間缺少的 segment 以空位補上，讓 LSN 仍能直接換算成陣列位置
+    for (size_t i = 0; i < base_count; i++) {
+        MsgLogSegment seg = {bases[i], -1, NULL};
+        while (msglog_segment_count > 0 &&
+               msglog_segments[msglog_segment_count - 1].base + MSGLOG_SEGMENT_SIZE < bases[i]) {
+            MsgLogSegment hole = {msglog_segments[msglog_segment_count - 1].base + MSGLOG_SEGMENT_SIZE, -1, NULL};
+            msglog_push_segment(&hole);
+        }
+        if (msglog_segment_open(&seg, bases[i], 0) < 0) {
+            LOG_WARN("[WARN] Skipping unreadable message log segment %016llx\n", (unsigned long long)bases[i]);
+        }
+        msglog_push_segment(&seg);
+    }
+    free(bases);
+
+    // 重建期間不受記憶體預算限制，已經答應過的訊息不能丟
+    size_t budget = mailbox_budget;
+    mailbox_budget = SIZE_MAX;
+    size_t pending = 0, replayed = 0;
+    uint64_t replay_lsn = msglog_load_checkpoint(&pending);
+    if (msglog_segment_count > 0 && replay_lsn < msglog_segments[0].base) replay_lsn = msglog_segments[0].base;
+
+    // 每個 segment 讀到第一筆不完整的 record 為止；最後一個有資料的 segment 的結尾即為新的寫入位置
+    uint64_t end = replay_lsn;
+    for (size_t i = 0; i < msglog_segment_count; i++) {
+        MsgLogSegment *seg = &msglog_segments[i];
+        if (!seg->map || seg->base + MSGLOG_SEGMENT_SIZE <= replay_lsn) continue;
+        uint64_t pos = replay_lsn > seg->base ? replay_lsn : seg->base;
+        uint64_t start = pos;
+        MsgLogRecord rec;
+        while (msglog_parse(pos, &rec) == 0) {
+            if (rec.type == MSGLOG_MESSAGE || rec.type == MSGLOG_REF) {
+                if (mailbox_recover_message(&rec, pos) > 0) pending++;
+                if (rec.id >= msglog_next_id) msglog_next_id = rec.id + 1;
+            } else if (rec.type == MSGLOG_ACK) {
+                pending -= mailbox_recover_ack(&rec);
+            }
+            pos += rec.size;
+            replayed++;
+        }
+        if (pos > start || seg->base <= replay_lsn) end = pos;
+    }
+    mailbox_recover_done();
+    mailbox_budget = budget;
+
+    // 之後的 segment 只可能是預先建立的空檔，或沒有落地過的寫入
+    while (msglog_segment_count > 0 && msglog_segments[msglog_segment_count - 1].base > end) {
+        msglog_segment_close(&msglog_segments[--msglog_segment_count], 1);
+    }
+    MsgLogSegment *active = msglog_segment_for(end);
+    if (!active || end == active->base + MSGLOG_SEGMENT_SIZE) {
+        MsgLogSegment seg;
+        if (msglog_segment_count > 0 && !msglog_segments[msglog_segment_count - 1].map) msglog_segment_count--;
+        if (msglog_segment_open(&seg, end / MSGLOG_SEGMENT_SIZE * MSGLOG_SEGMENT_SIZE, 1) < 0 ||
+            msglog_push_segment(&seg) < 0) {
+            perror("[ERROR] Failed to create message log segment");
+            exit(EXIT_FAILURE);
+        }
+        active = &msglog_segments[msglog_segment_count - 1];
+    } else {
+        // 寫到一半的 record 清成 0，避免之後較短的 record 後面接著舊的殘骸
+        uint64_t offset = end - active->base;
+        uint32_t len;
+        memcpy(&len, active->map + offset, 4);
+        if (len != 0) memset(active->map + offset, 0, MSGLOG_SEGMENT_SIZE - offset);
+    }
+    msglog_append_lsn = msglog_durable_lsn = end;
+    msglog_checkpoint_lsn = replay_lsn;
+
+    if (__atomic_load_n(&mailbox_bytes, __ATOMIC_RELAXED) > mailbox_budget) {
+        LOG_WARN("[WARN] Recovered messages exceed the mailbox budget (%zu > %zu bytes).\n",
+                 __atomic_load_n(&mailbox_bytes, __ATOMIC_RELAXED), mailbox_budget);
+    }
+    LOG_INFO("[INFO] Message log: %zu pending message(s), replayed %zu record(s) from LSN %llu, %zu segment(s).\n",
+             pending, replayed, (unsigned long long)replay_lsn, msglog_segment_count);
+
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, msglog_flush_thread, NULL);
+    pthread_detach(thread_id);
+    pthread_create(&thread_id, NULL, msglog_checkpoint_thread, NULL);
+    pthread_detach(thread_id);
+}
+
+// ========== Worker pool ==========
+// 每個 worker 有自己的 deque：自己從尾端取 (LIFO)，閒置時從其他 worker 頭端偷 (FIFO)。
+// io_pool 處理連線 I/O (大小預設為核心數)；job_pool 處理檔案傳輸 / 串流等長時間工作。
+
+typedef void (*TaskFn)(void *arg);
+
+typedef struct {
+    TaskFn fn;
+    void *arg;
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Task *items;
+    size_t head, count, cap;
+} TaskDeque;
+
+typedef struct WorkerPool {
+    const char *name;
+    int size;
+    TaskDeque *deques;
+    pthread_t *threads;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle_workers;
+    long queued;          // 尚未被取走的 task 數 (queue depth)
+    long active;          // 正在執行的 task 數
+    unsigned long executed;
+    unsigned long stolen;
+    unsigned submit_rr;
+} WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    int index;
+} WorkerArg;
+
+static WorkerPool io_pool;
+static WorkerPool job_pool;
+static WorkerPool handshake_pool;   // TLS handshake 耗 CPU，獨立出來避免擋住已連線使用者的指令
+static WorkerPool decode_pool;      // 影片串流的 JPEG 解碼與 sink 輸出
+static WorkerPool compress_pool;    // 壓縮下載的區塊壓縮 (只做 CPU 工作，不會等待其他 task)
+static __thread WorkerPool *current_pool = NULL;
+static __thread int current_worker = -1;
+
+static void deque_push_tail(TaskDeque *dq, Task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 64;
+        Task *items = (Task *)malloc(cap * sizeof(Task));
+        for (size_t i = 0; i < dq->count; i++) {
+            items[i] = dq->items[(dq->head + i) % dq->cap];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->items[(dq->head + dq->count) % dq->cap] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static int deque_pop_tail(TaskDeque *dq, Task *task) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *task = dq->items[(dq->head + dq->count) % dq->cap];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static int deque_steal_head(TaskDeque *dq, Task *task) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        *task = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->cap;
+        dq->count--;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+void pool_submit(WorkerPool *pool, TaskFn fn, void *arg) {
+    Task task = {fn, arg};
+    int target;
+    if (current_pool == pool) {
+        target = current_worker; // 在 worker 內產生的 task 放回自己的 deque
+    } else {
+        target = __atomic_fetch_add(&pool->submit_rr, 1, __ATOMIC_RELAXED) % pool->size;
+    }
+    deque_push_tail(&pool->deques[target], task);
+    __atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->idle_workers > 0) pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void compress_submit(TaskFn fn, void *arg) {
+    pool_submit(&compress_pool, fn, arg);
+}
+
+static int pool_take(WorkerPool *pool, int self, Task *task) {
+    if (deque_pop_tail(&pool->deques[self], task)) return 1;
+    for (int i = 1; i < pool->size; i++) {
+        int victim = (self + i) % pool->size;
+        if (deque_steal_head(&pool->deques[victim], task)) {
+            __atomic_fetch_add(&pool->stolen, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_thread(void *arg) {
+    WorkerArg *wa = (WorkerArg *)arg;
+    WorkerPool *pool = wa->pool;
+    int self = wa->index;
+    free(wa);
+
+    current_pool = pool;
+    current_worker = self;
+
+    while (1) {
+        Task task;
+        if (pool_take(pool, self, &task)) {
+            __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            __atomic_fetch_add(&pool->active, 1, __ATOMIC_RELAXED);
+            task.fn(task.arg);
+            __atomic_fetch_sub(&pool->active, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&pool->executed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pool->idle_workers++;
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            pool->idle_workers--;
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+void pool_init(WorkerPool *pool, const char *name, int size) {
+    pool->name = name;
+    pool->size = size;
+    pool->deques = (TaskDeque *)calloc(size, sizeof(TaskDeque));
+    pool->threads = (pthread_t *)calloc(size, sizeof(pthread_t));
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < size; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    for (int i = 0; i < size; i++) {
+        WorkerArg *wa = (WorkerArg *)malloc(sizeof(WorkerArg));
+        wa->pool = pool;
+        wa->index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_thread, wa) != 0) {
+            perror("[ERROR] Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(pool->threads[i]);
+    }
+}
+
+// STATS 指令使用：回報 queue depth 以觀察是否飽和
+static void pool_format_stats(WorkerPool *pool, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s workers=%d queued=%ld active=%ld executed=%lu stolen=%lu\n",
+             pool->name, pool->size,
+             __atomic_load_n(&pool->queued, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->active, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->executed, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->stolen, __ATOMIC_RELAXED));
+}
+
+// handshake 統計：完整 / 重用 session 的次數，以及 0-RTT 是否被接受
+static unsigned long tls_full_handshakes = 0;
+static unsigned long tls_resumed_handshakes = 0;
+static unsigned long tls_early_accepted = 0;
+static unsigned long tls_early_rejected = 0;
+static SSL_CTX *server_ctx;
+
+static void tls_format_stats(char *out, size_t out_size) {
+    snprintf(out, out_size, "tls full=%lu resumed=%lu early_accepted=%lu early_rejected=%lu cached_sessions=%ld\n",
+             __atomic_load_n(&tls_full_handshakes, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_resumed_handshakes, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_early_accepted, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_early_rejected, __ATOMIC_RELAXED),
+             SSL_CTX_sess_number(server_ctx));
+}
+
+// ========== 直播轉發 ==========
+// STREAM_VIDEO 的 publisher 以頻道名稱 (預設為自己的 username) 開台，已登入的使用者以 WATCH <頻道> 觀看。
+// 每個 frame 只從 publisher 的 buffer 複製一次到 refcount 的 SharedFrame，所有觀眾的 queue 都指向同一份，
+// 不重新編碼也不逐觀眾複製。觀眾的連線在 WATCH 後從 event loop 移交給 relay loop，由它獨佔收送
+// (non-blocking SSL_write 直接從共用 buffer 送出)；觀眾跟不上時丟掉 queue 中較舊的 frame，publisher 不會被拖慢。
+// 觀眾送任何資料 (例如 "STOP") 即停止觀看：送完目前這個 frame 後補上 frame_size=0，連線交回 event loop。
+// 鎖的順序：channels_lock → Channel.lock → Viewer.lock → RelayLoop.lock
+
+typedef struct SharedFrame {
+    int refcnt;
+    uint32_t len;                   // data 長度 (含 4 bytes 大小欄位)；只有大小欄位的是結束標記
+    unsigned char data[];           // [4 bytes frame 大小][JPEG]，與觀眾收到的格式相同
+} SharedFrame;
+
+struct Channel;
+struct RelayLoop;
+
+typedef struct Viewer {
+    struct Viewer *next;            // relay loop 的 attach / ready 串列 (加入後才會進 ready 串列)
+    Connection *conn;
+    struct Channel *channel;
+    struct RelayLoop *loop;
+    pthread_mutex_t lock;           // 保護 queue，publisher 與 relay loop 共用
+    SharedFrame *queue[RELAY_QUEUE_FRAMES];
+    int head, count;
+    int started;                    // queue[head] 已開始送出 (SSL_write 重試需要同一份資料)，不可丟棄
+    uint32_t offset;                // queue[head] 已送出的 bytes
+    size_t retry;                   // 上次 SSL_write 未完成時的長度
+    int ending;                     // 結束標記已排入，不再接收新 frame
+    int ready;                      // 已在 ready 串列中
+    int want_out;                   // 等待 EPOLLOUT
+} Viewer;
+
+typedef struct Channel {
+    struct Channel *next;
+    char name[USERNAME_BUFFER_SIZE];
+    pthread_mutex_t lock;           // 保護 viewers
+    int refcnt;                     // registry 一份 + 每位觀眾一份
+    int live;
+    Viewer **viewers;
+    int viewer_count, viewer_cap;
+} Channel;
+
+typedef struct RelayLoop {
+    int epfd;
+    int wakefd;                     // eventfd，有新觀眾或新 frame 時喚醒
+    pthread_mutex_t lock;
+    Viewer *attach;                 // 剛送出 WATCH、等待加入的觀眾
+    Viewer *ready;                  // queue 有新 frame 的觀眾
+} RelayLoop;
+
+static RelayLoop *relay_loops;
+static int relay_loop_count;
+static unsigned relay_next_loop = 0;
+static Channel *channels;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static long relay_channels = 0;
+static long relay_viewers = 0;
+static unsigned long relay_frames_sent = 0;
+static unsigned long relay_frames_dropped = 0;
+
+static SharedFrame *shared_frame_create(const void *jpeg, uint32_t len) {
+    SharedFrame *frame = (SharedFrame *)malloc(sizeof(SharedFrame) + sizeof(uint32_t) + len);
+    if (!frame) return NULL;
+    frame->refcnt = 1;
+    frame->len = sizeof(uint32_t) + len;
+    uint32_t net_len = htonl(len);
+    memcpy(frame->data, &net_len, sizeof(net_len));
+    if (len) memcpy(frame->data + sizeof(uint32_t), jpeg, len);
+    return frame;
+}
+
+static void shared_frame_release(SharedFrame *frame) {
+    if (__atomic_sub_fetch(&frame->refcnt, 1, __ATOMIC_ACQ_REL) == 0) free(frame);
+}
+
+static int shared_frame_is_end(const SharedFrame *frame) {
+    return frame->len == sizeof(uint32_t);
+}
+
+static void relay_wake(RelayLoop *loop) {
+    uint64_t one = 1;
+    if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("[ERROR] relay wake");
+}
+
+// 移除 queue 中第 index 個 frame (呼叫者持有 v->lock)
+static void viewer_remove_locked(Viewer *v, int index) {
+    shared_frame_release(v->queue[(v->head + index) % RELAY_QUEUE_FRAMES]);
+    if (index == 0) {
+        v->head = (v->head + 1) % RELAY_QUEUE_FRAMES;
+    } else {
+        for (int i = index; i < v->count - 1; i++) {
+            v->queue[(v->head + i) % RELAY_QUEUE_FRAMES] = v->queue[(v->head + i + 1) % RELAY_QUEUE_FRAMES];
+        }
+    }
+    v->count--;
+}
+
+// 把 frame 排進觀眾的 queue (多一個 reference，不複製)，queue 滿時丟掉最舊且還沒開始送的 frame
+static void viewer_push(Viewer *v, SharedFrame *frame) {
+    pthread_mutex_lock(&v->lock);
+    if (v->ending) {
+        pthread_mutex_unlock(&v->lock);
+        return;
+    }
+    if (v->count == RELAY_QUEUE_FRAMES) {
+        viewer_remove_locked(v, v->started ? 1 : 0);
+        __atomic_fetch_add(&relay_frames_dropped, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&frame->refcnt, 1, __ATOMIC_RELAXED);
+    v->queue[(v->head + v->count) % RELAY_QUEUE_FRAMES] = frame;
+    v->count++;
+    if (shared_frame_is_end(frame)) v->ending = 1;
+    int schedule = !v->ready;
+    v->ready = 1;
+    pthread_mutex_unlock(&v->lock);
+
+    if (schedule) {
+        RelayLoop *loop = v->loop;
+        pthread_mutex_lock(&loop->lock);
+        v->next = loop->ready;
+        loop->ready = v;
+        pthread_mutex_unlock(&loop->lock);
+        relay_wake(loop);
+    }
+}
+
+// 觀眾要求停止：丟掉還沒開始送的 frame，排入結束標記
+static void viewer_stop(Viewer *v) {
+    pthread_mutex_lock(&v->lock);
+    if (v->ending) {
+        pthread_mutex_unlock(&v->lock);
+        return;
+    }
+    while (v->count > (v->started ? 1 : 0)) viewer_remove_locked(v, v->count - 1);
+    pthread_mutex_unlock(&v->lock);
+
+    SharedFrame *end = shared_frame_create(NULL, 0);
+    if (!end) return;
+    viewer_push(v, end);
+    shared_frame_release(end);
+}
+
+static void channel_release(Channel *ch) {
+    if (__atomic_sub_fetch(&ch->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&ch->lock);
+        free(ch->viewers);
+        free(ch);
+    }
+}
+
+// 只有已登入的 publisher 能開台，頻道名稱須為自己的 username 或 <username>/<名稱>，不能冒用別人的頻道
+static int channel_name_allowed(const Connection *conn, const char *name) {
+    if (!conn->logged_in) return 0;
+    size_t len = strlen(conn->username);
+    if (strncmp(name, conn->username, len) != 0) return 0;
+    return name[len] == '\0' || (name[len] == '/' && name[len + 1] != '\0');
+}
+
+// publisher 開台；同名頻道正在直播時回傳 NULL
+static Channel *channel_open(const char *name) {
+    pthread_mutex_lock(&channels_lock);
+    for (Channel *ch = channels; ch; ch = ch->next) {
+        if (strcmp(ch->name, name) == 0) {
+            pthread_mutex_unlock(&channels_lock);
+            return NULL;
+        }
+    }
+    Channel *ch = (Channel *)calloc(1, sizeof(Channel));
+    if (ch) {
+        snprintf(ch->name, sizeof(ch->name), "%s", name);
+        pthread_mutex_init(&ch->lock, NULL);
+        ch->refcnt = 1;
+        ch->live = 1;
+        ch->next = channels;
+        channels = ch;
+        __atomic_fetch_add(&relay_channels, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&channels_lock);
+    return ch;
+}
+
+// 只是提示 (不加鎖)：delta 串流沒有觀眾時不必重新編碼 JPEG
+static int channel_has_viewers(Channel *ch) {
+    return __atomic_load_n(&ch->viewer_count, __ATOMIC_RELAXED) > 0;
+}
+
+// WATCH 查詢頻道，找到時多持有一個 reference
+static Channel *channel_find(const char *name) {
+    pthread_mutex_lock(&channels_lock);
+    Channel *ch = channels;
+    while (ch && strcmp(ch->name, name) != 0) ch = ch->next;
+    if (ch) __atomic_fetch_add(&ch->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&channels_lock);
+    return ch;
+}
+
+// 送給目前所有觀眾；沒有觀眾時不配置任何東西
+static void channel_publish(Channel *ch, const void *jpeg, uint32_t len) {
+    pthread_mutex_lock(&ch->lock);
+    if (ch->viewer_count > 0) {
+        SharedFrame *frame = shared_frame_create(jpeg, len);
+        if (frame) {
+            for (int i = 0; i < ch->viewer_count; i++) viewer_push(ch->viewers[i], frame);
+            shared_frame_release(frame);
+        }
+    }
+    pthread_mutex_unlock(&ch->lock);
+}
+
+// publisher 結束：從 registry 移除，通知所有觀眾串流結束
+static void channel_close(Channel *ch) {
+    pthread_mutex_lock(&channels_lock);
+    for (Channel **slot = &channels; *slot; slot = &(*slot)->next) {
+        if (*slot == ch) {
+            *slot = ch->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channels_lock);
+    __atomic_fetch_sub(&relay_channels, 1, __ATOMIC_RELAXED);
+
+    SharedFrame *end = shared_frame_create(NULL, 0);
+    pthread_mutex_lock(&ch->lock);
+    ch->live = 0;
+    for (int i = 0; end && i < ch->viewer_count; i++) viewer_push(ch->viewers[i], end);
+    pthread_mutex_unlock(&ch->lock);
+    if (end) shared_frame_release(end);
+    channel_release(ch);
+}
+
+// relay loop 內執行：頻道已結束時回傳 -1
+static int channel_join(Channel *ch, Viewer *v) {
+    int ret = -1;
+    pthread_mutex_lock(&ch->lock);
+    if (ch->live && ch->viewer_count == ch->viewer_cap) {
+        int cap = ch->viewer_cap ? ch->viewer_cap * 2 : 8;
+        Viewer **viewers = (Viewer **)realloc(ch->viewers, cap * sizeof(Viewer *));
+        if (viewers) {
+            ch->viewers = viewers;
+            ch->viewer_cap = cap;
+        }
+    }
+    if (ch->live && ch->viewer_count < ch->viewer_cap) {
+        ch->viewers[ch->viewer_count++] = v;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ch->lock);
+    return ret;
+}
+
+static void channel_leave(Channel *ch, Viewer *v) {
+    pthread_mutex_lock(&ch->lock);
+    for (int i = 0; i < ch->viewer_count; i++) {
+        if (ch->viewers[i] == v) {
+            ch->viewers[i] = ch->viewers[--ch->viewer_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ch->lock);
+    channel_release(ch);
+}
+
+// WATCH <頻道>：建立觀眾狀態，連線接著會被移交給 relay loop；頻道不存在時回傳 -1
+static int relay_watch(Connection *conn, const char *name) {
+    Channel *ch = channel_find(name);
+    if (!ch) return -1;
+    Viewer *v = (Viewer *)calloc(1, sizeof(Viewer));
+    if (!v) {
+        channel_release(ch);
+        return -1;
+    }
+    pthread_mutex_init(&v->lock, NULL);
+    v->conn = conn;
+    v->channel = ch;
+    v->loop = &relay_loops[__atomic_fetch_add(&relay_next_loop, 1, __ATOMIC_RELAXED) % relay_loop_count];
+    conn->viewer = v;
+    __atomic_fetch_add(&relay_viewers, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// event loop 已把連線從自己的 epoll 移除後呼叫
+static void relay_attach(Connection *conn) {
+    RelayLoop *loop = conn->viewer->loop;
+    pthread_mutex_lock(&loop->lock);
+    conn->viewer->next = loop->attach;
+    loop->attach = conn->viewer;
+    pthread_mutex_unlock(&loop->lock);
+    relay_wake(loop);
+}
+
+// 離開頻道並釋放觀眾狀態；之後 publisher 不會再碰到這個 Viewer
+static void relay_detach(Viewer *v) {
+    RelayLoop *loop = v->loop;
+    channel_leave(v->channel, v);
+    pthread_mutex_lock(&loop->lock);
+    if (v->ready) {
+        for (Viewer **slot = &loop->ready; *slot; slot = &(*slot)->next) {
+            if (*slot == v) {
+                *slot = v->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+    while (v->count > 0) viewer_remove_locked(v, 0);
+    pthread_mutex_destroy(&v->lock);
+    v->conn->viewer = NULL;
+    free(v);
+    __atomic_fetch_sub(&relay_viewers, 1, __ATOMIC_RELAXED);
+}
+
+// 觀眾送來的任何資料都視為停止要求；回傳 -1 代表斷線
+static int relay_read_input(Viewer *v) {
+    char buffer[COMMAND_BUFFER_SIZE];
+    while (1) {
+        ERR_clear_error();
+        int n = SSL_read(v->conn->ssl, buffer, sizeof(buffer));
+        if (n > 0) {
+            metrics_add_bytes(n, 0);
+            viewer_stop(v);
+            continue;
+        }
+        int err = SSL_get_error(v->conn->ssl, n);
+        return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? 0 : -1;
+    }
+}
+
+// 盡量送出 queue 中的 frame：回傳 1 代表結束標記已送出、0 代表送完或需等待 EPOLLOUT、-1 代表斷線
+static int relay_flush(Viewer *v) {
+    Connection *conn = v->conn;
+    v->want_out = 0;
+
+    // WATCH 的回覆可能還在 wbuf 中
+    int err = conn_flush(conn);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+        v->want_out = 1;
+        return 0;
+    }
+    if (err != SSL_ERROR_NONE) return -1;
+
+    while (1) {
+        pthread_mutex_lock(&v->lock);
+        if (v->count == 0) {
+            pthread_mutex_unlock(&v->lock);
+            return 0;
+        }
+        SharedFrame *frame = v->queue[v->head];
+        v->started = 1;
+        uint32_t offset = v->offset;
+        pthread_mutex_unlock(&v->lock);
+
+        // 只有 relay loop 會移除已開始送出的 frame，放開鎖寫入時 frame 不會被釋放
+        size_t len = v->retry ? v->retry : frame->len - offset;
+        ERR_clear_error();
+        int sent = SSL_write(conn->ssl, frame->data + offset, (int)len);
+        if (sent <= 0) {
+            err = SSL_get_error(conn->ssl, sent);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                v->retry = len; // OpenSSL 要求以相同資料與長度重試
+                v->want_out = 1;
+                return 0;
+            }
+            return -1;
+        }
+        v->retry = 0;
+        metrics_add_bytes(0, sent);
+
+        pthread_mutex_lock(&v->lock);
+        v->offset += sent;
+        int finished = v->offset == frame->len;
+        int end = shared_frame_is_end(frame);
+        if (finished) {
+            v->head = (v->head + 1) % RELAY_QUEUE_FRAMES;
+            v->count--;
+            v->started = 0;
+            v->offset = 0;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (!finished) continue;
+        shared_frame_release(frame);
+        if (end) return 1;
+        __atomic_fetch_add(&relay_frames_sent, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// 依 relay_read_input / relay_flush 的結果更新 epoll，或結束觀看
+static void relay_update(RelayLoop *loop, Viewer *v, int ret) {
+    Connection *conn = v->conn;
+    if (ret != 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        relay_detach(v);
+        if (ret < 0) {
+            conn_close(conn);
+        } else {
+            // 觀看結束，連線交回 event loop
+            conn->state = CONN_READY;
+            conn_arm(conn, EPOLL_CTL_ADD);
+        }
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (v->want_out ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = v;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void *relay_loop_thread(void *arg) {
+    RelayLoop *loop = (RelayLoop *)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERROR] relay epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Viewer *v = (Viewer *)events[i].data.ptr;
+            if (!v) {
+                uint64_t count;
+                if (read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("[ERROR] relay wake");
+                continue;
+            }
+            int ret = relay_read_input(v);
+            if (ret == 0) ret = relay_flush(v);
+            relay_update(loop, v, ret);
+        }
+
+        // 新觀眾與有新 frame 的觀眾在處理完 socket 事件後才處理，避免碰到剛被釋放的 Viewer
+        pthread_mutex_lock(&loop->lock);
+        Viewer *attach = loop->attach;
+        Viewer *ready = loop->ready;
+        loop->attach = NULL;
+        loop->ready = NULL;
+        pthread_mutex_unlock(&loop->lock);
+
+        while (attach) {
+            Viewer *v = attach;
+            attach = v->next;
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.ptr = v;
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, v->conn->fd, &ev);
+            if (channel_join(v->channel, v) < 0) viewer_stop(v); // 頻道在 WATCH 之後已結束
+            relay_update(loop, v, relay_flush(v));
+        }
+        while (ready) {
+            Viewer *v = ready;
+            ready = v->next;
+            pthread_mutex_lock(&v->lock);
+            v->ready = 0;
+            pthread_mutex_unlock(&v->lock);
+            if (!v->want_out) relay_update(loop, v, relay_flush(v)); // 等 EPOLLOUT 時由 socket 事件接手
+        }
+    }
+    return NULL;
+}
+
+void relay_init(int count) {
+    relay_loop_count = count;
+    relay_loops = (RelayLoop *)calloc(count, sizeof(RelayLoop));
+    for (int i = 0; i < count; i++) {
+        RelayLoop *loop = &relay_loops[i];
+        pthread_mutex_init(&loop->lock, NULL);
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epfd < 0 || loop->wakefd < 0) {
+            perror("[ERROR] relay loop");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, relay_loop_thread, loop);
+        pthread_detach(thread_id);
+    }
+}
+
+static void relay_format_stats(char *out, size_t out_size) {
+    snprintf(out, out_size, "relay loops=%d channels=%ld viewers=%ld sent=%lu dropped=%lu\n", relay_loop_count,
+             __atomic_load_n(&relay_channels, __ATOMIC_RELAXED),
+             __atomic_load_n(&relay_viewers, __ATOMIC_RELAXED),
+             __atomic_load_n(&relay_frames_sent, __ATOMIC_RELAXED),
+             __atomic_load_n(&relay_frames_dropped, __ATOMIC_RELAXED));
+}
+
+// ========== 影片串流 ==========
+// I/O 端 (job_pool 執行緒) 只負責把 frame 讀進每條串流的 ring buffer，解碼與輸出在 decode_pool。
+// 每條串流同一時間最多只有一個 drain task，所以同一串流的 frame 依序處理，不同串流可平行解碼。
+// ring 滿時預設丟掉最舊的 frame (畫面只需要最新的)；-B 改為讓 I/O 端等待，適合錄影等不能掉 frame 的 sink。
+// 收到的 frame 交給 sink：gui (OpenCV 視窗)、null (只解碼，量測用)、record (原始 JPEG 存到 store/)。
+// +delta 串流 (格式見 protocol.h) 由 drain task 依 keyframe / tile delta 重建畫面再交給 sink：畫面沒變的 frame
+// 不需解碼，只有變動的 tile 需要解一張小 mosaic。record sink 與觀眾需要 JPEG 時才把重建的畫面重新編碼。
+// 丟過 frame 後 delta 失去基準，之後的 delta 一律丟掉直到下一張 keyframe，並在 feedback 中要求 client 補送。
+
+typedef struct VideoSink {
+    const char *name;
+    int needs_decode;               // record 直接寫原始 JPEG，不需要解碼
+    void *(*open)(Connection *conn);
+    // 回傳非 0 代表要求結束串流 (例如 GUI 視窗按下 ESC)；time_us 為 server 收到該 frame 的時間
+    int (*frame)(void *state, const std::vector<uchar> &jpeg, const cv::Mat &frame, uint64_t time_us);
+    void (*close)(void *state);
+} VideoSink;
+
+typedef struct VideoStream {
+    pthread_mutex_t lock;
+    pthread_cond_t space;           // -B 模式下 I/O 端等待空位
+    std::vector<uchar> ring[VIDEO_RING_FRAMES];
+    uint64_t ring_time[VIDEO_RING_FRAMES];      // 收到該 frame 的時間
+    int head, count;
+    int draining;                   // 已經有 drain task 在 decode_pool 中
+    int closing;                    // I/O 端已結束，drain 完就釋放
+    int stop;                       // sink 要求結束
+    unsigned long dropped;          // 這條串流因 ring 滿而丟掉的 frame
+    const VideoSink *sink;
+    void *sink_state;
+    int delta;                      // +delta 串流
+    int resync;                     // 等待 keyframe (丟過 frame 或解碼失敗)
+    int key_requested;              // 已在 feedback 中要求 keyframe
+    cv::Mat reference;              // 重建出的目前畫面，只有 drain task 存取
+    std::vector<uchar> output_jpeg; // 目前畫面的 JPEG (給 record sink / 觀眾)
+    Channel *channel;               // delta 串流改由 drain task 轉發重建後的畫面
+} VideoStream;
+
+static const VideoSink *video_sink;
+static int video_block_when_full = 0;
+static long video_active_streams = 0;
+static unsigned long video_frames_received = 0;
+static unsigned long video_frames_decoded = 0;
+static unsigned long video_frames_dropped = 0;
+static unsigned long video_decode_errors = 0;
+static unsigned long video_keyframes = 0;
+static unsigned long video_delta_frames = 0;
+static unsigned long video_delta_tiles = 0;
+
+// --- gui sink ---
+// HighGUI 不是 thread-safe，所有視窗都由同一個 GUI 執行緒顯示；decode worker 只更新最新畫面。
+// 顯示頻率跟著 waitKey(GUI_REFRESH_MS)，不會再限制收 frame 的速度。
+
+typedef struct GuiWindow {
+    struct GuiWindow *next;
+    char name[64];
+    cv::Mat frame;
+    int updated;
+    int closed;
+    int esc;
+} GuiWindow;
+
+static GuiWindow *gui_windows;
+static pthread_mutex_t gui_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gui_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t gui_once = PTHREAD_ONCE_INIT;
+
+// 只有 GUI 執行緒會移除節點，因此放開鎖顯示畫面時手上的節點不會被釋放
+static void *gui_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&gui_lock);
+    while (1) {
+        while (!gui_windows) pthread_cond_wait(&gui_cond, &gui_lock);
+        GuiWindow **slot = &gui_windows;
+        while (*slot) {
+            GuiWindow *win = *slot;
+            if (win->closed) {
+                *slot = win->next;
+                pthread_mutex_unlock(&gui_lock);
+                cv::destroyWindow(win->name);
+                delete win;
+                pthread_mutex_lock(&gui_lock);
+                continue;
+            }
+            if (win->updated) {
+                cv::Mat frame = win->frame; // 共用資料，不複製
+                win->updated = 0;
+                pthread_mutex_unlock(&gui_lock);
+                cv::imshow(win->name, frame);
+                pthread_mutex_lock(&gui_lock);
+            }
+            slot = &win->next;
+        }
+        pthread_mutex_unlock(&gui_lock);
+        int key = cv::waitKey(GUI_REFRESH_MS);
+        pthread_mutex_lock(&gui_lock);
+        if (key == 27) { // ESC：結束所有正在顯示的串流
+            LOG_DEBUG("[DEBUG] ESC pressed. Stopping stream.\n");
+            for (GuiWindow *win = gui_windows; win; win = win->next) win->esc = 1;
+        }
+    }
+    return NULL;
+}
+
+static void gui_start() {
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, gui_thread, NULL);
+    pthread_detach(thread_id);
+}
+
+static void *gui_sink_open(Connection *conn) {
+    pthread_once(&gui_once, gui_start);
+    GuiWindow *win = new GuiWindow();
+    snprintf(win->name, sizeof(win->name), "Video Stream %llu", (unsigned long long)conn->id);
+    pthread_mutex_lock(&gui_lock);
+    win->next = gui_windows;
+    gui_windows = win;
+    pthread_cond_signal(&gui_cond);
+    pthread_mutex_unlock(&gui_lock);
+    return win;
+}
+
+static int gui_sink_frame(void *state, const std::vector<uchar> &jpeg, const cv::Mat &frame, uint64_t time_us) {
+    GuiWindow *win = (GuiWindow *)state;
+    (void)jpeg;
+    (void)time_us;
+    pthread_mutex_lock(&gui_lock);
+    win->frame = frame;
+    win->updated = 1;
+    int esc = win->esc;
+    pthread_mutex_unlock(&gui_lock);
+    return esc;
+}
+
+static void gui_sink_close(void *state) {
+    GuiWindow *win = (GuiWindow *)state;
+    pthread_mutex_lock(&gui_lock);
+    win->closed = 1;
+    pthread_mutex_unlock(&gui_lock);
+}
+
+// --- null sink ---
+
+static void *null_sink_open(Connection *conn) {
+    (void)conn;
+    return NULL;
+}
+
+static int null_sink_frame(void *state, const std::vector<uchar> &jpeg, const cv::Mat &frame, uint64_t time_us) {
+    (void)state;
+    (void)jpeg;
+    (void)frame;
+    (void)time_us;
+    return 0;
+}
+
+static void null_sink_close(void *state) {
+    (void)state;
+}
+
+// --- record sink ---
+// 不解碼也不重新編碼，收到的 JPEG 依序串接成 MJPEG 分段：每 VIDEO_SEGMENT_SECONDS 秒 (或 VIDEO_SEGMENT_MAX_BYTES) 一段。
+// 錄製中寫到 store/.rec-<n>.<段號>.mjpg，一段結束就改名為 store/<user>-<時間>-<n>.<段號>.mjpg，錄影還沒結束即可用 RECEIVE_FILE 下載。
+// 索引放在 RECORD_INDEX_DIR：每段一個 <段落>.idx ("<毫秒> <offset> <大小>"，時間為 server 收到 frame 時距錄影開始的毫秒)，
+// 整個錄影的段落列在 <user>-<時間>-<n>.segments ("<段落檔名> <開始毫秒> <結束毫秒> <frame 數> <bytes>")，SEEK_RECORDING 依此把時間換成段落與 offset。
+// frame 先累積進上傳 pipeline 的 1 MiB buffer，交給 disk writer 執行緒批次 pwrite：多條串流同時錄影時磁碟看到的是
+// 少量的大塊循序寫入，decode worker 只有在 buffer 全部用完時才會等待磁碟。
+// 換段時的收尾 (fdatasync、寫索引、改名) 也排在該段的寫入之後交給 disk writer，decode worker 直接開始寫下一段；
+// 同一個錄影的段落依段號順序收尾，.segments 只會依序追加。
+
+typedef struct RecordState RecordState;
+
+typedef struct {                                // 一個段落；換段後交給 disk writer 收尾並釋放
+    RecordState *rec;
+    Upload out;                                 // 段落的 fd 與在途的寫入
+    char temp_path[64];
+    int segment;                                // 段號
+    uint64_t start_ms, last_ms;
+    uint64_t size;                              // bytes (含還沒交給 disk writer 的 rec->buf)
+    unsigned long frames;
+    std::string index;                          // .idx 內容
+} RecordSegment;
+
+struct RecordState {
+    char base[USERNAME_BUFFER_SIZE + 48];       // <user>-<時間>-<n>
+    unsigned long seq;
+    RecordSegment *cur;                         // 寫入中的段落
+    UploadBuffer *buf;                          // 還沒交給 disk writer 的資料
+    uint64_t buf_offset;                        // buf 在段落中的位置
+    int next_segment;
+    uint64_t start_us;                          // 第一個 frame 的時間
+    pthread_mutex_t lock;
+    pthread_cond_t finished_cond;
+    int refs;                                   // sink 本身 + 還沒收尾的段落
+    int finished;                               // 已收尾的段落數 (也是下一個可以收尾的段號)
+    int saved;                                  // 成功存下的段落數
+    std::string manifest;                       // .segments 內容，只由輪到收尾的段落修改
+};
+
+static unsigned long record_sequence = 0;
+
+// 先寫 RECORD_INDEX_DIR/.<name>.tmp 再 rename，SEEK_RECORDING 不會讀到寫一半的索引
+static int write_record_index(const char *name, const std::string &data) {
+    char path[sizeof(RECORD_INDEX_DIR) + USERNAME_BUFFER_SIZE * 2 + 8];
+    char tmp_path[sizeof(RECORD_INDEX_DIR) + USERNAME_BUFFER_SIZE * 2 + 8];
+    snprintf(path, sizeof(path), RECORD_INDEX_DIR "/%s", name);
+    snprintf(tmp_path, sizeof(tmp_path), RECORD_INDEX_DIR "/.%s.tmp", name);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) return -1;
+    int ok = fwrite(data.data(), 1, data.size(), file) == data.size() && fflush(file) == 0 &&
+             fdatasync(fileno(file)) == 0;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int record_segment_open(RecordState *rec) {
+    RecordSegment *seg = new RecordSegment();
+    seg->rec = rec;
+    seg->segment = rec->next_segment;
+    snprintf(seg->temp_path, sizeof(seg->temp_path), "./store/.rec-%lu.%03d.mjpg", rec->seq, seg->segment);
+    seg->out.fd = open(seg->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->out.fd < 0) {
+        perror("[ERROR] Failed to open recording segment");
+        delete seg;
+        return -1;
+    }
+    pthread_mutex_init(&seg->out.lock, NULL);
+    pthread_cond_init(&seg->out.done, NULL);
+    rec->next_segment++;
+    rec->cur = seg;
+    rec->buf = NULL;
+    pthread_mutex_lock(&rec->lock);
+    rec->refs++;
+    pthread_mutex_unlock(&rec->lock);
+    return 0;
+}
+
+// 複製進 buffer，滿了就交給 disk writer
+static void record_write(RecordState *rec, const unsigned char *data, size_t len) {
+    RecordSegment *seg = rec->cur;
+    while (len > 0) {
+        if (!rec->buf) {
+            rec->buf = upload_buffer_acquire();
+            rec->buf_offset = seg->size;
+        }
+        size_t n = UPLOAD_BUFFER_SIZE - rec->buf->len;
+        if (n > len) n = len;
+        memcpy(rec->buf->data + rec->buf->len, data, n);
+        rec->buf->len += n;
+        seg->size += n;
+        data += n;
+        len -= n;
+        if (rec->buf->len == UPLOAD_BUFFER_SIZE) {
+            upload_submit_write(&seg->out, rec->buf, rec->buf_offset);
+            rec->buf = NULL;
+        }
+    }
+}
+
+static void record_release(RecordState *rec) {
+    pthread_mutex_lock(&rec->lock);
+    int last = --rec->refs == 0;
+    pthread_mutex_unlock(&rec->lock);
+    if (!last) return;
+    if (rec->saved > 0) LOG_INFO("[RECORD] Recording %s finished (%d segment(s))\n", rec->base, rec->saved);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->finished_cond);
+    delete rec;
+}
+
+// disk writer task：該段的寫入都已排在前面，等它們寫完並落地後改成正式檔名，再依段號順序更新 .segments；
+// 空的或寫入失敗的段落直接刪掉
+static void record_segment_finish(void *arg) {
+    RecordSegment *seg = (RecordSegment *)arg;
+    RecordState *rec = seg->rec;
+    upload_wait_idle(&seg->out);
+    int ok = !seg->out.error && seg->frames > 0 && fdatasync(seg->out.fd) == 0;
+    close(seg->out.fd);
+    pthread_mutex_destroy(&seg->out.lock);
+    pthread_cond_destroy(&seg->out.done);
+
+    char name[USERNAME_BUFFER_SIZE * 2], path[USERNAME_BUFFER_SIZE * 2 + 16];
+    snprintf(name, sizeof(name), "%s.%03d.idx", rec->base, seg->segment);
+    if (ok) ok = write_record_index(name, seg->index) == 0;
+    snprintf(name, sizeof(name), "%s.%03d.mjpg", rec->base, seg->segment);
+    snprintf(path, sizeof(path), "./store/%s", name);
+    if (!ok || rename(seg->temp_path, path) < 0) {
+        if (seg->frames > 0) LOG_ERROR("[ERROR] Failed to save recording segment %s\n", name);
+        unlink(seg->temp_path);
+        ok = 0;
+    }
+
+    // 前一段由另一個 disk writer 執行緒收尾時 (它一定較早被取出)，等它更新完 .segments
+    pthread_mutex_lock(&rec->lock);
+    while (rec->finished != seg->segment) pthread_cond_wait(&rec->finished_cond, &rec->lock);
+    pthread_mutex_unlock(&rec->lock);
+    if (ok) {
+        char line[USERNAME_BUFFER_SIZE * 2 + 96];
+        snprintf(line, sizeof(line), "%s %llu %llu %lu %llu\n", name, (unsigned long long)seg->start_ms,
+                 (unsigned long long)seg->last_ms, seg->frames, (unsigned long long)seg->size);
+        rec->manifest += line;
+        snprintf(name, sizeof(name), "%s.segments", rec->base);
+        write_record_index(name, rec->manifest);
+        LOG_INFO("[RECORD] Saved %s.%03d.mjpg (%lu frames)\n", rec->base, seg->segment, seg->frames);
+    }
+    pthread_mutex_lock(&rec->lock);
+    rec->finished++;
+    if (ok) rec->saved++;
+    pthread_cond_broadcast(&rec->finished_cond);
+    pthread_mutex_unlock(&rec->lock);
+    delete seg;
+    record_release(rec);
+}
+
+// 送出剩下的資料後把段落交給 disk writer 收尾，不等磁碟
+static void record_segment_close(RecordState *rec) {
+    RecordSegment *seg = rec->cur;
+    if (!seg) return;
+    rec->cur = NULL;
+    if (rec->buf && rec->buf->len > 0) upload_submit_write(&seg->out, rec->buf, rec->buf_offset);
+    else if (rec->buf) upload_buffer_release(rec->buf);
+    rec->buf = NULL;
+    disk_writer_submit_task(record_segment_finish, seg);
+}
+
+static void *record_sink_open(Connection *conn) {
+    RecordState *rec = new RecordState();
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm_now;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm_now));
+    rec->seq = __atomic_add_fetch(&record_sequence, 1, __ATOMIC_RELAXED);
+    snprintf(rec->base, sizeof(rec->base), "%s-%s-%lu", conn->logged_in ? conn->username : "anonymous", stamp, rec->seq);
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->finished_cond, NULL);
+    rec->refs = 1;
+    if (record_segment_open(rec) < 0) {
+        record_release(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+static int record_sink_frame(void *state, const std::vector<uchar> &jpeg, const cv::Mat &frame, uint64_t time_us) {
+    RecordState *rec = (RecordState *)state;
+    (void)frame;
+    if (!rec || jpeg.empty()) return 0;
+    if (rec->start_us == 0) rec->start_us = time_us;
+    uint64_t ms = (time_us - rec->start_us) / 1000;
+    RecordSegment *seg = rec->cur;
+    if (seg && seg->frames > 0 && (ms - seg->start_ms >= VIDEO_SEGMENT_SECONDS * 1000ULL ||
+                                   seg->size + jpeg.size() > VIDEO_SEGMENT_MAX_BYTES)) {
+        record_segment_close(rec);
+    }
+    if (!rec->cur && record_segment_open(rec) < 0) return 1;
+    seg = rec->cur;
+    if (seg->frames == 0) seg->start_ms = ms;
+
+    char line[64];
+    snprintf(line, sizeof(line), "%llu %llu %zu\n", (unsigned long long)ms, (unsigned long long)seg->size,
+             jpeg.size());
+    seg->index += line;
+    record_write(rec, jpeg.data(), jpeg.size());
+    seg->frames++;
+    seg->last_ms = ms;
+
+    pthread_mutex_lock(&seg->out.lock);
+    int error = seg->out.error;
+    pthread_mutex_unlock(&seg->out.lock);
+    if (error) {
+        LOG_ERROR("[ERROR] Failed to write recording %s\n", rec->base);
+        return 1;
+    }
+    return 0;
+}
+
+static void record_sink_close(void *state) {
+    RecordState *rec = (RecordState *)state;
+    if (!rec) return;
+    record_segment_close(rec);
+    record_release(rec);
+}
+
+// SEEK_RECORDING <錄影名稱> <毫秒>：回傳 "<段落檔名> <offset> <frame 毫秒>"，即該時間點 (含) 之前的最後一個 frame，
+// client 再以 RECEIVE_FILE <段落檔名> <offset> 從這個 frame 開始下載。只找得到已經完成的段落
+void handle_seek_recording(Connection *conn, const char *buffer) {
+    char name[USERNAME_BUFFER_SIZE];
+    char path[sizeof(RECORD_INDEX_DIR) + USERNAME_BUFFER_SIZE * 2 + 8];
+    char segment[USERNAME_BUFFER_SIZE * 2], found[USERNAME_BUFFER_SIZE * 2];
+    unsigned long long target = 0;
+    name[0] = found[0] = '\0';
+    if (sscanf(buffer, "SEEK_RECORDING %127s %llu", name, &target) < 2 || !is_valid_store_name(name)) {
+        conn_reply(conn, "Seek command parse error\n");
+        return;
+    }
+
+    // 開始時間不晚於目標的最後一段 (目標在錄影開始前時取第一段)
+    snprintf(path, sizeof(path), RECORD_INDEX_DIR "/%s.segments", name);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        conn_reply(conn, "Recording not found\n");
+        return;
+    }
+    unsigned long long start, end, bytes;
+    unsigned long frames;
+    while (fscanf(file, "%255s %llu %llu %lu %llu", segment, &start, &end, &frames, &bytes) == 5) {
+        if (found[0] != '\0' && start > target) break;
+        strcpy(found, segment);
+    }
+    fclose(file);
+    size_t len = strlen(found);
+    if (len < 5) {
+        conn_reply(conn, "Recording not found\n");
+        return;
+    }
+
+    // 段落內：時間不晚於目標的最後一個 frame
+    snprintf(path, sizeof(path), RECORD_INDEX_DIR "/%.*s.idx", (int)(len - 5), found); // 去掉 ".mjpg"
+    file = fopen(path, "r");
+    unsigned long long ms, offset, size, hit_ms = 0, hit_offset = 0;
+    int hits = 0;
+    while (file && fscanf(file, "%llu %llu %llu", &ms, &offset, &size) == 3) {
+        if (hits > 0 && ms > target) break;
+        hit_ms = ms;
+        hit_offset = offset;
+        hits++;
+    }
+    if (file) fclose(file);
+    if (hits == 0) {
+        conn_reply(conn, "Recording index not found\n");
+        return;
+    }
+    char reply[USERNAME_BUFFER_SIZE * 2 + 48];
+    snprintf(reply, sizeof(reply), "%s %llu %llu\n", found, hit_offset, hit_ms);
+    conn_reply(conn, reply);
+}
+
+static const VideoSink video_sinks[] = {
+    {"gui", 1, gui_sink_open, gui_sink_frame, gui_sink_close},
+    {"null", 1, null_sink_open, null_sink_frame, null_sink_close},
+    {"record", 0, record_sink_open, record_sink_frame, record_sink_close},
+};
+
+static const VideoSink *video_sink_find(const char *name) {
+    for (size_t i = 0; i < sizeof(video_sinks) / sizeof(video_sinks[0]); i++) {
+        if (strcmp(video_sinks[i].name, name) == 0) return &video_sinks[i];
+    }
+    return NULL;
+}
+
+// 沒有指定時：有 DISPLAY 才開視窗，headless server 只解碼
+void video_init(const char *sink_name) {
+    const char *display = getenv("DISPLAY");
+    video_sink = video_sink_find(sink_name ? sink_name : (display && display[0] ? "gui" : "null"));
+    if (!video_sink) {
+        fprintf(stderr, "Unknown video sink '%s' (gui, null, record)\n", sink_name);
+        exit(EXIT_FAILURE);
+    }
+    if (strcmp(video_sink->name, "record") == 0) mkdir(RECORD_INDEX_DIR, 0700);
+    if (strcmp(video_sink->name, "gui") == 0 && !(display && display[0])) {
+        LOG_WARN("[WARN] No DISPLAY, using null video sink.\n");
+        video_sink = video_sink_find("null");
+    }
+}
+
+// --- 串流 / ring buffer ---
+
+static void video_stream_destroy(VideoStream *stream) {
+    stream->sink->close(stream->sink_state);
+    if (stream->channel) channel_release(stream->channel);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->space);
+    delete stream;
+    __atomic_fetch_sub(&video_active_streams, 1, __ATOMIC_RELAXED);
+}
+
+// 依 keyframe / tile delta 更新 stream->reference；*changed 表示畫面是否有變動。
+// 格式錯誤或解碼失敗回傳 -1 (reference 不變，需等下一張 keyframe)
+static int video_apply_delta(VideoStream *stream, std::vector<uchar> &payload, int *changed) {
+    *changed = 1;
+    if (!payload.empty() && payload[0] == VIDEO_FRAME_KEY) {
+        payload.erase(payload.begin()); // 剩下的就是 JPEG，可以直接給 record sink / 觀眾
+        cv::Mat frame = cv::imdecode(payload, cv::IMREAD_COLOR);
+        if (frame.empty()) return -1;
+        stream->reference = frame;
+        stream->output_jpeg.swap(payload);
+        __atomic_fetch_add(&video_keyframes, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    VideoDeltaHeader header;
+    cv::Mat &ref = stream->reference;
+    if (ref.empty() || video_delta_decode_header(payload.data(), payload.size(), &header) < 0) return -1;
+    if (header.width != ref.cols || header.height != ref.rows) return -1;
+    __atomic_fetch_add(&video_delta_frames, 1, __ATOMIC_RELAXED);
+    if (header.count == 0) {
+        *changed = 0;
+        return 0;
+    }
+
+    size_t offset = VIDEO_DELTA_HEADER_SIZE + (size_t)header.count * 2;
+    if (offset >= payload.size()) return -1;
+    cv::Mat mosaic = cv::imdecode(cv::Mat(1, (int)(payload.size() - offset), CV_8UC1, payload.data() + offset),
+                                  cv::IMREAD_COLOR);
+    int columns = header.count < VIDEO_MOSAIC_COLUMNS ? header.count : VIDEO_MOSAIC_COLUMNS;
+    int rows = (header.count + columns - 1) / columns;
+    if (mosaic.empty() || mosaic.cols < columns * header.tile || mosaic.rows < rows * header.tile) return -1;
+
+    // sink (GUI) 可能還持有上一張畫面，改在複本上套用 tile
+    cv::Mat frame = ref.clone();
+    int tiles = video_tile_count(header.width, header.height, header.tile);
+    for (int i = 0; i < header.count; i++) {
+        uint16_t net_index;
+        memcpy(&net_index, payload.data() + VIDEO_DELTA_HEADER_SIZE + i * 2, sizeof(net_index));
+        int index = ntohs(net_index);
+        if (index >= tiles) return -1;
+        int x, y, w, h;
+        video_tile_rect(header.width, header.height, header.tile, index, &x, &y, &w, &h);
+        int mx = i % columns * header.tile, my = i / columns * header.tile;
+        for (int r = 0; r < h; r++) memcpy(frame.ptr(y + r) + x * 3, mosaic.ptr(my + r) + mx * 3, (size_t)w * 3);
+    }
+    stream->reference = frame;
+    __atomic_fetch_add(&video_delta_tiles, header.count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void video_deliver_delta(VideoStream *stream, std::vector<uchar> &payload, uint64_t time_us) {
+    int keyframe = !payload.empty() && payload[0] == VIDEO_FRAME_KEY;
+    int changed;
+    uint64_t start = metrics_now_us();
+    if (video_apply_delta(stream, payload, &changed) < 0) {
+        __atomic_fetch_add(&video_decode_errors, 1, __ATOMIC_RELAXED);
+        LOG_WARN("[WARN] Failed to decode delta frame, waiting for keyframe.\n");
+        pthread_mutex_lock(&stream->lock);
+        stream->resync = 1;
+        stream->key_requested = 0;
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+    metrics_record_decode(metrics_now_us() - start);
+    __atomic_fetch_add(&video_frames_decoded, 1, __ATOMIC_RELAXED);
+
+    // keyframe 的 JPEG 直接沿用；delta 有變動時，只在有人需要 JPEG 時才重新編碼
+    int viewers = stream->channel && channel_has_viewers(stream->channel);
+    if (changed && !keyframe) {
+        if (!stream->sink->needs_decode || viewers) {
+            std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, VIDEO_REENCODE_QUALITY};
+            if (!cv::imencode(".jpg", stream->reference, stream->output_jpeg, params)) stream->output_jpeg.clear();
+        } else {
+            stream->output_jpeg.clear();
+        }
+    }
+    // 畫面沒變時觀眾不需要新 frame；record sink 仍收到上一張，維持 frame 數
+    if (changed && viewers && !stream->output_jpeg.empty()) {
+        channel_publish(stream->channel, stream->output_jpeg.data(), (uint32_t)stream->output_jpeg.size());
+    }
+    if (stream->sink->frame(stream->sink_state, stream->output_jpeg, stream->reference, time_us)) {
+        __atomic_store_n(&stream->stop, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void video_deliver(VideoStream *stream, const std::vector<uchar> &jpeg, uint64_t time_us) {
+    cv::Mat frame;
+    if (stream->sink->needs_decode) {
+        uint64_t start = metrics_now_us();
+        frame = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+        if (frame.empty()) {
+            __atomic_fetch_add(&video_decode_errors, 1, __ATOMIC_RELAXED);
+            LOG_WARN("[WARN] Failed to decode frame.\n");
+            return;
+        }
+        metrics_record_decode(metrics_now_us() - start);
+        __atomic_fetch_add(&video_frames_decoded, 1, __ATOMIC_RELAXED);
+    }
+    if (stream->sink->frame(stream->sink_state, jpeg, frame, time_us)) {
+        __atomic_store_n(&stream->stop, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// decode_pool task：依序處理 ring 中的 frame 直到清空
+static void video_drain_task(void *arg) {
+    VideoStream *stream = (VideoStream *)arg;
+    std::vector<uchar> jpeg;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count > 0) {
+        jpeg.swap(stream->ring[stream->head]); // 換出來的舊 buffer 留在 ring 中重複使用
+        uint64_t time_us = stream->ring_time[stream->head];
+        stream->head = (stream->head + 1) % VIDEO_RING_FRAMES;
+        stream->count--;
+        pthread_cond_signal(&stream->space);
+        int skip = 0;
+        if (stream->delta && stream->resync) {
+            if (!jpeg.empty() && jpeg[0] == VIDEO_FRAME_KEY) {
+                stream->resync = 0;
+                stream->key_requested = 0;
+            } else {
+                // 基準已經不對，套用 delta 只會得到錯的畫面
+                skip = 1;
+                stream->dropped++;
+                __atomic_fetch_add(&video_frames_dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        if (!skip) {
+            if (stream->delta) video_deliver_delta(stream, jpeg, time_us);
+            else video_deliver(stream, jpeg, time_us);
+        }
+
+        pthread_mutex_lock(&stream->lock);
+    }
+    stream->draining = 0;
+    int done = stream->closing;
+    pthread_mutex_unlock(&stream->lock);
+    if (done) video_stream_destroy(stream);
+}
+
+// 把 frame 放進 ring (與 ring 中的空 buffer 交換，不複製)，需要時排程 drain task
+static void video_push(VideoStream *stream, std::vector<uchar> &frame) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == VIDEO_RING_FRAMES && video_block_when_full && !stream->stop) {
+        pthread_cond_wait(&stream->space, &stream->lock);
+    }
+    if (stream->count == VIDEO_RING_FRAMES) {
+        // 丟掉最舊的一張，它的 buffer 就是接下來要放新 frame 的位置
+        std::vector<uchar> &oldest = stream->ring[stream->head];
+        if (stream->delta) {
+            // 丟掉的是回應 key=1 的 keyframe 時要重新要求，否則 client 不會再送
+            if (!oldest.empty() && oldest[0] == VIDEO_FRAME_KEY) stream->key_requested = 0;
+            stream->resync = 1;
+        }
+        stream->head = (stream->head + 1) % VIDEO_RING_FRAMES;
+        stream->count--;
+        stream->dropped++;
+        __atomic_fetch_add(&video_frames_dropped, 1, __ATOMIC_RELAXED);
+    }
+    int slot = (stream->head + stream->count) % VIDEO_RING_FRAMES;
+    stream->ring[slot].swap(frame);
+    stream->ring_time[slot] = metrics_now_us();
+    stream->count++;
+    int schedule = !stream->draining;
+    stream->draining = 1;
+    pthread_mutex_unlock(&stream->lock);
+    if (schedule) pool_submit(&decode_pool, video_drain_task, stream);
+}
+
+static void video_stream_close(VideoStream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = 1;
+    int idle = !stream->draining;
+    pthread_mutex_unlock(&stream->lock);
+    if (idle) video_stream_destroy(stream);
+}
+
+// 回報給 +feedback 的 client：已收到的 frame、ring 滿而丟掉的 frame、等待解碼的 frame；
+// delta 串流失去基準時附上 key=1 (每次只要求一次)
+static void video_send_feedback(SSL *ssl, VideoStream *stream, unsigned long frames) {
+    char line[128];
+    pthread_mutex_lock(&stream->lock);
+    unsigned long dropped = stream->dropped;
+    int depth = stream->count;
+    int key = stream->resync && !stream->key_requested;
+    if (key) stream->key_requested = 1;
+    pthread_mutex_unlock(&stream->lock);
+    int len = snprintf(line, sizeof(line), "FB received=%lu dropped=%lu depth=%d%s\n", frames, dropped, depth,
+                       key ? " key=1" : "");
+    if (SSL_write(ssl, line, len) > 0) metrics_add_bytes(0, len);
+}
+
+// STREAM_VIDEO [頻道] [+feedback] [+delta]：client 連續送 [4 bytes frame 大小][JPEG]，frame_size=0 代表串流結束。
+// 串流期間同時以該頻道名稱轉發給 WATCH 的觀眾。
+// +feedback 時 server 每 250 ms 回一行 "FB received=<n> dropped=<n> depth=<n>" 供 client 調整畫質，
+// sink 要求停止時回 "FB stop" 並繼續讀到 frame_size=0，最後以 "FB end" 結束，client 讀到 end 才送下一個指令。
+// +delta 時先回 "FB codec=delta"，之後的 payload 改為 keyframe / tile delta (見 protocol.h)
+void handle_video_stream(Connection *conn) {
+    SSL *ssl = conn->ssl;
+    char channel_name[USERNAME_BUFFER_SIZE];
+    char args[3][USERNAME_BUFFER_SIZE];
+    int feedback = 0;
+    int delta = 0;
+    channel_name[0] = '\0';
+    int arg_count = sscanf(conn->pending, "STREAM_VIDEO %127s %127s %127s", args[0], args[1], args[2]);
+    for (int i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "+feedback") == 0) feedback = 1;
+        else if (strcmp(args[i], "+delta") == 0) delta = 1;
+        else strcpy(channel_name, args[i]);
+    }
+    if (channel_name[0] == '\0' && conn->logged_in) strcpy(channel_name, conn->username); // 預設以 username 作為頻道名稱
+    Channel *channel = NULL;
+    if (!channel_name_allowed(conn, channel_name)) {
+        if (channel_name[0]) LOG_WARN("[WARN] Not allowed to publish channel '%s', not relaying this stream.\n", channel_name);
+    } else if (!(channel = channel_open(channel_name))) {
+        LOG_WARN("[WARN] Channel '%s' is already live, not relaying this stream.\n", channel_name);
+    }
+    VideoStream *stream = new VideoStream();
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->space, NULL);
+    stream->sink = video_sink;
+    stream->sink_state = video_sink->open(conn);
+    if (!stream->sink_state && video_sink->open != null_sink_open) {
+        stream->sink = video_sink_find("null"); // sink 開不起來仍要把資料讀完，維持協定同步
+    }
+    __atomic_fetch_add(&video_active_streams, 1, __ATOMIC_RELAXED);
+    if (delta) {
+        stream->delta = 1;
+        if (channel) { // drain task 轉發時 publisher 可能已經結束，多持有一個 reference
+            __atomic_fetch_add(&channel->refcnt, 1, __ATOMIC_RELAXED);
+            stream->channel = channel;
+        }
+        SSL_write(ssl, "FB codec=delta\n", strlen("FB codec=delta\n"));
+    }
+
+    std::vector<uchar> frame_buffer;
+    unsigned long frames = 0;
+    uint64_t next_feedback = metrics_now_us() + VIDEO_FEEDBACK_INTERVAL_US;
+    int stopped = 0;
+    while (1) {
+        if (!stopped && __atomic_load_n(&stream->stop, __ATOMIC_RELAXED)) {
+            if (!feedback) break;
+            // 通知 client 停止，之後只讀掉剩下的 frame 直到 frame_size=0，維持協定同步
+            stopped = 1;
+            SSL_write(ssl, "FB stop\n", strlen("FB stop\n"));
+        }
+        uint32_t net_frame_size;
+        if (ssl_read_full(ssl, &net_frame_size, sizeof(net_frame_size)) < 0) {
+            LOG_ERROR("[ERROR] Failed to receive frame size\n");
+            break;
+        }
+
+        uint32_t frame_size = ntohl(net_frame_size);
+        if (frame_size == 0) {
+            // Client 傳 0 代表串流結束
+            LOG_DEBUG("[DEBUG] Received frame_size=0, stopping stream.\n");
+            break;
+        }
+        if (frame_size > VIDEO_FRAME_MAX) {
+            LOG_ERROR("[ERROR] Frame size %u too large, closing stream.\n", frame_size);
+            break;
+        }
+
+        LOG_DEBUG("[DEBUG] Receiving frame of size: %u bytes\n", frame_size);
+        frame_buffer.resize(frame_size);
+        if (ssl_read_full(ssl, frame_buffer.data(), frame_size) < 0) {
+            LOG_ERROR("[ERROR] Received incomplete frame data.\n");
+            break;
+        }
+        metrics_add_bytes(sizeof(net_frame_size) + frame_size, 0);
+        if (stopped) continue;
+        __atomic_fetch_add(&video_frames_received, 1, __ATOMIC_RELAXED);
+        frames++;
+        if (channel && !delta) channel_publish(channel, frame_buffer.data(), frame_size);
+        video_push(stream, frame_buffer);
+        if (feedback && metrics_now_us() >= next_feedback) {
+            video_send_feedback(ssl, stream, frames);
+            next_feedback = metrics_now_us() + VIDEO_FEEDBACK_INTERVAL_US;
+        }
+    }
+    if (feedback) SSL_write(ssl, "FB end\n", strlen("FB end\n"));
+
+    if (channel) channel_close(channel);
+    video_stream_close(stream);
+    LOG_INFO("Video stream ended (%lu frames).\n", frames);
+}
+
+static void video_format_stats(char *out, size_t out_size) {
+    snprintf(out, out_size, "video sink=%s streams=%ld received=%lu decoded=%lu dropped=%lu decode_errors=%lu "
+             "keyframes=%lu deltas=%lu delta_tiles=%lu\n",
+             video_sink ? video_sink->name : "none",
+             __atomic_load_n(&video_active_streams, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_frames_received, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_frames_decoded, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_frames_dropped, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_decode_errors, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_keyframes, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_delta_frames, __ATOMIC_RELAXED),
+             __atomic_load_n(&video_delta_tiles, __ATOMIC_RELAXED));
+}
+
+// ========== 使用者資料庫 ==========
+// user_db 為 append-only 文字 log ("username password\n")，啟動時載入記憶體中的
+// open-addressing hash table；user_db.snap 為定期壓縮出的二進位快照，可直接 mmap，
+// 啟動時只需重播快照之後新增的 log。
+
+typedef struct {
+    size_t hash;                    // 0 代表空槽
+    const char *name;
+    const char *pass;
+    unsigned char name_len, pass_len;
+} UserEntry;
+
+typedef struct {
+    char magic[8];
+    uint64_t log_offset;            // 快照涵蓋到 user_db 的哪個 byte
+    uint32_t count;
+    uint32_t reserved;
+} UserSnapshotHeader;
+
+typedef struct UserArena {
+    struct UserArena *next;
+    size_t used;
+    char data[USER_ARENA_BLOCK];
+} UserArena;
+
+static pthread_rwlock_t user_db_lock = PTHREAD_RWLOCK_INITIALIZER;
+static UserEntry *user_table;
+static size_t user_table_cap;       // 2 的次方
+static size_t user_count;
+static UserArena *user_arena;
+static int user_log_fd = -1;
+static uint64_t user_log_size;      // 目前 user_db 長度
+static uint64_t user_snapshot_offset;
+static int user_compaction_running;
+
+static size_t user_hash(const char *name, size_t len) {
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static char *user_arena_copy(const char *str, size_t len) {
+    if (!user_arena || user_arena->used + len > USER_ARENA_BLOCK) {
+        UserArena *block = (UserArena *)malloc(sizeof(UserArena));
+        if (!block) return NULL;
+        block->next = user_arena;
+        block->used = 0;
+        user_arena = block;
+    }
+    char *dst = user_arena->data + user_arena->used;
+    memcpy(dst, str, len);
+    user_arena->used += len;
+    return dst;
+}
+
+static UserEntry *user_find_slot(const char *name, size_t len, size_t hash) {
+    size_t mask = user_table_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        UserEntry *e = &user_table[i];
+        if (e->hash == 0) return e;
+        if (e->hash == hash && e->name_len == len && memcmp(e->name, name, len) == 0) return e;
+    }
+}
+
+static void user_table_grow() {
+    UserEntry *old = user_table;
+    size_t old_cap = user_table_cap;
+
+    user_table_cap = old_cap ? old_cap * 2 : 1024;
+    user_table = (UserEntry *)calloc(user_table_cap, sizeof(UserEntry));
+    if (!user_table) {
+        perror("[ERROR] Failed to grow user table");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].hash == 0) continue;
+        *user_find_slot(old[i].name, old[i].name_len, old[i].hash) = old[i];
+    }
+    free(old);
+}
+
+// 已存在就不覆蓋 (與原本逐行 fscanf 找第一筆的行為一致)；copy=0 時字串直接指向 mmap 的快照
+static int user_insert(const char *name, size_t name_len, const char *pass, size_t pass_len, int copy) {
+    if (name_len == 0 || name_len >= USERNAME_BUFFER_SIZE || pass_len >= USERNAME_BUFFER_SIZE) return -1;
+    if ((user_count + 1) * 10 > user_table_cap * 7) user_table_grow();
+
+    size_t hash = user_hash(name, name_len);
+    UserEntry *e = user_find_slot(name, name_len, hash);
+    if (e->hash != 0) return 0;
+
+    if (copy) {
+        name = user_arena_copy(name, name_len);
+        pass = user_arena_copy(pass, pass_len);
+        if (!name || !pass) return -1;
+    }
+    e->hash = hash;
+    e->name = name;
+    e->pass = pass;
+    e->name_len = (unsigned char)name_len;
+    e->pass_len = (unsigned char)pass_len;
+    user_count++;
+    return 1;
+}
+
+static const UserEntry *user_lookup(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= USERNAME_BUFFER_SIZE) return NULL;
+    const UserEntry *e = user_find_slot(name, len, user_hash(name, len));
+    return e->hash ? e : NULL;
+}
+
+// 載入快照：回傳快照涵蓋的 log 位置，沒有或格式不符回傳 0
+static uint64_t user_load_snapshot(uint64_t log_size) {
+    int fd = open(USER_DB_SNAPSHOT_PATH, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(UserSnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    char *map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    UserSnapshotHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, USER_SNAPSHOT_MAGIC, 8) != 0 || header.log_offset > log_size) {
+        // user_db 被換掉或截短，快照已不可信，改為重播整份 log
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    // 先確認 count 筆記錄都完整；快照被截短時只載入一部分會漏掉只存在於缺少部分的使用者，
+    // 而 log 又只從 log_offset 重播，因此整份快照不用，改為重播整份 log
+    const char *start = map + sizeof(header);
+    const char *end = map + st.st_size;
+    const char *p = start;
+    uint32_t records = 0;
+    while (records < header.count && p + 2 <= end) {
+        size_t name_len = (unsigned char)p[0];
+        size_t pass_len = (unsigned char)p[1];
+        if (name_len == 0 || name_len >= USERNAME_BUFFER_SIZE || pass_len >= USERNAME_BUFFER_SIZE ||
+            p + 2 + name_len + pass_len > end) {
+            break;
+        }
+        p += 2 + name_len + pass_len;
+        records++;
+    }
+    if (records != header.count || p != end) {
+        LOG_WARN("[WARN] User snapshot is incomplete (%u/%u records), replaying the whole user_db.\n", records,
+                 header.count);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    for (p = start; p < end; p += 2 + (unsigned char)p[0] + (unsigned char)p[1]) {
+        size_t name_len = (unsigned char)p[0];
+        user_insert(p + 2, name_len, p + 2 + name_len, (unsigned char)p[1], 0);
+    }
+    // 快照 mapping 保留到程式結束，table 內的字串直接指向它
+    return header.log_offset;
+}
+
+static void user_replay_log(uint64_t offset) {
+    FILE *file = fopen(USER_DB_PATH, "r");
+    if (!file) return;
+    fseek(file, (long)offset, SEEK_SET);
+
+    char stored_username[USERNAME_BUFFER_SIZE];
+    char stored_password[USERNAME_BUFFER_SIZE];
+    char line[USERNAME_BUFFER_SIZE * 2 + 4];
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%127s %127s", stored_username, stored_password) == 2) {
+            user_insert(stored_username, strlen(stored_username),
+                        stored_password, strlen(stored_password), 1);
+        }
+    }
+    fclose(file);
+}
+
+// 把整張 table 寫成新快照 (先寫暫存檔再 rename)；呼叫時持有 read lock
+static void user_write_snapshot() {
+    char tmp_path[] = USER_DB_SNAPSHOT_PATH ".tmp";
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("[ERROR] Failed to write user snapshot");
+        return;
+    }
+
+    UserSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USER_SNAPSHOT_MAGIC, 8);
+    header.log_offset = user_log_size;
+    header.count = (uint32_t)user_count;
+    fwrite(&header, sizeof(header), 1, file);
+    for (size_t i = 0; i < user_table_cap; i++) {
+        const UserEntry *e = &user_table[i];
+        if (e->hash == 0) continue;
+        unsigned char lens[2] = {e->name_len, e->pass_len};
+        fwrite(lens, 1, 2, file);
+        fwrite(e->name, 1, e->name_len, file);
+        fwrite(e->pass, 1, e->pass_len, file);
+    }
+    fflush(file);
+    fsync(fileno(file));
+    fclose(file);
+
+    if (rename(tmp_path, USER_DB_SNAPSHOT_PATH) == 0) {
+        user_snapshot_offset = header.log_offset;
+        LOG_INFO("[INFO] User snapshot compacted: %u users.\n", header.count);
+    }
+}
+
+static void user_compaction_task(void *arg) {
+    (void)arg;
+    pthread_rwlock_rdlock(&user_db_lock); // 寫快照期間暫停註冊，查詢不受影響
+    user_write_snapshot();
+    pthread_rwlock_unlock(&user_db_lock);
+    __atomic_store_n(&user_compaction_running, 0, __ATOMIC_RELEASE);
+}
+
+void user_db_init() {
+    user_log_fd = open(USER_DB_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (user_log_fd < 0) {
+        perror("Failed to open user_db");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    fstat(user_log_fd, &st);
+    user_log_size = st.st_size;
+
+    // 手動編輯過的 user_db 可能缺少結尾換行，避免下一筆註冊黏在同一行
+    if (user_log_size > 0) {
+        char last = '\n';
+        int rfd = open(USER_DB_PATH, O_RDONLY | O_CLOEXEC);
+        if (rfd >= 0) {
+            pread(rfd, &last, 1, user_log_size - 1);
+            close(rfd);
+        }
+        if (last != '\n' && write(user_log_fd, "\n", 1) == 1) user_log_size++;
+    }
+
+    user_table_grow();
+    user_snapshot_offset = user_load_snapshot(user_log_size);
+    user_replay_log(user_snapshot_offset);
+    LOG_INFO("[INFO] Loaded %zu users (snapshot covers %llu/%llu bytes of user_db).\n", user_count,
+           (unsigned long long)user_snapshot_offset, (unsigned long long)user_log_size);
+
+    if (user_log_size - user_snapshot_offset > USER_COMPACT_THRESHOLD) {
+        user_write_snapshot();
+    }
+}
+
+int username_exists_in_db(const char *username) {
+    pthread_rwlock_rdlock(&user_db_lock);
+    int exists = user_lookup(username) != NULL;
+    pthread_rwlock_unlock(&user_db_lock);
+    return exists;
+}
+
+int user_authenticate(const char *username, const char *password) {
+    int ok = 0;
+    pthread_rwlock_rdlock(&user_db_lock);
+    const UserEntry *e = user_lookup(username);
+    if (e && e->pass_len == strlen(password) && memcmp(e->pass, password, e->pass_len) == 0) {
+        ok = 1;
+    }
+    pthread_rwlock_unlock(&user_db_lock);
+    return ok;
+}
+
+// 回傳 1 註冊成功、0 帳號已存在、-1 寫入失敗
+int register_user(const char *username, const char *password) {
+    char line[USERNAME_BUFFER_SIZE * 2 + 4];
+    int len = snprintf(line, sizeof(line), "%s %s\n", username, password);
+    int ret;
+
+    pthread_rwlock_wrlock(&user_db_lock);
+    if (user_lookup(username)) {
+        ret = 0;
+    } else if (write(user_log_fd, line, len) != len) {
+        perror("Failed to append user_db");
+        ret = -1;
+    } else {
+        user_log_size += len;
+        ret = user_insert(username, strlen(username), password, strlen(password), 1) < 0 ? -1 : 1;
+    }
+    int compact = ret == 1 && user_log_size - user_snapshot_offset > USER_COMPACT_THRESHOLD &&
+                  !__atomic_exchange_n(&user_compaction_running, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&user_db_lock);
+
+    if (compact) pool_submit(&job_pool, user_compaction_task, NULL);
+    return ret;
+}
+
+// ========== 群組 ==========
+// 群組 (頻道) 記錄在 group_db，為 append-only 文字 log，啟動時重播到記憶體：
+//   "CREATE <群組> <建立者>\n"、"ADD <群組> <使用者>\n"、"REMOVE <群組> <使用者>\n"
+// 任何人都可加入或退出，建立者可一次加入多位成員。成員名單依名稱排序，
+// 群發時在讀鎖下複製一份名單，之後的投遞不再持有群組的鎖。
+
+typedef struct Group {
+    struct Group *next;
+    char name[USERNAME_BUFFER_SIZE];
+    char owner[USERNAME_BUFFER_SIZE];
+    char (*members)[USERNAME_BUFFER_SIZE]; // 依名稱排序
+    size_t member_count, member_cap;
+} Group;
+
+static Group *group_buckets[GROUP_BUCKETS];
+static pthread_rwlock_t group_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int group_log_fd = -1;
+static size_t group_count;
+
+static Group **group_slot(const char *name) {
+    Group **slot = &group_buckets[hash_string(name) % GROUP_BUCKETS];
+    while (*slot && strcmp((*slot)->name, name) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+// 回傳 user 在名單中的位置 (不在名單中時為應插入的位置)
+static size_t group_member_pos(const Group *group, const char *user, int *found) {
+    size_t lo = 0, hi = group->member_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcmp(group->members[mid], user);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+// op 為 CREATE / ADD / REMOVE；呼叫時持有寫鎖。log 非 0 時先把變更寫進 group_db 再套用。
+// 回傳 1 有變更、0 已是該狀態 (CREATE 時為群組已存在)、-1 群組不存在、-2 寫入失敗或記憶體不足
+static int group_apply(const char *op, const char *name, const char *user, int log) {
+    Group **slot = group_slot(name);
+    Group *group = *slot;
+    int create = strcmp(op, "CREATE") == 0, add = strcmp(op, "ADD") == 0;
+    if (create && group) return 0;
+    if (!create && !group) return -1;
+
+    int found = 0;
+    size_t pos = group ? group_member_pos(group, user, &found) : 0;
+    if (!create && found == add) return 0;
+    if ((create || add) && (!group || group->member_count == group->member_cap)) {
+        if (create) {
+            group = (Group *)calloc(1, sizeof(Group));
+            if (!group) return -2;
+        }
+        size_t cap = group->member_cap ? group->member_cap * 2 : 8;
+        char (*members)[USERNAME_BUFFER_SIZE] =
+            (char (*)[USERNAME_BUFFER_SIZE])realloc(group->members, cap * USERNAME_BUFFER_SIZE);
+        if (!members) {
+            if (create) free(group);
+            return -2;
+        }
+        group->members = members;
+        group->member_cap = cap;
+    }
+
+    if (log) {
+        char line[USERNAME_BUFFER_SIZE * 2 + 16];
+        int len = snprintf(line, sizeof(line), "%s %s %s\n", op, name, user);
+        if (write(group_log_fd, line, len) != len) {
+            perror("Failed to append group_db");
+            if (create) {
+                free(group->members);
+                free(group);
+            }
+            return -2;
+        }
+    }
+
+    if (create) {
+        strncpy(group->name, name, USERNAME_BUFFER_SIZE - 1);
+        strncpy(group->owner, user, USERNAME_BUFFER_SIZE - 1);
+        *slot = group;
+        group_count++;
+    }
+    if (create || add) {
+        memmove(group->members + pos + 1, group->members + pos, (group->member_count - pos) * USERNAME_BUFFER_SIZE);
+        memset(group->members[pos], 0, USERNAME_BUFFER_SIZE);
+        strncpy(group->members[pos], user, USERNAME_BUFFER_SIZE - 1);
+        group->member_count++;
+    } else {
+        memmove(group->members + pos, group->members + pos + 1, (group->member_count - pos - 1) * USERNAME_BUFFER_SIZE);
+        group->member_count--;
+    }
+    return 1;
+}
+
+void group_db_init() {
+    FILE *file = fopen(GROUP_DB_PATH, "r");
+    if (file) {
+        char op[16], name[USERNAME_BUFFER_SIZE], user[USERNAME_BUFFER_SIZE];
+        while (fscanf(file, "%15s %127s %127s", op, name, user) == 3) {
+            group_apply(op, name, user, 0);
+        }
+        fclose(file);
+    }
+    group_log_fd = open(GROUP_DB_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (group_log_fd < 0) {
+        perror("Failed to open group_db");
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("[INFO] Loaded %zu groups.\n", group_count);
+}
+
+// JOIN / LEAVE / ADD / REMOVE 共用；requester 非 NULL 時只有建立者可以操作
+int group_update(const char *op, const char *name, const char *user, const char *requester) {
+    pthread_rwlock_wrlock(&group_lock);
+    Group *group = *group_slot(name);
+    int ret;
+    if (!group) ret = -1;
+    else if (requester && strcmp(group->owner, requester) != 0) ret = -3;
+    else ret = group_apply(op, name, user, 1);
+    pthread_rwlock_unlock(&group_lock);
+    return ret;
+}
+
+int group_create(const char *name, const char *owner) {
+    pthread_rwlock_wrlock(&group_lock);
+    int ret = group_apply("CREATE", name, owner, 1);
+    pthread_rwlock_unlock(&group_lock);
+    return ret;
+}
+
+// 複製成員名單 (不含 exclude)，*names 由呼叫者 free。群組不存在回傳 -1；
+// *is_member 表示 exclude 是否為成員 (只有成員可以對群組發訊息)
+int group_members(const char *name, const char *exclude, char (**names)[USERNAME_BUFFER_SIZE], size_t *count,
+                  int *is_member) {
+    pthread_rwlock_rdlock(&group_lock);
+    Group *group = *group_slot(name);
+    if (!group) {
+        pthread_rwlock_unlock(&group_lock);
+        return -1;
+    }
+    size_t pos = group_member_pos(group, exclude, is_member);
+    size_t n = group->member_count - (*is_member ? 1 : 0);
+    *names = (char (*)[USERNAME_BUFFER_SIZE])malloc((n ? n : 1) * USERNAME_BUFFER_SIZE);
+    if (!*names) {
+        pthread_rwlock_unlock(&group_lock);
+        return -1;
+    }
+    if (*is_member) {
+        memcpy(*names, group->members, pos * USERNAME_BUFFER_SIZE);
+        memcpy(*names + pos, group->members + pos + 1, (group->member_count - pos - 1) * USERNAME_BUFFER_SIZE);
+    } else {
+        memcpy(*names, group->members, group->member_count * USERNAME_BUFFER_SIZE);
+    }
+    *count = n;
+    pthread_rwlock_unlock(&group_lock);
+    return 0;
+}
+
+// GROUP MEMBERS 的回覆："Members of <群組> (<人數>): a b c\n"，超過 ONLINE_REPLY_MAX 時以 "..." 截斷
+static void group_format_members(const char *name, char *out, size_t out_size) {
+    pthread_rwlock_rdlock(&group_lock);
+    Group *group = *group_slot(name);
+    if (!group) {
+        snprintf(out, out_size, "Group not found\n");
+    } else {
+        size_t used = snprintf(out, out_size, "Members of %s (%zu, owner %s):", group->name, group->member_count,
+                               group->owner);
+        for (size_t i = 0; i < group->member_count; i++) {
+            size_t len = strlen(group->members[i]);
+            if (used + len + 6 >= out_size) {
+                used += snprintf(out + used, out_size - used, " ...");
+                break;
+            }
+            out[used++] = ' ';
+            memcpy(out + used, group->members[i], len);
+            used += len;
+        }
+        snprintf(out + used, out_size - used, "\n");
+    }
+    pthread_rwlock_unlock(&group_lock);
+}
+
+static int compare_member_names(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// "a,b,c" 拆成排序、去除重複的名單 (*names 由呼叫者 free)；空的或過長的名稱略過
+static size_t parse_name_list(const char *list, char (**names)[USERNAME_BUFFER_SIZE]) {
+    size_t cap = 1;
+    for (const char *p = list; *p; p++) cap += *p == ',';
+    *names = (char (*)[USERNAME_BUFFER_SIZE])calloc(cap, USERNAME_BUFFER_SIZE);
+    if (!*names) return 0;
+
+    size_t count = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (len > 0 && len < USERNAME_BUFFER_SIZE) memcpy((*names)[count++], list, len);
+        list += len;
+        if (*list == ',') list++;
+    }
+    qsort(*names, count, USERNAME_BUFFER_SIZE, compare_member_names);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || strcmp((*names)[unique - 1], (*names)[i]) != 0) {
+            if (unique != i) memcpy((*names)[unique], (*names)[i], USERNAME_BUFFER_SIZE);
+            unique++;
+        }
+    }
+    return unique;
+}
+
+// GROUP CREATE|JOIN|LEAVE|MEMBERS <群組>、GROUP ADD <群組> <user1>,<user2>,...
+void handle_group(Connection *conn, const char *buffer) {
+    char action[16], name[USERNAME_BUFFER_SIZE], list[COMMAND_BUFFER_SIZE];
+    int fields = sscanf(buffer, "GROUP %15s %127s %511s", action, name, list);
+    if (fields < 2) {
+        conn_reply(conn, "Group command parse error\n");
+        return;
+    }
+    if (!conn->logged_in) {
+        conn_reply(conn, "Please login first\n");
+        return;
+    }
+    // 名稱中的 ',' 與開頭的 '#' 保留給 SEND 的收件者語法
+    if (strchr(name, ',') || name[0] == '#') {
+        conn_reply(conn, "Invalid group name\n");
+        return;
+    }
+
+    char reply[ONLINE_REPLY_MAX];
+    int ret;
+    if (strcmp(action, "CREATE") == 0) {
+        ret = group_create(name, conn->username);
+        conn_reply(conn, ret == 1 ? "Group created\n" : ret == 0 ? "Group already exists\n" : "Group update failed\n");
+    } else if (strcmp(action, "JOIN") == 0 || strcmp(action, "LEAVE") == 0) {
+        int join = action[0] == 'J';
+        ret = group_update(join ? "ADD" : "REMOVE", name, conn->username, NULL);
+        if (ret == 1) snprintf(reply, sizeof(reply), "%s %s\n", join ? "Joined" : "Left", name);
+        else if (ret == 0) snprintf(reply, sizeof(reply), join ? "Already a member\n" : "Not a member\n");
+        else snprintf(reply, sizeof(reply), ret == -1 ? "Group not found\n" : "Group update failed\n");
+        conn_reply(conn, reply);
+    } else if (strcmp(action, "ADD") == 0 && fields == 3) {
+        char (*names)[USERNAME_BUFFER_SIZE];
+        size_t count = parse_name_list(list, &names), added = 0, unknown = 0;
+        ret = count ? 0 : -2;
+        for (size_t i = 0; i < count; i++) {
+            if (!username_exists_in_db(names[i])) {
+                unknown++;
+                continue;
+            }
+            ret = group_update("ADD", name, names[i], conn->username);
+            if (ret < 0) break;
+            added += ret;
+        }
+        free(names);
+        if (ret == -1) snprintf(reply, sizeof(reply), "Group not found\n");
+        else if (ret == -3) snprintf(reply, sizeof(reply), "Only the group owner can add members\n");
+        else snprintf(reply, sizeof(reply), "Added %zu member(s), %zu unknown user(s)\n", added, unknown);
+        conn_reply(conn, reply);
+    } else if (strcmp(action, "MEMBERS") == 0) {
+        group_format_members(name, reply, sizeof(reply));
+        conn_reply(conn, reply);
+    } else {
+        conn_reply(conn, "Group command parse error\n");
+    }
+}
+
+// SEND <user1>,<user2>,... <message> 或 SEND #<群組> <message>。與單人 SEND 相同只投遞給在線的收件者，
+// 內容只存一份 (store_multicast)；回覆 "Message sent to <投遞人數>/<收件者人數> recipients"
+void handle_send_multicast(Connection *conn, const char *target, const char *text) {
+    if (!conn->logged_in) {
+        conn_reply(conn, "Please login first\n");
+        return;
+    }
+    char (*names)[USERNAME_BUFFER_SIZE] = NULL;
+    size_t count = 0;
+    if (target[0] == '#') {
+        int is_member = 0;
+        if (group_members(target + 1, conn->username, &names, &count, &is_member) < 0) {
+            conn_reply(conn, "Group not found\n");
+            return;
+        }
+        if (!is_member) {
+            free(names);
+            conn_reply(conn, "Not a member of this group\n");
+            return;
+        }
+    } else {
+        count = parse_name_list(target, &names);
+    }
+
+    size_t online = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (find_client(names[i]) == 0) continue;
+        if (online != i) memcpy(names[online], names[i], USERNAME_BUFFER_SIZE);
+        online++;
+    }
+
+    uint64_t commit_lsn = 0;
+    size_t delivered = online ? store_multicast(conn->username, names, online, text, &commit_lsn) : 0;
+    char reply[96];
+    if (count == 0 || (online == 0 && target[0] != '#')) {
+        snprintf(reply, sizeof(reply), "Target user not found\n");
+    } else if (online > 0 && delivered == 0) {
+        snprintf(reply, sizeof(reply), msglog_failed ? "Message log write failed\n" : "Message store full\n");
+    } else {
+        snprintf(reply, sizeof(reply), "Message sent to %zu/%zu recipients\n", delivered, count);
+    }
+    if (delivered) {
+        conn->commit_lsn = commit_lsn;
+        for (size_t i = 0; i < online; i++) session_push(names[i]);
+    }
+    free(names);
+    conn_reply(conn, reply);
+}
+
+// ========== 連線狀態 / 回覆緩衝 ==========
+
+// 把 fd 切換為 non-blocking (event loop) 或 blocking (長時間指令)
+static int set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// 嘗試把 wbuf 內尚未送出的資料寫出，回傳 SSL_get_error 結果 (SSL_ERROR_NONE 代表已清空)
+static int conn_flush(Connection *conn) {
+    while (conn->wlen > 0) {
+        size_t len = conn->wretry ? conn->wretry : conn->wlen;
+        ERR_clear_error();
+        int sent = SSL_write(conn->ssl, conn->wbuf, (int)len);
+        if (sent <= 0) {
+            int err = SSL_get_error(conn->ssl, sent);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                conn->wretry = len; // OpenSSL 要求以相同長度重試
+            }
+            return err;
+        }
+        conn->wretry = 0;
+        metrics_add_bytes(0, sent);
+        memmove(conn->wbuf, conn->wbuf + sent, conn->wlen - sent);
+        conn->wlen -= sent;
+    }
+    return SSL_ERROR_NONE;
+}
+
+static int conn_reserve(Connection *conn, size_t len) {
+    if (conn->wlen + len > conn->wcap) {
+        size_t cap = conn->wcap ? conn->wcap : COMMAND_BUFFER_SIZE;
+        while (cap < conn->wlen + len) cap *= 2;
+        char *p = (char *)realloc(conn->wbuf, cap);
+        if (!p) {
+            perror("[ERROR] Failed to grow write buffer");
+            return -1;
+        }
+        conn->wbuf = p;
+        conn->wcap = cap;
+    }
+    return 0;
+}
+
+static void conn_send_pending(Connection *conn) {
+    if (conn->corked || conn->commit_lsn) return; // SEND 的回覆等 log 落地才送 (見 conn_handle_event)
+    int err = conn_flush(conn);
+    if (err != SSL_ERROR_NONE && err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+        conn->state = CONN_CLOSED;
+    }
+}
+
+// 回覆放進 wbuf 後立即嘗試送出；送不完的部分等 EPOLLOUT 再送
+static void conn_write(Connection *conn, const void *data, size_t len) {
+    if (conn_reserve(conn, len) < 0) return;
+    memcpy(conn->wbuf + conn->wlen, data, len);
+    conn->wlen += len;
+    conn_send_pending(conn);
+}
+
+static void conn_write_frame(Connection *conn, uint8_t type, uint32_t request_id,
+                             const void *payload, size_t len) {
+    if (conn_reserve(conn, FRAME_HEADER_SIZE + len) < 0) return;
+    frame_encode_header((unsigned char *)conn->wbuf + conn->wlen, type, 0, request_id, (uint32_t)len);
+    memcpy(conn->wbuf + conn->wlen + FRAME_HEADER_SIZE, payload, len);
+    conn->wlen += FRAME_HEADER_SIZE + len;
+    conn_send_pending(conn);
+}
+
+// 壓縮後的 RESPONSE：payload 為 [4 bytes 原始長度][zlib 資料]。壓不小時回傳 -1，由呼叫者改送原文
+static int conn_write_frame_zlib(Connection *conn, uint32_t request_id, const char *msg, size_t len) {
+    if (conn_reserve(conn, FRAME_HEADER_SIZE + 4 + len) < 0) return -1;
+    unsigned char *out = (unsigned char *)conn->wbuf + conn->wlen;
+    uLongf zlen = len - 5; // 連同長度欄位至少要省 1 byte
+    if (compress2(out + FRAME_HEADER_SIZE + 4, &zlen, (const Bytef *)msg, len, ZBLOCK_LEVEL) != Z_OK) return -1;
+    uint32_t net_len = htonl((uint32_t)len);
+    frame_encode_header(out, FRAME_RESPONSE, FRAME_FLAG_ZLIB, request_id, (uint32_t)(4 + zlen));
+    memcpy(out + FRAME_HEADER_SIZE, &net_len, 4);
+    conn->wlen += FRAME_HEADER_SIZE + 4 + zlen;
+    zstat_add(&zstat_frames, 1);
+    zstat_add_bytes(len, 4 + zlen);
+    conn_send_pending(conn);
+    return 0;
+}
+
+// 文字指令直接回傳文字；frame 指令則以相同 request_id 包成 RESPONSE (client 接受時把長回覆壓縮)
+static void conn_reply(Connection *conn, const char *msg) {
+    if (conn->framed) {
+        size_t len = strlen(msg);
+        if ((conn->request_flags & FRAME_FLAG_ZLIB) && len >= FRAME_COMPRESS_MIN &&
+            conn_write_frame_zlib(conn, conn->request_id, msg, len) == 0) {
+            return;
+        }
+        conn_write_frame(conn, FRAME_RESPONSE, conn->request_id, msg, len);
+    } else {
+        conn_write(conn, msg, strlen(msg));
+    }
+}
+
+// 推播連線：把收件匣中的訊息寫進回覆緩衝 (只由持有連線的執行緒呼叫)。
+// 已被新的 SUBSCRIBE 取代時不再取訊息，改為關閉連線
+static void conn_push_messages(Connection *conn) {
+    pthread_mutex_lock(&conn->arm_lock);
+    int pending = conn->push_pending;
+    int replaced = conn->push_replaced;
+    conn->push_pending = 0;
+    pthread_mutex_unlock(&conn->arm_lock);
+    if (!pending && !replaced) return;
+
+    char output[COMMAND_BUFFER_SIZE * 10];
+    while (conn->state == CONN_READY) {
+        if (replaced) {
+            LOG_INFO("Push subscription of %s replaced, closing the old one.\n", conn->push_user);
+            conn->push_user[0] = '\0'; // session 已指向新的推播連線，關閉時不必 detach
+            conn->state = CONN_CLOSED;
+            return;
+        }
+        if (conn->wlen >= PUSH_WBUF_LIMIT) {
+            // client 讀得慢：先留在收件匣，等 EPOLLOUT 送出一部分後再繼續
+            pthread_mutex_lock(&conn->arm_lock);
+            conn->push_pending = 1;
+            pthread_mutex_unlock(&conn->arm_lock);
+            return;
+        }
+        size_t taken = get_messages(conn->push_user, output, sizeof(output));
+        if (taken == 0) return;
+        __atomic_fetch_add(&push_deliveries, taken, __ATOMIC_RELAXED);
+        conn_write(conn, output, strlen(output));
+        pthread_mutex_lock(&conn->arm_lock);
+        replaced = conn->push_replaced;
+        pthread_mutex_unlock(&conn->arm_lock);
+    }
+}
+
+// ========== STATS ==========
+
+// 所有 mailbox 的訊息總數與最深的一個 (逐 shard 加鎖掃描，只在 STATS 時使用)
+static void mailbox_format_stats(char *out, size_t out_size) {
+    size_t mailboxes = 0, messages = 0, max_depth = 0;
+    for (int i = 0; i < MAILBOX_SHARDS; i++) {
+        MailboxShard *shard = &mailbox_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        mailboxes += shard->mailbox_count;
+        for (size_t b = 0; b < shard->bucket_count; b++) {
+            for (Mailbox *box = shard->buckets[b]; box; box = box->next) {
+                messages += box->count;
+                if (box->count > max_depth) max_depth = box->count;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    snprintf(out, out_size, "mailbox messages=%zu mailboxes=%zu max_depth=%zu bytes=%zu budget=%zu multicasts=%lu "
+             "multicast_refs=%lu\n", messages, mailboxes, max_depth, __atomic_load_n(&mailbox_bytes, __ATOMIC_RELAXED),
+             mailbox_budget, __atomic_load_n(&multicast_sends, __ATOMIC_RELAXED),
+             __atomic_load_n(&multicast_refs, __ATOMIC_RELAXED));
+}
+
+// STATS 指令與 stats port 共用的輸出
+static void format_stats(char *out, size_t out_size) {
+    size_t len = 0;
+    pool_format_stats(&io_pool, out, out_size);
+    len = strlen(out);
+    pool_format_stats(&job_pool, out + len, out_size - len);
+    len += strlen(out + len);
+    pool_format_stats(&handshake_pool, out + len, out_size - len);
+    len += strlen(out + len);
+    pool_format_stats(&decode_pool, out + len, out_size - len);
+    len += strlen(out + len);
+    pool_format_stats(&compress_pool, out + len, out_size - len);
+    len += strlen(out + len);
+    video_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    relay_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    tls_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    snprintf(out + len, out_size - len, "sessions online=%zu push_subscribers=%zu pushed=%lu\n",
+             __atomic_load_n(&online_count, __ATOMIC_RELAXED), __atomic_load_n(&push_subscribers, __ATOMIC_RELAXED),
+             __atomic_load_n(&push_deliveries, __ATOMIC_RELAXED));
+    len += strlen(out + len);
+    mailbox_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    msglog_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    store_index_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    dedup_format_stats(out + len, out_size - len);
+    len += strlen(out + len);
+    zstat_format(out + len, out_size - len);
+    len += strlen(out + len);
+    metrics_format(out + len, out_size - len);
+}
+
+// 本機 plaintext stats port：連上後送出一次 STATS 內容就關閉 (例如 nc 127.0.0.1 <port>)
+static void *stats_port_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *stats = (char *)malloc(STATS_REPLY_MAX);
+    while (stats) {
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR) perror("[ERROR] stats accept");
+            continue;
+        }
+        format_stats(stats, STATS_REPLY_MAX);
+        size_t len = strlen(stats), sent = 0;
+        while (sent < len) {
+            ssize_t n = write(client, stats + sent, len - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+static void stats_port_start(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // 只開放本機，不經 TLS
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("[ERROR] Failed to open stats port");
+        close(fd);
+        return;
+    }
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, stats_port_thread, (void *)(intptr_t)fd);
+    pthread_detach(thread_id);
+    LOG_INFO("[INFO] Stats available on 127.0.0.1:%d\n", port);
+}
+
+// ========== 指令處理 ==========
+
+// 可以在 0-RTT early data 中執行的指令：唯讀、重送也不會改變狀態 (early data 可能被重放)
+static int is_early_safe_command(const char *command) {
+    return strcmp(command, "ONLINE") == 0 ||
+           strcmp(command, "LIST_FILES") == 0 ||
+           strcmp(command, "FILE_STATUS") == 0 ||
+           strcmp(command, "SEEK_RECORDING") == 0 ||
+           strcmp(command, "STATS") == 0 ||
+           strcmp(command, "RECEIVE_FILE") == 0 ||
+           strcmp(command, "RECEIVE_CHUNKS") == 0;
+}
+
+// 需要在 blocking 模式下長時間收送資料的指令，交給獨立執行緒處理
+static int is_blocking_command(const char *command) {
+    return strncmp(command, "SEND_FILE", 9) == 0 ||
+           strncmp(command, "RECEIVE_FILE", 12) == 0 ||
+           strncmp(command, "RECEIVE_CHUNKS", 14) == 0 ||
+           strncmp(command, "STREAM_VIDEO", 12) == 0;
+}
+
+static void execute_command(Connection *conn, char *buffer, const char *command) {
+    if (conn->in_early && !is_early_safe_command(command)) {
+        const char *msg = "Command not allowed in early data\n";
+        if (conn->framed) conn_write_frame(conn, FRAME_ERROR, conn->request_id, msg, strlen(msg));
+        else conn_reply(conn, msg);
+        return;
+    }
+
+    if (strcmp(command, "REGISTER") == 0) {
+        char reg_username[USERNAME_BUFFER_SIZE];
+        char reg_password[USERNAME_BUFFER_SIZE];
+        if (sscanf(buffer, "REGISTER %127s %127s", reg_username, reg_password) < 2) {
+            conn_reply(conn, "Register command parse error\n");
+            return;
+        }
+        // ',' 與開頭的 '#' 是 SEND 的群發語法，'/' 用於直播的子頻道名稱 (<username>/<名稱>)
+        if (strchr(reg_username, ',') || strchr(reg_username, '/') || reg_username[0] == '#') {
+            conn_reply(conn, "Invalid username\n");
+            return;
+        }
+
+        int ret = register_user(reg_username, reg_password);
+        if (ret == 0) {
+            conn_reply(conn, "Username already exists\n");
+        } else if (ret < 0) {
+            conn_reply(conn, "Registration failed\n");
+        } else {
+            LOG_INFO("[REGISTER] New user: %s\n", reg_username);
+            conn_reply(conn, "Registration successful\n");
+        }
+
+    } else if (strcmp(command, "LOGIN") == 0) {
+        char tmp_user[USERNAME_BUFFER_SIZE];
+        char tmp_pass[USERNAME_BUFFER_SIZE];
+        int ret = sscanf(buffer, "LOGIN %127s %127s", tmp_user, tmp_pass);
+        if (ret < 2) {
+            conn_reply(conn, "Login command parse error\n");
+            return;
+        }
+        if (!user_authenticate(tmp_user, tmp_pass)) {
+            conn_reply(conn, "Invalid username or password\n");
+        } else if (conn->logged_in || add_client(tmp_user, conn) < 0) {
+            conn_reply(conn, "User already logged in\n");
+        } else {
+            log_user_login(tmp_user);
+            conn_reply(conn, "Login successful\n");
+            conn->logged_in = 1;
+            strncpy(conn->username, tmp_user, USERNAME_BUFFER_SIZE);
+        }
+
+    } else if (strcmp(command, "RETRIEVE") == 0) {
+        char output[COMMAND_BUFFER_SIZE * 10];
+        get_messages(conn->username, output, sizeof(output));
+        if (strlen(output) == 0) {
+            strcpy(output, "No new messages\n");
+        }
+        conn_reply(conn, output);
+
+    } else if (strcmp(command, "ONLINE") == 0) {
+        handle_online(conn, buffer);
+
+    } else if (strcmp(command, "GROUP") == 0) {
+        handle_group(conn, buffer);
+
+    } else if (strcmp(command, "SUBSCRIBE") == 0) {
+        // SUBSCRIBE <username> <password>：這條連線之後直接收到該使用者的新訊息 ("From <寄件者>: <內容>\n")，
+        // 不必再以 RETRIEVE 輪詢；client 通常另開一條連線專門接收
+        char tmp_user[USERNAME_BUFFER_SIZE];
+        char tmp_pass[USERNAME_BUFFER_SIZE];
+        if (sscanf(buffer, "SUBSCRIBE %127s %127s", tmp_user, tmp_pass) < 2) {
+            conn_reply(conn, "Subscribe command parse error\n");
+        } else if (conn->framed) {
+            const char *msg = "Command not supported in framed mode\n";
+            conn_write_frame(conn, FRAME_ERROR, conn->request_id, msg, strlen(msg));
+        } else if (!user_authenticate(tmp_user, tmp_pass)) {
+            conn_reply(conn, "Invalid username or password\n");
+        } else if (conn->push_user[0]) {
+            conn_reply(conn, "Already subscribed\n");
+        } else if (session_attach_push(tmp_user, conn) < 0) {
+            conn_reply(conn, "User not online\n");
+        } else {
+            conn_reply(conn, "Subscribed\n");
+            // 登入後、訂閱前收到的訊息先送出
+            conn->push_pending = 1;
+            conn_push_messages(conn);
+        }
+
+    } else if (strcmp(command, "LOGOUT") == 0) {
+        LOG_INFO("Client %s logged out.\n", conn->username);
+        remove_client(conn);
+        bzero(conn->username, sizeof(conn->username));
+        conn->logged_in = 0;
+        conn_reply(conn, "Logged out successfully\n");
+
+    } else if (strcmp(command, "exit") == 0) {
+        conn->state = CONN_CLOSED; // conn_close() 負責移除線上名單
+
+    } else if (is_blocking_command(command)) {
+        if (conn->framed) {
+            // 這些指令後面接的是原始資料流，只能以文字指令送出
+            const char *msg = "Command not supported in framed mode\n";
+            conn_write_frame(conn, FRAME_ERROR, conn->request_id, msg, strlen(msg));
+            return;
+        }
+        // 交給 run_blocking_command()，此時不再由 event loop 讀取這條連線
+        strncpy(conn->pending, buffer, COMMAND_BUFFER_SIZE);
+        conn->state = CONN_BUSY;
+
+    } else if (strcmp(command, "WATCH") == 0) {
+        // WATCH <頻道>：回覆 "Watching <頻道>" 後持續送 [4 bytes frame 大小][JPEG]，frame_size=0 代表結束
+        char channel_name[USERNAME_BUFFER_SIZE];
+        if (sscanf(buffer, "WATCH %127s", channel_name) < 1) {
+            conn_reply(conn, "Watch command parse error\n");
+        } else if (!conn->logged_in) {
+            conn_reply(conn, "Please login first\n");
+        } else if (conn->framed) {
+            const char *msg = "Command not supported in framed mode\n";
+            conn_write_frame(conn, FRAME_ERROR, conn->request_id, msg, strlen(msg));
+        } else if (relay_watch(conn, channel_name) < 0) {
+            conn_reply(conn, "Stream not found\n");
+        } else {
+            char reply[USERNAME_BUFFER_SIZE + 16];
+            snprintf(reply, sizeof(reply), "Watching %s\n", channel_name);
+            conn_reply(conn, reply);
+            conn->state = CONN_WATCHING;
+        }
+
+    } else if (strncmp(command, "SEND", 4) == 0) {
+        // SEND <target_username> <message...>；收件者為 "a,b,c" 或 "#群組" 時群發
+        char target_username[COMMAND_BUFFER_SIZE];
+        char msg_content[COMMAND_BUFFER_SIZE];
+        if (sscanf(buffer, "SEND %511s %511[^\n]", target_username, msg_content) < 2) {
+            conn_reply(conn, "Send command parse error\n");
+            return;
+        }
+        if (target_username[0] == '#' || strchr(target_username, ',')) {
+            handle_send_multicast(conn, target_username, msg_content);
+            return;
+        }
+
+        uint64_t commit_lsn;
+        if (find_client(target_username) != 0) {
+            if (store_message(conn->username, target_username, msg_content, &commit_lsn) == 0) {
+                conn->commit_lsn = commit_lsn;
+                session_push(target_username);
+                conn_reply(conn, "Message sent\n");
+            } else {
+                conn_reply(conn, msglog_failed ? "Message log write failed\n" : "Message store full\n");
+            }
+        } else {
+            conn_reply(conn, "Target user not found\n");
+        }
+
+    } else if (strcmp(command, "LIST_FILES") == 0) {
+        handle_list_files(conn, buffer);
+
+    } else if (strcmp(command, "FILE_STATUS") == 0) {
+        handle_file_status(conn, buffer);
+
+    } else if (strcmp(command, "SEEK_RECORDING") == 0) {
+        handle_seek_recording(conn, buffer);
+
+    } else if (strcmp(command, "STATS") == 0) {
+        char *stats = (char *)malloc(STATS_REPLY_MAX);
+        if (!stats) {
+            conn_reply(conn, "Server busy\n");
+            return;
+        }
+        format_stats(stats, STATS_REPLY_MAX);
+        conn_reply(conn, stats);
+        free(stats);
+
+    } else {
+        conn_reply(conn, "Unknown command\n");
+    }
+}
+
+void process_command(Connection *conn, char *buffer) {
+    char command[COMMAND_BUFFER_SIZE];
+
+    // 取出第一個 token 作為指令名稱
+    size_t skip = strspn(buffer, " \t\r\n");
+    size_t len = strcspn(buffer + skip, " \t\r\n");
+    if (len >= sizeof(command)) len = sizeof(command) - 1;
+    memcpy(command, buffer + skip, len);
+    command[len] = '\0';
+    LOG_DEBUG("[DEBUG] Received command: %s\n", command);
+
+    uint64_t start = metrics_now_us();
+    execute_command(conn, buffer, command);
+    // 長時間指令在 run_blocking_command 執行完才記錄
+    if (conn->state != CONN_BUSY) metrics_record_command(metric_command_index(command), metrics_now_us() - start);
+}
+
+// ========== Event loop ==========
+// 每個 loop 執行緒擁有自己的 epoll；accept 後以 round-robin 分配連線。
+// loop 只負責等待事件，實際處理以 task 形式交給 io_pool。
+// 所有連線都以 EPOLLONESHOT 註冊，同一時間只會有一個 worker 處理同一條連線。
+
+typedef struct {
+    int epfd;
+    int wake_fd;                    // eventfd：有連線等待釋放時喚醒
+    pthread_mutex_t retired_lock;
+    Connection *retired;            // 已關閉的連線，這一批事件處理完後才釋放
+    pthread_t thread_id;
+} EventLoop;
+
+static EventLoop *event_loops;
+static int event_loop_count;
+static int listen_fd = -1;
+static Connection listener_marker; // epoll data 指向它代表 listen socket
+static Connection wake_marker;     // epoll data 指向它代表 EventLoop.wake_fd
+
+// 持有連線的執行緒處理完畢，交回 event loop 等待下一個事件
+static void conn_arm(Connection *conn, int op) {
+    struct epoll_event ev;
+    pthread_mutex_lock(&conn->arm_lock);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    if (conn->wlen > 0 || conn->want_write || conn->push_pending) ev.events |= EPOLLOUT;
+    ev.data.ptr = conn;
+    conn->owned = 0;
+    if (epoll_ctl(event_loops[conn->loop].epfd, op, conn->fd, &ev) < 0) {
+        perror("[ERROR] epoll_ctl");
+    }
+    pthread_mutex_unlock(&conn->arm_lock);
+}
+
+// event loop 收到事件時取得連線。推播可能在事件已觸發、event loop 還沒取得之前就直接取得連線，
+// 已有人持有時略過即可：持有者結束時會重新 arm，level-triggered 的事件不會遺失
+static int conn_claim(Connection *conn) {
+    pthread_mutex_lock(&conn->arm_lock);
+    int claimed = !conn->owned;
+    conn->owned = 1;
+    pthread_mutex_unlock(&conn->arm_lock);
+    return claimed;
+}
+
+// 由其他執行緒呼叫 (持有 session shard 鎖，連線在此期間不會被釋放)。連線正在 epoll 中等待時
+// 直接取得並交給 io_pool，不動 epoll 的註冊 (重新 arm 會讓已回報過的連線再觸發一次)；
+// 正被處理時只設旗標，由持有者取出或由 conn_arm 帶上 EPOLLOUT
+static void conn_push_notify(Connection *conn) {
+    int claimed = 0;
+    pthread_mutex_lock(&conn->arm_lock);
+    if (!conn->push_pending) {
+        conn->push_pending = 1;
+        if (!conn->owned) {
+            conn->owned = 1;
+            claimed = 1;
+        }
+    }
+    pthread_mutex_unlock(&conn->arm_lock);
+    if (claimed) pool_submit(&io_pool, conn_handle_event, conn);
+}
+
+// event loop 在一批事件處理完後釋放已關閉的連線：同一批事件中可能還有這條連線的舊事件
+static void event_loop_free_retired(EventLoop *loop) {
+    pthread_mutex_lock(&loop->retired_lock);
+    Connection *conn = loop->retired;
+    loop->retired = NULL;
+    pthread_mutex_unlock(&loop->retired_lock);
+    while (conn) {
+        Connection *next = conn->retired_next;
+        pthread_mutex_destroy(&conn->arm_lock);
+        free(conn);
+        conn = next;
+    }
+}
+
+static void conn_close(Connection *conn) {
+    epoll_ctl(event_loops[conn->loop].epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (conn->viewer) relay_detach(conn->viewer); // WATCH 之後、移交 relay loop 之前就斷線
+    if (conn->push_user[0]) session_detach_push(conn);
+    if (conn->logged_in) {
+        LOG_INFO("Client %s disconnected.\n", conn->username);
+        remove_client(conn);
+    } else {
+        LOG_INFO("Anonymous client disconnected.\n");
+    }
+    if (conn->handshake_done && SSL_is_init_finished(conn->ssl)) SSL_shutdown(conn->ssl);
+    ERR_clear_error(); // error queue 是 per-thread，不能殘留給下一條連線的 SSL_get_error
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn->wbuf);
+    free(conn->rbuf);
+    free(conn->early_buf);
+    __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELAXED);
+
+    // 已從 epoll 移除，但 event loop 手上可能還有這條連線的事件，交給它在這批處理完後釋放
+    EventLoop *loop = &event_loops[conn->loop];
+    uint64_t one = 1;
+    pthread_mutex_lock(&loop->retired_lock);
+    conn->retired_next = loop->retired;
+    loop->retired = conn;
+    pthread_mutex_unlock(&loop->retired_lock);
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) perror("[ERROR] eventfd write");
+}
+
+// 長時間指令 (檔案傳輸 / 串流) 在 job_pool 以 blocking 模式執行，結束後重新交回 event loop
+static void run_blocking_command(void *arg) {
+    Connection *conn = (Connection *)arg;
+    char command[COMMAND_BUFFER_SIZE];
+
+    set_nonblocking(conn->fd, 0);
+    SSL_clear_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE); // blocking 模式下 SSL_write 一次寫完
+    conn_flush(conn);
+    sscanf(conn->pending, "%511s", command);
+    uint64_t start = metrics_now_us();
+
+    if (strcmp(command, "SEND_FILE_DEDUP") == 0) {
+        handle_send_file_dedup(conn->ssl, conn->pending);
+    } else if (strncmp(command, "SEND_FILE", 9) == 0) {
+        handle_send_file(conn->ssl, conn->pending);
+    } else if (strncmp(command, "RECEIVE_FILE", 12) == 0) {
+        handle_receive_file(conn->ssl, conn->pending);
+    } else if (strncmp(command, "RECEIVE_CHUNKS", 14) == 0) {
+        handle_receive_chunks(conn->ssl, conn->pending);
+    } else if (strncmp(command, "STREAM_VIDEO", 12) == 0) {
+        handle_video_stream(conn);
+    }
+    metrics_record_command(metric_command_index(command), metrics_now_us() - start);
+
+    SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    set_nonblocking(conn->fd, 1);
+    conn->state = CONN_READY;
+    conn_arm(conn, EPOLL_CTL_MOD);
+}
+
+// 從 rbuf 取出所有完整的 frame 逐一執行；回傳 -1 代表 frame 格式錯誤
+static int conn_process_frames(Connection *conn) {
+    size_t pos = 0;
+    int ret = 0;
+
+    conn->corked = 1;
+    while (conn->state == CONN_READY && conn->rlen - pos >= FRAME_HEADER_SIZE) {
+        FrameHeader header;
+        if (frame_decode_header(conn->rbuf + pos, &header) < 0) {
+            ret = -1;
+            break;
+        }
+        if (conn->rlen - pos < FRAME_HEADER_SIZE + header.length) break;
+
+        const char *payload = (const char *)conn->rbuf + pos + FRAME_HEADER_SIZE;
+        pos += FRAME_HEADER_SIZE + header.length;
+        if (header.type != FRAME_REQUEST || header.length >= COMMAND_BUFFER_SIZE) {
+            const char *msg = "Bad request\n";
+            conn_write_frame(conn, FRAME_ERROR, header.request_id, msg, strlen(msg));
+            continue;
+        }
+
+        char command[COMMAND_BUFFER_SIZE];
+        memcpy(command, payload, header.length);
+        command[header.length] = '\0';
+        conn->framed = 1;
+        conn->request_id = header.request_id;
+        conn->request_flags = header.flags;
+        process_command(conn, command);
+        conn->framed = 0;
+    }
+    memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+    conn->rlen -= pos;
+    conn->corked = 0;
+    conn_send_pending(conn);
+    return ret;
+}
+
+static int conn_append_input(Connection *conn, const char *data, size_t len) {
+    if (conn->rlen + len > conn->rcap) {
+        size_t cap = conn->rcap ? conn->rcap : COMMAND_BUFFER_SIZE * 4;
+        while (cap < conn->rlen + len) cap *= 2;
+        if (cap > FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD) return -1;
+        unsigned char *p = (unsigned char *)realloc(conn->rbuf, cap);
+        if (!p) return -1;
+        conn->rbuf = p;
+        conn->rcap = cap;
+    }
+    memcpy(conn->rbuf + conn->rlen, data, len);
+    conn->rlen += len;
+    return 0;
+}
+
+// early data 在 handshake 完成前就會讀到，先保留每個 record，等 handshake 完成再執行
+static int conn_stash_early(Connection *conn, const char *data, size_t len) {
+    char *p = (char *)realloc(conn->early_buf, conn->early_len + 2 + len);
+    if (!p) return -1;
+    conn->early_buf = p;
+    p[conn->early_len] = (char)(len >> 8);
+    p[conn->early_len + 1] = (char)(len & 0xFF);
+    memcpy(p + conn->early_len + 2, data, len);
+    conn->early_len += 2 + len;
+    return 0;
+}
+
+// 推進 handshake：回傳 -1 代表失敗；尚未完成時 state 仍為 CONN_HANDSHAKE
+static int conn_do_handshake(Connection *conn) {
+    char early[CONN_READ_BUFFER_SIZE];
+    int ret, err;
+
+    // server 端必須先以 SSL_read_early_data 讀完 0-RTT 資料 (client 沒送時直接回傳 FINISH)
+    while (!conn->early_done) {
+        size_t n = 0;
+        ERR_clear_error();
+        ret = SSL_read_early_data(conn->ssl, early, sizeof(early), &n);
+        if (ret == SSL_READ_EARLY_DATA_ERROR) {
+            err = SSL_get_error(conn->ssl, 0);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                conn->want_write = (err == SSL_ERROR_WANT_WRITE);
+                return 0;
+            }
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+        if (n > 0 && conn_stash_early(conn, early, n) < 0) return -1;
+        metrics_add_bytes(n, 0);
+        if (ret == SSL_READ_EARLY_DATA_FINISH) conn->early_done = 1;
+    }
+
+    ERR_clear_error();
+    ret = SSL_do_handshake(conn->ssl);
+    if (ret != 1) {
+        err = SSL_get_error(conn->ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            conn->want_write = (err == SSL_ERROR_WANT_WRITE);
+            return 0;
+        }
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    conn->handshake_done = 1;
+    conn->state = CONN_READY;
+    int resumed = SSL_session_reused(conn->ssl);
+    __atomic_fetch_add(resumed ? &tls_resumed_handshakes : &tls_full_handshakes, 1, __ATOMIC_RELAXED);
+    metrics_record_handshake(resumed, metrics_now_us() - conn->accepted_us);
+    int status = SSL_get_early_data_status(conn->ssl);
+    if (status == SSL_EARLY_DATA_ACCEPTED) __atomic_fetch_add(&tls_early_accepted, 1, __ATOMIC_RELAXED);
+    else if (status == SSL_EARLY_DATA_REJECTED) __atomic_fetch_add(&tls_early_rejected, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// handshake 完成後執行 early data 中的指令；遇到長時間指令就停止 (後續資料由該指令自行讀取)
+static void conn_process_early(Connection *conn) {
+    size_t pos = 0;
+    conn->in_early = 1;
+    while (conn->state == CONN_READY && pos + 2 <= conn->early_len) {
+        size_t len = ((unsigned char)conn->early_buf[pos] << 8) | (unsigned char)conn->early_buf[pos + 1];
+        char *record = conn->early_buf + pos + 2;
+        pos += 2 + len;
+        if (conn->rlen > 0 || (unsigned char)record[0] == FRAME_MAGIC) {
+            if (conn_append_input(conn, record, len) < 0 || conn_process_frames(conn) < 0) {
+                conn->state = CONN_CLOSED;
+            }
+            continue;
+        }
+        char command[COMMAND_BUFFER_SIZE];
+        if (len >= COMMAND_BUFFER_SIZE) len = COMMAND_BUFFER_SIZE - 1;
+        memcpy(command, record, len);
+        command[len] = '\0';
+        process_command(conn, command);
+    }
+    conn->in_early = 0;
+    free(conn->early_buf);
+    conn->early_buf = NULL;
+    conn->early_len = 0;
+}
+
+static void conn_handle_event(void *arg);
+
+// SEND 的 log 落地後由 flusher 呼叫，把連線交回 io_pool 送出回覆並繼續讀取。
+// 無法落地時 wbuf 裡已是成功的回覆，不能送出，改為關閉連線
+static void conn_resume(void *arg, int ok) {
+    Connection *conn = (Connection *)arg;
+    if (!ok) conn->state = CONN_CLOSED;
+    pool_submit(&io_pool, conn_handle_event, conn);
+}
+
+// io_pool task：處理一次 epoll 事件 (handshake / 讀取指令 / 送出回覆)
+static void conn_handle_event(void *arg) {
+    Connection *conn = (Connection *)arg;
+    conn->want_write = 0;
+
+    if (conn->state == CONN_HANDSHAKE) {
+        if (conn_do_handshake(conn) < 0) {
+            conn_close(conn);
+            return;
+        }
+        if (conn->state == CONN_HANDSHAKE) {
+            conn_arm(conn, EPOLL_CTL_MOD);
+            return;
+        }
+        if (conn->early_len > 0) conn_process_early(conn);
+    }
+    if (conn->state == CONN_CLOSED) { // conn_resume：SEND 的 log 無法落地
+        conn_close(conn);
+        return;
+    }
+
+    int err = conn_flush(conn);
+    if (err != SSL_ERROR_NONE && err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->push_user[0]) conn_push_messages(conn);
+
+    char buffer[CONN_READ_BUFFER_SIZE];
+    while (conn->state == CONN_READY) {
+        ERR_clear_error();
+        int bytes_received = SSL_read(conn->ssl, buffer, sizeof(buffer) - 1);
+        if (bytes_received <= 0) {
+            err = SSL_get_error(conn->ssl, bytes_received);
+            if (err == SSL_ERROR_WANT_READ) break;
+            if (err == SSL_ERROR_WANT_WRITE) {
+                conn->want_write = 1;
+                break;
+            }
+            conn->state = CONN_CLOSED;
+            break;
+        }
+        metrics_add_bytes(bytes_received, 0);
+        if (conn->rlen > 0 || (unsigned char)buffer[0] == FRAME_MAGIC) {
+            // binary frame：可能一次收到多個，也可能跨多次 SSL_read
+            if (conn_append_input(conn, buffer, bytes_received) < 0 || conn_process_frames(conn) < 0) {
+                LOG_ERROR("[ERROR] Malformed frame, closing connection.\n");
+                conn->state = CONN_CLOSED;
+            }
+            continue;
+        }
+        // 舊的文字協定：一次 SSL_read (一個 TLS record) 即一個指令，長度上限同原本的 buffer
+        if (bytes_received >= COMMAND_BUFFER_SIZE) bytes_received = COMMAND_BUFFER_SIZE - 1;
+        buffer[bytes_received] = '\0';
+        process_command(conn, buffer);
+    }
+
+    if (conn->commit_lsn && conn->state != CONN_CLOSED) {
+        // SEND 的回覆 (及其後的回覆) 要等 log 落地才送出。一般情況不佔住 worker：連線先不 arm，
+        // 由 flusher 在 msync 完成後交回 io_pool，同一輪的所有連線共用一次 msync
+        uint64_t lsn = conn->commit_lsn;
+        conn->commit_lsn = 0;
+        int rc = conn->state == CONN_READY ? msglog_defer(lsn, conn_resume, conn) : msglog_wait(lsn);
+        if (rc > 0) return;
+        if (rc < 0) {
+            conn->state = CONN_CLOSED;
+        } else {
+            conn_send_pending(conn);
+        }
+    }
+
+    if (conn->state == CONN_CLOSED) {
+        conn_close(conn);
+    } else if (conn->state == CONN_BUSY) {
+        pool_submit(&job_pool, run_blocking_command, conn);
+    } else if (conn->state == CONN_WATCHING) {
+        // 之後由 relay loop 獨佔這條連線，觀看結束時再交回
+        epoll_ctl(event_loops[conn->loop].epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        relay_attach(conn);
+    } else {
+        conn_arm(conn, EPOLL_CTL_MOD);
+    }
+}
+
+static void accept_connections() {
+    static unsigned next_loop = 0;
+    static uint64_t next_conn_id = 1;
+
+    while (1) {
+        struct sockaddr_in cli;
+        socklen_t len = sizeof(cli);
+        int connfd = accept4(listen_fd, (struct sockaddr *)&cli, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("[ERROR] accept");
+            }
+            return;
+        }
+
+        Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(connfd);
+            continue;
+        }
+        conn->id = next_conn_id++;
+        conn->fd = connfd;
+        conn->accepted_us = metrics_now_us();
+        pthread_mutex_init(&conn->arm_lock, NULL);
+        __atomic_fetch_add(&active_connections, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&accepted_connections, 1, __ATOMIC_RELAXED);
+        conn->ssl = SSL_new(server_ctx);
+        SSL_set_fd(conn->ssl, connfd);
+        SSL_set_accept_state(conn->ssl);
+        conn->state = CONN_HANDSHAKE;
+        conn->loop = next_loop++ % event_loop_count;
+        conn_arm(conn, EPOLL_CTL_ADD);
+    }
+}
+
+static void *event_loop_thread(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[ERROR] epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *conn = (Connection *)events[i].data.ptr;
+            if (conn == &listener_marker) {
+                accept_connections();
+            } else if (conn == &wake_marker) {
+                uint64_t value;
+                if (read(loop->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) perror("[ERROR] eventfd read");
+            } else if (conn_claim(conn)) {
+                // 取得連線後沒有其他 task 在處理它，可安全讀取 state
+                pool_submit(conn->state == CONN_HANDSHAKE ? &handshake_pool : &io_pool, conn_handle_event, conn);
+            }
+        }
+        event_loop_free_retired(loop);
+    }
+    return NULL;
+}
+
+// 閒置連線數量大時需要足夠的 fd
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// ========== 主程式入口 ==========
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in servaddr;
+    int opt;
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int io_workers = cores;
+    int job_workers = DEFAULT_JOB_WORKERS;
+    int handshake_workers = cores;
+    size_t mailbox_mb = DEFAULT_MAILBOX_BUDGET_MB;
+    int stats_port = 0;
+    int decode_workers = cores;
+    int compress_workers = cores;
+    const char *sink_name = NULL;
+    int relay_loops_wanted = cores < MAX_RELAY_LOOPS ? cores : MAX_RELAY_LOOPS;
+
+    event_loop_count = cores < MAX_EVENT_LOOPS ? cores : MAX_EVENT_LOOPS;
+    while ((opt = getopt(argc, argv, "l:w:j:h:d:z:r:m:C:P:L:v:BKE")) != -1) {
+        switch (opt) {
+            case 'l':
+                event_loop_count = atoi(optarg);
+                break;
+            case 'w':
+                io_workers = atoi(optarg);
+                break;
+            case 'j':
+                job_workers = atoi(optarg);
+                break;
+            case 'm':
+                mailbox_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                zcache_budget = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'h':
+                handshake_workers = atoi(optarg);
+                break;
+            case 'd':
+                decode_workers = atoi(optarg);
+                break;
+            case 'z':
+                compress_workers = atoi(optarg);
+                break;
+            case 'r':
+                relay_loops_wanted = atoi(optarg);
+                break;
+            case 'v':
+                sink_name = optarg;
+                break;
+            case 'B':
+                video_block_when_full = 1;
+                break;
+            case 'P':
+                stats_port = atoi(optarg);
+                break;
+            case 'L':
+                log_level = atoi(optarg);
+                break;
+            case 'K':
+                ktls_enabled = 0;
+                break;
+            case 'E':
+                early_data_enabled = 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l event_loops] [-w io_workers] [-j job_workers] [-h handshake_workers] [-d decode_workers] [-z compress_workers] [-r relay_loops] [-m mailbox_mb] [-C zcache_mb] [-P stats_port] [-L log_level] [-v gui|null|record] [-B] [-K] [-E]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (event_loop_count < 1) event_loop_count = 1;
+    if (event_loop_count > MAX_EVENT_LOOPS) event_loop_count = MAX_EVENT_LOOPS;
+    if (io_workers < 1) io_workers = 1;
+    if (job_workers < 1) job_workers = 1;
+    if (handshake_workers < 1) handshake_workers = 1;
+    if (decode_workers < 1) decode_workers = 1;
+    if (compress_workers < 1) compress_workers = 1;
+    if (relay_loops_wanted < 1) relay_loops_wanted = 1;
+    if (relay_loops_wanted > MAX_RELAY_LOOPS) relay_loops_wanted = MAX_RELAY_LOOPS;
+
+    signal(SIGPIPE, SIG_IGN); // 對方斷線時 write 不要讓整個 server 結束
+    raise_fd_limit();
+    ensure_store_directory(); // 確保有 store/ 目錄
+    dedup_init();
+    zcache_init();
+    store_index_init();
+    mailbox_init(mailbox_mb * 1024 * 1024);
+    msglog_init();
+    session_registry_init();
+    user_db_init();
+    group_db_init();
+    disk_writer_init();
+    video_init(sink_name);
+    server_ctx = create_context();
+    configure_context(server_ctx);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    bzero(&servaddr, sizeof(servaddr));
+
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(PORT);
+
+    if (bind(listen_fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        perror("[ERROR] Failed to listen");
+        exit(EXIT_FAILURE);
+    }
+
+    pool_init(&io_pool, "io_pool", io_workers);
+    pool_init(&job_pool, "job_pool", job_workers);
+    pool_init(&handshake_pool, "handshake_pool", handshake_workers);
+    pool_init(&decode_pool, "decode_pool", decode_workers);
+    pool_init(&compress_pool, "compress_pool", compress_workers);
+    relay_init(relay_loops_wanted);
+    if (stats_port > 0) stats_port_start(stats_port);
+
+    event_loops = (EventLoop *)calloc(event_loop_count, sizeof(EventLoop));
+    for (int i = 0; i < event_loop_count; i++) {
+        event_loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        event_loops[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_loops[i].epfd < 0 || event_loops[i].wake_fd < 0) {
+            perror("[ERROR] epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&event_loops[i].retired_lock, NULL);
+        struct epoll_event wake_ev;
+        wake_ev.events = EPOLLIN;
+        wake_ev.data.ptr = &wake_marker;
+        epoll_ctl(event_loops[i].epfd, EPOLL_CTL_ADD, event_loops[i].wake_fd, &wake_ev);
+    }
+
+    // listen socket 只掛在第 0 個 loop
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_marker;
+    epoll_ctl(event_loops[0].epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    LOG_INFO("Server listening on port %d with %d event loop(s), %d io worker(s), %d job worker(s), "
+           "%d handshake worker(s), %d decode worker(s), %d compress worker(s), %d relay loop(s), video sink %s...\n",
+             PORT, event_loop_count, io_workers, job_workers, handshake_workers, decode_workers, compress_workers,
+             relay_loop_count, video_sink->name);
+
+    for (int i = 1; i < event_loop_count; i++) {
+        pthread_create(&event_loops[i].thread_id, NULL, event_loop_thread, &event_loops[i]);
     }
+    event_loop_thread(&event_loops[0]);
 
-    close(sockfd);
-    SSL_CTX_free(ctx);
+    close(listen_fd);
+    SSL_CTX_free(server_ctx);
     return 0;
 }